@@ -0,0 +1,499 @@
+#include <sstream>
+#include <vector>
+#include "ASTJson.h"
+#include "ASTree.h"
+#include "bytecode.h"
+
+static void json_string(PycOutput& pyc_output, const char* text, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    pyc_output.put('"');
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char ch = (unsigned char)text[i];
+        if (ch == '"' || ch == '\\') {
+            pyc_output.put('\\');
+            pyc_output.put(ch);
+        } else if (ch < 0x20) {
+            char escape[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+            pyc_output.write(escape, sizeof(escape));
+        } else {
+            pyc_output.put(ch);
+        }
+    }
+    pyc_output.put('"');
+}
+
+static void json_string(PycOutput& pyc_output, const char* text)
+{
+    json_string(pyc_output, text, strlen(text));
+}
+
+static void json_string(PycOutput& pyc_output, PycRef<PycString> str)
+{
+    if (str == NULL)
+        pyc_output << "null";
+    else
+        json_string(pyc_output, str->strValue().data(), str->strValue().size());
+}
+
+/* Operators are stored with the spaces used to print them */
+static void json_operator(PycOutput& pyc_output, const char* op)
+{
+    while (*op == ' ')
+        ++op;
+    size_t length = strlen(op);
+    while (length > 0 && op[length - 1] == ' ')
+        --length;
+    json_string(pyc_output, op, length);
+}
+
+static const char* block_type_name(int type)
+{
+    static const char* s_block_names[] = {
+        "main", "if", "else", "elif", "try", "container", "except",
+        "finally", "while", "for", "with", "async for"
+    };
+    if (type < 0 || type >= (int)(sizeof(s_block_names) / sizeof(s_block_names[0])))
+        return "<invalid>";
+    return s_block_names[type];
+}
+
+/* Writes nodes from an explicit stack of pending output.  Opening a node
+ * writes its scalar fields, and pushes its children (and the punctuation
+ * between them) to be written next. */
+class AstJsonWriter {
+public:
+    AstJsonWriter(PycModule* mod, PycOutput& pyc_output)
+        : m_mod(mod), m_output(pyc_output), m_reprOutput(m_reprStream, 4096) { }
+
+    /* Clear the visit marks of anything left open by an exception */
+    ~AstJsonWriter()
+    {
+        for (const auto& items : { &m_stack, &m_children }) {
+            for (const Item& item : *items) {
+                if (item.kind == Item::NODE_END)
+                    item.node->setVisiting(false);
+                else if (item.kind == Item::CODE_END)
+                    item.code->setVisiting(false);
+            }
+        }
+    }
+
+    void write(PycRef<PycCode> code)
+    {
+        m_stack.push_back(Item(code));
+        while (!m_stack.empty()) {
+            Item item = std::move(m_stack.back());
+            m_stack.pop_back();
+            switch (item.kind) {
+            case Item::TEXT:
+                m_output << item.text;
+                break;
+            case Item::FIELD:
+                m_output << ",\"" << item.text << "\":";
+                break;
+            case Item::NODE:
+                openNode(item.node);
+                break;
+            case Item::NODE_END:
+                item.node->setVisiting(false);
+                break;
+            case Item::CODE:
+                openCode(item.code);
+                break;
+            case Item::CODE_END:
+                item.code->setVisiting(false);
+                break;
+            }
+            pushChildren();
+        }
+    }
+
+private:
+    struct Item {
+        enum Kind { TEXT, FIELD, NODE, NODE_END, CODE, CODE_END };
+
+        Item(Kind kind, const char* text) : kind(kind), text(text) { }
+        explicit Item(PycRef<ASTNode> node, Kind kind = NODE)
+            : kind(kind), text(), node(std::move(node)) { }
+        explicit Item(PycRef<PycCode> code, Kind kind = CODE)
+            : kind(kind), text(), code(std::move(code)) { }
+
+        Kind kind;
+        const char* text;
+        PycRef<ASTNode> node;
+        PycRef<PycCode> code;
+    };
+
+    PycModule* m_mod;
+    PycOutput& m_output;
+    std::vector<Item> m_stack;
+    std::vector<Item> m_children;       // Of the node being opened, in order
+    std::ostringstream m_reprStream;
+    PycOutput m_reprOutput;
+
+    void text(const char* text) { m_children.push_back(Item(Item::TEXT, text)); }
+
+    void child(const char* field, PycRef<ASTNode> node)
+    {
+        m_children.push_back(Item(Item::FIELD, field));
+        m_children.push_back(Item(std::move(node)));
+    }
+
+    template <class Seq>
+    void list(const char* field, const Seq& nodes)
+    {
+        if (field)
+            m_children.push_back(Item(Item::FIELD, field));
+        text("[");
+        bool first = true;
+        for (const auto& node : nodes) {
+            if (!first)
+                text(",");
+            m_children.push_back(Item(PycRef<ASTNode>((ASTNode*)node)));
+            first = false;
+        }
+        text("]");
+    }
+
+    template <class Map>
+    void pairs(const char* field, const Map& items)
+    {
+        m_children.push_back(Item(Item::FIELD, field));
+        text("[");
+        bool first = true;
+        for (const auto& item : items) {
+            text(first ? "[" : ",[");
+            m_children.push_back(Item(item.first));
+            text(",");
+            m_children.push_back(Item(item.second));
+            text("]");
+            first = false;
+        }
+        text("]");
+    }
+
+    void pushChildren()
+    {
+        while (!m_children.empty()) {
+            m_stack.push_back(std::move(m_children.back()));
+            m_children.pop_back();
+        }
+    }
+
+    void writeRepr(PycRef<PycObject> obj)
+    {
+        m_reprStream.str(std::string());
+        print_const(m_reprOutput, obj, m_mod);
+        m_reprOutput.flush();
+        const std::string& repr = m_reprStream.str();
+        json_string(m_output, repr.data(), repr.size());
+    }
+
+    void openCode(PycRef<PycCode> code)
+    {
+        if (code->visiting()) {
+            fputs("WARNING: Circular reference detected\n", pyc_error_stream());
+            m_output << "null";
+            return;
+        }
+
+        bool clean;
+        PycRef<ASTNode> tree = build_code_tree(code, m_mod, clean);
+        m_output << "{\"name\":";
+        json_string(m_output, code->name());
+        if (m_mod->verCompare(3, 11) >= 0) {
+            m_output << ",\"qualname\":";
+            json_string(m_output, code->qualName());
+        }
+        formatted_print(m_output, ",\"firstlineno\":%d,\"clean\":%s,\"body\":",
+                        code->firstLine(), clean ? "true" : "false");
+        list(nullptr, tree.cast<ASTNodeList>()->nodes());
+        text("}");
+        m_children.push_back(Item(code, Item::CODE_END));
+        code->setVisiting(true);
+    }
+
+    void openNode(PycRef<ASTNode> node)
+    {
+        if (node == NULL) {
+            m_output << "null";
+            return;
+        }
+        if (node->visiting()) {
+            fputs("WARNING: Circular reference detected\n", pyc_error_stream());
+            formatted_print(m_output, "{\"node\":\"error\",\"offset\":%d,"
+                            "\"error\":\"Circular reference\"}", node->offset());
+            return;
+        }
+
+        m_output << "{\"node\":";
+        json_string(m_output, ASTNode::typeName(node->type()));
+        formatted_print(m_output, ",\"offset\":%d", node->offset());
+
+        switch (node->type()) {
+        case ASTNode::NODE_NODELIST:
+            list("nodes", node.cast<ASTNodeList>()->nodes());
+            break;
+        case ASTNode::NODE_CHAINSTORE:
+            {
+                PycRef<ASTChainStore> chain = node.cast<ASTChainStore>();
+                list("targets", chain->nodes());
+                child("src", chain->src());
+            }
+            break;
+        case ASTNode::NODE_OBJECT:
+        case ASTNode::NODE_LOADBUILDCLASS:
+            {
+                PycRef<PycObject> obj = (node->type() == ASTNode::NODE_OBJECT)
+                                      ? node.cast<ASTObject>()->object()
+                                      : node.cast<ASTLoadBuildClass>()->object();
+                if (obj == NULL) {
+                    m_output << ",\"type\":\"NULL\"";
+                    break;
+                }
+                m_output << ",\"type\":";
+                json_string(m_output, MarshalTypeName(obj->type()));
+                if (node->type() == ASTNode::NODE_OBJECT
+                        && (obj->type() == PycObject::TYPE_CODE
+                            || obj->type() == PycObject::TYPE_CODE2)) {
+                    m_children.push_back(Item(Item::FIELD, "code"));
+                    m_children.push_back(Item(obj.cast<PycCode>()));
+                } else {
+                    m_output << ",\"repr\":";
+                    writeRepr(obj);
+                }
+            }
+            break;
+        case ASTNode::NODE_UNARY:
+            {
+                PycRef<ASTUnary> unary = node.cast<ASTUnary>();
+                m_output << ",\"op\":";
+                json_operator(m_output, unary->op_str());
+                child("operand", unary->operand());
+            }
+            break;
+        case ASTNode::NODE_BINARY:
+        case ASTNode::NODE_COMPARE:
+            {
+                PycRef<ASTBinary> binary = node.cast<ASTBinary>();
+                m_output << ",\"op\":";
+                json_operator(m_output, binary->op_str());
+                child("left", binary->left());
+                child("right", binary->right());
+            }
+            break;
+        case ASTNode::NODE_SLICE:
+            {
+                PycRef<ASTSlice> slice = node.cast<ASTSlice>();
+                formatted_print(m_output, ",\"slice\":%d", slice->op());
+                child("lower", slice->left());
+                child("upper", slice->right());
+            }
+            break;
+        case ASTNode::NODE_STORE:
+            child("src", node.cast<ASTStore>()->src());
+            child("dest", node.cast<ASTStore>()->dest());
+            break;
+        case ASTNode::NODE_RETURN:
+            {
+                static const char* s_return_types[] = { "return", "yield", "yield from" };
+                PycRef<ASTReturn> ret = node.cast<ASTReturn>();
+                formatted_print(m_output, ",\"kind\":\"%s\"", s_return_types[ret->rettype()]);
+                child("value", ret->value());
+            }
+            break;
+        case ASTNode::NODE_NAME:
+            m_output << ",\"name\":";
+            json_string(m_output, node.cast<ASTName>()->name());
+            break;
+        case ASTNode::NODE_DELETE:
+            child("value", node.cast<ASTDelete>()->value());
+            break;
+        case ASTNode::NODE_FUNCTION:
+            {
+                PycRef<ASTFunction> function = node.cast<ASTFunction>();
+                child("code", function->code());
+                list("defaults", function->defargs());
+                list("kwdefaults", function->kwdefargs());
+            }
+            break;
+        case ASTNode::NODE_CLASS:
+            {
+                PycRef<ASTClass> cls = node.cast<ASTClass>();
+                child("name", cls->name());
+                child("bases", cls->bases());
+                child("code", cls->code());
+            }
+            break;
+        case ASTNode::NODE_CALL:
+            {
+                PycRef<ASTCall> call = node.cast<ASTCall>();
+                child("func", call->func());
+                list("args", call->pparams());
+                pairs("kwargs", call->kwparams());
+                child("var", call->var());
+                child("kw", call->kw());
+            }
+            break;
+        case ASTNode::NODE_IMPORT:
+            {
+                PycRef<ASTImport> import = node.cast<ASTImport>();
+                child("name", import->name());
+                child("fromlist", import->fromlist());
+                list("stores", import->stores());
+            }
+            break;
+        case ASTNode::NODE_TUPLE:
+            formatted_print(m_output, ",\"parens\":%s",
+                            node.cast<ASTTuple>()->requireParens() ? "true" : "false");
+            list("values", node.cast<ASTTuple>()->values());
+            break;
+        case ASTNode::NODE_LIST:
+            list("values", node.cast<ASTList>()->values());
+            break;
+        case ASTNode::NODE_SET:
+            list("values", node.cast<ASTSet>()->values());
+            break;
+        case ASTNode::NODE_MAP:
+            pairs("items", node.cast<ASTMap>()->values());
+            break;
+        case ASTNode::NODE_KW_NAMES_MAP:
+            pairs("items", node.cast<ASTKwNamesMap>()->values());
+            break;
+        case ASTNode::NODE_CONST_MAP:
+            child("keys", node.cast<ASTConstMap>()->keys());
+            list("values", node.cast<ASTConstMap>()->values());
+            break;
+        case ASTNode::NODE_SUBSCR:
+            child("name", node.cast<ASTSubscr>()->name());
+            child("key", node.cast<ASTSubscr>()->key());
+            break;
+        case ASTNode::NODE_PRINT:
+            {
+                PycRef<ASTPrint> print = node.cast<ASTPrint>();
+                formatted_print(m_output, ",\"eol\":%s", print->eol() ? "true" : "false");
+                list("values", print->values());
+                child("stream", print->stream());
+            }
+            break;
+        case ASTNode::NODE_CONVERT:
+            child("name", node.cast<ASTConvert>()->name());
+            break;
+        case ASTNode::NODE_KEYWORD:
+            formatted_print(m_output, ",\"word\":\"%s\"", node.cast<ASTKeyword>()->word_str());
+            break;
+        case ASTNode::NODE_RAISE:
+            list("params", node.cast<ASTRaise>()->params());
+            break;
+        case ASTNode::NODE_EXEC:
+            {
+                PycRef<ASTExec> exec = node.cast<ASTExec>();
+                child("statement", exec->statement());
+                child("globals", exec->globals());
+                child("locals", exec->locals());
+            }
+            break;
+        case ASTNode::NODE_BLOCK:
+            {
+                PycRef<ASTBlock> block = node.cast<ASTBlock>();
+                formatted_print(m_output, ",\"block\":\"%s\",\"end\":%d",
+                                block_type_name(block->blktype()), block->end());
+                switch (block->blktype()) {
+                case ASTBlock::BLK_IF:
+                case ASTBlock::BLK_ELIF:
+                case ASTBlock::BLK_WHILE:
+                case ASTBlock::BLK_EXCEPT:
+                    {
+                        PycRef<ASTCondBlock> cond = block.try_cast<ASTCondBlock>();
+                        if (cond == NULL)
+                            break;
+                        formatted_print(m_output, ",\"negative\":%s",
+                                        cond->negative() ? "true" : "false");
+                        child("cond", cond->cond());
+                    }
+                    break;
+                case ASTBlock::BLK_FOR:
+                case ASTBlock::BLK_ASYNCFOR:
+                    {
+                        PycRef<ASTIterBlock> iter = block.try_cast<ASTIterBlock>();
+                        if (iter == NULL)
+                            break;
+                        formatted_print(m_output, ",\"start\":%d,\"comprehension\":%s",
+                                        iter->start(), iter->isComprehension() ? "true" : "false");
+                        child("index", iter->index());
+                        child("iter", iter->iter());
+                        child("condition", iter->condition());
+                    }
+                    break;
+                case ASTBlock::BLK_CONTAINER:
+                    {
+                        PycRef<ASTContainerBlock> container = block.cast<ASTContainerBlock>();
+                        formatted_print(m_output, ",\"finally\":%d,\"except\":%d",
+                                        container->finally(), container->except());
+                    }
+                    break;
+                case ASTBlock::BLK_WITH:
+                    child("expr", block.cast<ASTWithBlock>()->expr());
+                    child("var", block.cast<ASTWithBlock>()->var());
+                    break;
+                default:
+                    break;
+                }
+                list("body", block->nodes());
+            }
+            break;
+        case ASTNode::NODE_COMPREHENSION:
+            child("result", node.cast<ASTComprehension>()->result());
+            list("generators", node.cast<ASTComprehension>()->generators());
+            break;
+        case ASTNode::NODE_AWAITABLE:
+            child("expression", node.cast<ASTAwaitable>()->expression());
+            break;
+        case ASTNode::NODE_FORMATTEDVALUE:
+            {
+                PycRef<ASTFormattedValue> value = node.cast<ASTFormattedValue>();
+                formatted_print(m_output, ",\"conversion\":%d", (int)value->conversion());
+                child("value", value->val());
+                child("format_spec", value->format_spec());
+            }
+            break;
+        case ASTNode::NODE_JOINEDSTR:
+            list("values", node.cast<ASTJoinedStr>()->values());
+            break;
+        case ASTNode::NODE_ANNOTATED_VAR:
+            child("name", node.cast<ASTAnnotatedVar>()->name());
+            child("annotation", node.cast<ASTAnnotatedVar>()->annotation());
+            break;
+        case ASTNode::NODE_TERNARY:
+            {
+                PycRef<ASTTernary> ternary = node.cast<ASTTernary>();
+                child("if_block", ternary->if_block());
+                child("if_expr", ternary->if_expr());
+                child("else_expr", ternary->else_expr());
+            }
+            break;
+        default:
+            break;
+        }
+        text("}");
+        m_children.push_back(Item(node, Item::NODE_END));
+        node->setVisiting(true);
+    }
+};
+
+void dump_ast_json(PycModule* mod, const char* dispname, PycOutput& pyc_output)
+{
+    pyc_output << "{\"file\":";
+    json_string(pyc_output, dispname);
+    formatted_print(pyc_output, ",\"version\":\"%d.%d\",\"code\":",
+                    mod->majorVer(), mod->minorVer());
+    if (mod->code() != NULL) {
+        AstJsonWriter writer(mod, pyc_output);
+        writer.write(mod->code());
+    } else {
+        pyc_output << "null";
+    }
+    pyc_output << "}\n";
+}
@@ -0,0 +1,26 @@
+#ifndef _PYC_ASTJSON_H
+#define _PYC_ASTJSON_H
+
+#include "ASTNode.h"
+
+/* Writes the trees BuildFromCode builds for mod as JSON, for pycdc
+ * --emit-ast=json, instead of printing them as source.
+ *
+ * The output is one object: {"file", "version", "code"}.  A code object is
+ * {"name", "qualname", "firstlineno", "clean", "body"}, where body is the
+ * list of statements as built, before the clean up done when printing
+ * (dropping the implicit return and the __module__ and __qualname__ stores).
+ * A node is {"node": its class name, "offset": the instruction that created
+ * it, ...its fields}, with null for a missing child.  Constants have their
+ * marshal type and repr, and code objects among them (function, class and
+ * comprehension bodies) are expanded in place.  A node that contains itself
+ * is written the second time as {"node": "error", "offset", "error"}, and a
+ * code object that contains itself as null.
+ *
+ * Each code object's tree is only built when the writer reaches it, and
+ * nodes are released as they are written, so neither the output nor the
+ * whole module's trees are held in memory.  The writer keeps its own stack,
+ * so deeply nested trees don't use the native stack. */
+void dump_ast_json(PycModule* mod, const char* dispname, PycOutput& pyc_output);
+
+#endif
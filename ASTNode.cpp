@@ -1,17 +1,38 @@
 #include "ASTNode.h"
 #include "bytecode.h"
 
+thread_local unsigned long ASTNode::s_created = 0;
+thread_local int ASTNode::s_offset = -1;
+
+const char* ASTNode::typeName(int type)
+{
+    static const char* s_type_names[] = {
+        "ASTNode", "ASTNodeList", "ASTObject", "ASTUnary", "ASTBinary",
+        "ASTCompare", "ASTSlice", "ASTStore", "ASTReturn", "ASTName",
+        "ASTDelete", "ASTFunction", "ASTClass", "ASTCall", "ASTImport",
+        "ASTTuple", "ASTList", "ASTSet", "ASTMap", "ASTSubscr", "ASTPrint",
+        "ASTConvert", "ASTKeyword", "ASTRaise", "ASTExec", "ASTBlock",
+        "ASTComprehension", "ASTLoadBuildClass", "ASTAwaitable",
+        "ASTFormattedValue", "ASTJoinedStr", "ASTConstMap",
+        "ASTAnnotatedVar", "ASTChainStore", "ASTTernary",
+        "ASTKwNamesMap", "ASTNode (locals)",
+    };
+    static_assert(sizeof(s_type_names) / sizeof(s_type_names[0]) == NODE_LOCALS + 1,
+                  "ASTNode::typeName s_type_names not in sync with node types");
+    if (type < 0 || type > NODE_LOCALS)
+        return "<invalid>";
+    return s_type_names[type];
+}
+
 /* ASTNodeList */
 void ASTNodeList::removeLast()
 {
-    list_t::iterator it = m_nodes.end();
-    --it;
-    m_nodes.erase(it);
+    m_nodes.pop_back();
 }
 
 void ASTNodeList::removeFirst()
 {
-    m_nodes.erase(m_nodes.begin());
+    m_nodes.pop_front();
 }
 
 
@@ -187,14 +208,12 @@ const char* ASTKeyword::word_str() const
 /* ASTBlock */
 void ASTBlock::removeLast()
 {
-    list_t::iterator it = m_nodes.end();
-    --it;
-    m_nodes.erase(it);
+    m_nodes.pop_back();
 }
 
 void ASTBlock::removeFirst()
 {
-    m_nodes.erase(m_nodes.begin());
+    m_nodes.pop_front();
 }
 
 const char* ASTBlock::type_str() const
@@ -2,6 +2,7 @@
 #define _PYC_ASTNODE_H
 
 #include "pyc_module.h"
+#include "SmallVector.h"
 #include <list>
 #include <deque>
 
@@ -24,18 +25,48 @@ public:
         NODE_LOCALS,
     };
 
-    ASTNode(int type = NODE_INVALID) : m_refs(), m_type(type), m_processed() { }
-    virtual ~ASTNode() { }
+    ASTNode(int type = NODE_INVALID)
+        : m_refs(), m_type(type), m_processed(), m_visiting(), m_offset(s_offset)
+    {
+        ++s_created;
+        PycMemStats::created(PycMemStats::AST_NODE, type);
+    }
+
+    virtual ~ASTNode() { PycMemStats::destroyed(PycMemStats::AST_NODE, m_type); }
+
+    /* Name of the class used for nodes of the given type */
+    static const char* typeName(int type);
+
+    /* Number of nodes created on this thread so far */
+    static unsigned long created() { return s_created; }
 
     int type() const { return internalGetType(this); }
 
     bool processed() const { return m_processed; }
     void setProcessed() { m_processed = true; }
 
+    /* Set while print_src is printing the node, to detect circular
+     * references */
+    bool visiting() const { return m_visiting; }
+    void setVisiting(bool visiting) { m_visiting = visiting; }
+
+    /* Offset of the instruction BuildFromCode was processing when the node
+     * was created, or -1 */
+    int offset() const { return m_offset; }
+
+    /* The offset given to nodes created on this thread from now on */
+    static int currentOffset() { return s_offset; }
+    static void setCurrentOffset(int offset) { s_offset = offset; }
+
 private:
     int m_refs;
     int m_type;
     bool m_processed;
+    bool m_visiting;
+    int m_offset;
+
+    static thread_local unsigned long s_created;
+    static thread_local int s_offset;
 
     // Hack to make clang happy :(
     static int internalGetType(const ASTNode *node)
@@ -63,7 +94,7 @@ public:
 
 class ASTNodeList : public ASTNode {
 public:
-    typedef std::list<PycRef<ASTNode>> list_t;
+    typedef SmallVector<PycRef<ASTNode>, 4> list_t;
 
     ASTNodeList(list_t nodes)
         : ASTNode(NODE_NODELIST), m_nodes(std::move(nodes)) { }
@@ -85,7 +116,7 @@ private:
 class ASTChainStore : public ASTNodeList {
 public:
     ASTChainStore(list_t nodes, PycRef<ASTNode> src)
-        : ASTNodeList(nodes, NODE_CHAINSTORE), m_src(std::move(src)) { }
+        : ASTNodeList(std::move(nodes), NODE_CHAINSTORE), m_src(std::move(src)) { }
     
     PycRef<ASTNode> src() const { return m_src; }
 
@@ -529,7 +560,7 @@ private:
 
 class ASTBlock : public ASTNode {
 public:
-    typedef std::list<PycRef<ASTNode>> list_t;
+    typedef SmallVector<PycRef<ASTNode>, 4> list_t;
 
     enum BlkType {
         BLK_MAIN, BLK_IF, BLK_ELSE, BLK_ELIF, BLK_TRY,
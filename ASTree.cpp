@@ -1,10 +1,17 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <cstdint>
+#include <sstream>
 #include <stdexcept>
-#include <unordered_set>
+#include <vector>
 #include "ASTree.h"
 #include "FastStack.h"
+#include "pyc_cache.h"
+#include "pyc_marshal.h"
 #include "pyc_numeric.h"
+#include "pyc_trace.h"
 #include "bytecode.h"
 
 // This must be a triple quote (''' or """), to handle interpolated string literals containing the opposite quote style.
@@ -18,19 +25,262 @@
 static void append_to_chain_store(const PycRef<ASTNode>& chainStore,
         PycRef<ASTNode> item, FastStack& stack, const PycRef<ASTBlock>& curblock);
 
-/* Use this to determine if an error occurred (and therefore, if we should
- * avoid cleaning the output tree) */
-static bool cleanBuild;
+/* State for one top-level decompyle() call.  Each thread has a default
+ * state, which decompyle() resets for every new module; a DecompileScope
+ * replaces it with a private one for the calls made within the scope. */
+struct DecompileState {
+    /* Use this to determine if an error occurred (and therefore, if we should
+     * avoid cleaning the output tree) */
+    bool cleanBuild = false;
 
-/* Use this to prevent printing return keywords and newlines in lambdas. */
-static bool inLambda = false;
+    /* Use this to prevent printing return keywords and newlines in lambdas. */
+    bool inLambda = false;
 
-/* Use this to keep track of whether we need to print out any docstring and
- * the list of global variables that we are using (such as inside a function). */
-static bool printDocstringAndGlobals = false;
+    /* Use this to keep track of whether we need to print out any docstring and
+     * the list of global variables that we are using (such as inside a function). */
+    bool printDocstringAndGlobals = false;
 
-/* Use this to keep track of whether we need to print a class or module docstring */
-static bool printClassDocstring = true;
+    /* Use this to keep track of whether we need to print a class or module docstring */
+    bool printClassDocstring = true;
+
+    int cur_indent = -1;
+
+    /* Nesting of decompyle() calls, 0 between modules */
+    int code_depth = 0;
+};
+
+static thread_local DecompileState* s_state = nullptr;
+static thread_local DecompileMemo* s_memo = nullptr;
+static thread_local DecompileBudget s_budget;
+static thread_local unsigned long s_budgetExceeded = 0;
+static thread_local bool s_streaming = false;
+static thread_local size_t s_streamBatch = DECOMPILE_STREAM_BATCH;
+
+static DecompileState& state()
+{
+    if (!s_state) {
+        static thread_local DecompileState s_default_state;
+        s_state = &s_default_state;
+    }
+    return *s_state;
+}
+
+DecompileScope::DecompileScope()
+    : m_state(new DecompileState), m_prev(s_state)
+{
+    s_state = m_state;
+}
+
+DecompileScope::~DecompileScope()
+{
+    s_state = m_prev;
+    delete m_state;
+}
+
+/* Thrown by BudgetMeter when BuildFromCode has used up its budget */
+class BudgetExceeded : public std::runtime_error {
+public:
+    explicit BudgetExceeded(const std::string& what) : std::runtime_error(what) { }
+};
+
+/* Charges the work done by one BuildFromCode call against s_budget */
+class BudgetMeter {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    BudgetMeter()
+        : m_budget(s_budget), m_steps(), m_firstNode(ASTNode::created()),
+          m_limited(m_budget.max_steps || m_budget.max_nodes || m_budget.max_time_ms)
+    {
+        if (m_budget.max_time_ms)
+            m_deadline = Clock::now() + std::chrono::milliseconds(m_budget.max_time_ms);
+    }
+
+    void step()
+    {
+        if (!m_limited)
+            return;
+        ++m_steps;
+        if (m_budget.max_steps && m_steps > m_budget.max_steps)
+            exceeded("step", m_budget.max_steps, "");
+        if (m_budget.max_nodes && ASTNode::created() - m_firstNode > m_budget.max_nodes)
+            exceeded("node", m_budget.max_nodes, "");
+        // Reading the clock costs more than the rest, so do it less often
+        if (m_budget.max_time_ms && (m_steps % 64) == 0 && Clock::now() > m_deadline)
+            exceeded("time", m_budget.max_time_ms, " ms");
+    }
+
+    /* Calls fn without charging the nodes it creates or the time it takes,
+     * e.g. for printing statements while streaming, which builds nested
+     * code objects against their own budgets */
+    template <typename Fn>
+    void exclude(Fn fn)
+    {
+        unsigned long nodes = ASTNode::created();
+        Clock::time_point start = m_budget.max_time_ms ? Clock::now() : Clock::time_point();
+        fn();
+        m_firstNode += ASTNode::created() - nodes;
+        if (m_budget.max_time_ms)
+            m_deadline += Clock::now() - start;
+    }
+
+private:
+    static void exceeded(const char* what, unsigned long limit, const char* unit)
+    {
+        throw BudgetExceeded(std::string("exceeded the ") + what + " budget of "
+                             + std::to_string(limit) + unit);
+    }
+
+    DecompileBudget m_budget;
+    unsigned long m_steps;
+    unsigned long m_firstNode;
+    bool m_limited;
+    Clock::time_point m_deadline;
+};
+
+#ifdef OPCODE_PROFILE
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h>
+#  define PROFILE_CLOCK() __rdtsc()
+#  define PROFILE_UNIT "cycles"
+#elif defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define PROFILE_CLOCK() __rdtsc()
+#  define PROFILE_UNIT "cycles"
+#else
+#  define PROFILE_CLOCK() (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( \
+            std::chrono::steady_clock::now().time_since_epoch()).count()
+#  define PROFILE_UNIT "ns"
+#endif
+
+/* Counts, for each opcode, how often BuildFromCode handled it, the time
+ * spent in its handler and the AST nodes it created.  The counts are kept
+ * for all threads, and printed to stderr as a table when the process
+ * exits. */
+class OpcodeProfile {
+public:
+    ~OpcodeProfile();
+
+    void add(int opcode, uint64_t time, unsigned long nodes)
+    {
+        Counters& counters = m_counters[index(opcode)];
+        counters.executions.fetch_add(1, std::memory_order_relaxed);
+        counters.time.fetch_add(time, std::memory_order_relaxed);
+        counters.nodes.fetch_add(nodes, std::memory_order_relaxed);
+    }
+
+    void unsupported(int opcode)
+    {
+        m_counters[index(opcode)].unsupported.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    struct Counters {
+        std::atomic<uint64_t> executions, time, nodes, unsupported;
+    };
+
+    // Opcodes outside the enum share the last slot
+    static int index(int opcode)
+    {
+        return (opcode >= 0 && opcode < Pyc::PYC_LAST_OPCODE) ? opcode : Pyc::PYC_LAST_OPCODE;
+    }
+
+    Counters m_counters[Pyc::PYC_LAST_OPCODE + 1] = { };
+};
+
+OpcodeProfile::~OpcodeProfile()
+{
+    std::vector<int> opcodes;
+    uint64_t total_time = 0;
+    for (int i = 0; i <= Pyc::PYC_LAST_OPCODE; ++i) {
+        if (m_counters[i].executions.load() == 0)
+            continue;
+        opcodes.push_back(i);
+        total_time += m_counters[i].time.load();
+    }
+    if (opcodes.empty())
+        return;
+    std::sort(opcodes.begin(), opcodes.end(), [this](int a, int b) {
+        return m_counters[a].time.load() > m_counters[b].time.load();
+    });
+
+    fprintf(stderr, "\n%-28s %12s %16s %10s %12s %8s %7s %12s\n", "Opcode", "Count",
+            "Total " PROFILE_UNIT, "Time/exec", "Nodes", "Nodes/exec", "Time %", "Unsupported");
+    for (int opcode : opcodes) {
+        const Counters& counters = m_counters[opcode];
+        uint64_t executions = counters.executions.load();
+        uint64_t time = counters.time.load();
+        uint64_t nodes = counters.nodes.load();
+        fprintf(stderr, "%-28s %12llu %16llu %10.1f %12llu %8.2f %6.2f%% %12llu\n",
+                (opcode < Pyc::PYC_LAST_OPCODE) ? Pyc::OpcodeName(opcode) : "<invalid>",
+                (unsigned long long)executions, (unsigned long long)time,
+                (double)time / executions, (unsigned long long)nodes,
+                (double)nodes / executions, total_time ? 100.0 * time / total_time : 0.0,
+                (unsigned long long)counters.unsupported.load());
+    }
+}
+
+static OpcodeProfile s_opcode_profile;
+
+/* Charges the time and nodes from its construction to its destruction to
+ * an opcode */
+class OpcodeProfileScope {
+public:
+    explicit OpcodeProfileScope(int opcode)
+        : m_opcode(opcode), m_nodes(ASTNode::created()), m_start(PROFILE_CLOCK()) { }
+
+    ~OpcodeProfileScope()
+    {
+        s_opcode_profile.add(m_opcode, PROFILE_CLOCK() - m_start,
+                             ASTNode::created() - m_nodes);
+    }
+
+private:
+    int m_opcode;
+    unsigned long m_nodes;
+    uint64_t m_start;
+};
+#endif
+
+/* Records the PycMemStats for a BuildFromCode call when it returns */
+class MemStatsScope {
+public:
+    MemStatsScope(const PycRef<PycCode>& code, const stackhist_t& stack_hist)
+        : m_code(code), m_stackHist(stack_hist), m_enabled(PycMemStats::enabled()),
+          m_liveNodes(), m_firstNode()
+    {
+        if (m_enabled) {
+            m_liveNodes = PycMemStats::liveNodes();
+            m_firstNode = ASTNode::created();
+            PycMemStats::resetPeakNodes();
+        }
+    }
+
+    ~MemStatsScope()
+    {
+        if (!m_enabled)
+            return;
+        PycMemStats::CodeStats stats;
+        PycRef<PycString> name = m_code->qualName();
+        if (name == NULL || name->length() == 0)
+            name = m_code->name();
+        stats.name = (name != NULL) ? name->value() : "<unknown>";
+        stats.code_size = (m_code->code() != NULL) ? m_code->code()->length() : 0;
+        stats.nodes_created = ASTNode::created() - m_firstNode;
+        stats.peak_nodes = PycMemStats::peakNodes() - m_liveNodes;
+        stats.snapshots = m_stackHist.snapshots();
+        stats.max_depth = m_stackHist.maxDepth();
+        stats.peak_bytes = m_stackHist.peakBytes();
+        PycMemStats::addCode(std::move(stats));
+    }
+
+private:
+    const PycRef<PycCode>& m_code;
+    const stackhist_t& m_stackHist;
+    bool m_enabled;
+    unsigned long m_liveNodes;
+    unsigned long m_firstNode;
+};
 
 // shortcut for all top/pop calls
 static PycRef<ASTNode> StackPopTop(FastStack& stack)
@@ -73,12 +323,33 @@ static void CheckIfExpr(FastStack& stack, PycRef<ASTBlock> curblock)
     stack.push(new ASTTernary(std::move(if_block), std::move(if_expr), std::move(else_expr)));
 }
 
-PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
+/* When streaming, BuildFromCode keeps this many statements at the end of
+ * the main block, since later instructions may still change them (e.g. an
+ * if and else that turn out to be a conditional expression, or a print
+ * statement continued by the next PRINT_ITEM), and hands the rest to the
+ * sink in batches of at least the batch size (set_decompile_streaming) */
+static const size_t STREAM_KEEP = 2;
+
+/* Restores the offset given to new AST nodes when BuildFromCode returns */
+class NodeOffsetScope {
+public:
+    NodeOffsetScope() : m_prev(ASTNode::currentOffset()) { }
+    ~NodeOffsetScope() { ASTNode::setCurrentOffset(m_prev); }
+
+private:
+    int m_prev;
+};
+
+PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod, ASTStatementSink* sink)
 {
+    PycTraceSpan span("BuildFromCode");
+    span.setCode(code);
+
     PycBuffer source(code->code()->value(), code->code()->length());
 
     FastStack stack((mod->majorVer() == 1) ? 20 : code->stackSize());
     stackhist_t stack_hist;
+    MemStatsScope mem_stats(code, stack_hist);
 
     std::stack<PycRef<ASTBlock> > blocks;
     PycRef<ASTBlock> defblock = new ASTBlock(ASTBlock::BLK_MAIN);
@@ -93,23 +364,36 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
     bool else_pop = false;
     bool need_try = false;
     bool variable_annotations = false;
+    BudgetMeter budget;
+    NodeOffsetScope node_offset;
 
     while (!source.atEof()) {
+        // Statements of the main block are complete once nothing is left on
+        // the stack for a later instruction to add to them
+        if (sink && curblock == defblock && defblock->size() >= STREAM_KEEP + s_streamBatch
+                && stack.empty() && stack_hist.empty() && unpack == 0
+                && !need_try && !else_pop) {
+            budget.exclude([&]() { sink->flush(defblock, defblock->size() - STREAM_KEEP); });
+        }
+
+        budget.step();
+
 #if defined(BLOCK_DEBUG) || defined(STACK_DEBUG)
-        fprintf(stderr, "%-7d", pos);
+        fprintf(pyc_error_stream(), "%-7d", pos);
     #ifdef STACK_DEBUG
-        fprintf(stderr, "%-5d", (unsigned int)stack_hist.size() + 1);
+        fprintf(pyc_error_stream(), "%-5d", (unsigned int)stack_hist.size() + 1);
     #endif
     #ifdef BLOCK_DEBUG
         for (unsigned int i = 0; i < blocks.size(); i++)
-            fprintf(stderr, "    ");
-        fprintf(stderr, "%s (%d)", curblock->type_str(), curblock->end());
+            fprintf(pyc_error_stream(), "    ");
+        fprintf(pyc_error_stream(), "%s (%d)", curblock->type_str(), curblock->end());
     #endif
-        fprintf(stderr, "\n");
+        fprintf(pyc_error_stream(), "\n");
 #endif
 
         curpos = pos;
         bc_next(source, mod, opcode, operand, pos);
+        ASTNode::setCurrentOffset(curpos);
 
         if (need_try && opcode != Pyc::SETUP_EXCEPT_A) {
             need_try = false;
@@ -135,6 +419,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             PycRef<ASTBlock> prev = curblock;
             while (prev->end() < pos
                     && prev->blktype() != ASTBlock::BLK_MAIN) {
+                budget.step();
                 if (prev->blktype() != ASTBlock::BLK_CONTAINER) {
                     if (prev->end() == 0) {
                         break;
@@ -160,12 +445,16 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             }
         }
 
+#ifdef OPCODE_PROFILE
+        OpcodeProfileScope profile(opcode);
+#endif
+
         switch (opcode) {
         case Pyc::BINARY_OP_A:
             {
                 ASTBinary::BinOp op = ASTBinary::from_binary_op(operand);
                 if (op == ASTBinary::BIN_INVALID)
-                    fprintf(stderr, "Unsupported `BINARY_OP` operand value: %d\n", operand);
+                    fprintf(pyc_error_stream(), "Unsupported `BINARY_OP` operand value: %d\n", operand);
                 PycRef<ASTNode> right = stack.top();
                 stack.pop();
                 PycRef<ASTNode> left = stack.top();
@@ -840,7 +1129,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                             stack = stack_hist.top();
                             stack_hist.pop();
                             if (!curblock->inited())
-                                fprintf(stderr, "Error when decompiling 'async for'.\n");
+                                fprintf(pyc_error_stream(), "Error when decompiling 'async for'.\n");
                         } else {
                             blocks.push(container);
                         }
@@ -975,7 +1264,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     curblock = blocks.top();
                     stack.push(nullptr);
                 } else {
-                     fprintf(stderr, "Unsupported use of GET_AITER outside of SETUP_LOOP\n");
+                     fprintf(pyc_error_stream(), "Unsupported use of GET_AITER outside of SETUP_LOOP\n");
                 }
             }
             break;
@@ -1236,7 +1525,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     stack = stack_hist.top();
                     stack_hist.pop();
                 } else {
-                    fprintf(stderr, "Warning: Stack history is empty, something wrong might have happened\n");
+                    fprintf(pyc_error_stream(), "Warning: Stack history is empty, something wrong might have happened\n");
                 }
 
                 PycRef<ASTBlock> prev = curblock;
@@ -1385,7 +1674,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                                 blocks.push(except);
                             }
                         } else {
-                            fprintf(stderr, "Something TERRIBLE happened!!\n");
+                            fprintf(pyc_error_stream(), "Something TERRIBLE happened!!\n");
                         }
                         prev = nil;
                     } else {
@@ -1427,14 +1716,14 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 stack.pop();
 
                 if (rhs.type() != ASTNode::NODE_OBJECT) {
-                    fprintf(stderr, "Unsupported argument found for SET_UPDATE\n");
+                    fprintf(pyc_error_stream(), "Unsupported argument found for SET_UPDATE\n");
                     break;
                 }
 
                 // I've only ever seen this be a TYPE_FROZENSET, but let's be careful...
                 PycRef<PycObject> obj = rhs.cast<ASTObject>()->object();
                 if (obj->type() != PycObject::TYPE_FROZENSET) {
-                    fprintf(stderr, "Unsupported argument type found for SET_UPDATE\n");
+                    fprintf(pyc_error_stream(), "Unsupported argument type found for SET_UPDATE\n");
                     break;
                 }
 
@@ -1454,14 +1743,14 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 stack.pop();
 
                 if (rhs.type() != ASTNode::NODE_OBJECT) {
-                    fprintf(stderr, "Unsupported argument found for LIST_EXTEND\n");
+                    fprintf(pyc_error_stream(), "Unsupported argument found for LIST_EXTEND\n");
                     break;
                 }
 
                 // I've only ever seen this be a SMALL_TUPLE, but let's be careful...
                 PycRef<PycObject> obj = rhs.cast<ASTObject>()->object();
                 if (obj->type() != PycObject::TYPE_TUPLE && obj->type() != PycObject::TYPE_SMALL_TUPLE) {
-                    fprintf(stderr, "Unsupported argument type found for LIST_EXTEND\n");
+                    fprintf(pyc_error_stream(), "Unsupported argument type found for LIST_EXTEND\n");
                     break;
                 }
 
@@ -1617,7 +1906,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         stack = stack_hist.top();
                         stack_hist.pop();
                     } else {
-                        fprintf(stderr, "Warning: Stack history is empty, something wrong might have happened\n");
+                        fprintf(pyc_error_stream(), "Warning: Stack history is empty, something wrong might have happened\n");
                     }
                 }
                 PycRef<ASTBlock> tmp = curblock;
@@ -1711,7 +2000,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     curblock->append(prev.cast<ASTNode>());
                 }
                 else {
-                    fprintf(stderr, "Wrong block type %i for END_FOR\n", curblock->blktype());
+                    fprintf(pyc_error_stream(), "Wrong block type %i for END_FOR\n", curblock->blktype());
                 }
             }
             break;
@@ -1928,7 +2217,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                 stack.pop();
 
                 if (none != NULL) {
-                    fprintf(stderr, "Something TERRIBLE happened!\n");
+                    fprintf(pyc_error_stream(), "Something TERRIBLE happened!\n");
                     break;
                 }
 
@@ -1940,7 +2229,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     curblock->append(with.cast<ASTNode>());
                 }
                 else {
-                    fprintf(stderr, "Something TERRIBLE happened! No matching with block found for WITH_CLEANUP at %d\n", curpos);
+                    fprintf(pyc_error_stream(), "Something TERRIBLE happened! No matching with block found for WITH_CLEANUP at %d\n", curpos);
                 }
             }
             break;
@@ -2036,7 +2325,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(attr);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        fputs("Something TERRIBLE happened!\n", pyc_error_stream());
 
                     if (--unpack <= 0) {
                         stack.pop();
@@ -2071,7 +2360,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        fputs("Something TERRIBLE happened!\n", pyc_error_stream());
 
                     if (--unpack <= 0) {
                         stack.pop();
@@ -2111,7 +2400,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        fputs("Something TERRIBLE happened!\n", pyc_error_stream());
 
                     if (--unpack <= 0) {
                         stack.pop();
@@ -2170,7 +2459,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        fputs("Something TERRIBLE happened!\n", pyc_error_stream());
 
                     if (--unpack <= 0) {
                         stack.pop();
@@ -2212,7 +2501,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(name);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        fputs("Something TERRIBLE happened!\n", pyc_error_stream());
 
                     if (--unpack <= 0) {
                         stack.pop();
@@ -2242,10 +2531,14 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                         break;
                     }
 
-                    // Return private names back to their original name
+                    // Return private names back to their original name.  The
+                    // module is left as loaded, so it can be printed again.
                     const std::string class_prefix = std::string("_") + code->name()->strValue();
-                    if (varname->startsWith(class_prefix + std::string("__")))
-                        varname->setValue(varname->strValue().substr(class_prefix.size()));
+                    if (varname->startsWith(class_prefix + std::string("__"))) {
+                        PycRef<PycString> unmangled = new PycString(varname->type());
+                        unmangled->setValue(varname->strValue().substr(class_prefix.size()));
+                        varname = unmangled;
+                    }
 
                     PycRef<ASTNode> name = new ASTName(varname);
 
@@ -2333,7 +2626,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
                     if (tup.type() == ASTNode::NODE_TUPLE)
                         tup.cast<ASTTuple>()->add(save);
                     else
-                        fputs("Something TERRIBLE happened!\n", stderr);
+                        fputs("Something TERRIBLE happened!\n", pyc_error_stream());
 
                     if (--unpack <= 0) {
                         stack.pop();
@@ -2585,8 +2878,11 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
             }
             break;
         default:
-            fprintf(stderr, "Unsupported opcode: %s (%d)\n", Pyc::OpcodeName(opcode), opcode);
-            cleanBuild = false;
+            fprintf(pyc_error_stream(), "Unsupported opcode: %s (%d)\n", Pyc::OpcodeName(opcode), opcode);
+#ifdef OPCODE_PROFILE
+            s_opcode_profile.unsupported(opcode);
+#endif
+            state().cleanBuild = false;
             return new ASTNodeList(defblock->nodes());
         }
 
@@ -2597,7 +2893,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
     }
 
     if (stack_hist.size()) {
-        fputs("Warning: Stack history is not empty!\n", stderr);
+        fputs("Warning: Stack history is not empty!\n", pyc_error_stream());
 
         while (stack_hist.size()) {
             stack_hist.pop();
@@ -2605,7 +2901,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
     }
 
     if (blocks.size() > 1) {
-        fputs("Warning: block stack is not empty!\n", stderr);
+        fputs("Warning: block stack is not empty!\n", pyc_error_stream());
 
         while (blocks.size() > 1) {
             PycRef<ASTBlock> tmp = blocks.top();
@@ -2615,7 +2911,7 @@ PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod)
         }
     }
 
-    cleanBuild = true;
+    state().cleanBuild = true;
     return new ASTNodeList(defblock->nodes());
 }
 
@@ -2693,7 +2989,7 @@ static int cmp_prec(PycRef<ASTNode> parent, PycRef<ASTNode> child)
 }
 
 static void print_ordered(PycRef<ASTNode> parent, PycRef<ASTNode> child,
-                          PycModule* mod, std::ostream& pyc_output)
+                          PycModule* mod, PycOutput& pyc_output)
 {
     if (child.type() == ASTNode::NODE_BINARY ||
         child.type() == ASTNode::NODE_COMPARE) {
@@ -2717,46 +3013,44 @@ static void print_ordered(PycRef<ASTNode> parent, PycRef<ASTNode> child,
     }
 }
 
-static void start_line(int indent, std::ostream& pyc_output)
+static void start_line(int indent, PycOutput& pyc_output)
 {
-    if (inLambda)
+    if (state().inLambda)
         return;
-    for (int i=0; i<indent; i++)
-        pyc_output << "    ";
+    pyc_output.indent(indent);
 }
 
-static void end_line(std::ostream& pyc_output)
+static void end_line(PycOutput& pyc_output)
 {
-    if (inLambda)
+    if (state().inLambda)
         return;
-    pyc_output << "\n";
+    pyc_output.put('\n');
 }
 
-int cur_indent = -1;
 static void print_block(PycRef<ASTBlock> blk, PycModule* mod,
-                        std::ostream& pyc_output)
+                        PycOutput& pyc_output)
 {
-    ASTBlock::list_t lines = blk->nodes();
+    const ASTBlock::list_t& lines = blk->nodes();
 
-    if (lines.size() == 0) {
+    if (lines.empty()) {
         PycRef<ASTNode> pass = new ASTKeyword(ASTKeyword::KW_PASS);
-        start_line(cur_indent, pyc_output);
+        start_line(state().cur_indent, pyc_output);
         print_src(pass, mod, pyc_output);
     }
 
     for (auto ln = lines.cbegin(); ln != lines.cend();) {
         if ((*ln).cast<ASTNode>().type() != ASTNode::NODE_NODELIST) {
-            start_line(cur_indent, pyc_output);
+            start_line(state().cur_indent, pyc_output);
         }
         print_src(*ln, mod, pyc_output);
-        if (++ln != lines.end()) {
+        if (++ln != lines.cend()) {
             end_line(pyc_output);
         }
     }
 }
 
 void print_formatted_value(PycRef<ASTFormattedValue> formatted_value, PycModule* mod,
-                           std::ostream& pyc_output)
+                           PycOutput& pyc_output)
 {
     pyc_output << "{";
     print_src(formatted_value->val(), mod, pyc_output);
@@ -2780,43 +3074,40 @@ void print_formatted_value(PycRef<ASTFormattedValue> formatted_value, PycModule*
     pyc_output << "}";
 }
 
-static std::unordered_set<ASTNode *> node_seen;
-
-void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
+/* Returns the operand of node that print_src prints first, if node can be
+ * part of a chain like a + b + c or a.b().c[0] that is printed from the
+ * left without recursing, or NULL */
+static PycRef<ASTNode> chain_operand(const PycRef<ASTNode>& node)
 {
-    if (node == NULL) {
-        pyc_output << "None";
-        cleanBuild = true;
-        return;
-    }
-
-    if (node_seen.find((ASTNode *)node) != node_seen.end()) {
-        fputs("WARNING: Circular reference detected\n", stderr);
-        return;
+    switch (node.type()) {
+    case ASTNode::NODE_BINARY:
+    case ASTNode::NODE_COMPARE:
+        return node.cast<ASTBinary>()->left();
+    case ASTNode::NODE_CALL:
+        return node.cast<ASTCall>()->func();
+    case ASTNode::NODE_SUBSCR:
+        return node.cast<ASTSubscr>()->name();
+    default:
+        return NULL;
     }
-    node_seen.insert((ASTNode *)node);
+}
 
-    switch (node->type()) {
+/* Prints what follows node's chain operand */
+static void print_chain_rest(const PycRef<ASTNode>& node, PycModule* mod,
+                             PycOutput& pyc_output)
+{
+    switch (node.type()) {
     case ASTNode::NODE_BINARY:
     case ASTNode::NODE_COMPARE:
         {
             PycRef<ASTBinary> bin = node.cast<ASTBinary>();
-            print_ordered(node, bin->left(), mod, pyc_output);
             pyc_output << bin->op_str();
             print_ordered(node, bin->right(), mod, pyc_output);
         }
         break;
-    case ASTNode::NODE_UNARY:
-        {
-            PycRef<ASTUnary> un = node.cast<ASTUnary>();
-            pyc_output << un->op_str();
-            print_ordered(node, un->operand(), mod, pyc_output);
-        }
-        break;
     case ASTNode::NODE_CALL:
         {
             PycRef<ASTCall> call = node.cast<ASTCall>();
-            print_src(call->func(), mod, pyc_output);
             pyc_output << "(";
             bool first = true;
             for (const auto& param : call->pparams()) {
@@ -2854,6 +3145,83 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             pyc_output << ")";
         }
         break;
+    case ASTNode::NODE_SUBSCR:
+        pyc_output << "[";
+        print_src(node.cast<ASTSubscr>()->key(), mod, pyc_output);
+        pyc_output << "]";
+        break;
+    default:
+        break;
+    }
+}
+
+/* Prints a chain of binary operators, calls and subscripts (which may be
+ * generated tens of thousands of operands long) with a loop down its left
+ * operands rather than recursion.  node has already been checked for a
+ * circular reference. */
+static void print_chain(PycRef<ASTNode> node, PycModule* mod, PycOutput& pyc_output)
+{
+    // links[i + 1] is the chain operand of links[i], and is parenthesized
+    // within it if parens[i] is set
+    std::vector<PycRef<ASTNode>> links;
+    std::vector<bool> parens;
+    PycRef<ASTNode> first;
+    for (;;) {
+        node->setVisiting(true);
+        links.push_back(node);
+        first = chain_operand(node);
+        if (chain_operand(first) == NULL || first->visiting())
+            break;
+        bool binary = node.type() == ASTNode::NODE_BINARY || node.type() == ASTNode::NODE_COMPARE;
+        parens.push_back(binary && (first.type() == ASTNode::NODE_BINARY
+                                    || first.type() == ASTNode::NODE_COMPARE)
+                         && cmp_prec(node, first) > 0);
+        node = first;
+    }
+
+    for (bool paren : parens) {
+        if (paren)
+            pyc_output << "(";
+    }
+    if (node.type() == ASTNode::NODE_BINARY || node.type() == ASTNode::NODE_COMPARE)
+        print_ordered(node, first, mod, pyc_output);
+    else
+        print_src(first, mod, pyc_output);
+    for (size_t i = links.size(); i-- > 0; ) {
+        print_chain_rest(links[i], mod, pyc_output);
+        links[i]->setVisiting(false);
+        if (i > 0 && parens[i - 1])
+            pyc_output << ")";
+    }
+    state().cleanBuild = true;
+}
+
+void print_src(PycRef<ASTNode> node, PycModule* mod, PycOutput& pyc_output)
+{
+    if (node == NULL) {
+        pyc_output << "None";
+        state().cleanBuild = true;
+        return;
+    }
+
+    if (node->visiting()) {
+        fputs("WARNING: Circular reference detected\n", pyc_error_stream());
+        return;
+    }
+    if (chain_operand(node) != NULL) {
+        print_chain(node, mod, pyc_output);
+        return;
+    }
+    node->setVisiting(true);
+
+    switch (node->type()) {
+    case ASTNode::NODE_UNARY:
+        {
+            PycRef<ASTUnary> un = node.cast<ASTUnary>();
+            pyc_output << un->op_str();
+            print_ordered(node, un->operand(), mod, pyc_output);
+        }
+        break;
     case ASTNode::NODE_DELETE:
         {
             pyc_output << "del ";
@@ -2896,7 +3264,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                 print_const(pyc_output, val.cast<ASTObject>()->object(), mod, F_STRING_QUOTE);
                 break;
             default:
-                fprintf(stderr, "Unsupported node type %d in NODE_JOINEDSTR\n", val.type());
+                fprintf(pyc_error_stream(), "Unsupported node type %d in NODE_JOINEDSTR\n", val.type());
             }
         }
         pyc_output << F_STRING_QUOTE;
@@ -2908,17 +3276,17 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             pyc_output << "[";
             bool first = true;
-            cur_indent++;
+            state().cur_indent++;
             for (const auto& val : node.cast<ASTList>()->values()) {
                 if (first)
                     pyc_output << "\n";
                 else
                     pyc_output << ",\n";
-                start_line(cur_indent, pyc_output);
+                start_line(state().cur_indent, pyc_output);
                 print_src(val, mod, pyc_output);
                 first = false;
             }
-            cur_indent--;
+            state().cur_indent--;
             pyc_output << "]";
         }
         break;
@@ -2926,17 +3294,17 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             pyc_output << "{";
             bool first = true;
-            cur_indent++;
+            state().cur_indent++;
             for (const auto& val : node.cast<ASTSet>()->values()) {
                 if (first)
                     pyc_output << "\n";
                 else
                     pyc_output << ",\n";
-                start_line(cur_indent, pyc_output);
+                start_line(state().cur_indent, pyc_output);
                 print_src(val, mod, pyc_output);
                 first = false;
             }
-            cur_indent--;
+            state().cur_indent--;
             pyc_output << "}";
         }
         break;
@@ -2964,19 +3332,19 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             pyc_output << "{";
             bool first = true;
-            cur_indent++;
+            state().cur_indent++;
             for (const auto& val : node.cast<ASTMap>()->values()) {
                 if (first)
                     pyc_output << "\n";
                 else
                     pyc_output << ",\n";
-                start_line(cur_indent, pyc_output);
+                start_line(state().cur_indent, pyc_output);
                 print_src(val.first, mod, pyc_output);
                 pyc_output << ": ";
                 print_src(val.second, mod, pyc_output);
                 first = false;
             }
-            cur_indent--;
+            state().cur_indent--;
             pyc_output << " }";
         }
         break;
@@ -3003,15 +3371,15 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         break;
     case ASTNode::NODE_NODELIST:
         {
-            cur_indent++;
+            state().cur_indent++;
             for (const auto& ln : node.cast<ASTNodeList>()->nodes()) {
                 if (ln.cast<ASTNode>().type() != ASTNode::NODE_NODELIST) {
-                    start_line(cur_indent, pyc_output);
+                    start_line(state().cur_indent, pyc_output);
                 }
                 print_src(ln, mod, pyc_output);
                 end_line(pyc_output);
             }
-            cur_indent--;
+            state().cur_indent--;
         }
         break;
     case ASTNode::NODE_BLOCK:
@@ -3057,9 +3425,9 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             }
             pyc_output << ":\n";
 
-            cur_indent++;
+            state().cur_indent++;
             print_block(blk, mod, pyc_output);
-            cur_indent--;
+            state().cur_indent--;
         }
         break;
     case ASTNode::NODE_OBJECT:
@@ -3110,7 +3478,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         {
             PycRef<ASTReturn> ret = node.cast<ASTReturn>();
             PycRef<ASTNode> value = ret->value();
-            if (!inLambda) {
+            if (!state().inLambda) {
                 switch (ret->rettype()) {
                 case ASTReturn::RETURN:
                     pyc_output << "return ";
@@ -3219,9 +3587,9 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             }
             pyc_output << ": ";
 
-            inLambda = true;
+            state().inLambda = true;
             print_src(code, mod, pyc_output);
-            inLambda = false;
+            state().inLambda = false;
 
             pyc_output << ")";
         }
@@ -3237,13 +3605,13 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
 
                 if (strcmp(code_src->name()->value(), "<lambda>") == 0) {
                     pyc_output << "\n";
-                    start_line(cur_indent, pyc_output);
+                    start_line(state().cur_indent, pyc_output);
                     print_src(dest, mod, pyc_output);
                     pyc_output << " = lambda ";
                     isLambda = true;
                 } else {
                     pyc_output << "\n";
-                    start_line(cur_indent, pyc_output);
+                    start_line(state().cur_indent, pyc_output);
                     if (code_src->flags() & PycCode::CO_COROUTINE)
                         pyc_output << "async ";
                     pyc_output << "def ";
@@ -3291,18 +3659,18 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     pyc_output << ": ";
                 } else {
                     pyc_output << "):\n";
-                    printDocstringAndGlobals = true;
+                    state().printDocstringAndGlobals = true;
                 }
 
-                bool preLambda = inLambda;
-                inLambda |= isLambda;
+                bool preLambda = state().inLambda;
+                state().inLambda |= isLambda;
 
                 print_src(code, mod, pyc_output);
 
-                inLambda = preLambda;
+                state().inLambda = preLambda;
             } else if (src.type() == ASTNode::NODE_CLASS) {
                 pyc_output << "\n";
-                start_line(cur_indent, pyc_output);
+                start_line(state().cur_indent, pyc_output);
                 pyc_output << "class ";
                 print_src(dest, mod, pyc_output);
                 PycRef<ASTTuple> bases = src.cast<ASTClass>()->bases().cast<ASTTuple>();
@@ -3320,7 +3688,7 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
                     // Don't put parens if there are no base classes
                     pyc_output << ":\n";
                 }
-                printClassDocstring = true;
+                state().printClassDocstring = true;
                 PycRef<ASTNode> code = src.cast<ASTClass>()->code().cast<ASTCall>()
                                        ->func().cast<ASTFunction>()->code();
                 print_src(code, mod, pyc_output);
@@ -3379,14 +3747,6 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
             print_src(node.cast<ASTChainStore>()->src(), mod, pyc_output);
         }
         break;
-    case ASTNode::NODE_SUBSCR:
-        {
-            print_src(node.cast<ASTSubscr>()->name(), mod, pyc_output);
-            pyc_output << "[";
-            print_src(node.cast<ASTSubscr>()->key(), mod, pyc_output);
-            pyc_output << "]";
-        }
-        break;
     case ASTNode::NODE_CONVERT:
         {
             pyc_output << "`";
@@ -3449,18 +3809,18 @@ void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output)
         break;
     default:
         pyc_output << "<NODE:" << node->type() << ">";
-        fprintf(stderr, "Unsupported Node type: %d\n", node->type());
-        cleanBuild = false;
-        node_seen.erase((ASTNode *)node);
+        fprintf(pyc_error_stream(), "Unsupported Node type: %d\n", node->type());
+        state().cleanBuild = false;
+        node->setVisiting(false);
         return;
     }
 
-    cleanBuild = true;
-    node_seen.erase((ASTNode *)node);
+    state().cleanBuild = true;
+    node->setVisiting(false);
 }
 
 bool print_docstring(PycRef<PycObject> obj, int indent, PycModule* mod,
-                     std::ostream& pyc_output)
+                     PycOutput& pyc_output)
 {
     // docstrings are translated from the bytecode __doc__ = 'string' to simply '''string'''
     auto doc = obj.try_cast<PycString>();
@@ -3473,26 +3833,112 @@ bool print_docstring(PycRef<PycObject> obj, int indent, PycModule* mod,
     return false;
 }
 
-static std::unordered_set<PycCode *> code_seen;
+/* Marks a code object as being decompiled until its decompyle() call
+ * returns, including by an exception */
+class CodeVisitGuard {
+public:
+    explicit CodeVisitGuard(PycCode* code) : m_code(code)
+    {
+        m_code->setVisiting(true);
+        ++state().code_depth;
+    }
+
+    ~CodeVisitGuard()
+    {
+        m_code->setVisiting(false);
+        --state().code_depth;
+    }
+
+private:
+    PycCode* m_code;
+};
 
-void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output)
+PycRef<ASTNode> build_code_tree(PycRef<PycCode> code, PycModule* mod, bool& clean,
+                                ASTStatementSink* sink)
 {
-    if (code_seen.find((PycCode *)code) != code_seen.end()) {
-        fputs("WARNING: Circular reference detected\n", stderr);
-        return;
+    PycRef<ASTNode> source;
+    try {
+        source = BuildFromCode(code, mod, sink);
+    } catch (BudgetExceeded& ex) {
+        PycRef<PycString> name = code->qualName();
+        if (name == NULL || name->length() == 0)
+            name = code->name();
+        fprintf(pyc_error_stream(), "Abandoned %s: %s\n",
+                (name != NULL) ? name->value() : "<unknown>", ex.what());
+        source = new ASTNodeList(ASTNodeList::list_t());
+        state().cleanBuild = false;
+        ++s_budgetExceeded;
+    }
+    clean = state().cleanBuild;
+    return source;
+}
+
+/* Prints the statements of a code object's main block for decompyle_code,
+ * either as BuildFromCode streams them or all at once when it returns.
+ * The statements the compiler adds at the start of the block are left out
+ * (and a docstring among them is printed as one), then the docstring and
+ * globals of a function are printed before the first statement. */
+class SourcePrinter : public ASTStatementSink {
+public:
+    SourcePrinter(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output)
+        : m_code(std::move(code)), m_mod(mod), m_output(pyc_output),
+          m_stage(STRIP_MODULE), m_keepPrologue(), m_printed() { }
+
+    /* Print the statements at the start as they are, e.g. after an
+     * incomplete build */
+    void keepPrologue() { m_keepPrologue = true; }
+
+    void flush(PycRef<ASTBlock> block, size_t count) override
+    {
+        PycTraceSpan span("print_src");
+        span.setCode(m_code);
+        for (size_t i = 0; i < count; ++i) {
+            PycRef<ASTNode> node = block->nodes().front();
+            block->removeFirst();
+            statement(node);
+        }
     }
-    code_seen.insert((PycCode *)code);
 
-    PycRef<ASTNode> source = BuildFromCode(code, mod);
+    /* Print the statements left when BuildFromCode returns */
+    void finish(PycRef<ASTNodeList> source)
+    {
+        PycTraceSpan span("print_src");
+        span.setCode(m_code);
+        for (const auto& node : source->nodes())
+            statement(node);
+        if (m_stage != STRIP_DONE)
+            endPrologue();
+
+        // This is outside the clean check so a source block will always
+        // be compilable, even if decompylation failed.
+        if (m_printed == 0 && !m_code.isIdent(m_mod->code()))
+            statement(new ASTKeyword(ASTKeyword::KW_PASS));
+        state().cleanBuild = true;
+    }
 
-    PycRef<ASTNodeList> clean = source.cast<ASTNodeList>();
-    if (cleanBuild) {
-        // The Python compiler adds some stuff that we don't really care
-        // about, and would add extra code for re-compilation anyway.
-        // We strip these lines out here, and then add a "pass" statement
-        // if the cleaned up code is empty
-        if (clean->nodes().front().type() == ASTNode::NODE_STORE) {
-            PycRef<ASTStore> store = clean->nodes().front().cast<ASTStore>();
+private:
+    enum Stage { STRIP_MODULE, STRIP_QUALNAME, STRIP_DOCSTRING, STRIP_DONE };
+
+    PycRef<PycCode> m_code;
+    PycModule* m_mod;
+    PycOutput& m_output;
+    Stage m_stage;
+    bool m_keepPrologue;
+    unsigned long m_printed;
+
+    static bool isStore(const PycRef<ASTNode>& node)
+    {
+        return node.type() == ASTNode::NODE_STORE;
+    }
+
+    /* Whether node is one of the statements the compiler adds at the start
+     * of the block, printing it if it is a docstring */
+    bool stripped(const PycRef<ASTNode>& node)
+    {
+        if (m_keepPrologue)
+            return false;
+        if (m_stage <= STRIP_MODULE && isStore(node)) {
+            PycRef<ASTStore> store = node.cast<ASTStore>();
             if (store->src().type() == ASTNode::NODE_NAME
                     && store->dest().type() == ASTNode::NODE_NAME) {
                 PycRef<ASTName> src = store->src().cast<ASTName>();
@@ -3501,37 +3947,110 @@ void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output)
                         && dest->name()->isEqual("__module__")) {
                     // __module__ = __name__
                     // Automatically added by Python 2.2.1 and later
-                    clean->removeFirst();
+                    m_stage = STRIP_QUALNAME;
+                    return true;
                 }
             }
         }
-        if (clean->nodes().front().type() == ASTNode::NODE_STORE) {
-            PycRef<ASTStore> store = clean->nodes().front().cast<ASTStore>();
+        if (m_stage <= STRIP_QUALNAME && isStore(node)) {
+            PycRef<ASTStore> store = node.cast<ASTStore>();
             if (store->src().type() == ASTNode::NODE_OBJECT
                     && store->dest().type() == ASTNode::NODE_NAME) {
-                PycRef<ASTObject> src = store->src().cast<ASTObject>();
-                PycRef<PycString> srcString = src->object().try_cast<PycString>();
                 PycRef<ASTName> dest = store->dest().cast<ASTName>();
                 if (dest->name()->isEqual("__qualname__")) {
                     // __qualname__ = '<Class Name>'
                     // Automatically added by Python 3.3 and later
-                    clean->removeFirst();
+                    m_stage = STRIP_DOCSTRING;
+                    return true;
                 }
             }
         }
 
         // Class and module docstrings may only appear at the beginning of their source
-        if (printClassDocstring && clean->nodes().front().type() == ASTNode::NODE_STORE) {
-            PycRef<ASTStore> store = clean->nodes().front().cast<ASTStore>();
+        if (m_stage <= STRIP_DOCSTRING && state().printClassDocstring && isStore(node)) {
+            PycRef<ASTStore> store = node.cast<ASTStore>();
             if (store->dest().type() == ASTNode::NODE_NAME &&
                     store->dest().cast<ASTName>()->name()->isEqual("__doc__") &&
                     store->src().type() == ASTNode::NODE_OBJECT) {
                 if (print_docstring(store->src().cast<ASTObject>()->object(),
-                        cur_indent + (code->name()->isEqual("<module>") ? 0 : 1), mod, pyc_output))
-                    clean->removeFirst();
+                        state().cur_indent + (m_code->name()->isEqual("<module>") ? 0 : 1),
+                        m_mod, m_output)) {
+                    endPrologue();
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void endPrologue()
+    {
+        m_stage = STRIP_DONE;
+        if (state().printClassDocstring)
+            state().printClassDocstring = false;
+
+        if (state().printDocstringAndGlobals) {
+            if (m_code->consts()->size())
+                print_docstring(m_code->getConst(0), state().cur_indent + 1, m_mod, m_output);
+
+            PycCode::globals_t globs = m_code->getGlobals();
+            if (globs.size()) {
+                start_line(state().cur_indent + 1, m_output);
+                m_output << "global ";
+                bool first = true;
+                for (const auto& glob : globs) {
+                    if (!first)
+                        m_output << ", ";
+                    m_output << glob->value();
+                    first = false;
+                }
+                m_output << "\n";
             }
+            state().printDocstringAndGlobals = false;
         }
-        if (clean->nodes().back().type() == ASTNode::NODE_RETURN) {
+    }
+
+    /* Prints node as print_src prints each node of an ASTNodeList */
+    void statement(const PycRef<ASTNode>& node)
+    {
+        if (m_stage != STRIP_DONE) {
+            if (stripped(node))
+                return;
+            endPrologue();
+        }
+
+        state().cur_indent++;
+        if (node.type() != ASTNode::NODE_NODELIST)
+            start_line(state().cur_indent, m_output);
+        print_src(node, m_mod, m_output);
+        end_line(m_output);
+        state().cur_indent--;
+        ++m_printed;
+    }
+};
+
+static void decompyle_code(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output)
+{
+    SourcePrinter printer(code, mod, pyc_output);
+
+    // A function's globals are only known once it has been built, and
+    // they are printed before its first statement, so only module and
+    // class bodies are streamed
+    bool streaming = s_streaming && !state().printDocstringAndGlobals;
+
+    // A code object over budget is left empty; it gets a pass statement and
+    // a warning below
+    bool built_clean;
+    PycRef<ASTNode> source = build_code_tree(code, mod, built_clean,
+                                             streaming ? &printer : nullptr);
+
+    PycRef<ASTNodeList> clean = source.cast<ASTNodeList>();
+    if (built_clean) {
+        // The Python compiler adds some stuff that we don't really care
+        // about, and would add extra code for re-compilation anyway.
+        // The printer strips these lines out from the start, and then
+        // adds a "pass" statement if the cleaned up code is empty
+        if (!clean->nodes().empty() && clean->nodes().back().type() == ASTNode::NODE_RETURN) {
             PycRef<ASTReturn> ret = clean->nodes().back().cast<ASTReturn>();
 
             PycRef<ASTObject> retObj = ret->value().try_cast<ASTObject>();
@@ -3540,42 +4059,266 @@ void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output)
                 clean->removeLast();  // Always an extraneous return statement
             }
         }
+    } else {
+        printer.keepPrologue();
     }
-    if (printClassDocstring)
-        printClassDocstring = false;
-    // This is outside the clean check so a source block will always
-    // be compilable, even if decompylation failed.
-    if (clean->nodes().size() == 0 && !code.isIdent(mod->code()))
-        clean->append(new ASTKeyword(ASTKeyword::KW_PASS));
-
-    bool part1clean = cleanBuild;
-
-    if (printDocstringAndGlobals) {
-        if (code->consts()->size())
-            print_docstring(code->getConst(0), cur_indent + 1, mod, pyc_output);
-
-        PycCode::globals_t globs = code->getGlobals();
-        if (globs.size()) {
-            start_line(cur_indent + 1, pyc_output);
-            pyc_output << "global ";
-            bool first = true;
-            for (const auto& glob : globs) {
-                if (!first)
-                    pyc_output << ", ";
-                pyc_output << glob->value();
-                first = false;
-            }
-            pyc_output << "\n";
+
+    printer.finish(clean);
+
+    if (!built_clean) {
+        start_line(state().cur_indent, pyc_output);
+        pyc_output << "# WARNING: Decompyle incomplete\n";
+    }
+}
+
+enum {
+    MEMO_CLEAN_BUILD = 0x1,
+    MEMO_IN_LAMBDA = 0x2,
+    MEMO_PRINT_DOCSTRING_AND_GLOBALS = 0x4,
+    MEMO_PRINT_CLASS_DOCSTRING = 0x8,
+};
+
+static unsigned memo_state()
+{
+    return (state().cleanBuild ? MEMO_CLEAN_BUILD : 0)
+            | (state().inLambda ? MEMO_IN_LAMBDA : 0)
+            | (state().printDocstringAndGlobals ? MEMO_PRINT_DOCSTRING_AND_GLOBALS : 0)
+            | (state().printClassDocstring ? MEMO_PRINT_CLASS_DOCSTRING : 0);
+}
+
+static void restore_memo_state(unsigned flags)
+{
+    state().cleanBuild = (flags & MEMO_CLEAN_BUILD) != 0;
+    state().inLambda = (flags & MEMO_IN_LAMBDA) != 0;
+    state().printDocstringAndGlobals = (flags & MEMO_PRINT_DOCSTRING_AND_GLOBALS) != 0;
+    state().printClassDocstring = (flags & MEMO_PRINT_CLASS_DOCSTRING) != 0;
+}
+
+/* Hash the code structurally, along with everything else that affects how
+ * it is printed */
+static bool memo_key(PycRef<PycCode> code, PycModule* mod, DecompileMemo::Key& key)
+{
+    PycMarshalWriter writer(mod->majorVer(), mod->minorVer());
+    writer.setStructural(true);
+    try {
+        writer.writeObject(code.cast<PycObject>());
+    } catch (std::exception&) {
+        return false;
+    }
+
+    char context[64];
+    snprintf(context, sizeof(context), "%d.%d %d %d %d %u", mod->majorVer(),
+             mod->minorVer(), mod->isUnicode(), mod->decimalLongs(),
+             state().cur_indent, memo_state() & ~MEMO_CLEAN_BUILD);
+    writer.writeBuffer(context, strlen(context));
+
+    const std::string& data = writer.data();
+    key.hash[0] = PycCache::hash(data.data(), data.size());
+    key.hash[1] = PycCache::hash(data.data(), data.size(), 0x9E3779B97F4A7C15ULL);
+    return true;
+}
+
+void decompyle(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output)
+{
+    if (state().code_depth == 0) {
+        // Starting a new module; discard anything left over from the last
+        // one, which may have been abandoned by an exception
+        state().inLambda = false;
+        state().printDocstringAndGlobals = false;
+        state().printClassDocstring = true;
+        state().cur_indent = -1;
+    } else if (code->visiting()) {
+        fputs("WARNING: Circular reference detected\n", pyc_error_stream());
+        return;
+    }
+    CodeVisitGuard guard((PycCode *)code);
+    PycTraceSpan span("decompyle");
+    span.setCode(code);
+
+    DecompileMemo* memo = s_memo;
+    DecompileMemo::Key key;
+    if (!memo || code.isIdent(mod->code()) || !memo_key(code, mod, key)) {
+        decompyle_code(code, mod, pyc_output);
+        return;
+    }
+
+    DecompileMemo::Entry entry;
+    if (memo->lookup(key, entry)) {
+        pyc_output << entry.text;
+        restore_memo_state(entry.state);
+        return;
+    }
+
+    // Print to a buffer, so the text can be remembered
+    unsigned long errors = pyc_error_count();
+    std::ostringstream text;
+    {
+        PycOutput memo_output(text);
+        try {
+            decompyle_code(code, mod, memo_output);
+        } catch (...) {
+            memo_output.flush();
+            pyc_output << text.str();
+            throw;
         }
-        printDocstringAndGlobals = false;
     }
+    entry.text = text.str();
+    pyc_output << entry.text;
+    if (pyc_error_count() == errors) {
+        entry.state = memo_state();
+        memo->insert(key, std::move(entry));
+    }
+}
+
+void set_decompile_memo(DecompileMemo* memo)
+{
+    s_memo = memo;
+}
 
-    print_src(source, mod, pyc_output);
+void set_decompile_budget(const DecompileBudget& budget)
+{
+    s_budget = budget;
+}
 
-    if (!cleanBuild || !part1clean) {
-        start_line(cur_indent, pyc_output);
-        pyc_output << "# WARNING: Decompyle incomplete\n";
+DecompileBudget decompile_budget()
+{
+    return s_budget;
+}
+
+unsigned long decompile_budget_exceeded()
+{
+    return s_budgetExceeded;
+}
+
+void set_decompile_streaming(bool streaming, size_t batch)
+{
+    s_streaming = streaming;
+    s_streamBatch = (batch > 0) ? batch : 1;
+}
+
+bool decompile_streaming()
+{
+    return s_streaming;
+}
+
+size_t decompile_stream_batch()
+{
+    return s_streamBatch;
+}
+
+bool DecompileMemo::lookup(const Key& key, Entry& entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_entries.find(key);
+    if (found == m_entries.end()) {
+        ++m_misses;
+        return false;
+    }
+    ++m_hits;
+    entry = found->second;
+    return true;
+}
+
+void DecompileMemo::insert(const Key& key, Entry entry)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_size + entry.text.size() > m_maxSize)
+        return;
+    m_size += entry.text.size();
+    m_entries[key] = std::move(entry);
+}
+
+unsigned long DecompileMemo::hits() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hits;
+}
+
+unsigned long DecompileMemo::misses() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_misses;
+}
+
+size_t DecompileMemo::entries() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
+
+/* Saved memo files hold MEMO_MAGIC and the build ID, followed by the
+ * entries as key, state, text size and text.  Numbers are little-endian. */
+static const char MEMO_MAGIC[8] = { 'P', 'Y', 'C', 'M', 'E', 'M', 'O', '1' };
+
+static void append_u64(std::string& data, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        data += (char)(value >> (i * 8));
+}
+
+static bool read_u64(FILE* file, uint64_t& value)
+{
+    unsigned char bytes[8];
+    if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
+        return false;
+    value = 0;
+    for (int i = 7; i >= 0; --i)
+        value = (value << 8) | bytes[i];
+    return true;
+}
+bool DecompileMemo::load(const char* filename, uint64_t build_id)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return false;
+
+    char magic[sizeof(MEMO_MAGIC)];
+    uint64_t file_build_id;
+    bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+            && memcmp(magic, MEMO_MAGIC, sizeof(magic)) == 0
+            && read_u64(file, file_build_id) && file_build_id == build_id;
+
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    size_t size = 0;
+    Key key;
+    while (ok && read_u64(file, key.hash[0])) {
+        uint64_t state, length;
+        Entry entry;
+        ok = read_u64(file, key.hash[1]) && read_u64(file, state)
+                && read_u64(file, length) && length <= m_maxSize;
+        if (ok) {
+            entry.state = (unsigned)state;
+            entry.text.resize((size_t)length);
+            ok = length == 0 || fread(&entry.text[0], 1, entry.text.size(), file) == entry.text.size();
+        }
+        if (ok && size + entry.text.size() <= m_maxSize) {
+            size += entry.text.size();
+            entries[key] = std::move(entry);
+        }
     }
+    fclose(file);
+    if (!ok)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries = std::move(entries);
+    m_size = size;
+    return true;
+}
 
-    code_seen.erase((PycCode *)code);
+bool DecompileMemo::save(const char* filename, uint64_t build_id) const
+{
+    std::string data(MEMO_MAGIC, sizeof(MEMO_MAGIC));
+    append_u64(data, build_id);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto& item : m_entries) {
+            append_u64(data, item.first.hash[0]);
+            append_u64(data, item.first.hash[1]);
+            append_u64(data, item.second.state);
+            append_u64(data, item.second.text.size());
+            data += item.second.text;
+        }
+    }
+    return PycCache::writeFile(filename, data);
 }
@@ -2,10 +2,140 @@
 #define _PYC_ASTREE_H
 
 #include "ASTNode.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
-PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod);
-void print_src(PycRef<ASTNode> node, PycModule* mod, std::ostream& pyc_output);
+/* Takes statements from the main block of a code object while BuildFromCode
+ * is still building it, once no later instruction can change them */
+class ASTStatementSink {
+public:
+    virtual ~ASTStatementSink() { }
 
-void decompyle(PycRef<PycCode> code, PycModule* mod, std::ostream& pyc_output);
+    /* Handle the first count statements of block, and remove them */
+    virtual void flush(PycRef<ASTBlock> block, size_t count) = 0;
+};
+
+PycRef<ASTNode> BuildFromCode(PycRef<PycCode> code, PycModule* mod,
+                              ASTStatementSink* sink = nullptr);
+void print_src(PycRef<ASTNode> node, PycModule* mod, PycOutput& pyc_output);
+
+void decompyle(PycRef<PycCode> code, PycModule* mod, PycOutput& pyc_output);
+
+/* Builds the tree for code as decompyle() does.  A code object that goes
+ * over the decompile budget (see below) is reported and gives an empty
+ * ASTNodeList.  clean is set to whether the tree was built without errors.
+ * Statements given to sink are not in the tree. */
+PycRef<ASTNode> build_code_tree(PycRef<PycCode> code, PycModule* mod, bool& clean,
+                                ASTStatementSink* sink = nullptr);
+
+/* Gives the decompiler calls made on this thread while the scope is alive
+ * their own state, independent of any decompilation already in progress
+ * (e.g. one whose output callback started this one). */
+class DecompileScope {
+public:
+    DecompileScope();
+    ~DecompileScope();
+
+    DecompileScope(const DecompileScope&) = delete;
+    DecompileScope& operator=(const DecompileScope&) = delete;
+
+private:
+    struct DecompileState* m_state;
+    struct DecompileState* m_prev;
+};
+
+/* Limits on the work done to build the tree for each code object, so that
+ * one pathological function can't hold up the rest of the module.  A code
+ * object that goes over any of them is abandoned: it is printed as a stub
+ * marked "# WARNING: Decompyle incomplete", the reason is reported to
+ * pyc_error_stream(), and decompilation continues with the next one.
+ * Zero means no limit. */
+struct DecompileBudget {
+    DecompileBudget() : max_steps(), max_nodes(), max_time_ms() { }
+
+    unsigned long max_steps;    // Instructions processed and blocks unwound
+    unsigned long max_nodes;    // AST nodes created
+    unsigned long max_time_ms;  // Wall time
+};
+
+/* Use budget for the decompyle() calls made on this thread */
+void set_decompile_budget(const DecompileBudget& budget);
+DecompileBudget decompile_budget();
+
+/* The number of code objects abandoned for going over budget on this
+ * thread so far */
+unsigned long decompile_budget_exceeded();
+
+/* For the decompyle() calls made on this thread, print the statements of
+ * module and class bodies as soon as they are built and release their
+ * trees, instead of building the whole tree for the body first.  This
+ * keeps the memory used for very large modules down, and the output starts
+ * sooner.  The output is the same, except for a body that can't be
+ * decompiled completely: the statements printed before the problem was
+ * found are kept (even if it goes over budget), and the __module__,
+ * __qualname__ and docstring statements added by the compiler are still
+ * left out. */
+enum { DECOMPILE_STREAM_BATCH = 16 };
+
+/* While streaming, the statements of a body are printed in batches of at
+ * least batch statements (tests use 1, so that every module is printed
+ * as it is built). */
+void set_decompile_streaming(bool streaming, size_t batch = DECOMPILE_STREAM_BATCH);
+bool decompile_streaming();
+size_t decompile_stream_batch();
+
+/* Remembers the source printed by decompyle() for code objects, keyed by a
+ * structural hash of the code (which ignores where it was compiled) and the
+ * state it was printed in.  Identical code found again, in the same module
+ * or a later one, is then printed without being decompiled again.  Code
+ * whose decompilation reported anything to pyc_error_stream() is not
+ * remembered.  A memo may be shared between threads. */
+class DecompileMemo {
+public:
+    struct Key {
+        uint64_t hash[2];
+
+        bool operator==(const Key& other) const
+        {
+            return hash[0] == other.hash[0] && hash[1] == other.hash[1];
+        }
+    };
+
+    struct Entry {
+        std::string text;
+        unsigned state;     // Decompiler state flags after printing
+    };
+
+    /* max_size limits the total size of the remembered source */
+    explicit DecompileMemo(size_t max_size = 256 * 1024 * 1024)
+        : m_size(), m_maxSize(max_size), m_hits(), m_misses() { }
+
+    bool lookup(const Key& key, Entry& entry);
+    void insert(const Key& key, Entry entry);
+
+    /* Saved memos are only loaded by a build with the same build_id, since
+     * another version of the decompiler may print the same code differently */
+    bool load(const char* filename, uint64_t build_id);
+    bool save(const char* filename, uint64_t build_id) const;
+
+    unsigned long hits() const;
+    unsigned long misses() const;
+    size_t entries() const;
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return (size_t)key.hash[0]; }
+    };
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<Key, Entry, KeyHash> m_entries;
+    size_t m_size, m_maxSize;
+    unsigned long m_hits, m_misses;
+};
+
+/* Use memo for the decompyle() calls made on this thread (NULL for none) */
+void set_decompile_memo(DecompileMemo* memo);
 
 #endif
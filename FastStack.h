@@ -32,7 +32,7 @@ public:
             m_stack[m_ptr--] = nullptr;
         else {
             #ifdef BLOCK_DEBUG
-                fprintf(stderr, "pop from empty stack\n");
+                fprintf(pyc_error_stream(), "pop from empty stack\n");
             #endif
         }
     }
@@ -45,13 +45,13 @@ public:
                 return m_stack[idx];
             else {
                 #ifdef BLOCK_DEBUG
-                    fprintf(stderr, "insufficient values on stack\n");
+                    fprintf(pyc_error_stream(), "insufficient values on stack\n");
                 #endif
                 return nullptr;
             }
         }
         else {
-            fprintf(stderr, "incorrect operand %i\n", i);
+            fprintf(pyc_error_stream(), "incorrect operand %i\n", i);
             return nullptr;
         }
     }
@@ -61,11 +61,48 @@ public:
         return m_ptr == -1;
     }
 
+    size_t bytes() const { return m_stack.capacity() * sizeof(m_stack[0]); }
+
 private:
     std::vector<PycRef<ASTNode>> m_stack;
     int m_ptr;
 };
 
-typedef std::stack<FastStack> stackhist_t;
+/* The stacks saved on entering blocks, to be restored on leaving them.
+ * While PycMemStats is enabled, this also tracks how much they hold. */
+class StackHistory : public std::stack<FastStack> {
+public:
+    StackHistory() : m_snapshots(), m_maxDepth(), m_bytes(), m_peakBytes() { }
+
+    void push(const FastStack& stack)
+    {
+        std::stack<FastStack>::push(stack);
+        if (PycMemStats::enabled()) {
+            ++m_snapshots;
+            if (size() > m_maxDepth)
+                m_maxDepth = size();
+            m_bytes += top().bytes();
+            if (m_bytes > m_peakBytes)
+                m_peakBytes = m_bytes;
+        }
+    }
+
+    void pop()
+    {
+        if (PycMemStats::enabled() && m_bytes >= top().bytes())
+            m_bytes -= top().bytes();
+        std::stack<FastStack>::pop();
+    }
+
+    unsigned long snapshots() const { return m_snapshots; }
+    unsigned long maxDepth() const { return m_maxDepth; }
+    unsigned long long peakBytes() const { return m_peakBytes; }
+
+private:
+    unsigned long m_snapshots, m_maxDepth;
+    unsigned long long m_bytes, m_peakBytes;
+};
+
+typedef StackHistory stackhist_t;
 
 #endif
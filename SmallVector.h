@@ -0,0 +1,229 @@
+#ifndef _PYC_SMALLVECTOR_H
+#define _PYC_SMALLVECTOR_H
+
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <utility>
+
+/* Contiguous sequence container with room for a few elements stored inline.
+ * Elements live in [m_data + m_head, m_data + m_head + m_size), so removing
+ * from the front only advances m_head instead of shifting every element. */
+template <class _Elem, size_t _Inline>
+class SmallVector {
+public:
+    typedef _Elem value_type;
+    typedef size_t size_type;
+    typedef _Elem* iterator;
+    typedef const _Elem* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    SmallVector() noexcept
+        : m_data(inlineData()), m_head(), m_size(), m_capacity(_Inline) { }
+
+    SmallVector(const SmallVector& copy)
+        : m_data(inlineData()), m_head(), m_size(), m_capacity(_Inline)
+    {
+        reserve(copy.m_size);
+        for (const auto& elem : copy)
+            new (m_data + m_size++) _Elem(elem);
+    }
+
+    SmallVector(SmallVector&& move) noexcept
+        : m_data(inlineData()), m_head(), m_size(), m_capacity(_Inline)
+    {
+        steal(move);
+    }
+
+    ~SmallVector()
+    {
+        clear();
+        releaseStorage();
+    }
+
+    SmallVector& operator=(const SmallVector& copy)
+    {
+        if (&copy != this) {
+            clear();
+            reserve(copy.m_size);
+            for (const auto& elem : copy)
+                new (m_data + m_size++) _Elem(elem);
+        }
+        return *this;
+    }
+
+    SmallVector& operator=(SmallVector&& move) noexcept
+    {
+        if (&move != this) {
+            clear();
+            releaseStorage();
+            steal(move);
+        }
+        return *this;
+    }
+
+    iterator begin() noexcept { return m_data + m_head; }
+    iterator end() noexcept { return m_data + m_head + m_size; }
+    const_iterator begin() const noexcept { return m_data + m_head; }
+    const_iterator end() const noexcept { return m_data + m_head + m_size; }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    reverse_iterator rbegin() noexcept { return reverse_iterator(end()); }
+    reverse_iterator rend() noexcept { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const noexcept { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const noexcept { return const_reverse_iterator(begin()); }
+    const_reverse_iterator crbegin() const noexcept { return rbegin(); }
+    const_reverse_iterator crend() const noexcept { return rend(); }
+
+    size_type size() const noexcept { return m_size; }
+    bool empty() const noexcept { return m_size == 0; }
+
+    _Elem& operator[](size_type idx) { return m_data[m_head + idx]; }
+    const _Elem& operator[](size_type idx) const { return m_data[m_head + idx]; }
+
+    _Elem& front() { return m_data[m_head]; }
+    const _Elem& front() const { return m_data[m_head]; }
+    _Elem& back() { return m_data[m_head + m_size - 1]; }
+    const _Elem& back() const { return m_data[m_head + m_size - 1]; }
+
+    void reserve(size_type count)
+    {
+        if (m_head + count > m_capacity)
+            relocate(count > m_capacity ? count : m_capacity);
+    }
+
+    template <class... _Args>
+    void emplace_back(_Args&&... args)
+    {
+        if (m_head + m_size < m_capacity) {
+            new (m_data + m_head + m_size) _Elem(std::forward<_Args>(args)...);
+            ++m_size;
+            return;
+        }
+
+        // args may refer to an element of this vector, so the new element
+        // is built before the old ones are moved, as std::vector does.
+        // Reclaim the space freed by pop_front() if the new element fits
+        // in front of the live ones, and grow otherwise.
+        if (m_size < m_head) {
+            new (m_data + m_size) _Elem(std::forward<_Args>(args)...);
+            moveElements(m_data);
+        } else {
+            size_type capacity = m_capacity * 2;
+            _Elem* storage = allocate(capacity);
+            try {
+                new (storage + m_size) _Elem(std::forward<_Args>(args)...);
+            } catch (...) {
+                ::operator delete(storage);
+                throw;
+            }
+            moveElements(storage);
+            releaseStorage();
+            m_data = storage;
+            m_capacity = capacity;
+        }
+        m_head = 0;
+        ++m_size;
+    }
+
+    void push_back(const _Elem& elem) { emplace_back(elem); }
+    void push_back(_Elem&& elem) { emplace_back(std::move(elem)); }
+
+    void pop_front()
+    {
+        m_data[m_head].~_Elem();
+        if (--m_size == 0)
+            m_head = 0;
+        else
+            ++m_head;
+    }
+
+    void pop_back()
+    {
+        m_data[m_head + --m_size].~_Elem();
+        if (m_size == 0)
+            m_head = 0;
+    }
+
+    void clear() noexcept
+    {
+        for (size_type i = 0; i < m_size; ++i)
+            m_data[m_head + i].~_Elem();
+        m_head = 0;
+        m_size = 0;
+    }
+
+private:
+    _Elem* m_data;
+    size_type m_head, m_size, m_capacity;
+    alignas(_Elem) unsigned char m_inline[_Inline * sizeof(_Elem)];
+
+    _Elem* inlineData() noexcept { return reinterpret_cast<_Elem*>(m_inline); }
+    bool isInline() const noexcept { return m_data == reinterpret_cast<const _Elem*>(m_inline); }
+
+    void releaseStorage() noexcept
+    {
+        if (!isInline())
+            ::operator delete(m_data);
+        m_data = inlineData();
+        m_capacity = _Inline;
+    }
+
+    /* Through operator new rather than malloc, so a replacement operator
+     * new (e.g. pycbench's allocation counter) sees it */
+    static _Elem* allocate(size_type capacity)
+    {
+        return static_cast<_Elem*>(::operator new(capacity * sizeof(_Elem)));
+    }
+
+    /* Move the live elements to the start of storage, which may be the
+     * current buffer.  m_head is left for the caller to reset. */
+    void moveElements(_Elem* storage)
+    {
+        for (size_type i = 0; i < m_size; ++i) {
+            new (storage + i) _Elem(std::move(m_data[m_head + i]));
+            m_data[m_head + i].~_Elem();
+        }
+    }
+
+    /* Move the live elements to the start of a buffer holding at least
+     * capacity elements, which may be the current buffer. */
+    void relocate(size_type capacity)
+    {
+        if (capacity <= m_capacity && m_head == 0)
+            return;
+
+        _Elem* storage = (capacity > m_capacity) ? allocate(capacity) : m_data;
+        moveElements(storage);
+        if (storage != m_data) {
+            releaseStorage();
+            m_data = storage;
+            m_capacity = capacity;
+        }
+        m_head = 0;
+    }
+
+    void steal(SmallVector& move) noexcept
+    {
+        if (move.isInline()) {
+            for (size_type i = 0; i < move.m_size; ++i) {
+                new (m_data + i) _Elem(std::move(move.m_data[move.m_head + i]));
+                move.m_data[move.m_head + i].~_Elem();
+            }
+            m_size = move.m_size;
+        } else {
+            m_data = move.m_data;
+            m_head = move.m_head;
+            m_size = move.m_size;
+            m_capacity = move.m_capacity;
+            move.m_data = move.inlineData();
+            move.m_capacity = _Inline;
+        }
+        move.m_head = 0;
+        move.m_size = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,481 @@
+/* In-process benchmarks for the loader, disassembler and decompiler.
+ *
+ * Microbenchmarks time the individual stages (LoadObject, bc_next,
+ * BuildFromCode, print_src and PycString::print) over every file in the
+ * corpus, and macrobenchmarks time full decompilation of the corpus and
+ * of any synthetic modules given with --synthetic.  Results can be written
+ * as text, JSON or CSV so that two builds can be compared. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "ASTree.h"
+#include "bytecode.h"
+#include "pyc_module.h"
+#include "pyc_string.h"
+
+#ifdef WIN32
+#  include <io.h>
+#  define PATHSEP '\\'
+#  define NULL_DEVICE "NUL"
+#  define dup _dup
+#  define dup2 _dup2
+#  define close _close
+#  define fileno _fileno
+#else
+#  include <unistd.h>
+#  define PATHSEP '/'
+#  define NULL_DEVICE "/dev/null"
+#endif
+
+/* Allocation accounting for everything allocated through operator new.
+ * The decompiler has no other heap allocations of its own (SmallVector
+ * uses operator new too), but allocations made directly with malloc by
+ * the C library are not counted. */
+static unsigned long long s_allocCount = 0;
+static unsigned long long s_allocBytes = 0;
+
+void* operator new(size_t size)
+{
+    ++s_allocCount;
+    s_allocBytes += size;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+/* Discards all output, so only the decompiler's own work is measured */
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type ch) override { return traits_type::not_eof(ch); }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+struct BenchResult {
+    std::string name;
+    const char* unit;
+    unsigned long long iterations;
+    double nsPerOp;
+    double instrPerSec;     // Python bytecode instructions, 0 if not applicable
+    double allocsPerOp;
+    double bytesPerOp;
+};
+
+struct CorpusFile {
+    std::string path;
+    std::vector<char> data;
+    std::unique_ptr<PycModule> mod;
+    std::vector<PycRef<PycCode>> codes;
+    unsigned long long instructions;
+};
+
+static double s_minTime = 0.2;
+static const char* s_filter = nullptr;
+
+static void read_file(const char* filename, std::vector<char>& data)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        throw std::runtime_error(std::string("Could not open ") + filename);
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void collect_code(PycRef<PycCode> code, std::vector<PycRef<PycCode>>& codes)
+{
+    codes.push_back(code);
+    PycRef<PycSequence> consts = code->consts();
+    for (int i = 0; i < consts->size(); ++i) {
+        PycRef<PycObject> obj = consts->get(i);
+        if (obj.type() == PycObject::TYPE_CODE || obj.type() == PycObject::TYPE_CODE2)
+            collect_code(obj.cast<PycCode>(), codes);
+    }
+}
+
+static unsigned long long count_instructions(PycRef<PycCode> code, PycModule* mod)
+{
+    PycBuffer source(code->code()->value(), code->code()->length());
+    int opcode, operand, pos = 0;
+    unsigned long long count = 0;
+    while (!source.atEof()) {
+        bc_next(source, mod, opcode, operand, pos);
+        ++count;
+    }
+    return count;
+}
+
+static bool load_corpus_file(const char* filename, CorpusFile& file)
+{
+    file.path = filename;
+    read_file(filename, file.data);
+    file.mod.reset(new PycModule);
+    file.mod->loadFromBuffer(file.data.data(), (int)file.data.size());
+    if (!file.mod->isValid() || file.mod->code() == NULL)
+        return false;
+
+    collect_code(file.mod->code(), file.codes);
+    file.instructions = 0;
+    for (const auto& code : file.codes)
+        file.instructions += count_instructions(code, file.mod.get());
+    return true;
+}
+
+/* Run body() until at least s_minTime seconds have elapsed, doubling the
+ * iteration count each round.  Each call to body() performs opsPerCall
+ * operations and processes instrPerCall bytecode instructions. */
+template <class _Body>
+static bool run_bench(std::vector<BenchResult>& results, const std::string& name,
+                      const char* unit, unsigned long long opsPerCall,
+                      unsigned long long instrPerCall, _Body body)
+{
+    if (s_filter && name.find(s_filter) == std::string::npos)
+        return false;
+    if (opsPerCall == 0)
+        return false;
+
+    typedef std::chrono::steady_clock clock;
+    body();     // Warm up caches and lazily initialized state
+
+    unsigned long long iterations = 1;
+    for ( ;; ) {
+        unsigned long long allocCount = s_allocCount;
+        unsigned long long allocBytes = s_allocBytes;
+        clock::time_point start = clock::now();
+        for (unsigned long long i = 0; i < iterations; ++i)
+            body();
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+        if (elapsed >= s_minTime || iterations >= (1ULL << 40)) {
+            double ops = double(iterations) * opsPerCall;
+            BenchResult result;
+            result.name = name;
+            result.unit = unit;
+            result.iterations = iterations;
+            result.nsPerOp = elapsed * 1e9 / ops;
+            result.instrPerSec = instrPerCall ? (double(iterations) * instrPerCall) / elapsed : 0.0;
+            result.allocsPerOp = double(s_allocCount - allocCount) / ops;
+            result.bytesPerOp = double(s_allocBytes - allocBytes) / ops;
+            results.push_back(result);
+            return true;
+        }
+        iterations *= 2;
+    }
+}
+
+static void decompile_module(PycModule* mod, PycOutput& pyc_output)
+{
+    decompyle(mod->code(), mod, pyc_output);
+}
+
+static void run_micro(std::vector<BenchResult>& results, std::vector<CorpusFile>& corpus,
+                      std::ostream& null_stream)
+{
+    unsigned long long totalInstr = 0, totalCodes = 0;
+    for (const auto& file : corpus) {
+        totalInstr += file.instructions;
+        totalCodes += file.codes.size();
+    }
+
+    run_bench(results, "micro/LoadObject", "module", corpus.size(), totalInstr, [&] {
+        for (const auto& file : corpus) {
+            PycModule mod;
+            mod.loadFromBuffer(file.data.data(), (int)file.data.size());
+        }
+    });
+
+    run_bench(results, "micro/bc_next", "instruction", totalInstr, totalInstr, [&] {
+        for (const auto& file : corpus) {
+            for (const auto& code : file.codes)
+                count_instructions(code, file.mod.get());
+        }
+    });
+
+    run_bench(results, "micro/BuildFromCode", "code object", totalCodes, totalInstr, [&] {
+        for (const auto& file : corpus) {
+            for (const auto& code : file.codes)
+                BuildFromCode(code, file.mod.get());
+        }
+    });
+
+    // Printing a module also rebuilds any functions and classes it defines,
+    // since print_src decompiles nested code objects as it reaches them
+    std::vector<PycRef<ASTNode>> trees;
+    for (const auto& file : corpus)
+        trees.push_back(BuildFromCode(file.mod->code(), file.mod.get()));
+    run_bench(results, "micro/print_src", "module", corpus.size(), 0, [&] {
+        PycOutput pyc_output(null_stream);
+        for (size_t i = 0; i < corpus.size(); ++i)
+            print_src(trees[i], corpus[i].mod.get(), pyc_output);
+    });
+
+    std::vector<std::pair<PycRef<PycString>, PycModule*>> strings;
+    for (const auto& file : corpus) {
+        for (const auto& code : file.codes) {
+            PycRef<PycSequence> consts = code->consts();
+            for (int i = 0; i < consts->size(); ++i) {
+                PycRef<PycString> str = consts->get(i).try_cast<PycString>();
+                if (str != NULL)
+                    strings.emplace_back(str, file.mod.get());
+            }
+        }
+    }
+    run_bench(results, "micro/PycString::print", "string", strings.size(), 0, [&] {
+        PycOutput pyc_output(null_stream);
+        for (const auto& str : strings)
+            str.first->print(pyc_output, str.second);
+    });
+}
+
+static void run_macro(std::vector<BenchResult>& results, const char* group,
+                      std::vector<CorpusFile>& files, bool perFile,
+                      std::ostream& null_stream)
+{
+    unsigned long long totalInstr = 0;
+    for (const auto& file : files)
+        totalInstr += file.instructions;
+
+    run_bench(results, std::string("macro/") + group, "module", files.size(), totalInstr, [&] {
+        PycOutput pyc_output(null_stream);
+        for (const auto& file : files) {
+            PycModule mod;
+            mod.loadFromBuffer(file.data.data(), (int)file.data.size());
+            decompile_module(&mod, pyc_output);
+        }
+    });
+
+    if (!perFile)
+        return;
+    for (const auto& file : files) {
+        const char* basename = strrchr(file.path.c_str(), PATHSEP);
+        basename = basename ? basename + 1 : file.path.c_str();
+        run_bench(results, std::string("macro/") + group + "/" + basename, "module",
+                  1, file.instructions, [&] {
+            PycOutput pyc_output(null_stream);
+            PycModule mod;
+            mod.loadFromBuffer(file.data.data(), (int)file.data.size());
+            decompile_module(&mod, pyc_output);
+        });
+    }
+}
+
+static std::string json_escape(const std::string& text)
+{
+    std::string result;
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\')
+            result.push_back('\\');
+        result.push_back(ch);
+    }
+    return result;
+}
+
+static void write_results(FILE* out, const char* format, const std::vector<BenchResult>& results)
+{
+#ifdef __OPTIMIZE__
+    const bool optimized = true;
+#else
+    const bool optimized = false;
+#endif
+
+    if (strcmp(format, "json") == 0) {
+        fprintf(out, "{\n  \"optimized\": %s,\n  \"min_time\": %g,\n  \"results\": [\n",
+                optimized ? "true" : "false", s_minTime);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const BenchResult& r = results[i];
+            fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"iterations\": %llu, "
+                         "\"ns_per_op\": %.3f, \"instr_per_sec\": %.0f, "
+                         "\"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}%s\n",
+                    json_escape(r.name).c_str(), r.unit, r.iterations, r.nsPerOp,
+                    r.instrPerSec, r.allocsPerOp, r.bytesPerOp,
+                    (i + 1 < results.size()) ? "," : "");
+        }
+        fputs("  ]\n}\n", out);
+    } else if (strcmp(format, "csv") == 0) {
+        fputs("name,unit,iterations,ns_per_op,instr_per_sec,allocs_per_op,bytes_per_op\n", out);
+        for (const auto& r : results) {
+            fprintf(out, "%s,%s,%llu,%.3f,%.0f,%.3f,%.1f\n", r.name.c_str(), r.unit,
+                    r.iterations, r.nsPerOp, r.instrPerSec, r.allocsPerOp, r.bytesPerOp);
+        }
+    } else {
+        if (!optimized)
+            fputs("Note: this benchmark was built without optimization\n\n", out);
+        fprintf(out, "%-40s %14s %14s %12s %12s  %s\n", "Benchmark", "ns/op",
+                "instr/s", "allocs/op", "bytes/op", "op");
+        for (const auto& r : results) {
+            fprintf(out, "%-40s %14.1f %14.0f %12.2f %12.1f  %s\n", r.name.c_str(),
+                    r.nsPerOp, r.instrPerSec, r.allocsPerOp, r.bytesPerOp, r.unit);
+        }
+    }
+}
+
+/* Write results to filename, or to stdout if filename is null */
+static bool write_results_file(const char* filename, const char* format,
+                               const std::vector<BenchResult>& results)
+{
+    FILE* out = stdout;
+    if (filename) {
+        out = fopen(filename, "w");
+        if (!out) {
+            fprintf(stderr, "Error opening file '%s' for writing\n", filename);
+            return false;
+        }
+    }
+    write_results(out, format, results);
+    if (out != stdout)
+        fclose(out);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* format = "text";
+    const char* outfile = nullptr;
+    const char* jsonfile = nullptr;
+    const char* csvfile = nullptr;
+    bool perFile = false;
+    bool verbose = false;
+    std::vector<const char*> corpusFiles, syntheticFiles;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-o") == 0) {
+            if (arg + 1 < argc) {
+                outfile = argv[++arg];
+            } else {
+                fputs("Option '-o' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strncmp(argv[arg], "--format=", 9) == 0) {
+            format = argv[arg] + 9;
+            if (strcmp(format, "text") != 0 && strcmp(format, "json") != 0
+                    && strcmp(format, "csv") != 0) {
+                fprintf(stderr, "Unknown output format '%s'\n", format);
+                return 1;
+            }
+        } else if (strncmp(argv[arg], "--json=", 7) == 0) {
+            jsonfile = argv[arg] + 7;
+        } else if (strncmp(argv[arg], "--csv=", 6) == 0) {
+            csvfile = argv[arg] + 6;
+        } else if (strncmp(argv[arg], "--min-time=", 11) == 0) {
+            s_minTime = atof(argv[arg] + 11);
+        } else if (strncmp(argv[arg], "--filter=", 9) == 0) {
+            s_filter = argv[arg] + 9;
+        } else if (strcmp(argv[arg], "--per-file") == 0) {
+            perFile = true;
+        } else if (strcmp(argv[arg], "--verbose") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[arg], "--synthetic") == 0) {
+            if (arg + 1 < argc) {
+                syntheticFiles.push_back(argv[++arg]);
+            } else {
+                fputs("Option '--synthetic' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "Usage:  %s [options] corpus.pyc [...]\n\n", argv[0]);
+            fputs("Options:\n", stderr);
+            fputs("  -o <filename>      Write results to <filename> (default: stdout)\n", stderr);
+            fputs("  --format=<fmt>     Output format: text, json or csv (default: text)\n", stderr);
+            fputs("  --json=<filename>  Also write results as JSON to <filename>\n", stderr);
+            fputs("  --csv=<filename>   Also write results as CSV to <filename>\n", stderr);
+            fputs("  --min-time=<sec>   Minimum time to run each benchmark (default: 0.2)\n", stderr);
+            fputs("  --filter=<text>    Only run benchmarks whose name contains <text>\n", stderr);
+            fputs("  --per-file         Also time full decompilation of each file separately\n", stderr);
+            fputs("  --synthetic <file> Add a synthetic module to the macrobenchmarks\n", stderr);
+            fputs("  --verbose          Don't silence decompiler warnings while benchmarking\n", stderr);
+            fputs("  --help             Show this help text and then exit\n", stderr);
+            return 0;
+        } else if (argv[arg][0] == '-') {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        } else {
+            corpusFiles.push_back(argv[arg]);
+        }
+    }
+
+    std::vector<CorpusFile> corpus, synthetic;
+    try {
+        for (const char* filename : corpusFiles) {
+            corpus.emplace_back();
+            if (!load_corpus_file(filename, corpus.back())) {
+                fprintf(stderr, "Skipping %s: could not load file\n", filename);
+                corpus.pop_back();
+            }
+        }
+        for (const char* filename : syntheticFiles) {
+            synthetic.emplace_back();
+            if (!load_corpus_file(filename, synthetic.back())) {
+                fprintf(stderr, "Skipping %s: could not load file\n", filename);
+                synthetic.pop_back();
+            }
+        }
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error loading benchmark input: %s\n", ex.what());
+        return 1;
+    }
+
+    // Unsupported opcode warnings would otherwise be repeated on every
+    // iteration, so stderr is silenced while the benchmarks run
+    int saved_stderr = -1;
+    if (!verbose) {
+        fflush(stderr);
+        saved_stderr = dup(fileno(stderr));
+        if (!freopen(NULL_DEVICE, "w", stderr))
+            saved_stderr = -1;
+    }
+
+    NullBuffer null_buffer;
+    std::ostream null_stream(&null_buffer);
+    std::vector<BenchResult> results;
+    std::string error;
+    try {
+        if (!corpus.empty()) {
+            run_micro(results, corpus, null_stream);
+            run_macro(results, "corpus", corpus, perFile, null_stream);
+        }
+        if (!synthetic.empty())
+            run_macro(results, "synthetic", synthetic, true, null_stream);
+    } catch (std::exception& ex) {
+        error = ex.what();
+    }
+    if (saved_stderr >= 0) {
+        fflush(stderr);
+        dup2(saved_stderr, fileno(stderr));
+        close(saved_stderr);
+    }
+    if (!error.empty()) {
+        fprintf(stderr, "Error running benchmarks: %s\n", error.c_str());
+        return 1;
+    }
+
+    if (!write_results_file(outfile, format, results))
+        return 1;
+    if (jsonfile && !write_results_file(jsonfile, "json", results))
+        return 1;
+    if (csvfile && !write_results_file(csvfile, "csv", results))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,852 @@
+/* Generator for synthetic stress modules.
+ *
+ * Emits valid .pyc files with a parametric shape -- many functions, deeply
+ * nested ifs and loops, huge constant tuples, long expression chains and
+ * huge string literals, or any number of ordinary looking functions and
+ * classes -- so decompiler time and memory can be charted against input
+ * size.  The bytecode is assembled directly for the target
+ * version and serialized with PycMarshalWriter. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "bytecode.h"
+#include "pyc_marshal.h"
+#include "pyc_module.h"
+#include "pyc_numeric.h"
+
+struct GenOptions {
+    int major = 3, minor = 8;
+    int functions = 10;
+    int depth = 4;
+    int tupleSize = 0;
+    int chainLength = 0;
+    int callChainLength = 0;
+    int stringSize = 0;
+    int scale = 0;
+    int constCount = 0;
+    int nestedDepth = 0;
+};
+
+/* Assembles instructions for one code object, resolving jump labels and
+ * inserting EXTENDED_ARG prefixes where an argument needs them. */
+class Assembler {
+public:
+    Assembler(int major, int minor) : m_maj(major), m_min(minor)
+    {
+        m_opcodeBytes.assign(Pyc::PYC_LAST_OPCODE, -1);
+        for (int byte = 0; byte < 256; ++byte) {
+            int opcode = Pyc::ByteToOpcode(major, minor, byte);
+            if (opcode >= 0 && opcode < Pyc::PYC_LAST_OPCODE && m_opcodeBytes[opcode] < 0)
+                m_opcodeBytes[opcode] = byte;
+        }
+    }
+
+    int newLabel()
+    {
+        m_labels.push_back(-1);
+        return (int)m_labels.size() - 1;
+    }
+
+    void bind(int label) { m_labels[label] = (int)m_instrs.size(); }
+
+    void emit(int opcode, int arg = 0)
+    {
+        m_instrs.push_back({ opcode, arg, -1, extendedCount(arg) });
+    }
+
+    void emitJump(int opcode, int label) { m_instrs.push_back({ opcode, 0, label, 0 }); }
+
+    std::string assemble()
+    {
+        // Jump arguments depend on instruction offsets, which depend on how
+        // many EXTENDED_ARG prefixes are needed, so iterate until stable.
+        // Prefix counts only ever grow, so this terminates.
+        std::vector<int> offsets(m_instrs.size() + 1);
+        for ( ;; ) {
+            int pos = 0;
+            for (size_t i = 0; i < m_instrs.size(); ++i) {
+                offsets[i] = pos;
+                pos += instrSize(m_instrs[i]);
+            }
+            offsets[m_instrs.size()] = pos;
+
+            bool changed = false;
+            for (size_t i = 0; i < m_instrs.size(); ++i) {
+                Instr& instr = m_instrs[i];
+                if (instr.label < 0)
+                    continue;
+                int target = offsets[m_labels[instr.label]];
+                int arg = isRelativeJump(instr.opcode) ? target - offsets[i + 1] : target;
+                if (m_maj == 3 && m_min >= 10)
+                    arg /= 2;   // Jump arguments count instructions in 3.10
+                instr.arg = arg;
+                int extended = extendedCount(arg);
+                if (extended > instr.extended) {
+                    instr.extended = extended;
+                    changed = true;
+                }
+            }
+            if (!changed)
+                break;
+        }
+
+        std::string code;
+        for (const Instr& instr : m_instrs) {
+            int extended = instr.extended;
+            int shift = wordCode() ? 8 * extended : 16 * extended;
+            while (extended-- > 0) {
+                writeInstr(code, Pyc::EXTENDED_ARG_A, instr.arg >> shift);
+                shift -= wordCode() ? 8 : 16;
+            }
+            writeInstr(code, instr.opcode, instr.arg);
+        }
+        return code;
+    }
+
+private:
+    struct Instr {
+        int opcode, arg;
+        int label;
+        int extended;   // Number of EXTENDED_ARG prefixes
+    };
+
+    int m_maj, m_min;
+    std::vector<int> m_opcodeBytes;
+    std::vector<int> m_labels;
+    std::vector<Instr> m_instrs;
+
+    bool wordCode() const { return m_maj > 3 || (m_maj == 3 && m_min >= 6); }
+
+    static bool isRelativeJump(int opcode)
+    {
+        return opcode == Pyc::JUMP_FORWARD_A || opcode == Pyc::FOR_ITER_A
+            || opcode == Pyc::SETUP_LOOP_A;
+    }
+
+    int extendedCount(int arg) const
+    {
+        int count = 0;
+        if (wordCode()) {
+            while (arg > 0xFF && count < 3) {
+                arg >>= 8;
+                ++count;
+            }
+        } else if (arg > 0xFFFF) {
+            count = 1;
+        }
+        return count;
+    }
+
+    int instrSize(const Instr& instr) const
+    {
+        int size = wordCode() ? 2 : (instr.opcode >= Pyc::PYC_HAVE_ARG ? 3 : 1);
+        return size + instr.extended * (wordCode() ? 2 : 3);
+    }
+
+    void writeInstr(std::string& code, int opcode, int arg) const
+    {
+        int byte = m_opcodeBytes[opcode];
+        if (byte < 0) {
+            throw std::runtime_error(std::string("Opcode ") + Pyc::OpcodeName(opcode)
+                                     + " is not available in the target version");
+        }
+        code.push_back(char(byte));
+        if (wordCode()) {
+            code.push_back(char(arg & 0xFF));
+        } else if (opcode >= Pyc::PYC_HAVE_ARG) {
+            code.push_back(char(arg & 0xFF));
+            code.push_back(char((arg >> 8) & 0xFF));
+        }
+    }
+};
+
+/* Builds the objects for one module, choosing object types the way the
+ * target version's marshal would */
+class ModuleBuilder {
+public:
+    explicit ModuleBuilder(const GenOptions& options) : m_opts(options) { }
+
+    PycRef<PycCode> build()
+    {
+        CodeContext module;
+        Assembler as(m_opts.major, m_opts.minor);
+        for (int i = 0; i < m_opts.functions; ++i) {
+            std::string name = "func_" + std::to_string(i);
+            emitMakeFunction(module, as, buildFunction(name), name, NULL);
+            as.emit(Pyc::STORE_NAME_A, addName(module, name));
+        }
+
+        for (int i = 0; i < m_opts.scale; ++i) {
+            std::string name = "func_" + std::to_string(i);
+            emitMakeFunction(module, as, buildScaledFunction(i), name, new PycInt(i));
+            as.emit(Pyc::STORE_NAME_A, addName(module, name));
+            buildScaledClass(module, as, i);
+        }
+
+        if (m_opts.tupleSize > 0) {
+            PycRef<PycTuple> table = makeTuple();
+            for (int i = 0; i < m_opts.tupleSize; ++i) {
+                if (i % 4 == 3)
+                    table->append(makeText("item" + std::to_string(i)));
+                else
+                    table->append(new PycInt(i));
+            }
+            as.emit(Pyc::LOAD_CONST_A, addConst(module, table.cast<PycObject>()));
+            as.emit(Pyc::STORE_NAME_A, addName(module, "table"));
+        }
+
+        if (m_opts.constCount > 0) {
+            PycRef<PycTuple> big = makeTuple();
+            for (int i = 0; i < m_opts.constCount; ++i)
+                big->append(new PycInt(i));
+            as.emit(Pyc::LOAD_CONST_A, addConst(module, big.cast<PycObject>()));
+            as.emit(Pyc::STORE_NAME_A, addName(module, "big"));
+        }
+
+        if (m_opts.nestedDepth > 0) {
+            // nested = (depth - 1, (..., (1, (0, ()))))
+            PycRef<PycTuple> nested = makeTuple();
+            for (int i = 0; i < m_opts.nestedDepth; ++i) {
+                PycRef<PycTuple> outer = makeTuple();
+                outer->append(new PycInt(i));
+                outer->append(nested.cast<PycObject>());
+                nested = outer;
+            }
+            as.emit(Pyc::LOAD_CONST_A, addConst(module, nested.cast<PycObject>()));
+            as.emit(Pyc::STORE_NAME_A, addName(module, "nested"));
+        }
+
+        if (m_opts.stringSize > 0) {
+            static const char s_pattern[] = "Lorem ipsum 'dolor' \"sit\" amet,\tconsectetur\n";
+            std::string text;
+            text.reserve(m_opts.stringSize);
+            while ((int)text.size() < m_opts.stringSize)
+                text.push_back(s_pattern[text.size() % (sizeof(s_pattern) - 1)]);
+            as.emit(Pyc::LOAD_CONST_A, addConst(module, makeText(text)));
+            as.emit(Pyc::STORE_NAME_A, addName(module, "text"));
+        }
+
+        if (m_opts.chainLength > 0) {
+            // chain = a + 0 + 1 + ... as one left-associative expression
+            as.emit(Pyc::LOAD_NAME_A, addName(module, "a"));
+            for (int i = 0; i < m_opts.chainLength; ++i) {
+                as.emit(Pyc::LOAD_CONST_A, addInt(module, i % 100));
+                as.emit(Pyc::BINARY_ADD);
+            }
+            as.emit(Pyc::STORE_NAME_A, addName(module, "chain"));
+        }
+
+        if (m_opts.callChainLength > 0) {
+            // calls = a.m0().m1().m2().m3()[3]... as one chain of attributes,
+            // calls and subscripts
+            as.emit(Pyc::LOAD_NAME_A, addName(module, "a"));
+            for (int i = 0; i < m_opts.callChainLength; ++i) {
+                as.emit(Pyc::LOAD_ATTR_A, addName(module, "m" + std::to_string(i % 10)));
+                as.emit(Pyc::CALL_FUNCTION_A, 0);
+                if (i % 4 == 3) {
+                    as.emit(Pyc::LOAD_CONST_A, addInt(module, i % 100));
+                    as.emit(Pyc::BINARY_SUBSCR);
+                }
+            }
+            as.emit(Pyc::STORE_NAME_A, addName(module, "calls"));
+        }
+
+        as.emit(Pyc::LOAD_CONST_A, addConst(module, Pyc_None));
+        as.emit(Pyc::RETURN_VALUE);
+
+        PycRef<PycCode> code = makeCode(module, as, "<module>");
+        code->setFlags(PycCode::CO_NOFREE);
+        code->setStackSize(m_opts.scale > 0 ? 4 : 3);
+        return code;
+    }
+
+private:
+    struct CodeContext {
+        PycRef<PycTuple> consts;
+        PycRef<PycTuple> names;
+        PycRef<PycTuple> varnames;
+        std::map<std::string, int> nameIndex;
+        std::map<std::string, int> varIndex;
+        std::map<int, int> intIndex;
+    };
+
+    const GenOptions& m_opts;
+
+    int verCompare(int maj, int min) const
+    {
+        if (m_opts.major == maj)
+            return m_opts.minor - min;
+        return m_opts.major - maj;
+    }
+
+    PycRef<PycTuple> makeTuple() const
+    {
+        return new PycTuple(verCompare(3, 4) >= 0 ? PycObject::TYPE_SMALL_TUPLE
+                                                  : PycObject::TYPE_TUPLE);
+    }
+
+    PycRef<PycObject> makeString(const std::string& value, int type) const
+    {
+        PycRef<PycString> str = new PycString(type);
+        str->setValue(value);
+        return str.cast<PycObject>();
+    }
+
+    /* An identifier, as stored in names and varnames */
+    PycRef<PycObject> makeName(const std::string& value) const
+    {
+        if (m_opts.major < 3)
+            return makeString(value, PycObject::TYPE_INTERNED);
+        if (verCompare(3, 4) < 0)
+            return makeString(value, PycObject::TYPE_UNICODE);
+        return makeString(value, PycObject::TYPE_SHORT_ASCII_INTERNED);
+    }
+
+    /* A str constant */
+    PycRef<PycObject> makeText(const std::string& value) const
+    {
+        if (m_opts.major < 3)
+            return makeString(value, PycObject::TYPE_STRING);
+        if (verCompare(3, 4) < 0)
+            return makeString(value, PycObject::TYPE_UNICODE);
+        return makeString(value, value.size() <= 0xFF ? PycObject::TYPE_SHORT_ASCII
+                                                      : PycObject::TYPE_ASCII);
+    }
+
+    int addConst(CodeContext& ctx, PycRef<PycObject> value) const
+    {
+        if (ctx.consts == NULL)
+            ctx.consts = makeTuple();
+        ctx.consts->append(std::move(value));
+        return ctx.consts->size() - 1;
+    }
+
+    int addInt(CodeContext& ctx, int value) const
+    {
+        auto iter = ctx.intIndex.find(value);
+        if (iter != ctx.intIndex.end())
+            return iter->second;
+        int index = addConst(ctx, new PycInt(value));
+        ctx.intIndex[value] = index;
+        return index;
+    }
+
+    int addIndexed(PycRef<PycTuple>& tuple, std::map<std::string, int>& index,
+                   const std::string& name) const
+    {
+        auto iter = index.find(name);
+        if (iter != index.end())
+            return iter->second;
+        if (tuple == NULL)
+            tuple = makeTuple();
+        tuple->append(makeName(name));
+        index[name] = tuple->size() - 1;
+        return tuple->size() - 1;
+    }
+
+    int addName(CodeContext& ctx, const std::string& name) const
+    {
+        return addIndexed(ctx.names, ctx.nameIndex, name);
+    }
+
+    int addVar(CodeContext& ctx, const std::string& name) const
+    {
+        return addIndexed(ctx.varnames, ctx.varIndex, name);
+    }
+
+    PycRef<PycSequence> asSequence(PycRef<PycTuple> tuple) const
+    {
+        if (tuple == NULL)
+            tuple = makeTuple();
+        return tuple.cast<PycSequence>();
+    }
+
+    PycRef<PycCode> makeCode(CodeContext& ctx, Assembler& as, const std::string& name) const
+    {
+        PycRef<PycCode> code = new PycCode;
+        PycRef<PycString> bytecode = new PycString(PycObject::TYPE_STRING);
+        bytecode->setValue(as.assemble());
+        code->setCode(bytecode);
+        code->setConsts(asSequence(ctx.consts));
+        code->setNames(asSequence(ctx.names));
+        code->setLocalNames(asSequence(ctx.varnames));
+        code->setNumLocals(ctx.varnames == NULL ? 0 : ctx.varnames->size());
+        code->setFileName(makeText("synthetic.py").cast<PycString>());
+        code->setName(makeName(name).cast<PycString>());
+        code->setQualName(makeName(name).cast<PycString>());
+        code->setFirstLine(1);
+        return code;
+    }
+
+    /* Emits the instructions that make a function from code, with one
+     * positional default if defaultArg is not NULL */
+    void emitMakeFunction(CodeContext& ctx, Assembler& as, PycRef<PycCode> code,
+                          const std::string& qualname, PycRef<PycObject> defaultArg) const
+    {
+        int arg = 0;
+        if (defaultArg != NULL) {
+            // A count of defaults before 3.6, and a flag for a tuple of them after
+            if (verCompare(3, 6) >= 0) {
+                PycRef<PycTuple> defaults = makeTuple();
+                defaults->append(std::move(defaultArg));
+                defaultArg = defaults.cast<PycObject>();
+            }
+            as.emit(Pyc::LOAD_CONST_A, addConst(ctx, std::move(defaultArg)));
+            arg = 1;
+        }
+        as.emit(Pyc::LOAD_CONST_A, addConst(ctx, code.cast<PycObject>()));
+        if (verCompare(3, 3) >= 0)
+            as.emit(Pyc::LOAD_CONST_A, addConst(ctx, makeText(qualname)));
+        as.emit(Pyc::MAKE_FUNCTION_A, arg);
+    }
+
+    /* def name(x):
+     *     total = 0
+     *     <nested ifs and for loops, depth levels deep>
+     *     return total */
+    PycRef<PycCode> buildFunction(const std::string& name) const
+    {
+        CodeContext ctx;
+        Assembler as(m_opts.major, m_opts.minor);
+        addConst(ctx, Pyc_None);    // Docstring slot
+        int x = addVar(ctx, "x");
+        int total = addVar(ctx, "total");
+
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 0));
+        as.emit(Pyc::STORE_FAST_A, total);
+        int loops = buildNest(ctx, as, 1, x, total);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::RETURN_VALUE);
+
+        PycRef<PycCode> code = makeCode(ctx, as, name);
+        code->setArgCount(1);
+        code->setFlags(PycCode::CO_OPTIMIZED | PycCode::CO_NEWLOCALS | PycCode::CO_NOFREE);
+        code->setStackSize(3 + loops);
+        return code;
+    }
+
+    /* def func_<n>(items, scale=<n>):
+     *     """Synthetic function <n>"""
+     *     total = 0
+     *     names = {'a': <n>, 'b': 'text <n>', 'c': [1, 2, <n>]}
+     *     for idx, item in enumerate(items):
+     *         if item % 3 == 0 and idx > scale:
+     *             total += item * 2
+     *         elif item % 5 == 0:
+     *             total -= len(names) + idx
+     *         else:
+     *             total ^= item << 1
+     *     while total > 1000:
+     *         total //= 7
+     *     value = names['b'].upper() + str(total)
+     *     return items, total, value */
+    PycRef<PycCode> buildScaledFunction(int n) const
+    {
+        CodeContext ctx;
+        Assembler as(m_opts.major, m_opts.minor);
+        addConst(ctx, makeText("Synthetic function " + std::to_string(n)));
+        int items = addVar(ctx, "items");
+        int scale = addVar(ctx, "scale");
+        int total = addVar(ctx, "total");
+        int names = addVar(ctx, "names");
+        int idx = addVar(ctx, "idx");
+        int item = addVar(ctx, "item");
+        int value = addVar(ctx, "value");
+        bool setupLoop = verCompare(3, 8) < 0;
+
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 0));
+        as.emit(Pyc::STORE_FAST_A, total);
+
+        // Before 3.5, values are added to an empty map one at a time.  3.5
+        // builds it from key and value pairs, and later versions from the
+        // values and a tuple of constant keys.
+        bool storeMap = verCompare(3, 5) < 0;
+        bool constKeys = verCompare(3, 6) >= 0;
+        PycRef<PycTuple> keys = makeTuple();
+        if (storeMap)
+            as.emit(Pyc::BUILD_MAP_A, 3);
+        for (int entry = 0; entry < 3; ++entry) {
+            PycRef<PycObject> keyName = makeText(std::string(1, char('a' + entry)));
+            keys->append(keyName);
+            int key = constKeys ? -1 : addConst(ctx, keyName);
+            if (!storeMap && !constKeys)
+                as.emit(Pyc::LOAD_CONST_A, key);
+            if (entry == 0) {
+                as.emit(Pyc::LOAD_CONST_A, addInt(ctx, n));
+            } else if (entry == 1) {
+                as.emit(Pyc::LOAD_CONST_A, addConst(ctx, makeText("text " + std::to_string(n))));
+            } else {
+                as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 1));
+                as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 2));
+                as.emit(Pyc::LOAD_CONST_A, addInt(ctx, n));
+                as.emit(Pyc::BUILD_LIST_A, 3);
+            }
+            if (storeMap) {
+                as.emit(Pyc::LOAD_CONST_A, key);
+                as.emit(Pyc::STORE_MAP);
+            }
+        }
+        if (constKeys) {
+            as.emit(Pyc::LOAD_CONST_A, addConst(ctx, keys.cast<PycObject>()));
+            as.emit(Pyc::BUILD_CONST_KEY_MAP_A, 3);
+        } else if (!storeMap) {
+            as.emit(Pyc::BUILD_MAP_A, 3);
+        }
+        as.emit(Pyc::STORE_FAST_A, names);
+
+        int top = as.newLabel(), exhausted = as.newLabel(), after = as.newLabel();
+        int elif = as.newLabel(), otherwise = as.newLabel();
+        if (setupLoop)
+            as.emitJump(Pyc::SETUP_LOOP_A, after);
+        as.emit(Pyc::LOAD_GLOBAL_A, addName(ctx, "enumerate"));
+        as.emit(Pyc::LOAD_FAST_A, items);
+        as.emit(Pyc::CALL_FUNCTION_A, 1);
+        as.emit(Pyc::GET_ITER);
+        as.bind(top);
+        as.emitJump(Pyc::FOR_ITER_A, exhausted);
+        as.emit(Pyc::UNPACK_SEQUENCE_A, 2);
+        as.emit(Pyc::STORE_FAST_A, idx);
+        as.emit(Pyc::STORE_FAST_A, item);
+
+        as.emit(Pyc::LOAD_FAST_A, item);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 3));
+        as.emit(Pyc::BINARY_MODULO);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 0));
+        as.emit(Pyc::COMPARE_OP_A, 2);  // ==
+        as.emitJump(Pyc::POP_JUMP_IF_FALSE_A, elif);
+        as.emit(Pyc::LOAD_FAST_A, idx);
+        as.emit(Pyc::LOAD_FAST_A, scale);
+        as.emit(Pyc::COMPARE_OP_A, 4);  // >
+        as.emitJump(Pyc::POP_JUMP_IF_FALSE_A, elif);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::LOAD_FAST_A, item);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 2));
+        as.emit(Pyc::BINARY_MULTIPLY);
+        as.emit(Pyc::INPLACE_ADD);
+        as.emit(Pyc::STORE_FAST_A, total);
+        as.emitJump(Pyc::JUMP_ABSOLUTE_A, top);
+
+        as.bind(elif);
+        as.emit(Pyc::LOAD_FAST_A, item);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 5));
+        as.emit(Pyc::BINARY_MODULO);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 0));
+        as.emit(Pyc::COMPARE_OP_A, 2);  // ==
+        as.emitJump(Pyc::POP_JUMP_IF_FALSE_A, otherwise);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::LOAD_GLOBAL_A, addName(ctx, "len"));
+        as.emit(Pyc::LOAD_FAST_A, names);
+        as.emit(Pyc::CALL_FUNCTION_A, 1);
+        as.emit(Pyc::LOAD_FAST_A, idx);
+        as.emit(Pyc::BINARY_ADD);
+        as.emit(Pyc::INPLACE_SUBTRACT);
+        as.emit(Pyc::STORE_FAST_A, total);
+        as.emitJump(Pyc::JUMP_ABSOLUTE_A, top);
+
+        as.bind(otherwise);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::LOAD_FAST_A, item);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 1));
+        as.emit(Pyc::BINARY_LSHIFT);
+        as.emit(Pyc::INPLACE_XOR);
+        as.emit(Pyc::STORE_FAST_A, total);
+        as.emitJump(Pyc::JUMP_ABSOLUTE_A, top);
+        as.bind(exhausted);
+        if (setupLoop)
+            as.emit(Pyc::POP_BLOCK);
+        as.bind(after);
+
+        int test = as.newLabel(), done = as.newLabel(), afterWhile = as.newLabel();
+        if (setupLoop)
+            as.emitJump(Pyc::SETUP_LOOP_A, afterWhile);
+        as.bind(test);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 1000));
+        as.emit(Pyc::COMPARE_OP_A, 4);  // >
+        as.emitJump(Pyc::POP_JUMP_IF_FALSE_A, done);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::LOAD_CONST_A, addInt(ctx, 7));
+        as.emit(Pyc::INPLACE_FLOOR_DIVIDE);
+        as.emit(Pyc::STORE_FAST_A, total);
+        as.emitJump(Pyc::JUMP_ABSOLUTE_A, test);
+        as.bind(done);
+        if (setupLoop)
+            as.emit(Pyc::POP_BLOCK);
+        as.bind(afterWhile);
+
+        as.emit(Pyc::LOAD_FAST_A, names);
+        as.emit(Pyc::LOAD_CONST_A, addConst(ctx, makeText("b")));
+        as.emit(Pyc::BINARY_SUBSCR);
+        as.emit(Pyc::LOAD_ATTR_A, addName(ctx, "upper"));
+        as.emit(Pyc::CALL_FUNCTION_A, 0);
+        as.emit(Pyc::LOAD_GLOBAL_A, addName(ctx, "str"));
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::CALL_FUNCTION_A, 1);
+        as.emit(Pyc::BINARY_ADD);
+        as.emit(Pyc::STORE_FAST_A, value);
+        as.emit(Pyc::LOAD_FAST_A, items);
+        as.emit(Pyc::LOAD_FAST_A, total);
+        as.emit(Pyc::LOAD_FAST_A, value);
+        as.emit(Pyc::BUILD_TUPLE_A, 3);
+        as.emit(Pyc::RETURN_VALUE);
+
+        PycRef<PycCode> code = makeCode(ctx, as, "func_" + std::to_string(n));
+        code->setArgCount(2);
+        code->setFlags(PycCode::CO_OPTIMIZED | PycCode::CO_NEWLOCALS | PycCode::CO_NOFREE);
+        code->setStackSize(8);
+        return code;
+    }
+
+    /* class Class<n>(object):
+     *     attr = (<n>, 'attr', None)
+     *
+     *     def method(self, arg):
+     *         return func_<n>([arg, self.attr[0]]) */
+    void buildScaledClass(CodeContext& module, Assembler& as, int n) const
+    {
+        std::string name = "Class" + std::to_string(n);
+
+        CodeContext method;
+        Assembler method_as(m_opts.major, m_opts.minor);
+        addConst(method, Pyc_None);     // Docstring slot
+        int self = addVar(method, "self");
+        int arg = addVar(method, "arg");
+        method_as.emit(Pyc::LOAD_GLOBAL_A, addName(method, "func_" + std::to_string(n)));
+        method_as.emit(Pyc::LOAD_FAST_A, arg);
+        method_as.emit(Pyc::LOAD_FAST_A, self);
+        method_as.emit(Pyc::LOAD_ATTR_A, addName(method, "attr"));
+        method_as.emit(Pyc::LOAD_CONST_A, addInt(method, 0));
+        method_as.emit(Pyc::BINARY_SUBSCR);
+        method_as.emit(Pyc::BUILD_LIST_A, 2);
+        method_as.emit(Pyc::CALL_FUNCTION_A, 1);
+        method_as.emit(Pyc::RETURN_VALUE);
+        PycRef<PycCode> method_code = makeCode(method, method_as, "method");
+        method_code->setArgCount(2);
+        method_code->setFlags(PycCode::CO_OPTIMIZED | PycCode::CO_NEWLOCALS
+                              | PycCode::CO_NOFREE);
+        method_code->setStackSize(4);
+
+        // Class bodies take the namespace as an argument in 3.0 - 3.3
+        CodeContext body;
+        Assembler body_as(m_opts.major, m_opts.minor);
+        bool localsArg = m_opts.major >= 3 && verCompare(3, 4) < 0;
+        if (localsArg) {
+            body_as.emit(Pyc::LOAD_FAST_A, addVar(body, "__locals__"));
+            body_as.emit(Pyc::STORE_LOCALS);
+        }
+        body_as.emit(Pyc::LOAD_NAME_A, addName(body, "__name__"));
+        body_as.emit(Pyc::STORE_NAME_A, addName(body, "__module__"));
+        if (verCompare(3, 3) >= 0) {
+            body_as.emit(Pyc::LOAD_CONST_A, addConst(body, makeText(name)));
+            body_as.emit(Pyc::STORE_NAME_A, addName(body, "__qualname__"));
+        }
+        PycRef<PycTuple> attr = makeTuple();
+        attr->append(new PycInt(n));
+        attr->append(makeText("attr"));
+        attr->append(Pyc_None);
+        body_as.emit(Pyc::LOAD_CONST_A, addConst(body, attr.cast<PycObject>()));
+        body_as.emit(Pyc::STORE_NAME_A, addName(body, "attr"));
+        emitMakeFunction(body, body_as, method_code, name + ".method", NULL);
+        body_as.emit(Pyc::STORE_NAME_A, addName(body, "method"));
+        if (m_opts.major < 3) {
+            body_as.emit(Pyc::LOAD_LOCALS);
+        } else {
+            body_as.emit(Pyc::LOAD_CONST_A, addConst(body, Pyc_None));
+        }
+        body_as.emit(Pyc::RETURN_VALUE);
+        PycRef<PycCode> body_code = makeCode(body, body_as, name);
+        body_code->setArgCount(localsArg ? 1 : 0);
+        body_code->setFlags(m_opts.major < 3 || localsArg
+                            ? PycCode::CO_NEWLOCALS | PycCode::CO_NOFREE
+                            : PycCode::CO_NOFREE);
+        body_code->setStackSize(3);
+
+        if (m_opts.major < 3) {
+            as.emit(Pyc::LOAD_CONST_A, addConst(module, makeText(name)));
+            as.emit(Pyc::LOAD_NAME_A, addName(module, "object"));
+            as.emit(Pyc::BUILD_TUPLE_A, 1);
+            emitMakeFunction(module, as, body_code, name, NULL);
+            as.emit(Pyc::CALL_FUNCTION_A, 0);
+            as.emit(Pyc::BUILD_CLASS);
+        } else {
+            as.emit(Pyc::LOAD_BUILD_CLASS);
+            emitMakeFunction(module, as, body_code, name, NULL);
+            as.emit(Pyc::LOAD_CONST_A, addConst(module, makeText(name)));
+            as.emit(Pyc::LOAD_NAME_A, addName(module, "object"));
+            as.emit(Pyc::CALL_FUNCTION_A, 3);
+        }
+        as.emit(Pyc::STORE_NAME_A, addName(module, name));
+    }
+
+    /* Odd levels are ifs and even levels are for loops.  Returns the number
+     * of nested loops, each of which keeps an iterator on the stack. */
+    int buildNest(CodeContext& ctx, Assembler& as, int level, int x, int total) const
+    {
+        if (level > m_opts.depth) {
+            as.emit(Pyc::LOAD_FAST_A, total);
+            as.emit(Pyc::LOAD_FAST_A, x);
+            as.emit(Pyc::INPLACE_ADD);
+            as.emit(Pyc::STORE_FAST_A, total);
+            return 0;
+        }
+
+        if (level % 2 == 1) {
+            // if x > level:
+            int end = as.newLabel();
+            as.emit(Pyc::LOAD_FAST_A, x);
+            as.emit(Pyc::LOAD_CONST_A, addInt(ctx, level));
+            as.emit(Pyc::COMPARE_OP_A, 4);  // >
+            as.emitJump(Pyc::POP_JUMP_IF_FALSE_A, end);
+            int loops = buildNest(ctx, as, level + 1, x, total);
+            as.bind(end);
+            return loops;
+        }
+
+        // for v<level> in x:
+        bool setupLoop = verCompare(3, 8) < 0;
+        int top = as.newLabel(), exhausted = as.newLabel(), after = as.newLabel();
+        if (setupLoop)
+            as.emitJump(Pyc::SETUP_LOOP_A, after);
+        as.emit(Pyc::LOAD_FAST_A, x);
+        as.emit(Pyc::GET_ITER);
+        as.bind(top);
+        as.emitJump(Pyc::FOR_ITER_A, exhausted);
+        as.emit(Pyc::STORE_FAST_A, addVar(ctx, "v" + std::to_string(level)));
+        int loops = buildNest(ctx, as, level + 1, x, total);
+        as.emitJump(Pyc::JUMP_ABSOLUTE_A, top);
+        as.bind(exhausted);
+        if (setupLoop)
+            as.emit(Pyc::POP_BLOCK);
+        as.bind(after);
+        return loops + 1;
+    }
+};
+
+static bool parse_int_option(const char* arg, const char* name, int& value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    value = atoi(arg + len + 1);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    GenOptions options;
+    const char* outfile = nullptr;
+    const char* remarshal = nullptr;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-o") == 0) {
+            if (arg + 1 < argc) {
+                outfile = argv[++arg];
+            } else {
+                fputs("Option '-o' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "-v") == 0) {
+            if (arg + 1 < argc && sscanf(argv[arg + 1], "%d.%d", &options.major, &options.minor) == 2) {
+                ++arg;
+            } else {
+                fputs("Option '-v' requires a version (use the format x.y)\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--remarshal") == 0) {
+            if (arg + 1 < argc) {
+                remarshal = argv[++arg];
+            } else {
+                fputs("Option '--remarshal' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (parse_int_option(argv[arg], "--functions", options.functions)
+                || parse_int_option(argv[arg], "--depth", options.depth)
+                || parse_int_option(argv[arg], "--tuple-size", options.tupleSize)
+                || parse_int_option(argv[arg], "--chain-length", options.chainLength)
+                || parse_int_option(argv[arg], "--call-chain-length", options.callChainLength)
+                || parse_int_option(argv[arg], "--string-size", options.stringSize)
+                || parse_int_option(argv[arg], "--scale", options.scale)
+                || parse_int_option(argv[arg], "--const-count", options.constCount)
+                || parse_int_option(argv[arg], "--nested-depth", options.nestedDepth)) {
+            continue;
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "Usage:  %s [options] -o output.pyc\n\n", argv[0]);
+            fputs("Options:\n", stderr);
+            fputs("  -o <filename>       Write the generated module to <filename>\n", stderr);
+            fputs("  -v <x.y>            Python version to generate (2.7 or 3.1 - 3.10, default: 3.8)\n", stderr);
+            fputs("  --functions=<n>     Number of functions (default: 10)\n", stderr);
+            fputs("  --depth=<n>         Nesting depth of ifs and loops in each function (default: 4)\n", stderr);
+            fputs("  --tuple-size=<n>    Elements in a module-level constant tuple (default: 0)\n", stderr);
+            fputs("  --chain-length=<n>  Terms in a module-level expression chain (default: 0)\n", stderr);
+            fputs("  --call-chain-length=<n>  Method calls in a module-level call chain (default: 0)\n", stderr);
+            fputs("  --string-size=<n>   Length of a module-level string literal (default: 0)\n", stderr);
+            fputs("  --scale=<n>         Ordinary functions, each with a class calling it (default: 0)\n", stderr);
+            fputs("  --const-count=<n>   Ints in a module-level constant tuple, 0 to n-1 (default: 0)\n", stderr);
+            fputs("  --nested-depth=<n>  Depth of a module-level nested constant tuple (default: 0)\n", stderr);
+            fputs("  --remarshal <file>  Load <file> and write it back out instead of generating\n", stderr);
+            fputs("  --help              Show this help text and then exit\n", stderr);
+            return 0;
+        } else {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        }
+    }
+
+    if (!outfile) {
+        fputs("No output file specified\n", stderr);
+        return 1;
+    }
+
+    if (remarshal) {
+        // Round-trip an existing module through PycMarshalWriter
+        try {
+            PycModule mod;
+            mod.loadFromFile(remarshal);
+            if (!mod.isValid()) {
+                fprintf(stderr, "Could not load file %s\n", remarshal);
+                return 1;
+            }
+            PycMarshalWriter writer(mod.majorVer(), mod.minorVer());
+            writer.writeHeader();
+            writer.writeObject(mod.code().cast<PycObject>());
+            if (!writer.saveToFile(outfile)) {
+                fprintf(stderr, "Error writing file %s\n", outfile);
+                return 1;
+            }
+        } catch (std::exception& ex) {
+            fprintf(stderr, "Error re-marshalling %s: %s\n", remarshal, ex.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    // The generated bytecode uses POP_JUMP_IF_FALSE and BINARY_ADD, which
+    // limits it to Python 2.7 and 3.1 - 3.10
+    bool supported = (options.major == 2 && options.minor == 7)
+            || (options.major == 3 && options.minor >= 1 && options.minor <= 10);
+    if (!supported) {
+        fprintf(stderr, "Unsupported version %d.%d\n", options.major, options.minor);
+        return 1;
+    }
+
+    try {
+        ModuleBuilder builder(options);
+        PycMarshalWriter writer(options.major, options.minor);
+        writer.writeHeader();
+        writer.writeObject(builder.build().cast<PycObject>());
+        if (!writer.saveToFile(outfile)) {
+            fprintf(stderr, "Error writing file %s\n", outfile);
+            return 1;
+        }
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error generating module: %s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
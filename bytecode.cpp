@@ -1,5 +1,6 @@
 #include "pyc_numeric.h"
 #include "bytecode.h"
+#include "SmallVector.h"
 #include <stdexcept>
 #include <cstdint>
 #include <cmath>
@@ -63,7 +64,7 @@ const char* Pyc::OpcodeName(int opcode)
     if (opcode < PYC_LAST_OPCODE)
         return opcode_names[opcode];
 
-    static char badcode[16];
+    static thread_local char badcode[16];
     snprintf(badcode, sizeof(badcode), "<%d>", opcode);
     return badcode;
 };
@@ -115,106 +116,128 @@ int Pyc::ByteToOpcode(int maj, int min, int opcode)
     return PYC_INVALID_OPCODE;
 }
 
-void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod,
-                 const char* parent_f_string_quote)
+static void print_binary_float(PycOutput& pyc_output, double value)
 {
-    if (obj == NULL) {
-        pyc_output << "<NULL>";
-        return;
+    char buffer[FLOAT_REPR_SIZE];
+    int length = float_repr(buffer, value);
+    if (std::isfinite(value)) {
+        pyc_output.write(buffer, length);
+    } else {
+        // Wrap any nan/inf values in float('').
+        pyc_output << "float('";
+        pyc_output.write(buffer, length);
+        pyc_output << "')";
     }
+}
+
+/* One open container while printing nested constants.  Values are walked
+ * in place through pointers into the container's own storage, which stays
+ * alive for as long as the outermost constant does. */
+struct ConstFrame {
+    const PycRef<PycObject>* next;
+    const PycRef<PycObject>* end;
+    const PycDict::item_t* nextItem;
+    const PycDict::item_t* endItem;
+    const char* close;
+    bool first;
+    bool inItem;    // Dict key printed, value still pending
+};
+
+typedef SmallVector<ConstFrame, 16> ConstStack;
+
+static bool open_const_container(PycOutput& pyc_output, PycObject* obj, ConstStack& stack)
+{
+    ConstFrame frame = { };
+    frame.first = true;
 
     switch (obj->type()) {
-    case PycObject::TYPE_STRING:
-    case PycObject::TYPE_UNICODE:
-    case PycObject::TYPE_INTERNED:
-    case PycObject::TYPE_ASCII:
-    case PycObject::TYPE_ASCII_INTERNED:
-    case PycObject::TYPE_SHORT_ASCII:
-    case PycObject::TYPE_SHORT_ASCII_INTERNED:
-        obj.cast<PycString>()->print(pyc_output, mod, false, parent_f_string_quote);
-        break;
     case PycObject::TYPE_TUPLE:
     case PycObject::TYPE_SMALL_TUPLE:
-        {
-            pyc_output << "(";
-            PycTuple::value_t values = obj.cast<PycTuple>()->values();
-            auto it = values.cbegin();
-            if (it != values.cend()) {
-                print_const(pyc_output, *it, mod);
-                while (++it != values.cend()) {
-                    pyc_output << ", ";
-                    print_const(pyc_output, *it, mod);
-                }
-            }
-            if (values.size() == 1)
-                pyc_output << ",)";
-            else
-                pyc_output << ")";
-        }
-        break;
     case PycObject::TYPE_LIST:
+    case PycObject::TYPE_SET:
+    case PycObject::TYPE_FROZENSET:
         {
-            pyc_output << "[";
-            PycList::value_t values = obj.cast<PycList>()->values();
-            auto it = values.cbegin();
-            if (it != values.cend()) {
-                print_const(pyc_output, *it, mod);
-                while (++it != values.cend()) {
-                    pyc_output << ", ";
-                    print_const(pyc_output, *it, mod);
-                }
+            const PycSimpleSequence::value_t& values =
+                    static_cast<PycSimpleSequence*>(obj)->values();
+            frame.next = values.data();
+            frame.end = values.data() + values.size();
+            switch (obj->type()) {
+            case PycObject::TYPE_TUPLE:
+            case PycObject::TYPE_SMALL_TUPLE:
+                pyc_output << "(";
+                frame.close = (values.size() == 1) ? ",)" : ")";
+                break;
+            case PycObject::TYPE_LIST:
+                pyc_output << "[";
+                frame.close = "]";
+                break;
+            case PycObject::TYPE_SET:
+                pyc_output << "{";
+                frame.close = "}";
+                break;
+            default:
+                pyc_output << "frozenset({";
+                frame.close = "})";
+                break;
             }
-            pyc_output << "]";
         }
         break;
     case PycObject::TYPE_DICT:
         {
+            const PycDict::value_t& values = static_cast<PycDict*>(obj)->values();
+            frame.nextItem = values.data();
+            frame.endItem = values.data() + values.size();
             pyc_output << "{";
-            PycDict::value_t values = obj.cast<PycDict>()->values();
-            auto it = values.cbegin();
-            if (it != values.cend()) {
-                print_const(pyc_output, std::get<0>(*it), mod);
-                pyc_output << ": ";
-                print_const(pyc_output, std::get<1>(*it), mod);
-                while (++it != values.cend()) {
-                    pyc_output << ", ";
-                    print_const(pyc_output, std::get<0>(*it), mod);
-                    pyc_output << ": ";
-                    print_const(pyc_output, std::get<1>(*it), mod);
-                }
-            }
-            pyc_output << "}";
+            frame.close = "}";
         }
         break;
-    case PycObject::TYPE_SET:
-        {
-            pyc_output << "{";
-            PycSet::value_t values = obj.cast<PycSet>()->values();
-            auto it = values.cbegin();
-            if (it != values.cend()) {
-                print_const(pyc_output, *it, mod);
-                while (++it != values.cend()) {
-                    pyc_output << ", ";
-                    print_const(pyc_output, *it, mod);
-                }
-            }
-            pyc_output << "}";
-        }
-        break;
-    case PycObject::TYPE_FROZENSET:
-        {
-            pyc_output << "frozenset({";
-            PycSet::value_t values = obj.cast<PycSet>()->values();
-            auto it = values.cbegin();
-            if (it != values.cend()) {
-                print_const(pyc_output, *it, mod);
-                while (++it != values.cend()) {
-                    pyc_output << ", ";
-                    print_const(pyc_output, *it, mod);
-                }
-            }
-            pyc_output << "})";
+    default:
+        return false;
+    }
+    stack.push_back(frame);
+    return true;
+}
+
+/* Emit the separator before the next value of the innermost container and
+ * return that value, or close the container and return false when it is
+ * exhausted. */
+static bool next_const_value(PycOutput& pyc_output, ConstFrame& frame, PycObject*& value)
+{
+    if (frame.inItem) {
+        pyc_output << ": ";
+        value = std::get<1>(*frame.nextItem++);
+        frame.inItem = false;
+        return true;
+    }
+    if (frame.next != frame.end || frame.nextItem != frame.endItem) {
+        if (!frame.first)
+            pyc_output << ", ";
+        frame.first = false;
+        if (frame.next != frame.end) {
+            value = *frame.next++;
+        } else {
+            value = std::get<0>(*frame.nextItem);
+            frame.inItem = true;
         }
+        return true;
+    }
+    pyc_output << frame.close;
+    return false;
+}
+
+/* Print a constant that is not a container */
+static void print_const_value(PycOutput& pyc_output, PycRef<PycObject> obj,
+                              PycModule* mod, const char* parent_f_string_quote)
+{
+    switch (obj->type()) {
+    case PycObject::TYPE_STRING:
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_INTERNED:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_ASCII_INTERNED:
+    case PycObject::TYPE_SHORT_ASCII:
+    case PycObject::TYPE_SHORT_ASCII_INTERNED:
+        obj.cast<PycString>()->print(pyc_output, mod, false, parent_f_string_quote);
         break;
     case PycObject::TYPE_NONE:
         pyc_output << "None";
@@ -229,44 +252,37 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
         pyc_output << "...";
         break;
     case PycObject::TYPE_INT:
-        formatted_print(pyc_output, "%d", obj.cast<PycInt>()->value());
+        pyc_output << obj.cast<PycInt>()->value();
         break;
     case PycObject::TYPE_LONG:
-        formatted_print(pyc_output, "%s", obj.cast<PycLong>()->repr(mod).c_str());
+        pyc_output << obj.cast<PycLong>()->repr(mod);
         break;
     case PycObject::TYPE_FLOAT:
-        formatted_print(pyc_output, "%s", obj.cast<PycFloat>()->value());
+        pyc_output << obj.cast<PycFloat>()->value();
         break;
     case PycObject::TYPE_COMPLEX:
-        formatted_print(pyc_output, "(%s+%sj)", obj.cast<PycComplex>()->value(),
-                                        obj.cast<PycComplex>()->imag());
+        pyc_output << '(' << obj.cast<PycComplex>()->value() << '+'
+                   << obj.cast<PycComplex>()->imag() << "j)";
         break;
     case PycObject::TYPE_BINARY_FLOAT:
+        print_binary_float(pyc_output, obj.cast<PycCFloat>()->value());
+        break;
+    case PycObject::TYPE_BINARY_COMPLEX:
         {
-            // Wrap any nan/inf values in float('').
-            double value = obj.cast<PycCFloat>()->value();
-            bool is_negative = std::signbit(value);
-            if (std::isnan(value)) {
-                if (is_negative) {
-                    pyc_output << "float('-nan')";
-                } else {
-                    pyc_output << "float('nan')";
-                }
-            } else if (std::isinf(value)) {
-                if (is_negative) {
-                    pyc_output << "float('-inf')";
-                } else {
-                    pyc_output << "float('inf')";
-                }
+            double real = obj.cast<PycCComplex>()->value();
+            double imag = obj.cast<PycCComplex>()->imag();
+            if (std::isfinite(real) && std::isfinite(imag)) {
+                char buffer[COMPLEX_REPR_SIZE];
+                pyc_output.write(buffer, complex_repr(buffer, real, imag));
             } else {
-                formatted_print(pyc_output, "%g", value);
+                pyc_output << "complex(";
+                print_binary_float(pyc_output, real);
+                pyc_output << ", ";
+                print_binary_float(pyc_output, imag);
+                pyc_output << ')';
             }
         }
         break;
-    case PycObject::TYPE_BINARY_COMPLEX:
-        formatted_print(pyc_output, "(%g+%gj)", obj.cast<PycCComplex>()->value(),
-                                        obj.cast<PycCComplex>()->imag());
-        break;
     case PycObject::TYPE_CODE:
     case PycObject::TYPE_CODE2:
         pyc_output << "<CODE> " << obj.cast<PycCode>()->name()->value();
@@ -276,6 +292,30 @@ void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod
     }
 }
 
+void print_const(PycOutput& pyc_output, PycRef<PycObject> obj, PycModule* mod,
+                 const char* parent_f_string_quote)
+{
+    // Nested containers are printed with an explicit stack rather than by
+    // recursion, so deeply nested or very large constants need neither
+    // native stack depth nor copies of each container's values.
+    ConstStack stack;
+    PycObject* value = obj;
+    for ( ;; ) {
+        if (value == NULL)
+            pyc_output << "<NULL>";
+        else if (!open_const_container(pyc_output, value, stack))
+            print_const_value(pyc_output, value, mod, stack.empty() ? parent_f_string_quote : nullptr);
+
+        for ( ;; ) {
+            if (stack.empty())
+                return;
+            if (next_const_value(pyc_output, stack.back(), value))
+                break;
+            stack.pop_back();
+        }
+    }
+}
+
 void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int& pos)
 {
     opcode = Pyc::ByteToOpcode(mod->majorVer(), mod->minorVer(), source.getByte());
@@ -302,8 +342,8 @@ void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int&
     }
 }
 
-void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
-               int indent, unsigned flags)
+void bc_operand(PycRef<PycCode> code, PycModule* mod, int opcode, int operand,
+                int pos, PycOperand& result)
 {
     static const char *cmp_strings[] = {
         "<", "<=", "==", "!=", ">", ">=", "in", "not in", "is", "is not",
@@ -338,7 +378,231 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
     };
     static const size_t format_value_names_len = sizeof(format_value_names) / sizeof(format_value_names[0]);
 
+    result.kind = PycOperand::PLAIN;
+    result.target = -1;
+    result.text.clear();
+
+    // Names for the UNKNOWN case of lookup tables
+    auto describe = [&result](const char* const* names, size_t count, size_t index) {
+        result.kind = PycOperand::DESC;
+        result.text = (index < count) ? names[index] : "UNKNOWN";
+    };
+
+    try {
+        switch (opcode) {
+        case Pyc::LOAD_CONST_A:
+        case Pyc::RESERVE_FAST_A:
+        case Pyc::KW_NAMES_A:
+        case Pyc::RETURN_CONST_A:
+        case Pyc::INSTRUMENTED_RETURN_CONST_A:
+            code->getConst(operand);
+            result.kind = PycOperand::CONST;
+            break;
+        case Pyc::LOAD_GLOBAL_A:
+            result.kind = PycOperand::NAME;
+            // Special case for Python 3.11+
+            if (mod->verCompare(3, 11) >= 0) {
+                if (operand & 1)
+                    result.text = "NULL + ";
+                result.text += code->getName(operand >> 1)->value();
+            } else {
+                result.text = code->getName(operand)->value();
+            }
+            break;
+        case Pyc::DELETE_ATTR_A:
+        case Pyc::DELETE_GLOBAL_A:
+        case Pyc::DELETE_NAME_A:
+        case Pyc::IMPORT_FROM_A:
+        case Pyc::IMPORT_NAME_A:
+        case Pyc::LOAD_ATTR_A:
+        case Pyc::LOAD_LOCAL_A:
+        case Pyc::LOAD_NAME_A:
+        case Pyc::STORE_ATTR_A:
+        case Pyc::STORE_GLOBAL_A:
+        case Pyc::STORE_NAME_A:
+        case Pyc::STORE_ANNOTATION_A:
+        case Pyc::LOAD_METHOD_A:
+        case Pyc::LOAD_FROM_DICT_OR_GLOBALS_A:
+            {
+                auto arg = operand;
+                if (opcode == Pyc::LOAD_ATTR_A && mod->verCompare(3, 12) >= 0)
+                    arg >>= 1;
+                result.kind = PycOperand::NAME;
+                result.text = code->getName(arg)->value();
+            }
+            break;
+        case Pyc::LOAD_SUPER_ATTR_A:
+        case Pyc::INSTRUMENTED_LOAD_SUPER_ATTR_A:
+            result.kind = PycOperand::NAME;
+            result.text = code->getName(operand >> 2)->value();
+            break;
+        case Pyc::DELETE_FAST_A:
+        case Pyc::LOAD_FAST_A:
+        case Pyc::STORE_FAST_A:
+        case Pyc::LOAD_FAST_CHECK_A:
+        case Pyc::LOAD_FAST_AND_CLEAR_A:
+            result.kind = PycOperand::NAME;
+            result.text = code->getLocal(operand)->value();
+            break;
+        case Pyc::LOAD_FAST_LOAD_FAST_A:
+        case Pyc::STORE_FAST_LOAD_FAST_A:
+        case Pyc::STORE_FAST_STORE_FAST_A:
+            result.kind = PycOperand::NAME;
+            result.text = code->getLocal(operand >> 4)->value();
+            result.text += ", ";
+            result.text += code->getLocal(operand & 0xF)->value();
+            break;
+        case Pyc::LOAD_CLOSURE_A:
+        case Pyc::LOAD_DEREF_A:
+        case Pyc::STORE_DEREF_A:
+        case Pyc::DELETE_DEREF_A:
+        case Pyc::MAKE_CELL_A:
+        case Pyc::CALL_FINALLY_A:
+        case Pyc::LOAD_FROM_DICT_OR_DEREF_A:
+            result.kind = PycOperand::NAME;
+            result.text = code->getCellVar(mod, operand)->value();
+            break;
+        case Pyc::JUMP_FORWARD_A:
+        case Pyc::JUMP_IF_FALSE_A:
+        case Pyc::JUMP_IF_TRUE_A:
+        case Pyc::SETUP_LOOP_A:
+        case Pyc::SETUP_FINALLY_A:
+        case Pyc::SETUP_EXCEPT_A:
+        case Pyc::FOR_LOOP_A:
+        case Pyc::FOR_ITER_A:
+        case Pyc::SETUP_WITH_A:
+        case Pyc::SETUP_ASYNC_WITH_A:
+        case Pyc::POP_JUMP_FORWARD_IF_FALSE_A:
+        case Pyc::POP_JUMP_FORWARD_IF_TRUE_A:
+        case Pyc::SEND_A:
+        case Pyc::POP_JUMP_FORWARD_IF_NOT_NONE_A:
+        case Pyc::POP_JUMP_FORWARD_IF_NONE_A:
+        case Pyc::POP_JUMP_IF_NOT_NONE_A:
+        case Pyc::POP_JUMP_IF_NONE_A:
+        case Pyc::INSTRUMENTED_POP_JUMP_IF_NOT_NONE_A:
+        case Pyc::INSTRUMENTED_POP_JUMP_IF_NONE_A:
+        case Pyc::INSTRUMENTED_JUMP_FORWARD_A:
+        case Pyc::INSTRUMENTED_FOR_ITER_A:
+        case Pyc::INSTRUMENTED_POP_JUMP_IF_FALSE_A:
+        case Pyc::INSTRUMENTED_POP_JUMP_IF_TRUE_A:
+            {
+                /* TODO: Fix offset based on CACHE instructions.
+                   Offset is relative to next non-CACHE instruction
+                   and thus will be printed lower than actual value.
+                   See TODO @ END_FOR ASTree.cpp */
+                int offs = operand;
+                if (mod->verCompare(3, 10) >= 0)
+                    offs *= sizeof(uint16_t); // BPO-27129
+                result.kind = PycOperand::JUMP;
+                result.target = pos + offs;
+            }
+            break;
+        case Pyc::JUMP_BACKWARD_NO_INTERRUPT_A:
+        case Pyc::JUMP_BACKWARD_A:
+        case Pyc::POP_JUMP_BACKWARD_IF_NOT_NONE_A:
+        case Pyc::POP_JUMP_BACKWARD_IF_NONE_A:
+        case Pyc::POP_JUMP_BACKWARD_IF_FALSE_A:
+        case Pyc::POP_JUMP_BACKWARD_IF_TRUE_A:
+        case Pyc::INSTRUMENTED_JUMP_BACKWARD_A:
+            {
+                // BACKWARD jumps were only introduced in Python 3.11
+                int offs = operand * sizeof(uint16_t); // BPO-27129
+                result.kind = PycOperand::JUMP;
+                result.target = pos - offs;
+            }
+            break;
+        case Pyc::POP_JUMP_IF_FALSE_A:
+        case Pyc::POP_JUMP_IF_TRUE_A:
+        case Pyc::JUMP_IF_FALSE_OR_POP_A:
+        case Pyc::JUMP_IF_TRUE_OR_POP_A:
+        case Pyc::JUMP_ABSOLUTE_A:
+        case Pyc::JUMP_IF_NOT_EXC_MATCH_A:
+            if (mod->verCompare(3, 12) >= 0) {
+                // These are now relative as well
+                int offs = operand * sizeof(uint16_t);
+                result.kind = PycOperand::JUMP;
+                result.target = pos + offs;
+            } else if (mod->verCompare(3, 10) >= 0) {
+                // BPO-27129
+                result.kind = PycOperand::JUMP;
+                result.target = int(operand * sizeof(uint16_t));
+            } else {
+                // The text disassembly has always shown these as plain
+                // numbers, but they are still jumps
+                result.target = operand;
+            }
+            break;
+        case Pyc::COMPARE_OP_A:
+            {
+                auto arg = operand;
+                if (mod->verCompare(3, 12) == 0)
+                    arg >>= 4; // changed under GH-100923
+                else if (mod->verCompare(3, 13) >= 0)
+                    arg >>= 5;
+                describe(cmp_strings, cmp_strings_len, static_cast<size_t>(arg));
+            }
+            break;
+        case Pyc::BINARY_OP_A:
+            describe(binop_strings, binop_strings_len, static_cast<size_t>(operand));
+            break;
+        case Pyc::IS_OP_A:
+            result.kind = PycOperand::DESC;
+            result.text = (operand == 0) ? "is" : (operand == 1) ? "is not" : "UNKNOWN";
+            break;
+        case Pyc::CONTAINS_OP_A:
+            result.kind = PycOperand::DESC;
+            result.text = (operand == 0) ? "in" : (operand == 1) ? "not in" : "UNKNOWN";
+            break;
+        case Pyc::CALL_INTRINSIC_1_A:
+            describe(intrinsic1_names, intrinsic1_names_len, static_cast<size_t>(operand));
+            break;
+        case Pyc::CALL_INTRINSIC_2_A:
+            describe(intrinsic2_names, intrinsic2_names_len, static_cast<size_t>(operand));
+            break;
+        case Pyc::FORMAT_VALUE_A:
+            describe(format_value_names, format_value_names_len,
+                     static_cast<size_t>(operand & 0x03));
+            if ((operand & 0x04) != 0)
+                result.text += " | FVS_HAVE_SPEC";
+            break;
+        case Pyc::CONVERT_VALUE_A:
+            describe(format_value_names, format_value_names_len, static_cast<size_t>(operand));
+            break;
+        case Pyc::SET_FUNCTION_ATTRIBUTE_A:
+            // This looks like a bitmask, but CPython treats it as an exclusive lookup...
+            result.kind = PycOperand::DESC;
+            switch (operand) {
+            case 0x01:
+                result.text = "MAKE_FUNCTION_DEFAULTS";
+                break;
+            case 0x02:
+                result.text = "MAKE_FUNCTION_KWDEFAULTS";
+                break;
+            case 0x04:
+                result.text = "MAKE_FUNCTION_ANNOTATIONS";
+                break;
+            case 0x08:
+                result.text = "MAKE_FUNCTION_CLOSURE";
+                break;
+            default:
+                result.text = "UNKNOWN";
+                break;
+            }
+            break;
+        default:
+            break;
+        }
+    } catch (const std::out_of_range &) {
+        result.kind = PycOperand::INVALID;
+        result.text.clear();
+    }
+}
+
+void bc_disasm(PycOutput& pyc_output, PycRef<PycCode> code, PycModule* mod,
+               int indent, unsigned flags)
+{
     PycBuffer source(code->code()->value(), code->code()->length());
+    PycOperand arg;
 
     int opcode, operand;
     int pos = 0;
@@ -348,252 +612,30 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
         if (opcode == Pyc::CACHE && (flags & Pyc::DISASM_SHOW_CACHES) == 0)
             continue;
 
-        for (int i=0; i<indent; i++)
-            pyc_output << "    ";
+        pyc_output.indent(indent);
         formatted_print(pyc_output, "%-7d %-30s  ", start_pos, Pyc::OpcodeName(opcode));
 
         if (opcode >= Pyc::PYC_HAVE_ARG) {
-            switch (opcode) {
-            case Pyc::LOAD_CONST_A:
-            case Pyc::RESERVE_FAST_A:
-            case Pyc::KW_NAMES_A:
-            case Pyc::RETURN_CONST_A:
-            case Pyc::INSTRUMENTED_RETURN_CONST_A:
-                try {
-                    auto constParam = code->getConst(operand);
-                    formatted_print(pyc_output, "%d: ", operand);
-                    print_const(pyc_output, constParam, mod);
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::LOAD_GLOBAL_A:
-                try {
-                    // Special case for Python 3.11+
-                    if (mod->verCompare(3, 11) >= 0) {
-                        if (operand & 1)
-                            formatted_print(pyc_output, "%d: NULL + %s", operand, code->getName(operand >> 1)->value());
-                        else
-                            formatted_print(pyc_output, "%d: %s", operand, code->getName(operand >> 1)->value());
-                    } else {
-                        formatted_print(pyc_output, "%d: %s", operand, code->getName(operand)->value());
-                    }
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::DELETE_ATTR_A:
-            case Pyc::DELETE_GLOBAL_A:
-            case Pyc::DELETE_NAME_A:
-            case Pyc::IMPORT_FROM_A:
-            case Pyc::IMPORT_NAME_A:
-            case Pyc::LOAD_ATTR_A:
-            case Pyc::LOAD_LOCAL_A:
-            case Pyc::LOAD_NAME_A:
-            case Pyc::STORE_ATTR_A:
-            case Pyc::STORE_GLOBAL_A:
-            case Pyc::STORE_NAME_A:
-            case Pyc::STORE_ANNOTATION_A:
-            case Pyc::LOAD_METHOD_A:
-            case Pyc::LOAD_FROM_DICT_OR_GLOBALS_A:
-                try {
-                    auto arg = operand;
-                    if (opcode == Pyc::LOAD_ATTR_A && mod->verCompare(3, 12) >= 0)
-                        arg >>= 1;
-                    formatted_print(pyc_output, "%d: %s", operand, code->getName(arg)->value());
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::LOAD_SUPER_ATTR_A:
-            case Pyc::INSTRUMENTED_LOAD_SUPER_ATTR_A:
-                try {
-                    formatted_print(pyc_output, "%d: %s", operand, code->getName(operand >> 2)->value());
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::DELETE_FAST_A:
-            case Pyc::LOAD_FAST_A:
-            case Pyc::STORE_FAST_A:
-            case Pyc::LOAD_FAST_CHECK_A:
-            case Pyc::LOAD_FAST_AND_CLEAR_A:
-                try {
-                    formatted_print(pyc_output, "%d: %s", operand, code->getLocal(operand)->value());
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::LOAD_FAST_LOAD_FAST_A:
-            case Pyc::STORE_FAST_LOAD_FAST_A:
-            case Pyc::STORE_FAST_STORE_FAST_A:
-                try {
-                    formatted_print(pyc_output, "%d: %s, %s", operand,
-                                    code->getLocal(operand >> 4)->value(),
-                                    code->getLocal(operand & 0xF)->value());
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::LOAD_CLOSURE_A:
-            case Pyc::LOAD_DEREF_A:
-            case Pyc::STORE_DEREF_A:
-            case Pyc::DELETE_DEREF_A:
-            case Pyc::MAKE_CELL_A:
-            case Pyc::CALL_FINALLY_A:
-            case Pyc::LOAD_FROM_DICT_OR_DEREF_A:
-                try {
-                    formatted_print(pyc_output, "%d: %s", operand, code->getCellVar(mod, operand)->value());
-                } catch (const std::out_of_range &) {
-                    formatted_print(pyc_output, "%d <INVALID>", operand);
-                }
-                break;
-            case Pyc::JUMP_FORWARD_A:
-            case Pyc::JUMP_IF_FALSE_A:
-            case Pyc::JUMP_IF_TRUE_A:
-            case Pyc::SETUP_LOOP_A:
-            case Pyc::SETUP_FINALLY_A:
-            case Pyc::SETUP_EXCEPT_A:
-            case Pyc::FOR_LOOP_A:
-            case Pyc::FOR_ITER_A:
-            case Pyc::SETUP_WITH_A:
-            case Pyc::SETUP_ASYNC_WITH_A:
-            case Pyc::POP_JUMP_FORWARD_IF_FALSE_A:
-            case Pyc::POP_JUMP_FORWARD_IF_TRUE_A:
-            case Pyc::SEND_A:
-            case Pyc::POP_JUMP_FORWARD_IF_NOT_NONE_A:
-            case Pyc::POP_JUMP_FORWARD_IF_NONE_A:
-            case Pyc::POP_JUMP_IF_NOT_NONE_A:
-            case Pyc::POP_JUMP_IF_NONE_A:
-            case Pyc::INSTRUMENTED_POP_JUMP_IF_NOT_NONE_A:
-            case Pyc::INSTRUMENTED_POP_JUMP_IF_NONE_A:
-            case Pyc::INSTRUMENTED_JUMP_FORWARD_A:
-            case Pyc::INSTRUMENTED_FOR_ITER_A:
-            case Pyc::INSTRUMENTED_POP_JUMP_IF_FALSE_A:
-            case Pyc::INSTRUMENTED_POP_JUMP_IF_TRUE_A:
-                {
-                    /* TODO: Fix offset based on CACHE instructions.
-                       Offset is relative to next non-CACHE instruction
-                       and thus will be printed lower than actual value.
-                       See TODO @ END_FOR ASTree.cpp */
-                    int offs = operand;
-                    if (mod->verCompare(3, 10) >= 0)
-                        offs *= sizeof(uint16_t); // BPO-27129
-                    formatted_print(pyc_output, "%d (to %d)", operand, pos+offs);
-                }
-                break;
-            case Pyc::JUMP_BACKWARD_NO_INTERRUPT_A:
-            case Pyc::JUMP_BACKWARD_A:
-            case Pyc::POP_JUMP_BACKWARD_IF_NOT_NONE_A:
-            case Pyc::POP_JUMP_BACKWARD_IF_NONE_A:
-            case Pyc::POP_JUMP_BACKWARD_IF_FALSE_A:
-            case Pyc::POP_JUMP_BACKWARD_IF_TRUE_A:
-            case Pyc::INSTRUMENTED_JUMP_BACKWARD_A:
-                {
-                    // BACKWARD jumps were only introduced in Python 3.11
-                    int offs = operand * sizeof(uint16_t); // BPO-27129
-                    formatted_print(pyc_output, "%d (to %d)", operand, pos-offs);
-                }
-                break;
-            case Pyc::POP_JUMP_IF_FALSE_A:
-            case Pyc::POP_JUMP_IF_TRUE_A:
-            case Pyc::JUMP_IF_FALSE_OR_POP_A:
-            case Pyc::JUMP_IF_TRUE_OR_POP_A:
-            case Pyc::JUMP_ABSOLUTE_A:
-            case Pyc::JUMP_IF_NOT_EXC_MATCH_A:
-                if (mod->verCompare(3, 12) >= 0) {
-                    // These are now relative as well
-                    int offs = operand * sizeof(uint16_t);
-                    formatted_print(pyc_output, "%d (to %d)", operand, pos+offs);
-                } else if (mod->verCompare(3, 10) >= 0) {
-                    // BPO-27129
-                    formatted_print(pyc_output, "%d (to %d)", operand,
-                                    int(operand * sizeof(uint16_t)));
-                } else {
-                    formatted_print(pyc_output, "%d", operand);
-                }
-                break;
-            case Pyc::COMPARE_OP_A:
-                {
-                    auto arg = operand;
-                    if (mod->verCompare(3, 12) == 0)
-                        arg >>= 4; // changed under GH-100923
-                    else if (mod->verCompare(3, 13) >= 0)
-                        arg >>= 5;
-                    if (static_cast<size_t>(arg) < cmp_strings_len)
-                        formatted_print(pyc_output, "%d (%s)", operand, cmp_strings[arg]);
-                    else
-                        formatted_print(pyc_output, "%d (UNKNOWN)", operand);
-                }
-                break;
-            case Pyc::BINARY_OP_A:
-                if (static_cast<size_t>(operand) < binop_strings_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, binop_strings[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
-                break;
-            case Pyc::IS_OP_A:
-                formatted_print(pyc_output, "%d (%s)", operand, (operand == 0) ? "is"
-                                                      : (operand == 1) ? "is not"
-                                                      : "UNKNOWN");
-                break;
-            case Pyc::CONTAINS_OP_A:
-                formatted_print(pyc_output, "%d (%s)", operand, (operand == 0) ? "in"
-                                                      : (operand == 1) ? "not in"
-                                                      : "UNKNOWN");
+            bc_operand(code, mod, opcode, operand, pos, arg);
+            switch (arg.kind) {
+            case PycOperand::PLAIN:
+                formatted_print(pyc_output, "%d", operand);
                 break;
-            case Pyc::CALL_INTRINSIC_1_A:
-                if (static_cast<size_t>(operand) < intrinsic1_names_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, intrinsic1_names[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+            case PycOperand::CONST:
+                formatted_print(pyc_output, "%d: ", operand);
+                print_const(pyc_output, code->getConst(operand), mod);
                 break;
-            case Pyc::CALL_INTRINSIC_2_A:
-                if (static_cast<size_t>(operand) < intrinsic2_names_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, intrinsic2_names[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+            case PycOperand::NAME:
+                formatted_print(pyc_output, "%d: %s", operand, arg.text.c_str());
                 break;
-            case Pyc::FORMAT_VALUE_A:
-                {
-                    auto conv = static_cast<size_t>(operand & 0x03);
-                    const char *flag = (operand & 0x04) ? " | FVS_HAVE_SPEC" : "";
-                    if (conv < format_value_names_len) {
-                        formatted_print(pyc_output, "%d (%s%s)", operand,
-                                        format_value_names[conv], flag);
-                    } else {
-                        formatted_print(pyc_output, "%d (UNKNOWN)", operand);
-                    }
-                }
+            case PycOperand::JUMP:
+                formatted_print(pyc_output, "%d (to %d)", operand, arg.target);
                 break;
-            case Pyc::CONVERT_VALUE_A:
-                if (static_cast<size_t>(operand) < format_value_names_len)
-                    formatted_print(pyc_output, "%d (%s)", operand, format_value_names[operand]);
-                else
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
+            case PycOperand::DESC:
+                formatted_print(pyc_output, "%d (%s)", operand, arg.text.c_str());
                 break;
-            case Pyc::SET_FUNCTION_ATTRIBUTE_A:
-                // This looks like a bitmask, but CPython treats it as an exclusive lookup...
-                switch (operand) {
-                case 0x01:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_DEFAULTS)", operand);
-                    break;
-                case 0x02:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_KWDEFAULTS)", operand);
-                    break;
-                case 0x04:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_ANNOTATIONS)", operand);
-                    break;
-                case 0x08:
-                    formatted_print(pyc_output, "%d (MAKE_FUNCTION_CLOSURE)", operand);
-                    break;
-                default:
-                    formatted_print(pyc_output, "%d (UNKNOWN)", operand);
-                    break;
-                }
-                break;
-            default:
-                formatted_print(pyc_output, "%d", operand);
+            case PycOperand::INVALID:
+                formatted_print(pyc_output, "%d <INVALID>", operand);
                 break;
             }
         }
@@ -601,14 +643,11 @@ void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
     }
 }
 
-void bc_exceptiontable(std::ostream& pyc_output, PycRef<PycCode> code,
+void bc_exceptiontable(PycOutput& pyc_output, PycRef<PycCode> code,
                int indent)
 {
     for (const auto& entry : code->exceptionTableEntries()) {
-
-        for (int i=0; i<indent; i++)
-            pyc_output << "    ";
-
+        pyc_output.indent(indent);
         pyc_output << entry.start_offset << " to " << entry.end_offset
                    << " -> " << entry.target << " [" << entry.stack_depth
                    << "] " << (entry.push_lasti ? "lasti": "")
@@ -27,10 +27,31 @@ int ByteToOpcode(int maj, int min, int opcode);
 
 }
 
-void print_const(std::ostream& pyc_output, PycRef<PycObject> obj, PycModule* mod,
+void print_const(PycOutput& pyc_output, PycRef<PycObject> obj, PycModule* mod,
                  const char* parent_f_string_quote = nullptr);
 void bc_next(PycBuffer& source, PycModule* mod, int& opcode, int& operand, int& pos);
-void bc_disasm(std::ostream& pyc_output, PycRef<PycCode> code, PycModule* mod,
+
+/* How the operand of an instruction is shown in a disassembly */
+struct PycOperand {
+    enum Kind {
+        PLAIN,      // Just the number
+        CONST,      // Index of a valid constant
+        NAME,       // A name, local or cell; text is the name
+        JUMP,       // A jump; target is the offset jumped to
+        DESC,       // An operator or flag; text describes it
+        INVALID,    // Out of range index
+    };
+
+    Kind kind;
+    int target;         // Jump target offset, or -1 (also set for PLAIN jumps)
+    std::string text;
+};
+
+/* Decodes the operand of an instruction read by bc_next(), where pos is the
+ * offset following it */
+void bc_operand(PycRef<PycCode> code, PycModule* mod, int opcode, int operand,
+                int pos, PycOperand& result);
+void bc_disasm(PycOutput& pyc_output, PycRef<PycCode> code, PycModule* mod,
                int indent, unsigned flags);
-void bc_exceptiontable(std::ostream& pyc_output, PycRef<PycCode> code,
+void bc_exceptiontable(PycOutput& pyc_output, PycRef<PycCode> code,
                int indent);
@@ -0,0 +1,298 @@
+#include "corpus_stats.h"
+#include "bytecode.h"
+#include "pyc_cache.h"
+#include "pyc_fs.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#ifdef WIN32
+#  define PATHSEP '\\'
+#else
+#  define PATHSEP '/'
+#endif
+
+typedef unsigned long long count_t;
+
+struct VersionStats {
+    VersionStats()
+        : files(), code_objects(), instructions(), bytecode_bytes(),
+          opcodes(Pyc::PYC_LAST_OPCODE + 1) { }
+
+    count_t files, code_objects, instructions, bytecode_bytes;
+    std::vector<count_t> opcodes;       // The last entry counts invalid opcodes
+    std::map<int, count_t> sizes;       // Bytecode size buckets, by power of two
+    std::map<int, count_t> constants;   // By marshal type
+    std::map<int, count_t> depths;
+
+    void merge(const VersionStats& other)
+    {
+        files += other.files;
+        code_objects += other.code_objects;
+        instructions += other.instructions;
+        bytecode_bytes += other.bytecode_bytes;
+        for (size_t i = 0; i < opcodes.size(); ++i)
+            opcodes[i] += other.opcodes[i];
+        for (const auto& it : other.sizes)
+            sizes[it.first] += it.second;
+        for (const auto& it : other.constants)
+            constants[it.first] += it.second;
+        for (const auto& it : other.depths)
+            depths[it.first] += it.second;
+    }
+};
+
+struct CorpusStats {
+    CorpusStats() : files(), failed() { }
+
+    count_t files, failed;
+    std::map<std::pair<int, int>, VersionStats> versions;
+
+    void merge(const CorpusStats& other)
+    {
+        files += other.files;
+        failed += other.failed;
+        for (const auto& it : other.versions)
+            versions[it.first].merge(it.second);
+    }
+};
+
+static bool has_suffix(const std::string& name, const char* suffix)
+{
+    size_t length = strlen(suffix);
+    return name.size() >= length && name.compare(name.size() - length, length, suffix) == 0;
+}
+
+/* Adds input to files, or the .pyc and .pyo files under it if it is a
+ * directory.  Links to directories found inside are not followed, so a
+ * link back to a parent can't make the search recurse forever. */
+static void find_files(const std::string& input, std::vector<std::string>& files)
+{
+    if (!is_directory(input)) {
+        files.push_back(input);
+        return;
+    }
+    std::vector<std::string> entries = list_directory(input);
+    std::sort(entries.begin(), entries.end());
+    for (const std::string& name : entries) {
+        std::string path = input + PATHSEP + name;
+        if (is_directory(path)) {
+            if (!is_link(path))
+                find_files(path, files);
+        }
+        else if (has_suffix(name, ".pyc") || has_suffix(name, ".pyo"))
+            files.push_back(path);
+    }
+}
+
+static int size_bucket(int size)
+{
+    int bucket = 0;
+    while (size > 1) {
+        size >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+static void count_code(PycRef<PycCode> code, PycModule* mod, int depth, VersionStats& stats)
+{
+    if (code->visiting()) {
+        fputs("WARNING: Circular reference detected\n", stderr);
+        return;
+    }
+    PycVisitMark mark((PycObject *)code);
+
+    ++stats.code_objects;
+    ++stats.depths[depth];
+
+    PycRef<PycString> bytecode = code->code();
+    int size = (bytecode != NULL) ? bytecode->length() : 0;
+    stats.bytecode_bytes += size;
+    ++stats.sizes[size_bucket(size)];
+
+    if (size) {
+        PycBuffer source(bytecode->value(), size);
+        int opcode, operand, pos = 0;
+        while (!source.atEof()) {
+            bc_next(source, mod, opcode, operand, pos);
+            if (opcode == Pyc::CACHE)
+                continue;
+            if (opcode < 0 || opcode >= Pyc::PYC_LAST_OPCODE)
+                opcode = Pyc::PYC_LAST_OPCODE;
+            ++stats.opcodes[opcode];
+            ++stats.instructions;
+        }
+    }
+
+    if (code->consts() == NULL)
+        return;
+    for (int i = 0; i < code->consts()->size(); ++i) {
+        PycRef<PycObject> obj = code->consts()->get(i);
+        ++stats.constants[obj.type()];
+        if (obj.type() == PycObject::TYPE_CODE || obj.type() == PycObject::TYPE_CODE2)
+            count_code(obj.cast<PycCode>(), mod, depth + 1, stats);
+    }
+}
+
+static void count_file(const std::string& filename, const CorpusStatsOptions& options,
+                       CorpusStats& stats)
+{
+    ++stats.files;
+    std::string contents;
+    if (!PycCache::readFile(filename.c_str(), contents)) {
+        fprintf(stderr, "Error opening file %s\n", filename.c_str());
+        ++stats.failed;
+        return;
+    }
+
+    PycModule mod;
+    mod.setStrictUnicode(options.strict_unicode);
+    try {
+        mod.loadFromBuffer(contents.data(), (int)contents.size());
+        if (!mod.isValid() || mod.code() == NULL) {
+            fprintf(stderr, "Could not load file %s\n", filename.c_str());
+            ++stats.failed;
+            return;
+        }
+        VersionStats file_stats;
+        file_stats.files = 1;
+        count_code(mod.code(), &mod, 0, file_stats);
+        stats.versions[std::make_pair(mod.majorVer(), mod.minorVer())].merge(file_stats);
+    } catch (std::exception& ex) {
+        fprintf(stderr, "Error loading file %s: %s\n", filename.c_str(), ex.what());
+        ++stats.failed;
+    }
+}
+
+static std::string size_bucket_name(int bucket)
+{
+    if (bucket == 0)
+        return "0-1";
+    return std::to_string(1ULL << bucket) + "-" + std::to_string((1ULL << (bucket + 1)) - 1);
+}
+
+/* Calls fn(key, count) for each category of the stats, in output order */
+template <typename Fn>
+static void for_each_count(const VersionStats& stats, const char* category, Fn fn)
+{
+    if (strcmp(category, "opcodes") == 0) {
+        std::vector<int> opcodes;
+        for (int i = 0; i <= Pyc::PYC_LAST_OPCODE; ++i) {
+            if (stats.opcodes[i])
+                opcodes.push_back(i);
+        }
+        std::stable_sort(opcodes.begin(), opcodes.end(), [&](int a, int b) {
+            return stats.opcodes[a] > stats.opcodes[b];
+        });
+        for (int opcode : opcodes) {
+            fn(std::string(opcode < Pyc::PYC_LAST_OPCODE ? Pyc::OpcodeName(opcode) : "<invalid>"),
+               stats.opcodes[opcode]);
+        }
+    } else if (strcmp(category, "bytecode_sizes") == 0) {
+        for (const auto& it : stats.sizes)
+            fn(size_bucket_name(it.first), it.second);
+    } else if (strcmp(category, "constants") == 0) {
+        // Several type codes can share a name, e.g. unknown ones
+        std::map<std::string, count_t> names;
+        for (const auto& it : stats.constants)
+            names[MarshalTypeName(it.first)] += it.second;
+        for (const auto& it : names)
+            fn(it.first, it.second);
+    } else if (strcmp(category, "depths") == 0) {
+        for (const auto& it : stats.depths)
+            fn(std::to_string(it.first), it.second);
+    }
+}
+
+static const char* const CATEGORIES[] = { "opcodes", "bytecode_sizes", "constants", "depths" };
+
+static void write_json(const CorpusStats& stats, std::ostream& out)
+{
+    out << "{\n  \"files\": " << stats.files << ",\n  \"failed\": " << stats.failed
+        << ",\n  \"versions\": {";
+    bool first_version = true;
+    for (const auto& version : stats.versions) {
+        const VersionStats& vstats = version.second;
+        out << (first_version ? "\n" : ",\n") << "    \"" << version.first.first << "."
+            << version.first.second << "\": {\n"
+            << "      \"files\": " << vstats.files << ",\n"
+            << "      \"code_objects\": " << vstats.code_objects << ",\n"
+            << "      \"instructions\": " << vstats.instructions << ",\n"
+            << "      \"bytecode_bytes\": " << vstats.bytecode_bytes;
+        for (const char* category : CATEGORIES) {
+            out << ",\n      \"" << category << "\": {";
+            bool first = true;
+            for_each_count(vstats, category, [&](const std::string& key, count_t count) {
+                out << (first ? "" : ", ") << "\"" << key << "\": " << count;
+                first = false;
+            });
+            out << "}";
+        }
+        out << "\n    }";
+        first_version = false;
+    }
+    out << "\n  }\n}\n";
+}
+
+static void write_csv(const CorpusStats& stats, std::ostream& out)
+{
+    out << "version,category,key,count\n";
+    out << "all,summary,files," << stats.files << "\n";
+    out << "all,summary,failed," << stats.failed << "\n";
+    for (const auto& version : stats.versions) {
+        const VersionStats& vstats = version.second;
+        std::string name = std::to_string(version.first.first) + "."
+                + std::to_string(version.first.second);
+        out << name << ",summary,files," << vstats.files << "\n";
+        out << name << ",summary,code_objects," << vstats.code_objects << "\n";
+        out << name << ",summary,instructions," << vstats.instructions << "\n";
+        out << name << ",summary,bytecode_bytes," << vstats.bytecode_bytes << "\n";
+        for (const char* category : CATEGORIES) {
+            for_each_count(vstats, category, [&](const std::string& key, count_t count) {
+                out << name << "," << category << "," << key << "," << count << "\n";
+            });
+        }
+    }
+}
+
+int corpus_stats_main(const std::vector<std::string>& inputs,
+                      const CorpusStatsOptions& options, std::ostream& out)
+{
+    std::vector<std::string> files;
+    for (const std::string& input : inputs)
+        find_files(input, files);
+
+    unsigned jobs = options.jobs ? options.jobs : std::thread::hardware_concurrency();
+    if (jobs == 0)
+        jobs = 1;
+    if (jobs > files.size())
+        jobs = (unsigned)std::max<size_t>(files.size(), 1);
+
+    CorpusStats stats;
+    std::mutex mutex;
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        CorpusStats thread_stats;
+        for (size_t i = next++; i < files.size(); i = next++)
+            count_file(files[i], options, thread_stats);
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.merge(thread_stats);
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < jobs; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    if (options.csv)
+        write_csv(stats, out);
+    else
+        write_json(stats, out);
+    return stats.failed ? 1 : 0;
+}
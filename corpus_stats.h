@@ -0,0 +1,31 @@
+#ifndef _PYC_CORPUS_STATS_H
+#define _PYC_CORPUS_STATS_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* pycdas --stats: opcode and feature counts for a corpus of .pyc files.
+ *
+ * The inputs may be files or directories, which are searched recursively
+ * for .pyc and .pyo files.  Files are loaded in parallel, and for each Python
+ * version the tool counts files, code objects, opcodes, bytecode sizes
+ * (in power of two buckets), constant types (by marshal type) and the
+ * nesting depth of code objects.  No disassembly is produced.
+ *
+ * JSON output is one object with a "versions" member, keyed by "X.Y".
+ * CSV output has a "version,category,key,count" row for each count.
+ */
+
+struct CorpusStatsOptions {
+    CorpusStatsOptions() : csv(), jobs(), strict_unicode() { }
+
+    bool csv;               // CSV instead of JSON
+    unsigned jobs;          // 0 for one per CPU
+    bool strict_unicode;
+};
+
+int corpus_stats_main(const std::vector<std::string>& inputs,
+                      const CorpusStatsOptions& options, std::ostream& out);
+
+#endif
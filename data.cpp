@@ -1,8 +1,29 @@
 #include "data.h"
+#include "pyc_numeric.h"
 #include <cstring>
 #include <cstdarg>
+#include <stdexcept>
 #include <vector>
 
+static thread_local FILE* s_error_stream = nullptr;
+static thread_local unsigned long s_error_count = 0;
+
+FILE* pyc_error_stream()
+{
+    ++s_error_count;
+    return s_error_stream ? s_error_stream : stderr;
+}
+
+unsigned long pyc_error_count()
+{
+    return s_error_count;
+}
+
+void set_pyc_error_stream(FILE* stream)
+{
+    s_error_stream = stream;
+}
+
 /* PycData */
 int PycData::get16()
 {
@@ -54,8 +75,7 @@ int PycFile::getByte()
 {
     int ch = fgetc(m_stream);
     if (ch == EOF) {
-        fputs("PycFile::getByte(): Unexpected end of stream\n", stderr);
-        std::exit(1);
+        throw std::runtime_error("PycFile::getByte(): Unexpected end of stream");
     }
     return ch;
 }
@@ -63,8 +83,7 @@ int PycFile::getByte()
 void PycFile::getBuffer(int bytes, void* buffer)
 {
     if (fread(buffer, 1, bytes, m_stream) != (size_t)bytes) {
-        fputs("PycFile::getBuffer(): Unexpected end of stream\n", stderr);
-        std::exit(1);
+        throw std::runtime_error("PycFile::getBuffer(): Unexpected end of stream");
     }
 }
 
@@ -73,8 +92,7 @@ void PycFile::getBuffer(int bytes, void* buffer)
 int PycBuffer::getByte()
 {
     if (atEof()) {
-        fputs("PycBuffer::getByte(): Unexpected end of stream\n", stderr);
-        std::exit(1);
+        throw std::runtime_error("PycBuffer::getByte(): Unexpected end of stream");
     }
     int ch = (int)(*(m_buffer + m_pos));
     ++m_pos;
@@ -84,35 +102,118 @@ int PycBuffer::getByte()
 void PycBuffer::getBuffer(int bytes, void* buffer)
 {
     if (m_pos + bytes > m_size) {
-        fputs("PycBuffer::getBuffer(): Unexpected end of stream\n", stderr);
-        std::exit(1);
+        throw std::runtime_error("PycBuffer::getBuffer(): Unexpected end of stream");
     }
     if (bytes != 0)
         memcpy(buffer, (m_buffer + m_pos), bytes);
     m_pos += bytes;
 }
 
-int formatted_print(std::ostream& stream, const char* format, ...)
+
+/* PycOutput */
+PycOutput::PycOutput(std::ostream& stream, size_t bufsize)
+    : m_stream(stream), m_length(0), m_capacity(bufsize)
+{
+    m_buffer = new char[m_capacity];
+}
+
+void PycOutput::flush()
+{
+    if (m_length) {
+        m_stream.write(m_buffer, m_length);
+        m_length = 0;
+    }
+    m_stream.flush();
+}
+
+void PycOutput::indent(int level)
+{
+    static const char spaces[] = "                                "
+                                 "                                ";
+    static const int levels_per_chunk = (sizeof(spaces) - 1) / 4;
+
+    while (level > levels_per_chunk) {
+        write(spaces, levels_per_chunk * 4);
+        level -= levels_per_chunk;
+    }
+    if (level > 0)
+        write(spaces, level * 4);
+}
+
+int PycOutput::printf(const char* format, ...)
 {
     va_list args;
     va_start(args, format);
-    int result = formatted_printv(stream, format, args);
+    int result = vprintf(format, args);
     va_end(args);
     return result;
 }
 
-int formatted_printv(std::ostream& stream, const char* format, va_list args)
+int PycOutput::vprintf(const char* format, va_list args)
 {
+    // Format directly into the free space at the end of the buffer, and only
+    // fall back to a temporary when the result won't fit even after flushing
     va_list saved_args;
     va_copy(saved_args, args);
-    int len = std::vsnprintf(nullptr, 0, format, args);
-    if (len < 0)
-        return len;
-    std::vector<char> vec(static_cast<size_t>(len) + 1);
-    int written = std::vsnprintf(&vec[0], vec.size(), format, saved_args);
+    size_t avail = m_capacity - m_length;
+    int len = std::vsnprintf(m_buffer + m_length, avail, format, args);
+    if (len >= 0 && static_cast<size_t>(len) < avail) {
+        m_length += len;
+    } else if (len >= 0) {
+        flush();
+        if (static_cast<size_t>(len) < m_capacity) {
+            len = std::vsnprintf(m_buffer, m_capacity, format, saved_args);
+            if (len >= 0)
+                m_length = len;
+        } else {
+            std::vector<char> vec(static_cast<size_t>(len) + 1);
+            len = std::vsnprintf(&vec[0], vec.size(), format, saved_args);
+            if (len >= 0)
+                write(&vec[0], len);
+        }
+    }
     va_end(saved_args);
+    return len;
+}
 
-    if (written >= 0)
-        stream << &vec[0];
-    return written;
+PycOutput& PycOutput::operator<<(long long value)
+{
+    if (value < 0) {
+        put('-');
+        return *this << (0ULL - (unsigned long long)value);
+    }
+    return *this << (unsigned long long)value;
+}
+
+PycOutput& PycOutput::operator<<(unsigned long long value)
+{
+    char digits[24];
+    char* dp = digits + sizeof(digits);
+    do {
+        *--dp = char('0' + (value % 10));
+        value /= 10;
+    } while (value != 0);
+    write(dp, (digits + sizeof(digits)) - dp);
+    return *this;
+}
+
+PycOutput& PycOutput::operator<<(double value)
+{
+    char text[FLOAT_REPR_SIZE];
+    write(text, float_repr(text, value));
+    return *this;
+}
+
+int formatted_print(PycOutput& stream, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int result = stream.vprintf(format, args);
+    va_end(args);
+    return result;
+}
+
+int formatted_printv(PycOutput& stream, const char* format, va_list args)
+{
+    return stream.vprintf(format, args);
 }
@@ -2,7 +2,10 @@
 #define _PYC_FILE_H
 
 #include <cstdio>
+#include <cstdarg>
+#include <cstring>
 #include <ostream>
+#include <string>
 
 #ifdef WIN32
 typedef __int64 Pyc_INT64;
@@ -57,7 +60,76 @@ private:
     int m_size, m_pos;
 };
 
-int formatted_print(std::ostream& stream, const char* format, ...);
-int formatted_printv(std::ostream& stream, const char* format, va_list args);
+/* Buffered text sink used for all decompiler and disassembler output.
+ * Output is accumulated in a large buffer and handed to the underlying
+ * stream in big chunks, rather than one character at a time. */
+class PycOutput {
+public:
+    PycOutput(std::ostream& stream, size_t bufsize = 64 * 1024);
+    ~PycOutput()
+    {
+        flush();
+        delete[] m_buffer;
+    }
+
+    PycOutput(const PycOutput&) = delete;
+    PycOutput& operator=(const PycOutput&) = delete;
+
+    void write(const char* data, size_t length)
+    {
+        if (length > m_capacity - m_length) {
+            flush();
+            if (length >= m_capacity) {
+                m_stream.write(data, length);
+                return;
+            }
+        }
+        memcpy(m_buffer + m_length, data, length);
+        m_length += length;
+    }
+
+    void put(char ch)
+    {
+        if (m_length == m_capacity)
+            flush();
+        m_buffer[m_length++] = ch;
+    }
+
+    /* Write four spaces per indentation level */
+    void indent(int level);
+
+    int printf(const char* format, ...);
+    int vprintf(const char* format, va_list args);
+
+    void flush();
+
+    PycOutput& operator<<(const char* str) { write(str, strlen(str)); return *this; }
+    PycOutput& operator<<(const std::string& str) { write(str.data(), str.size()); return *this; }
+    PycOutput& operator<<(char ch) { put(ch); return *this; }
+    PycOutput& operator<<(int value) { return *this << (long long)value; }
+    PycOutput& operator<<(unsigned value) { return *this << (unsigned long long)value; }
+    PycOutput& operator<<(long long value);
+    PycOutput& operator<<(unsigned long long value);
+    PycOutput& operator<<(double value);
+
+private:
+    std::ostream& m_stream;
+    char* m_buffer;
+    size_t m_length, m_capacity;
+};
+
+int formatted_print(PycOutput& stream, const char* format, ...);
+int formatted_printv(PycOutput& stream, const char* format, va_list args);
+
+/* Warnings and errors from loading and decompiling are written here.  This
+ * is stderr unless the current thread has redirected it, which lets several
+ * modules be processed in parallel with their diagnostics kept apart.
+ * Passing NULL restores stderr. */
+FILE* pyc_error_stream();
+void set_pyc_error_stream(FILE* stream);
+
+/* How many times pyc_error_stream() has been fetched on this thread, which
+ * tells callers whether anything was reported during some operation */
+unsigned long pyc_error_count();
 
 #endif
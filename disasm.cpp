@@ -0,0 +1,757 @@
+#include <cstdarg>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <unordered_map>
+#include "disasm.h"
+#include "pyc_ir.h"
+#include "pyc_numeric.h"
+#include "bytecode.h"
+
+static const char* flag_names[] = {
+    "CO_OPTIMIZED", "CO_NEWLOCALS", "CO_VARARGS", "CO_VARKEYWORDS",
+    "CO_NESTED", "CO_GENERATOR", "CO_NOFREE", "CO_COROUTINE",
+    "CO_ITERABLE_COROUTINE", "CO_ASYNC_GENERATOR", "<0x400>", "<0x800>",
+    "CO_GENERATOR_ALLOWED", "<0x2000>", "<0x4000>", "<0x8000>",
+    "<0x10000>", "CO_FUTURE_DIVISION", "CO_FUTURE_ABSOLUTE_IMPORT", "CO_FUTURE_WITH_STATEMENT",
+    "CO_FUTURE_PRINT_FUNCTION", "CO_FUTURE_UNICODE_LITERALS", "CO_FUTURE_BARRY_AS_BDFL",
+            "CO_FUTURE_GENERATOR_STOP",
+    "CO_FUTURE_ANNOTATIONS", "CO_NO_MONITORING_EVENTS", "<0x4000000>", "<0x8000000>",
+    "<0x10000000>", "<0x20000000>", "<0x40000000>", "<0x80000000>"
+};
+
+static void print_coflags(unsigned long flags, PycOutput& pyc_output)
+{
+    if (flags == 0) {
+        pyc_output << "\n";
+        return;
+    }
+
+    pyc_output << " (";
+    unsigned long f = 1;
+    int k = 0;
+    while (k < 32) {
+        if ((flags & f) != 0) {
+            flags &= ~f;
+            if (flags == 0)
+                pyc_output << flag_names[k];
+            else
+                pyc_output << flag_names[k] << " | ";
+        }
+        ++k;
+        f <<= 1;
+    }
+    pyc_output << ")\n";
+}
+
+static void iputs(PycOutput& pyc_output, int indent, const char* text)
+{
+    pyc_output.indent(indent);
+    pyc_output << text;
+}
+
+static void ivprintf(PycOutput& pyc_output, int indent, const char* fmt,
+                     va_list varargs)
+{
+    pyc_output.indent(indent);
+    formatted_printv(pyc_output, fmt, varargs);
+}
+
+static void iprintf(PycOutput& pyc_output, int indent, const char* fmt, ...)
+{
+    va_list varargs;
+    va_start(varargs, fmt);
+    ivprintf(pyc_output, indent, fmt, varargs);
+    va_end(varargs);
+}
+
+void output_object(PycRef<PycObject> obj, PycModule* mod, int indent,
+                   unsigned flags, PycOutput& pyc_output)
+{
+    if (obj == NULL) {
+        iputs(pyc_output, indent, "<NULL>");
+        return;
+    }
+
+    if (obj->visiting()) {
+        fputs("WARNING: Circular reference detected\n", pyc_error_stream());
+        return;
+    }
+
+    switch (obj->type()) {
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        {
+            PycVisitMark mark((PycObject *)obj);
+            PycRef<PycCode> codeObj = obj.cast<PycCode>();
+            iputs(pyc_output, indent, "[Code]\n");
+            iprintf(pyc_output, indent + 1, "File Name: %s\n", codeObj->fileName()->value());
+            iprintf(pyc_output, indent + 1, "Object Name: %s\n", codeObj->name()->value());
+            if (mod->verCompare(3, 11) >= 0)
+                iprintf(pyc_output, indent + 1, "Qualified Name: %s\n", codeObj->qualName()->value());
+            iprintf(pyc_output, indent + 1, "Arg Count: %d\n", codeObj->argCount());
+            if (mod->verCompare(3, 8) >= 0)
+                iprintf(pyc_output, indent + 1, "Pos Only Arg Count: %d\n", codeObj->posOnlyArgCount());
+            if (mod->majorVer() >= 3)
+                iprintf(pyc_output, indent + 1, "KW Only Arg Count: %d\n", codeObj->kwOnlyArgCount());
+            if (mod->verCompare(3, 11) < 0)
+                iprintf(pyc_output, indent + 1, "Locals: %d\n", codeObj->numLocals());
+            if (mod->verCompare(1, 5) >= 0)
+                iprintf(pyc_output, indent + 1, "Stack Size: %d\n", codeObj->stackSize());
+            if (mod->verCompare(1, 3) >= 0) {
+                unsigned int orig_flags = codeObj->flags();
+                if (mod->verCompare(3, 8) < 0) {
+                    // Remap flags back to the value stored in the PyCode object
+                    orig_flags = (orig_flags & 0xFFFF) | ((orig_flags & 0xFFF00000) >> 4);
+                }
+                iprintf(pyc_output, indent + 1, "Flags: 0x%08X", orig_flags);
+                print_coflags(codeObj->flags(), pyc_output);
+            }
+
+            iputs(pyc_output, indent + 1, "[Names]\n");
+            for (int i=0; i<codeObj->names()->size(); i++)
+                output_object(codeObj->names()->get(i), mod, indent + 2, flags, pyc_output);
+
+            if (mod->verCompare(1, 3) >= 0) {
+                if (mod->verCompare(3, 11) >= 0)
+                    iputs(pyc_output, indent + 1, "[Locals+Names]\n");
+                else
+                    iputs(pyc_output, indent + 1, "[Var Names]\n");
+                for (int i=0; i<codeObj->localNames()->size(); i++)
+                    output_object(codeObj->localNames()->get(i), mod, indent + 2, flags, pyc_output);
+            }
+
+            if (mod->verCompare(3, 11) >= 0 && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
+                iputs(pyc_output, indent + 1, "[Locals+Kinds]\n");
+                output_object(codeObj->localKinds().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
+            }
+
+            if (mod->verCompare(2, 1) >= 0 && mod->verCompare(3, 11) < 0) {
+                iputs(pyc_output, indent + 1, "[Free Vars]\n");
+                for (int i=0; i<codeObj->freeVars()->size(); i++)
+                    output_object(codeObj->freeVars()->get(i), mod, indent + 2, flags, pyc_output);
+
+                iputs(pyc_output, indent + 1, "[Cell Vars]\n");
+                for (int i=0; i<codeObj->cellVars()->size(); i++)
+                    output_object(codeObj->cellVars()->get(i), mod, indent + 2, flags, pyc_output);
+            }
+
+            iputs(pyc_output, indent + 1, "[Constants]\n");
+            for (int i=0; i<codeObj->consts()->size(); i++)
+                output_object(codeObj->consts()->get(i), mod, indent + 2, flags, pyc_output);
+
+            iputs(pyc_output, indent + 1, "[Disassembly]\n");
+            bc_disasm(pyc_output, codeObj, mod, indent + 2, flags);
+
+            if (mod->verCompare(3, 11) >= 0) {
+                iputs(pyc_output, indent + 1, "[Exception Table]\n");
+                bc_exceptiontable(pyc_output, codeObj, indent+2);
+            }
+
+            if (mod->verCompare(1, 5) >= 0 && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
+                iprintf(pyc_output, indent + 1, "First Line: %d\n", codeObj->firstLine());
+                iputs(pyc_output, indent + 1, "[Line Number Table]\n");
+                output_object(codeObj->lnTable().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
+            }
+        }
+        break;
+    case PycObject::TYPE_STRING:
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_INTERNED:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_ASCII_INTERNED:
+    case PycObject::TYPE_SHORT_ASCII:
+    case PycObject::TYPE_SHORT_ASCII_INTERNED:
+        iputs(pyc_output, indent, "");
+        obj.cast<PycString>()->print(pyc_output, mod);
+        pyc_output << "\n";
+        break;
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        {
+            PycVisitMark mark((PycObject *)obj);
+            iputs(pyc_output, indent, "(\n");
+            for (const auto& val : obj.cast<PycTuple>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, ")\n");
+        }
+        break;
+    case PycObject::TYPE_LIST:
+        {
+            PycVisitMark mark((PycObject *)obj);
+            iputs(pyc_output, indent, "[\n");
+            for (const auto& val : obj.cast<PycList>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, "]\n");
+        }
+        break;
+    case PycObject::TYPE_DICT:
+        {
+            PycVisitMark mark((PycObject *)obj);
+            iputs(pyc_output, indent, "{\n");
+            for (const auto& val : obj.cast<PycDict>()->values()) {
+                output_object(std::get<0>(val), mod, indent + 1, flags, pyc_output);
+                output_object(std::get<1>(val), mod, indent + 2, flags, pyc_output);
+            }
+            iputs(pyc_output, indent, "}\n");
+        }
+        break;
+    case PycObject::TYPE_SET:
+        {
+            PycVisitMark mark((PycObject *)obj);
+            iputs(pyc_output, indent, "{\n");
+            for (const auto& val : obj.cast<PycSet>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, "}\n");
+        }
+        break;
+    case PycObject::TYPE_FROZENSET:
+        {
+            PycVisitMark mark((PycObject *)obj);
+            iputs(pyc_output, indent, "frozenset({\n");
+            for (const auto& val : obj.cast<PycSet>()->values())
+                output_object(val, mod, indent + 1, flags, pyc_output);
+            iputs(pyc_output, indent, "})\n");
+        }
+        break;
+    case PycObject::TYPE_NONE:
+        iputs(pyc_output, indent, "None\n");
+        break;
+    case PycObject::TYPE_FALSE:
+        iputs(pyc_output, indent, "False\n");
+        break;
+    case PycObject::TYPE_TRUE:
+        iputs(pyc_output, indent, "True\n");
+        break;
+    case PycObject::TYPE_ELLIPSIS:
+        iputs(pyc_output, indent, "...\n");
+        break;
+    case PycObject::TYPE_INT:
+        iprintf(pyc_output, indent, "%d\n", obj.cast<PycInt>()->value());
+        break;
+    case PycObject::TYPE_LONG:
+        iprintf(pyc_output, indent, "%s\n", obj.cast<PycLong>()->repr(mod).c_str());
+        break;
+    case PycObject::TYPE_FLOAT:
+        iprintf(pyc_output, indent, "%s\n", obj.cast<PycFloat>()->value());
+        break;
+    case PycObject::TYPE_COMPLEX:
+        iprintf(pyc_output, indent, "(%s+%sj)\n", obj.cast<PycComplex>()->value(),
+                                      obj.cast<PycComplex>()->imag());
+        break;
+    case PycObject::TYPE_BINARY_FLOAT:
+        {
+            char buffer[FLOAT_REPR_SIZE];
+            float_repr(buffer, obj.cast<PycCFloat>()->value());
+            iprintf(pyc_output, indent, "%s\n", buffer);
+        }
+        break;
+    case PycObject::TYPE_BINARY_COMPLEX:
+        {
+            char buffer[COMPLEX_REPR_SIZE];
+            complex_repr(buffer, obj.cast<PycCComplex>()->value(),
+                         obj.cast<PycCComplex>()->imag());
+            iprintf(pyc_output, indent, "%s\n", buffer);
+        }
+        break;
+    default:
+        iprintf(pyc_output, indent, "<TYPE: %d>\n", obj->type());
+    }
+}
+
+static void json_string(PycOutput& pyc_output, const char* text, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    pyc_output.put('"');
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char ch = (unsigned char)text[i];
+        if (ch == '"' || ch == '\\') {
+            pyc_output.put('\\');
+            pyc_output.put(ch);
+        } else if (ch < 0x20) {
+            char escape[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+            pyc_output.write(escape, sizeof(escape));
+        } else {
+            pyc_output.put(ch);
+        }
+    }
+    pyc_output.put('"');
+}
+
+static void json_string(PycOutput& pyc_output, const std::string& text)
+{
+    json_string(pyc_output, text.data(), text.size());
+}
+
+static void json_string(PycOutput& pyc_output, PycRef<PycString> str)
+{
+    if (str == NULL)
+        pyc_output << "null";
+    else
+        json_string(pyc_output, str->strValue());
+}
+
+static void json_names(PycOutput& pyc_output, PycRef<PycSequence> names)
+{
+    pyc_output.put('[');
+    for (int i = 0; names != NULL && i < names->size(); ++i) {
+        if (i != 0)
+            pyc_output.put(',');
+        json_string(pyc_output, names->get(i).try_cast<PycString>());
+    }
+    pyc_output.put(']');
+}
+
+/* Renders constants with print_const() for the "repr" fields */
+class ConstRepr {
+public:
+    ConstRepr() : m_output(m_stream, 4096) { }
+
+    const std::string& repr(PycRef<PycObject> obj, PycModule* mod)
+    {
+        m_stream.str(std::string());
+        print_const(m_output, obj, mod);
+        m_output.flush();
+        m_text = m_stream.str();
+        return m_text;
+    }
+
+private:
+    std::ostringstream m_stream;
+    PycOutput m_output;
+    std::string m_text;
+};
+
+/* Writes one code object.  Code objects among its constants are given the
+ * next free ids and added to pending. */
+static void json_code(PycRef<PycCode> code, int id, int parent, PycModule* mod,
+                      unsigned flags, std::deque<std::pair<PycRef<PycCode>, int>>& pending,
+                      std::unordered_map<PycCode*, int>& ids, ConstRepr& const_repr,
+                      PycOutput& pyc_output)
+{
+    formatted_print(pyc_output, "{\"type\":\"code\",\"id\":%d,\"parent\":", id);
+    if (parent < 0)
+        pyc_output << "null";
+    else
+        pyc_output << parent;
+    pyc_output << ",\"name\":";
+    json_string(pyc_output, code->name());
+    if (mod->verCompare(3, 11) >= 0) {
+        pyc_output << ",\"qualname\":";
+        json_string(pyc_output, code->qualName());
+    }
+    pyc_output << ",\"filename\":";
+    json_string(pyc_output, code->fileName());
+    formatted_print(pyc_output, ",\"firstlineno\":%d,\"argcount\":%d,\"posonlyargcount\":%d"
+                    ",\"kwonlyargcount\":%d,\"nlocals\":%d,\"stacksize\":%d",
+                    code->firstLine(), code->argCount(), code->posOnlyArgCount(),
+                    code->kwOnlyArgCount(), code->numLocals(), code->stackSize());
+
+    unsigned int orig_flags = code->flags();
+    if (mod->verCompare(3, 8) < 0) {
+        // Remap flags back to the value stored in the PyCode object
+        orig_flags = (orig_flags & 0xFFFF) | ((orig_flags & 0xFFF00000) >> 4);
+    }
+    formatted_print(pyc_output, ",\"flags\":%u,\"flag_names\":[", orig_flags);
+    bool first = true;
+    for (int k = 0; k < 32; ++k) {
+        if ((code->flags() & (1UL << k)) != 0) {
+            if (!first)
+                pyc_output.put(',');
+            json_string(pyc_output, std::string(flag_names[k]));
+            first = false;
+        }
+    }
+    pyc_output << "]";
+
+    pyc_output << ",\"names\":";
+    json_names(pyc_output, code->names());
+    pyc_output << ",\"varnames\":";
+    json_names(pyc_output, code->localNames());
+    if (mod->verCompare(3, 11) >= 0) {
+        pyc_output << ",\"localkinds\":[";
+        PycRef<PycString> kinds = code->localKinds();
+        for (int i = 0; kinds != NULL && i < kinds->length(); ++i) {
+            if (i != 0)
+                pyc_output.put(',');
+            pyc_output << (int)(unsigned char)kinds->value()[i];
+        }
+        pyc_output << "]";
+    }
+    pyc_output << ",\"freevars\":";
+    json_names(pyc_output, code->freeVars());
+    pyc_output << ",\"cellvars\":";
+    json_names(pyc_output, code->cellVars());
+
+    pyc_output << ",\"consts\":[";
+    for (int i = 0; i < code->consts()->size(); ++i) {
+        PycRef<PycObject> obj = code->consts()->get(i);
+        if (i != 0)
+            pyc_output.put(',');
+        if (obj == NULL) {
+            pyc_output << "{\"type\":\"NULL\"}";
+            continue;
+        }
+        pyc_output << "{\"type\":";
+        json_string(pyc_output, std::string(MarshalTypeName(obj->type())));
+        if (obj->type() == PycObject::TYPE_CODE || obj->type() == PycObject::TYPE_CODE2) {
+            PycRef<PycCode> child = obj.cast<PycCode>();
+            auto inserted = ids.emplace((PycCode*)child, (int)ids.size());
+            if (inserted.second)
+                pending.emplace_back(child, id);
+            formatted_print(pyc_output, ",\"code\":%d", inserted.first->second);
+        }
+        pyc_output << ",\"repr\":";
+        json_string(pyc_output, const_repr.repr(obj, mod));
+        pyc_output.put('}');
+    }
+    pyc_output << "]";
+
+    pyc_output << ",\"instructions\":[";
+    PycBuffer source(code->code()->value(), code->code()->length());
+    PycOperand arg;
+    int opcode, operand;
+    int pos = 0;
+    first = true;
+    while (!source.atEof()) {
+        int start_pos = pos;
+        bc_next(source, mod, opcode, operand, pos);
+        if (opcode == Pyc::CACHE && (flags & Pyc::DISASM_SHOW_CACHES) == 0)
+            continue;
+
+        formatted_print(pyc_output, "%s{\"offset\":%d,\"opname\":\"%s\"",
+                        first ? "" : ",", start_pos, Pyc::OpcodeName(opcode));
+        first = false;
+        if (opcode >= Pyc::PYC_HAVE_ARG) {
+            bc_operand(code, mod, opcode, operand, pos, arg);
+            formatted_print(pyc_output, ",\"arg\":%d", operand);
+            switch (arg.kind) {
+            case PycOperand::CONST:
+                pyc_output << ",\"argrepr\":";
+                json_string(pyc_output, const_repr.repr(code->getConst(operand), mod));
+                break;
+            case PycOperand::NAME:
+            case PycOperand::DESC:
+                pyc_output << ",\"argrepr\":";
+                json_string(pyc_output, arg.text);
+                break;
+            case PycOperand::INVALID:
+                pyc_output << ",\"argrepr\":\"<INVALID>\"";
+                break;
+            default:
+                break;
+            }
+            if (arg.target >= 0)
+                formatted_print(pyc_output, ",\"target\":%d", arg.target);
+        }
+        pyc_output.put('}');
+    }
+    pyc_output << "]";
+
+    pyc_output << ",\"lines\":[";
+    first = true;
+    for (const auto& entry : code->lineTableEntries(mod)) {
+        formatted_print(pyc_output, "%s[%d,%d,", first ? "" : ",",
+                        entry.start_offset, entry.end_offset);
+        if (entry.line < 0)
+            pyc_output << "null]";
+        else
+            pyc_output << entry.line << "]";
+        first = false;
+    }
+    pyc_output << "]";
+
+    pyc_output << ",\"exceptions\":[";
+    first = true;
+    for (const auto& entry : code->exceptionTableEntries()) {
+        formatted_print(pyc_output, "%s{\"start\":%d,\"end\":%d,\"target\":%d,"
+                        "\"depth\":%d,\"lasti\":%s}", first ? "" : ",",
+                        entry.start_offset, entry.end_offset, entry.target,
+                        entry.stack_depth, entry.push_lasti ? "true" : "false");
+        first = false;
+    }
+    pyc_output << "]}";
+}
+
+void output_json(PycModule* mod, const char* dispname, bool ndjson,
+                 unsigned flags, PycOutput& pyc_output)
+{
+    pyc_output << (ndjson ? "{\"type\":\"module\",\"file\":" : "{\"file\":");
+    json_string(pyc_output, std::string(dispname));
+    formatted_print(pyc_output, ",\"version\":\"%d.%d\",\"unicode\":%s",
+                    mod->majorVer(), mod->minorVer(),
+                    (mod->majorVer() < 3 && mod->isUnicode()) ? "true" : "false");
+    pyc_output << (ndjson ? "}\n" : ",\"code\":[\n");
+
+    std::deque<std::pair<PycRef<PycCode>, int>> pending;
+    std::unordered_map<PycCode*, int> ids;
+    ConstRepr const_repr;
+    if (mod->code() != NULL) {
+        ids.emplace((PycCode*)mod->code(), 0);
+        pending.emplace_back(mod->code(), -1);
+    }
+
+    // Breadth first, so ids are assigned in the order records are written
+    int id = 0;
+    while (!pending.empty()) {
+        PycRef<PycCode> code = pending.front().first;
+        int parent = pending.front().second;
+        pending.pop_front();
+        if (!ndjson && id != 0)
+            pyc_output << ",\n";
+        json_code(code, id++, parent, mod, flags, pending, ids, const_repr, pyc_output);
+        if (ndjson)
+            pyc_output.put('\n');
+    }
+
+    if (!ndjson)
+        pyc_output << "\n]}\n";
+}
+
+static_assert(sizeof(PycIRHeader) == 152, "PycIRHeader layout changed");
+static_assert(sizeof(PycIRCode) == 112, "PycIRCode layout changed");
+static_assert(sizeof(PycIRConst) == 16, "PycIRConst layout changed");
+static_assert(sizeof(PycIRInstruction) == 24, "PycIRInstruction layout changed");
+static_assert(sizeof(PycIRLine) == 12, "PycIRLine layout changed");
+static_assert(sizeof(PycIRException) == 20, "PycIRException layout changed");
+
+/* The sections of a binary disassembly, built up in memory */
+class IRBuilder {
+public:
+    uint32_t string(const std::string& text)
+    {
+        auto inserted = m_stringIds.emplace(text, (uint32_t)m_strings.size());
+        if (inserted.second) {
+            PycIRString entry;
+            entry.offset = (uint32_t)m_stringData.size();
+            entry.length = (uint32_t)text.size();
+            m_strings.push_back(entry);
+            m_stringData.append(text);
+            m_stringData.push_back('\0');
+        }
+        return inserted.first->second;
+    }
+
+    uint32_t string(PycRef<PycString> str)
+    {
+        return (str == NULL) ? PYCIR_NONE : string(str->strValue());
+    }
+
+    PycIRRange names(PycRef<PycSequence> names)
+    {
+        PycIRRange range = { (uint32_t)m_names.size(), 0 };
+        for (int i = 0; names != NULL && i < names->size(); ++i)
+            m_names.push_back(string(names->get(i).try_cast<PycString>()));
+        range.count = (uint32_t)m_names.size() - range.first;
+        return range;
+    }
+
+    void write(PycModule* mod, PycOutput& pyc_output) const;
+
+    std::vector<PycIRString> m_strings;
+    std::string m_stringData;
+    std::vector<uint32_t> m_names;
+    std::vector<PycIRConst> m_consts;
+    std::vector<PycIRCode> m_codes;
+    std::vector<PycIRInstruction> m_instructions;
+    std::vector<PycIRLine> m_lines;
+    std::vector<PycIRException> m_exceptions;
+
+private:
+    std::unordered_map<std::string, uint32_t> m_stringIds;
+};
+
+template <class T>
+static void ir_section(PycIRSection& section, const std::vector<T>& records,
+                       uint64_t& offset)
+{
+    section.offset = offset;
+    section.count = records.size();
+    offset = (offset + records.size() * sizeof(T) + 7) & ~uint64_t(7);
+}
+
+template <class T>
+static void ir_write(PycOutput& pyc_output, const T* data, size_t count)
+{
+    static const char padding[8] = { };
+    size_t bytes = count * sizeof(T);
+    pyc_output.write(reinterpret_cast<const char*>(data), bytes);
+    pyc_output.write(padding, (8 - (bytes & 7)) & 7);
+}
+
+void IRBuilder::write(PycModule* mod, PycOutput& pyc_output) const
+{
+    PycIRHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PYCIR_MAGIC, sizeof(header.magic));
+    header.version = PYCIR_VERSION;
+    header.header_size = sizeof(header);
+    header.py_major = (uint16_t)mod->majorVer();
+    header.py_minor = (uint16_t)mod->minorVer();
+    if (mod->majorVer() < 3 && mod->isUnicode())
+        header.flags |= PYCIR_FLAG_UNICODE;
+
+    uint64_t offset = sizeof(header);
+    ir_section(header.strings, m_strings, offset);
+    header.string_data.offset = offset;
+    header.string_data.count = m_stringData.size();
+    offset = (offset + m_stringData.size() + 7) & ~uint64_t(7);
+    ir_section(header.names, m_names, offset);
+    ir_section(header.consts, m_consts, offset);
+    ir_section(header.codes, m_codes, offset);
+    ir_section(header.instructions, m_instructions, offset);
+    ir_section(header.lines, m_lines, offset);
+    ir_section(header.exceptions, m_exceptions, offset);
+
+    ir_write(pyc_output, &header, 1);
+    ir_write(pyc_output, m_strings.data(), m_strings.size());
+    ir_write(pyc_output, m_stringData.data(), m_stringData.size());
+    ir_write(pyc_output, m_names.data(), m_names.size());
+    ir_write(pyc_output, m_consts.data(), m_consts.size());
+    ir_write(pyc_output, m_codes.data(), m_codes.size());
+    ir_write(pyc_output, m_instructions.data(), m_instructions.size());
+    ir_write(pyc_output, m_lines.data(), m_lines.size());
+    ir_write(pyc_output, m_exceptions.data(), m_exceptions.size());
+}
+
+static void ir_code(PycRef<PycCode> code, uint32_t parent, PycModule* mod,
+                    unsigned flags, std::deque<std::pair<PycRef<PycCode>, int>>& pending,
+                    std::unordered_map<PycCode*, int>& ids, ConstRepr& const_repr,
+                    IRBuilder& ir)
+{
+    PycIRCode record;
+    memset(&record, 0, sizeof(record));
+    record.name = ir.string(code->name());
+    record.qualname = (mod->verCompare(3, 11) >= 0) ? ir.string(code->qualName()) : PYCIR_NONE;
+    record.filename = ir.string(code->fileName());
+    record.parent = parent;
+    record.first_line = code->firstLine();
+    record.arg_count = code->argCount();
+    record.pos_only_arg_count = code->posOnlyArgCount();
+    record.kw_only_arg_count = code->kwOnlyArgCount();
+    record.num_locals = code->numLocals();
+    record.stack_size = code->stackSize();
+    record.flags = code->flags();
+    if (mod->verCompare(3, 8) < 0) {
+        // Remap flags back to the value stored in the PyCode object
+        record.flags = (record.flags & 0xFFFF) | ((record.flags & 0xFFF00000) >> 4);
+    }
+    record.code_size = (uint32_t)code->code()->length();
+    record.names = ir.names(code->names());
+    record.var_names = ir.names(code->localNames());
+    record.free_vars = ir.names(code->freeVars());
+    record.cell_vars = ir.names(code->cellVars());
+
+    record.consts.first = (uint32_t)ir.m_consts.size();
+    for (int i = 0; i < code->consts()->size(); ++i) {
+        PycRef<PycObject> obj = code->consts()->get(i);
+        PycIRConst entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = (uint16_t)((obj == NULL) ? (int)PycObject::TYPE_NULL : obj->type());
+        entry.repr = PYCIR_NONE;
+        entry.code = PYCIR_NONE;
+        if (obj != NULL) {
+            if (obj->type() == PycObject::TYPE_CODE || obj->type() == PycObject::TYPE_CODE2) {
+                PycRef<PycCode> child = obj.cast<PycCode>();
+                auto inserted = ids.emplace((PycCode*)child, (int)ids.size());
+                if (inserted.second)
+                    pending.emplace_back(child, (int)ir.m_codes.size());
+                entry.code = (uint32_t)inserted.first->second;
+            }
+            entry.repr = ir.string(const_repr.repr(obj, mod));
+        }
+        ir.m_consts.push_back(entry);
+    }
+    record.consts.count = (uint32_t)ir.m_consts.size() - record.consts.first;
+
+    record.instructions.first = (uint32_t)ir.m_instructions.size();
+    PycBuffer source(code->code()->value(), code->code()->length());
+    PycOperand arg;
+    int opcode, operand;
+    int pos = 0;
+    while (!source.atEof()) {
+        PycIRInstruction insn;
+        memset(&insn, 0, sizeof(insn));
+        insn.offset = (uint32_t)pos;
+        bc_next(source, mod, opcode, operand, pos);
+        if (opcode == Pyc::CACHE && (flags & Pyc::DISASM_SHOW_CACHES) == 0)
+            continue;
+
+        insn.opname = ir.string(std::string(Pyc::OpcodeName(opcode)));
+        insn.argrepr = PYCIR_NONE;
+        insn.target = -1;
+        insn.kind = PycIRInstruction::NO_ARG;
+        if (opcode >= Pyc::PYC_HAVE_ARG) {
+            bc_operand(code, mod, opcode, operand, pos, arg);
+            insn.arg = operand;
+            insn.target = arg.target;
+            switch (arg.kind) {
+            case PycOperand::PLAIN:
+                insn.kind = PycIRInstruction::PLAIN;
+                break;
+            case PycOperand::CONST:
+                insn.kind = PycIRInstruction::CONST;
+                insn.argrepr = ir.string(const_repr.repr(code->getConst(operand), mod));
+                break;
+            case PycOperand::NAME:
+                insn.kind = PycIRInstruction::NAME;
+                insn.argrepr = ir.string(arg.text);
+                break;
+            case PycOperand::JUMP:
+                insn.kind = PycIRInstruction::JUMP;
+                break;
+            case PycOperand::DESC:
+                insn.kind = PycIRInstruction::DESC;
+                insn.argrepr = ir.string(arg.text);
+                break;
+            case PycOperand::INVALID:
+                insn.kind = PycIRInstruction::INVALID;
+                break;
+            }
+        }
+        ir.m_instructions.push_back(insn);
+    }
+    record.instructions.count = (uint32_t)ir.m_instructions.size() - record.instructions.first;
+
+    record.lines.first = (uint32_t)ir.m_lines.size();
+    for (const auto& entry : code->lineTableEntries(mod)) {
+        PycIRLine line = { (uint32_t)entry.start_offset, (uint32_t)entry.end_offset,
+                           entry.line };
+        ir.m_lines.push_back(line);
+    }
+    record.lines.count = (uint32_t)ir.m_lines.size() - record.lines.first;
+
+    record.exceptions.first = (uint32_t)ir.m_exceptions.size();
+    for (const auto& entry : code->exceptionTableEntries()) {
+        PycIRException exc = { (uint32_t)entry.start_offset, (uint32_t)entry.end_offset,
+                               (uint32_t)entry.target, (uint32_t)entry.stack_depth,
+                               entry.push_lasti ? 1u : 0u };
+        ir.m_exceptions.push_back(exc);
+    }
+    record.exceptions.count = (uint32_t)ir.m_exceptions.size() - record.exceptions.first;
+
+    ir.m_codes.push_back(record);
+}
+
+void output_ir(PycModule* mod, unsigned flags, PycOutput& pyc_output)
+{
+    std::deque<std::pair<PycRef<PycCode>, int>> pending;
+    std::unordered_map<PycCode*, int> ids;
+    ConstRepr const_repr;
+    IRBuilder ir;
+    if (mod->code() != NULL) {
+        ids.emplace((PycCode*)mod->code(), 0);
+        pending.emplace_back(mod->code(), -1);
+    }
+
+    // Numbered breadth first, as for output_json()
+    while (!pending.empty()) {
+        PycRef<PycCode> code = pending.front().first;
+        int parent = pending.front().second;
+        pending.pop_front();
+        ir_code(code, (parent < 0) ? PYCIR_NONE : (uint32_t)parent, mod, flags,
+                pending, ids, const_repr, ir);
+    }
+    ir.write(mod, pyc_output);
+}
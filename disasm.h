@@ -0,0 +1,25 @@
+#ifndef _PYC_DISASM_H
+#define _PYC_DISASM_H
+
+#include "pyc_module.h"
+
+/* Print a disassembly of obj and everything it contains, as shown by
+ * pycdas.  flags is a combination of Pyc::DisassemblyFlags. */
+void output_object(PycRef<PycObject> obj, PycModule* mod, int indent,
+                   unsigned flags, PycOutput& pyc_output);
+
+/* Write mod as JSON for pycdas --format=json, or as newline-delimited JSON
+ * (one module record, then one record per code object) for ndjson.  Each
+ * code object is written as it is visited, so the output is not held in
+ * memory.  Records contain the code object's fields, its constants, its
+ * decoded instructions with their argument reprs and jump targets, its line
+ * ranges and its exception table.  Nested code objects are numbered in the
+ * order they are written, and refer to their parent by number. */
+void output_json(PycModule* mod, const char* dispname, bool ndjson,
+                 unsigned flags, PycOutput& pyc_output);
+
+/* Write mod in the binary format described in pyc_ir.h, for pycdas
+ * --format=bin.  Code objects are numbered as for output_json(). */
+void output_ir(PycModule* mod, unsigned flags, PycOutput& pyc_output);
+
+#endif
@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include "libpycdc.h"
+#include "ASTree.h"
+#include "disasm.h"
+#include "bytecode.h"
+
+struct pycdc_context {
+    std::unique_ptr<PycModule> mod;
+    bool strictUnicode = false;
+    bool decimalLongs = false;
+    unsigned disasmFlags = 0;
+    DecompileBudget budget;
+    bool streaming = false;
+
+    // Diagnostics are captured in a temporary file, reused for every call
+    FILE* errors = nullptr;
+
+    std::string message;
+    std::string diagnostics;
+    pycdc_error error = { PYCDC_OK, "", "" };
+
+    ~pycdc_context()
+    {
+        if (errors)
+            fclose(errors);
+    }
+};
+
+/* Forwards output to a pycdc_write_fn.  Once the callback asks to stop,
+ * writes fail, which leaves the stream bad and discards further output. */
+class CallbackBuf : public std::streambuf {
+public:
+    CallbackBuf(pycdc_write_fn write, void* user_data)
+        : m_write(write), m_userData(user_data), m_aborted(false) { }
+
+    bool aborted() const { return m_aborted; }
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize count) override
+    {
+        if (m_aborted)
+            return 0;
+        if (count > 0 && m_write(m_userData, data, (size_t)count) != 0) {
+            m_aborted = true;
+            return 0;
+        }
+        return count;
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char value = traits_type::to_char_type(ch);
+        return xsputn(&value, 1) == 1 ? ch : traits_type::eof();
+    }
+
+private:
+    pycdc_write_fn m_write;
+    void* m_userData;
+    bool m_aborted;
+};
+
+/* Writes into a fixed caller buffer, counting everything that didn't fit */
+class FixedBuf : public std::streambuf {
+public:
+    FixedBuf(char* buffer, size_t size) : m_buffer(buffer), m_size(size), m_length(0) { }
+
+    size_t length() const { return m_length; }
+
+    /* NUL-terminate the output if there is room; returns false if the
+     * output was truncated */
+    bool finish()
+    {
+        if (m_length < m_size) {
+            m_buffer[m_length] = 0;
+            return true;
+        }
+        return false;
+    }
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize count) override
+    {
+        if (m_length < m_size) {
+            size_t copy = std::min<size_t>((size_t)count, m_size - m_length);
+            memcpy(m_buffer + m_length, data, copy);
+        }
+        m_length += (size_t)count;
+        return count;
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char value = traits_type::to_char_type(ch);
+        xsputn(&value, 1);
+        return ch;
+    }
+
+private:
+    char* m_buffer;
+    size_t m_size, m_length;
+};
+
+/* Sets up a call on a context: a private decompiler state, diagnostics
+ * captured into the context, and the result recorded on return */
+class CallScope {
+public:
+    explicit CallScope(pycdc_context* ctx)
+        : m_ctx(ctx), m_prevErrors(pyc_error_stream()), m_prevBudget(decompile_budget()),
+          m_prevStreaming(decompile_streaming()), m_prevStreamBatch(decompile_stream_batch())
+    {
+        set_decompile_budget(m_ctx->budget);
+        set_decompile_streaming(m_ctx->streaming);
+        m_ctx->message.clear();
+        m_ctx->diagnostics.clear();
+        if (!m_ctx->errors)
+            m_ctx->errors = tmpfile();
+        if (m_ctx->errors) {
+            rewind(m_ctx->errors);
+            set_pyc_error_stream(m_ctx->errors);
+        }
+    }
+
+    ~CallScope()
+    {
+        set_pyc_error_stream(m_prevErrors);
+        set_decompile_budget(m_prevBudget);
+        set_decompile_streaming(m_prevStreaming, m_prevStreamBatch);
+    }
+
+    pycdc_status finish(pycdc_status status, const char* message = nullptr)
+    {
+        if (message)
+            m_ctx->message = message;
+        if (m_ctx->errors) {
+            fflush(m_ctx->errors);
+            long end = ftell(m_ctx->errors);
+            if (end > 0) {
+                m_ctx->diagnostics.resize((size_t)end);
+                rewind(m_ctx->errors);
+                m_ctx->diagnostics.resize(fread(&m_ctx->diagnostics[0], 1, (size_t)end,
+                                                m_ctx->errors));
+            }
+        }
+        m_ctx->error.status = status;
+        m_ctx->error.message = m_ctx->message.c_str();
+        m_ctx->error.diagnostics = m_ctx->diagnostics.c_str();
+        return status;
+    }
+
+private:
+    pycdc_context* m_ctx;
+    FILE* m_prevErrors;
+    DecompileBudget m_prevBudget;
+    bool m_prevStreaming;
+    size_t m_prevStreamBatch;
+    DecompileScope m_decompileScope;
+};
+
+typedef void (*load_fn)(PycModule& mod, const void* data, int size, int major, int minor);
+
+static pycdc_status load_module(pycdc_context* ctx, const void* data, size_t size,
+                                int major, int minor, load_fn load)
+{
+    if (!ctx)
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    CallScope call(ctx);
+    ctx->mod.reset();
+    if (!data || size > INT_MAX)
+        return call.finish(PYCDC_ERR_INVALID_ARGUMENT, "Invalid input buffer");
+
+    try {
+        std::unique_ptr<PycModule> mod(new PycModule);
+        mod->setStrictUnicode(ctx->strictUnicode);
+        mod->setDecimalLongs(ctx->decimalLongs);
+        load(*mod, data, (int)size, major, minor);
+        if (!mod->isValid())
+            return call.finish(PYCDC_ERR_BAD_MAGIC, "Bad magic number");
+        ctx->mod = std::move(mod);
+    } catch (std::bad_alloc&) {
+        return call.finish(PYCDC_ERR_OUT_OF_MEMORY, "Out of memory");
+    } catch (std::exception& ex) {
+        return call.finish(PYCDC_ERR_LOAD, ex.what());
+    } catch (...) {
+        return call.finish(PYCDC_ERR_LOAD, "Unknown error");
+    }
+    return call.finish(PYCDC_OK);
+}
+
+typedef void (*output_fn)(pycdc_context* ctx, PycOutput& pyc_output);
+
+static void output_decompiled(pycdc_context* ctx, PycOutput& pyc_output)
+{
+    decompyle(ctx->mod->code(), ctx->mod.get(), pyc_output);
+}
+
+static void output_disassembly(pycdc_context* ctx, PycOutput& pyc_output)
+{
+    output_object(ctx->mod->code().try_cast<PycObject>(), ctx->mod.get(), 0,
+                  ctx->disasmFlags, pyc_output);
+}
+
+static pycdc_status produce_output(pycdc_context* ctx, std::streambuf* buf, output_fn output)
+{
+    if (!ctx)
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    CallScope call(ctx);
+    if (!ctx->mod)
+        return call.finish(PYCDC_ERR_NO_MODULE, "No module loaded");
+
+    try {
+        std::ostream stream(buf);
+        PycOutput pyc_output(stream);
+        output(ctx, pyc_output);
+        pyc_output.flush();
+    } catch (std::bad_alloc&) {
+        return call.finish(PYCDC_ERR_OUT_OF_MEMORY, "Out of memory");
+    } catch (std::exception& ex) {
+        return call.finish(PYCDC_ERR_DECOMPILE, ex.what());
+    } catch (...) {
+        return call.finish(PYCDC_ERR_DECOMPILE, "Unknown error");
+    }
+    return call.finish(PYCDC_OK);
+}
+
+static pycdc_status output_to_callback(pycdc_context* ctx, pycdc_write_fn write,
+                                       void* user_data, output_fn output)
+{
+    if (!write)
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    CallbackBuf buf(write, user_data);
+    pycdc_status status = produce_output(ctx, &buf, output);
+    if (status == PYCDC_OK && buf.aborted()) {
+        ctx->message = "Output aborted by callback";
+        ctx->error.status = PYCDC_ERR_ABORTED;
+        ctx->error.message = ctx->message.c_str();
+        return PYCDC_ERR_ABORTED;
+    }
+    return status;
+}
+
+static pycdc_status output_to_buffer(pycdc_context* ctx, char* buffer, size_t size,
+                                     size_t* length, output_fn output)
+{
+    if (!buffer && size != 0)
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    FixedBuf buf(buffer, size);
+    pycdc_status status = produce_output(ctx, &buf, output);
+    if (length)
+        *length = buf.length();
+    if (status == PYCDC_OK && !buf.finish()) {
+        ctx->message = "Output buffer too small";
+        ctx->error.status = PYCDC_ERR_BUFFER_TOO_SMALL;
+        ctx->error.message = ctx->message.c_str();
+        return PYCDC_ERR_BUFFER_TOO_SMALL;
+    }
+    return status;
+}
+
+int pycdc_api_version(void)
+{
+    return PYCDC_API_VERSION;
+}
+
+const char* pycdc_status_string(pycdc_status status)
+{
+    switch (status) {
+    case PYCDC_OK:
+        return "Success";
+    case PYCDC_ERR_INVALID_ARGUMENT:
+        return "Invalid argument";
+    case PYCDC_ERR_NO_MODULE:
+        return "No module loaded";
+    case PYCDC_ERR_BAD_MAGIC:
+        return "Bad magic number";
+    case PYCDC_ERR_UNSUPPORTED_VERSION:
+        return "Unsupported Python version";
+    case PYCDC_ERR_LOAD:
+        return "Error loading module";
+    case PYCDC_ERR_DECOMPILE:
+        return "Error decompiling module";
+    case PYCDC_ERR_BUFFER_TOO_SMALL:
+        return "Output buffer too small";
+    case PYCDC_ERR_ABORTED:
+        return "Output aborted by callback";
+    case PYCDC_ERR_OUT_OF_MEMORY:
+        return "Out of memory";
+    }
+    return "Unknown status";
+}
+
+pycdc_context* pycdc_context_create(void)
+{
+    return new (std::nothrow) pycdc_context;
+}
+
+void pycdc_context_destroy(pycdc_context* ctx)
+{
+    delete ctx;
+}
+
+pycdc_status pycdc_set_option(pycdc_context* ctx, pycdc_option option, int value)
+{
+    if (!ctx)
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    switch (option) {
+    case PYCDC_OPT_STRICT_UNICODE:
+        ctx->strictUnicode = (value != 0);
+        break;
+    case PYCDC_OPT_DECIMAL_LONGS:
+        ctx->decimalLongs = (value != 0);
+        break;
+    case PYCDC_OPT_DISASM_FLAGS:
+        if ((value & ~(PYCDC_DISASM_PYCODE_VERBOSE | PYCDC_DISASM_SHOW_CACHES)) != 0)
+            return PYCDC_ERR_INVALID_ARGUMENT;
+        ctx->disasmFlags = (unsigned)value;
+        break;
+    case PYCDC_OPT_BUDGET_STEPS:
+    case PYCDC_OPT_BUDGET_NODES:
+    case PYCDC_OPT_BUDGET_TIME_MS:
+        if (value < 0)
+            return PYCDC_ERR_INVALID_ARGUMENT;
+        if (option == PYCDC_OPT_BUDGET_STEPS)
+            ctx->budget.max_steps = (unsigned long)value;
+        else if (option == PYCDC_OPT_BUDGET_NODES)
+            ctx->budget.max_nodes = (unsigned long)value;
+        else
+            ctx->budget.max_time_ms = (unsigned long)value;
+        break;
+    case PYCDC_OPT_STREAM:
+        ctx->streaming = (value != 0);
+        break;
+    default:
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    }
+
+    // The module options are also used when printing
+    if (ctx->mod) {
+        ctx->mod->setStrictUnicode(ctx->strictUnicode);
+        ctx->mod->setDecimalLongs(ctx->decimalLongs);
+    }
+    return PYCDC_OK;
+}
+
+pycdc_status pycdc_load(pycdc_context* ctx, const void* data, size_t size)
+{
+    return load_module(ctx, data, size, 0, 0,
+            [](PycModule& mod, const void* buffer, int length, int, int) {
+                mod.loadFromBuffer(buffer, length);
+            });
+}
+
+pycdc_status pycdc_load_marshalled(pycdc_context* ctx, const void* data, size_t size,
+                                   int major, int minor)
+{
+    if (ctx && !PycModule::isSupportedVersion(major, minor)) {
+        CallScope call(ctx);
+        ctx->mod.reset();
+        return call.finish(PYCDC_ERR_UNSUPPORTED_VERSION, "Unsupported Python version");
+    }
+    return load_module(ctx, data, size, major, minor,
+            [](PycModule& mod, const void* buffer, int length, int maj, int min) {
+                mod.loadFromMarshalledBuffer(buffer, length, maj, min);
+            });
+}
+
+pycdc_status pycdc_python_version(const pycdc_context* ctx, int* major, int* minor)
+{
+    if (!ctx || !major || !minor)
+        return PYCDC_ERR_INVALID_ARGUMENT;
+    if (!ctx->mod)
+        return PYCDC_ERR_NO_MODULE;
+    *major = ctx->mod->majorVer();
+    *minor = ctx->mod->minorVer();
+    return PYCDC_OK;
+}
+
+pycdc_status pycdc_decompile(pycdc_context* ctx, pycdc_write_fn write, void* user_data)
+{
+    return output_to_callback(ctx, write, user_data, output_decompiled);
+}
+
+pycdc_status pycdc_disassemble(pycdc_context* ctx, pycdc_write_fn write, void* user_data)
+{
+    return output_to_callback(ctx, write, user_data, output_disassembly);
+}
+
+pycdc_status pycdc_decompile_to_buffer(pycdc_context* ctx, char* buffer, size_t size,
+                                       size_t* length)
+{
+    return output_to_buffer(ctx, buffer, size, length, output_decompiled);
+}
+
+pycdc_status pycdc_disassemble_to_buffer(pycdc_context* ctx, char* buffer, size_t size,
+                                         size_t* length)
+{
+    return output_to_buffer(ctx, buffer, size, length, output_disassembly);
+}
+
+const pycdc_error* pycdc_last_error(const pycdc_context* ctx)
+{
+    return ctx ? &ctx->error : nullptr;
+}
@@ -0,0 +1,142 @@
+/* libpycdc: C interface to the Decompyle++ decompiler and disassembler.
+ *
+ * All state lives in a pycdc_context.  A context may only be used by one
+ * thread at a time, but any number of contexts can be used concurrently
+ * from different threads.  Output callbacks may safely call back into the
+ * library with a different context.
+ *
+ * Typical use:
+ *
+ *     pycdc_context* ctx = pycdc_context_create();
+ *     if (pycdc_load(ctx, data, size) == PYCDC_OK)
+ *         pycdc_decompile(ctx, write_fn, user_data);
+ *     else
+ *         fprintf(stderr, "%s\n", pycdc_last_error(ctx)->message);
+ *     pycdc_context_destroy(ctx);
+ */
+
+#ifndef _LIBPYCDC_H
+#define _LIBPYCDC_H
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(PYCDC_BUILDING)
+#  define PYCDC_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(PYCDC_SHARED)
+#  define PYCDC_API __declspec(dllimport)
+#elif defined(__GNUC__) && defined(PYCDC_BUILDING)
+#  define PYCDC_API __attribute__((visibility("default")))
+#else
+#  define PYCDC_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented for incompatible changes to this interface */
+#define PYCDC_API_VERSION 1
+
+typedef struct pycdc_context pycdc_context;
+
+typedef enum pycdc_status {
+    PYCDC_OK = 0,
+    PYCDC_ERR_INVALID_ARGUMENT,     /* NULL pointer, bad option or oversized input */
+    PYCDC_ERR_NO_MODULE,            /* Nothing has been loaded into the context */
+    PYCDC_ERR_BAD_MAGIC,            /* Not a .pyc file, or an unknown Python version */
+    PYCDC_ERR_UNSUPPORTED_VERSION,  /* Python version not supported for raw code objects */
+    PYCDC_ERR_LOAD,                 /* Malformed or truncated marshal data */
+    PYCDC_ERR_DECOMPILE,            /* The decompiler or disassembler failed */
+    PYCDC_ERR_BUFFER_TOO_SMALL,     /* Output was truncated to fit the buffer */
+    PYCDC_ERR_ABORTED,              /* The output callback asked to stop */
+    PYCDC_ERR_OUT_OF_MEMORY,
+} pycdc_status;
+
+typedef struct pycdc_error {
+    pycdc_status status;
+
+    /* Description of the failure, or "" on success */
+    const char* message;
+
+    /* Warnings printed while loading or decompiling (e.g. unsupported
+     * opcodes), which pycdc would show on stderr, or "".  These may be
+     * set even when the call succeeded. */
+    const char* diagnostics;
+} pycdc_error;
+
+typedef enum pycdc_option {
+    PYCDC_OPT_STRICT_UNICODE,   /* Reject invalid UTF-8 strings (0 or 1) */
+    PYCDC_OPT_DECIMAL_LONGS,    /* Print long integers in decimal (0 or 1) */
+    PYCDC_OPT_DISASM_FLAGS,     /* PYCDC_DISASM_* flags for pycdc_disassemble */
+
+    /* Limits on the work done to decompile each function (0 for none, the
+     * default).  Functions over budget are printed as stubs marked
+     * "# WARNING: Decompyle incomplete", with the reason in the
+     * diagnostics, and the call still succeeds. */
+    PYCDC_OPT_BUDGET_STEPS,     /* Instructions processed */
+    PYCDC_OPT_BUDGET_NODES,     /* AST nodes created */
+    PYCDC_OPT_BUDGET_TIME_MS,   /* Wall time in milliseconds */
+
+    /* Deliver the source of module and class bodies a statement at a time
+     * as it is decompiled, rather than once each body is complete, which
+     * uses less memory for very large modules (0 or 1) */
+    PYCDC_OPT_STREAM,
+} pycdc_option;
+
+#define PYCDC_DISASM_PYCODE_VERBOSE 0x1     /* Show extra code object fields */
+#define PYCDC_DISASM_SHOW_CACHES    0x2     /* Show CACHE instructions (3.11+) */
+
+/* Receives output in chunks.  Return 0 to continue, or nonzero to discard
+ * the rest of the output and fail the call with PYCDC_ERR_ABORTED. */
+typedef int (*pycdc_write_fn)(void* user_data, const char* data, size_t size);
+
+/* PYCDC_API_VERSION of the library, to check it against the header */
+PYCDC_API int pycdc_api_version(void);
+PYCDC_API const char* pycdc_status_string(pycdc_status status);
+
+/* Returns NULL if out of memory */
+PYCDC_API pycdc_context* pycdc_context_create(void);
+PYCDC_API void pycdc_context_destroy(pycdc_context* ctx);
+
+/* Options apply to subsequent loads and output calls */
+PYCDC_API pycdc_status pycdc_set_option(pycdc_context* ctx, pycdc_option option, int value);
+
+/* Load a complete .pyc file image, replacing any previously loaded module.
+ * The data is not referenced after the call returns. */
+PYCDC_API pycdc_status pycdc_load(pycdc_context* ctx, const void* data, size_t size);
+
+/* Load a bare marshalled code object (no .pyc header) for the given
+ * Python version */
+PYCDC_API pycdc_status pycdc_load_marshalled(pycdc_context* ctx, const void* data,
+                                             size_t size, int major, int minor);
+
+/* Python version of the loaded module */
+PYCDC_API pycdc_status pycdc_python_version(const pycdc_context* ctx, int* major, int* minor);
+
+/* Decompile the loaded module to Python source */
+PYCDC_API pycdc_status pycdc_decompile(pycdc_context* ctx, pycdc_write_fn write,
+                                       void* user_data);
+
+/* Disassemble the loaded module, in the same format as pycdas */
+PYCDC_API pycdc_status pycdc_disassemble(pycdc_context* ctx, pycdc_write_fn write,
+                                         void* user_data);
+
+/* Buffer variants of the above.  The output is NUL-terminated if there is
+ * room, and *length receives the full output length excluding the NUL.
+ * If the output does not fit, as much as fits is written and
+ * PYCDC_ERR_BUFFER_TOO_SMALL is returned; call again with a buffer of at
+ * least *length + 1 bytes.  length may be NULL. */
+PYCDC_API pycdc_status pycdc_decompile_to_buffer(pycdc_context* ctx, char* buffer,
+                                                 size_t size, size_t* length);
+PYCDC_API pycdc_status pycdc_disassemble_to_buffer(pycdc_context* ctx, char* buffer,
+                                                   size_t size, size_t* length);
+
+/* Details of the most recent call on this context.  The strings remain
+ * valid until the next call on the context. */
+PYCDC_API const pycdc_error* pycdc_last_error(const pycdc_context* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,617 @@
+#include "pyc_cache.h"
+#include "data.h"
+#include "pyc_fs.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#  include <direct.h>
+#  include <process.h>
+#  include <sys/utime.h>
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <utime.h>
+#endif
+#ifdef __APPLE__
+#  include <mach-o/dyld.h>
+#endif
+
+/* Temporary files older than this are left over from a crashed writer */
+static const time_t STALE_TEMP_AGE = 3600;
+
+static const char ENTRY_MAGIC[] = "PYCCACHE2";
+
+/* ENTRY_MAGIC <output size> <diagnostics size>\n<output><diagnostics>, with
+ * the sizes padded so the header can be filled in once the output has been
+ * written after it */
+static const char ENTRY_HEADER[] = "%s %020llu %020llu\n";
+static const size_t ENTRY_HEADER_SIZE = sizeof(ENTRY_MAGIC) + 2 * 21;
+
+/* Hit and miss counts and the size of the cache, as little-endian 64-bit
+ * values.  The size is found by scanning the cache when it is trimmed, and
+ * each store adds to it, so a scan is only needed once the size passes the
+ * limit. */
+static const char COUNTERS_FILE[] = "counters";
+enum { COUNTER_HITS, COUNTER_MISSES, COUNTER_BYTES, COUNTER_COUNT };
+
+static bool make_directory(const std::string& path)
+{
+#ifdef _WIN32
+    int result = _mkdir(path.c_str());
+#else
+    int result = mkdir(path.c_str(), 0777);
+#endif
+    return result == 0 || errno == EEXIST;
+}
+
+static bool stat_file(const std::string& path, unsigned long long& size, time_t& mtime,
+                      bool& is_dir)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    size = (unsigned long long)st.st_size;
+    mtime = st.st_mtime;
+    is_dir = (st.st_mode & S_IFMT) == S_IFDIR;
+    return true;
+}
+
+/* Rename over an existing file, atomically where the platform allows */
+static bool replace_file(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+static std::string executable_path(const char* argv0)
+{
+#if defined(_WIN32)
+    char path[MAX_PATH];
+    DWORD length = GetModuleFileNameA(nullptr, path, sizeof(path));
+    if (length > 0 && length < sizeof(path))
+        return path;
+#elif defined(__APPLE__)
+    char path[4096];
+    uint32_t size = sizeof(path);
+    if (_NSGetExecutablePath(path, &size) == 0)
+        return path;
+#else
+    if (access("/proc/self/exe", R_OK) == 0)
+        return "/proc/self/exe";
+#endif
+    return argv0 ? argv0 : "";
+}
+
+static std::string hex64(uint64_t value)
+{
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long)value);
+    return text;
+}
+
+/* XXH64 */
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read64(const unsigned char* p)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    return rotl64(acc, 31) * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxh_round(0, value);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t PycCache::hash(const void* data, size_t size, uint64_t seed)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        for ( ; end - p >= 32; p += 32) {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+    h += (uint64_t)size;
+
+    for ( ; end - p >= 8; p += 8)
+        h = rotl64(h ^ xxh_round(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+    if (end - p >= 4) {
+        h = rotl64(h ^ (read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for ( ; p < end; ++p)
+        h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool PycCache::readFile(const char* filename, std::string& contents)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+        return false;
+    contents.clear();
+    char buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.append(buffer, count);
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+bool PycCache::buildId(const char* argv0, uint64_t& id)
+{
+    std::string executable;
+    if (!readFile(executable_path(argv0).c_str(), executable))
+        return false;
+    id = hash(executable.data(), executable.size());
+    return true;
+}
+
+bool PycCache::open(const char* dir, unsigned long long max_size, const char* argv0)
+{
+    std::string path = dir;
+    while (path.size() > 1 && (path.back() == '/' || path.back() == '\\'))
+        path.pop_back();
+    if (path.empty() || !make_directory(path) || !buildId(argv0, m_buildId))
+        return false;
+
+    m_dir = path;
+    m_maxSize = max_size;
+    return true;
+}
+
+std::string PycCache::makeKey(const std::string& contents, const std::string& options) const
+{
+    return hex64(hash(contents.data(), contents.size()))
+            + hex64(hash(options.data(), options.size(), m_buildId));
+}
+
+std::string PycCache::entryPath(const std::string& key) const
+{
+    return m_dir + "/" + key.substr(0, 2) + "/" + key;
+}
+
+bool PycCache::lookup(const std::string& key, std::ostream& out, std::string& diagnostics)
+{
+    std::string path = entryPath(key);
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    // Check the whole entry is there before writing any of it
+    char header[ENTRY_HEADER_SIZE + 1];
+    unsigned long long output_size, diag_size, entry_size;
+    time_t mtime;
+    bool is_dir;
+    char magic[16];
+    if (!fgets(header, sizeof(header), file)
+            || sscanf(header, "%15s %llu %llu", magic, &output_size, &diag_size) != 3
+            || strcmp(magic, ENTRY_MAGIC) != 0
+            || !stat_file(path, entry_size, mtime, is_dir)
+            || entry_size != strlen(header) + output_size + diag_size) {
+        fclose(file);
+        return false;
+    }
+
+    char buffer[65536];
+    while (output_size > 0) {
+        size_t count = fread(buffer, 1, (size_t)std::min<unsigned long long>(output_size,
+                                                                             sizeof(buffer)),
+                             file);
+        if (count == 0)
+            break;
+        out.write(buffer, count);
+        output_size -= count;
+    }
+    diagnostics.resize((size_t)diag_size);
+    if (diag_size > 0)
+        diagnostics.resize(fread(&diagnostics[0], 1, diagnostics.size(), file));
+    fclose(file);
+
+    // Mark as recently used
+#ifdef _WIN32
+    _utime(path.c_str(), nullptr);
+#else
+    utime(path.c_str(), nullptr);
+#endif
+    return true;
+}
+
+/* A name for a temporary file to be renamed to filename, unique to this
+ * process and call */
+static std::string temp_path_for(const std::string& filename)
+{
+    static std::atomic<unsigned> s_serial(0);
+
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = (int)getpid();
+#endif
+    std::ostringstream temp_name;
+    temp_name << filename << '.' << pid << '.' << s_serial++ << ".tmp";
+    return temp_name.str();
+}
+
+bool PycCache::writeFile(const std::string& filename, const std::string& contents)
+{
+    std::string temp_path = temp_path_for(filename);
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file)
+        return false;
+    bool ok = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || !replace_file(temp_path, filename)) {
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Passes output through to another stream while writing it to a new cache
+ * entry, so that the output isn't held back until it is complete */
+class EntryWriter : public std::streambuf {
+public:
+    EntryWriter(const std::string& path, std::ostream& out)
+        : m_path(path), m_tempPath(temp_path_for(path)), m_out(out.rdbuf()),
+          m_file(fopen(m_tempPath.c_str(), "wb")), m_size()
+    {
+        // The header is written again once the sizes are known
+        if (m_file && !writeHeader(0, 0))
+            discard();
+    }
+
+    ~EntryWriter() { discard(); }
+
+    /* Adds the diagnostics and renames the entry into place */
+    bool commit(const std::string& diagnostics)
+    {
+        if (!m_file)
+            return false;
+        bool ok = fwrite(diagnostics.data(), 1, diagnostics.size(), m_file)
+                        == diagnostics.size()
+                && fseek(m_file, 0, SEEK_SET) == 0
+                && writeHeader(m_size, diagnostics.size());
+        ok = (fclose(m_file) == 0) && ok;
+        m_file = nullptr;
+        if (!ok || !replace_file(m_tempPath, m_path)) {
+            remove(m_tempPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    unsigned long long outputSize() const { return m_size; }
+
+    void discard()
+    {
+        if (m_file) {
+            fclose(m_file);
+            m_file = nullptr;
+            remove(m_tempPath.c_str());
+        }
+    }
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize count) override
+    {
+        if (m_file && fwrite(data, 1, (size_t)count, m_file) != (size_t)count)
+            discard();
+        m_size += (unsigned long long)count;
+        return m_out->sputn(data, count);
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char value = traits_type::to_char_type(ch);
+        return xsputn(&value, 1) == 1 ? ch : traits_type::eof();
+    }
+
+    int sync() override { return m_out->pubsync(); }
+
+private:
+    bool writeHeader(unsigned long long output_size, unsigned long long diag_size)
+    {
+        return fprintf(m_file, ENTRY_HEADER, ENTRY_MAGIC, output_size, diag_size)
+                == (int)ENTRY_HEADER_SIZE;
+    }
+
+    std::string m_path;
+    std::string m_tempPath;
+    std::streambuf* m_out;
+    FILE* m_file;
+    unsigned long long m_size;
+};
+
+static void decode_counters(const unsigned char* data,
+                            unsigned long long values[COUNTER_COUNT])
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        values[i] = 0;
+        for (int byte = 7; byte >= 0; --byte)
+            values[i] = (values[i] << 8) | data[i * 8 + byte];
+    }
+}
+
+typedef std::function<void(unsigned long long values[COUNTER_COUNT])> CounterUpdate;
+
+static void apply_update(unsigned char* data, const CounterUpdate& update)
+{
+    unsigned long long values[COUNTER_COUNT];
+    decode_counters(data, values);
+    update(values);
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        for (int byte = 0; byte < 8; ++byte)
+            data[i * 8 + byte] = (unsigned char)(values[i] >> (byte * 8));
+    }
+}
+
+/* Reads the counters file into values, applying update (if given) and
+ * writing them back while the file is locked against other processes.
+ * Files from before a counter was added read it as 0. */
+static bool update_counters(const std::string& path, unsigned long long values[COUNTER_COUNT],
+                            const CounterUpdate& update = CounterUpdate())
+{
+    // File locks don't exclude other threads of the same process
+    static std::mutex s_lock;
+    std::lock_guard<std::mutex> guard(s_lock);
+
+    unsigned char data[COUNTER_COUNT * 8] = { };
+    bool ok = false;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    OVERLAPPED range = { };
+    if (LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, sizeof(data), 0, &range)) {
+        DWORD count = 0;
+        ok = ReadFile(file, data, sizeof(data), &count, nullptr) != 0;
+        if (ok && update) {
+            apply_update(data, update);
+            ok = SetFilePointer(file, 0, nullptr, FILE_BEGIN) == 0
+                    && WriteFile(file, data, sizeof(data), &count, nullptr) != 0
+                    && count == sizeof(data);
+        }
+        UnlockFileEx(file, 0, sizeof(data), 0, &range);
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return false;
+    struct flock lock = { };
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLKW, &lock) == 0) {
+        // A new file reads as zeros
+        ok = pread(fd, data, sizeof(data), 0) >= 0;
+        if (ok && update) {
+            apply_update(data, update);
+            ok = pwrite(fd, data, sizeof(data), 0) == (ssize_t)sizeof(data);
+        }
+    }
+    close(fd);  // Also releases the lock
+#endif
+
+    decode_counters(data, values);
+    return ok;
+}
+
+void PycCache::count(bool hit)
+{
+    unsigned long long values[COUNTER_COUNT];
+    int counter = hit ? COUNTER_HITS : COUNTER_MISSES;
+    update_counters(m_dir + "/" + COUNTERS_FILE, values,
+                    [counter](unsigned long long* counts) { ++counts[counter]; });
+}
+
+struct CacheFile {
+    std::string path;
+    unsigned long long size;
+    time_t mtime;
+
+    bool operator<(const CacheFile& other) const { return mtime < other.mtime; }
+};
+
+/* Calls fn for each entry and temporary file in the cache */
+template <typename Fn>
+static void scan_cache(const std::string& dir, Fn fn)
+{
+    for (const std::string& subdir : list_directory(dir)) {
+        std::string subdir_path = dir + "/" + subdir;
+        if (subdir.size() != 2 || !is_directory(subdir_path))
+            continue;
+        for (const std::string& name : list_directory(subdir_path)) {
+            CacheFile file;
+            file.path = subdir_path + "/" + name;
+            bool is_dir;
+            if (stat_file(file.path, file.size, file.mtime, is_dir) && !is_dir)
+                fn(file, name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0);
+        }
+    }
+}
+
+void PycCache::evict()
+{
+    std::vector<CacheFile> entries;
+    unsigned long long total = 0;
+    time_t now = time(nullptr);
+    scan_cache(m_dir, [&](const CacheFile& file, bool is_temp) {
+        if (!is_temp) {
+            entries.push_back(file);
+            total += file.size;
+        } else if (now - file.mtime > STALE_TEMP_AGE) {
+            remove(file.path.c_str());
+        }
+    });
+
+    if (total > m_maxSize) {
+        // Trim to 90% of the limit, so we don't have to do this again right away
+        std::sort(entries.begin(), entries.end());
+        unsigned long long target = m_maxSize - m_maxSize / 10;
+        for (const auto& file : entries) {
+            if (total <= target)
+                break;
+            if (remove(file.path.c_str()) == 0)
+                total -= file.size;
+        }
+    }
+
+    unsigned long long values[COUNTER_COUNT];
+    update_counters(m_dir + "/" + COUNTERS_FILE, values,
+                    [total](unsigned long long* counts) { counts[COUNTER_BYTES] = total; });
+}
+
+int PycCache::run(const char* infile, const std::string& options, std::ostream& out,
+                  const Producer& produce, bool& hit)
+{
+    std::string contents;
+    if (!readFile(infile, contents))
+        return -1;
+
+    std::string key = makeKey(contents, options);
+    std::string diagnostics;
+    hit = lookup(key, out, diagnostics);
+    count(hit);
+
+    int status = 0;
+    if (!hit) {
+        std::string path = entryPath(key);
+        make_directory(path.substr(0, path.rfind('/')));
+        EntryWriter entry(path, out);
+        std::ostream entry_stream(&entry);
+
+        PycDiagnosticsCapture capture;
+        bool cacheable = true;
+        status = produce(contents, entry_stream, cacheable);
+        entry_stream.flush();
+        bool captured = capture.isCapturing();
+        diagnostics = capture.finish();
+        if (status == 0 && captured && cacheable && entry.commit(diagnostics)) {
+            unsigned long long size = ENTRY_HEADER_SIZE + entry.outputSize()
+                    + diagnostics.size();
+            unsigned long long values[COUNTER_COUNT];
+            if (update_counters(m_dir + "/" + COUNTERS_FILE, values,
+                        [size](unsigned long long* counts) { counts[COUNTER_BYTES] += size; })
+                    && values[COUNTER_BYTES] > m_maxSize)
+                evict();
+        }
+    }
+
+    out.flush();
+    fputs(diagnostics.c_str(), pyc_error_stream());
+    return status;
+}
+
+PycCacheStats PycCache::stats() const
+{
+    PycCacheStats stats = { };
+    unsigned long long values[COUNTER_COUNT];
+    if (update_counters(m_dir + "/" + COUNTERS_FILE, values)) {
+        stats.hits = values[COUNTER_HITS];
+        stats.misses = values[COUNTER_MISSES];
+    }
+    scan_cache(m_dir, [&](const CacheFile& file, bool is_temp) {
+        if (!is_temp) {
+            ++stats.entries;
+            stats.bytes += file.size;
+        }
+    });
+    return stats;
+}
+
+PycDiagnosticsCapture::PycDiagnosticsCapture()
+    : m_prev(pyc_error_stream()), m_file(tmpfile())
+{
+    if (m_file)
+        set_pyc_error_stream(m_file);
+}
+
+PycDiagnosticsCapture::~PycDiagnosticsCapture()
+{
+    finish();
+}
+
+std::string PycDiagnosticsCapture::finish()
+{
+    std::string text;
+    if (!m_file)
+        return text;
+
+    set_pyc_error_stream(m_prev);
+    fflush(m_file);
+    long size = ftell(m_file);
+    if (size > 0) {
+        text.resize((size_t)size);
+        rewind(m_file);
+        text.resize(fread(&text[0], 1, text.size(), m_file));
+    }
+    fclose(m_file);
+    m_file = nullptr;
+    return text;
+}
@@ -0,0 +1,97 @@
+#ifndef _PYC_CACHE_H
+#define _PYC_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <ostream>
+#include <string>
+
+/* An on-disk cache of pycdc and pycdas output, shared between processes.
+ *
+ * Entries are keyed by a hash of the input file, the running executable
+ * (so any rebuild starts afresh) and the options that affect the output.
+ * Each entry is a file under <dir>/XX/, written to a temporary file as the
+ * output is produced and renamed into place once it is complete, so that
+ * concurrent users never see a partial entry.
+ * Reading an entry updates its modification time, and the least recently
+ * used entries are removed once the cache grows past its size limit.
+ *
+ * Hits and misses are counted in <dir>/counters, which is locked while
+ * concurrent processes update it.  It also keeps a running total of the
+ * cache size, so that the cache is only scanned once a store takes the
+ * total past the limit. */
+
+struct PycCacheStats {
+    unsigned long long hits, misses;
+    unsigned long long entries, bytes;
+};
+
+class PycCache {
+public:
+    /* Produces the output for the file whose contents are given, returning
+     * the tool's exit status.  Only output with a status of 0 is cached, and
+     * only if cacheable (initially true) is left set. */
+    typedef std::function<int(const std::string& contents, std::ostream& out,
+                              bool& cacheable)> Producer;
+
+    PycCache() : m_maxSize(), m_buildId() { }
+
+    /* Creates the directory if needed.  argv0 is used to find the running
+     * executable if the platform doesn't provide a better way. */
+    bool open(const char* dir, unsigned long long max_size, const char* argv0);
+    bool isOpen() const { return !m_dir.empty(); }
+
+    /* Writes the output for infile to out, from the cache if possible and
+     * otherwise from produce(), as it is produced.  Diagnostics are written
+     * to pyc_error_stream() after the output.  Returns the exit status, or -1
+     * if infile could not be read. */
+    int run(const char* infile, const std::string& options, std::ostream& out,
+            const Producer& produce, bool& hit);
+
+    PycCacheStats stats() const;
+
+    static uint64_t hash(const void* data, size_t size, uint64_t seed = 0);
+
+    /* A hash of the running executable, which changes with every build */
+    static bool buildId(const char* argv0, uint64_t& id);
+
+    static bool readFile(const char* filename, std::string& contents);
+
+    /* Write a file through a temporary file, so that it is replaced in one
+     * step and readers never see it partly written */
+    static bool writeFile(const std::string& filename, const std::string& contents);
+
+private:
+    std::string makeKey(const std::string& contents, const std::string& options) const;
+    std::string entryPath(const std::string& key) const;
+    bool lookup(const std::string& key, std::ostream& out, std::string& diagnostics);
+    void count(bool hit);
+    void evict();
+
+    std::string m_dir;
+    unsigned long long m_maxSize;
+    uint64_t m_buildId;
+};
+
+/* Captures everything printed to pyc_error_stream() on this thread while it
+ * is alive. */
+class PycDiagnosticsCapture {
+public:
+    PycDiagnosticsCapture();
+    ~PycDiagnosticsCapture();
+
+    PycDiagnosticsCapture(const PycDiagnosticsCapture&) = delete;
+    PycDiagnosticsCapture& operator=(const PycDiagnosticsCapture&) = delete;
+
+    bool isCapturing() const { return m_file != nullptr; }
+
+    /* Stops capturing, returning what was captured */
+    std::string finish();
+
+private:
+    FILE* m_prev;
+    FILE* m_file;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "pyc_code.h"
 #include "pyc_module.h"
 #include "data.h"
+#include "pyc_trace.h"
 
 /* == Marshal structure for Code object ==
                 1.0     1.3     1.5     2.1     2.3     3.0     3.8     3.11
@@ -28,6 +29,8 @@ exceptiontable                                                          Obj
 
 void PycCode::load(PycData* stream, PycModule* mod)
 {
+    PycTraceSpan span("LoadObject(code)");
+
     if (mod->verCompare(1, 3) >= 0 && mod->verCompare(2, 3) < 0)
         m_argCount = stream->get16();
     else if (mod->verCompare(2, 3) >= 0)
@@ -117,6 +120,8 @@ void PycCode::load(PycData* stream, PycModule* mod)
         m_exceptTable = LoadObject(stream, mod).cast<PycString>();
     else
         m_exceptTable = new PycString;
+
+    span.setCode(this);
 }
 
 PycRef<PycString> PycCode::getCellVar(PycModule* mod, int idx) const
@@ -169,3 +174,115 @@ std::vector<PycExceptionTableEntry> PycCode::exceptionTableEntries() const
     
     return entries;
 }
+
+static void add_line_range(std::vector<PycLineTableEntry>& entries, int start,
+                           int end, int line)
+{
+    if (start >= end)
+        return;
+    if (!entries.empty() && entries.back().end_offset == start
+            && entries.back().line == line) {
+        entries.back().end_offset = end;
+        return;
+    }
+    entries.push_back(PycLineTableEntry(start, end, line));
+}
+
+// Location table varints are little endian, unlike the exception table's
+static int location_varint(PycBuffer& data)
+{
+    int b = data.getByte();
+    int val = b & 0x3F;
+    int shift = 0;
+    while (b & 0x40) {
+        b = data.getByte();
+        shift += 6;
+        if (shift < 30)
+            val |= (b & 0x3F) << shift;
+    }
+    return val;
+}
+
+static int location_svarint(PycBuffer& data)
+{
+    int val = location_varint(data);
+    return (val & 1) ? -(val >> 1) : (val >> 1);
+}
+
+std::vector<PycLineTableEntry> PycCode::lineTableEntries(PycModule* mod) const
+{
+    PycBuffer data(m_lnTable->value(), m_lnTable->length());
+    std::vector<PycLineTableEntry> entries;
+    int line = m_firstLine;
+    int addr = 0;
+
+    if (mod->verCompare(3, 11) >= 0) {
+        while (!data.atEof()) {
+            int b = data.getByte();
+            int code = (b >> 3) & 0xF;
+            int length = ((b & 0x7) + 1) * 2;
+            int entry_line = line;
+            if (code == 15) {
+                entry_line = -1;
+            } else if (code == 14) {
+                line += location_svarint(data);
+                entry_line = line;
+                location_varint(data);  // end line
+                location_varint(data);  // column
+                location_varint(data);  // end column
+            } else if (code == 13) {
+                line += location_svarint(data);
+                entry_line = line;
+            } else if (code >= 10) {
+                line += code - 10;
+                entry_line = line;
+                data.getByte();         // column
+                data.getByte();         // end column
+            } else {
+                data.getByte();         // column
+            }
+            add_line_range(entries, addr, addr + length, entry_line);
+            addr += length;
+        }
+    } else if (mod->verCompare(3, 10) >= 0) {
+        while (!data.atEof()) {
+            int sdelta = data.getByte();
+            int ldelta = (signed char)data.getByte();
+            int entry_line = -1;
+            if (ldelta != -128) {
+                line += ldelta;
+                entry_line = line;
+            }
+            add_line_range(entries, addr, addr + sdelta, entry_line);
+            addr += sdelta;
+        }
+    } else {
+        // co_lnotab only records where each line starts
+        std::vector<std::pair<int, int>> starts;
+        int last_line = -1;
+        while (!data.atEof()) {
+            int byte_incr = data.getByte();
+            int line_incr = data.getByte();
+            if (byte_incr != 0) {
+                if (line != last_line) {
+                    starts.emplace_back(addr, line);
+                    last_line = line;
+                }
+                addr += byte_incr;
+            }
+            if (line_incr >= 0x80 && mod->verCompare(3, 6) >= 0)
+                line_incr -= 0x100;
+            line += line_incr;
+        }
+        if (line != last_line)
+            starts.emplace_back(addr, line);
+
+        int code_length = m_code->length();
+        for (size_t i = 0; i < starts.size(); ++i) {
+            int end = (i + 1 < starts.size()) ? starts[i + 1].first : code_length;
+            add_line_range(entries, starts[i].first, end, starts[i].second);
+        }
+    }
+
+    return entries;
+}
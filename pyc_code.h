@@ -20,6 +20,16 @@ public:
         start_offset(m_start_offset), end_offset(m_end_offset), target(m_target), stack_depth(m_stack_depth), push_lasti(m_push_lasti) {};
 };
 
+class PycLineTableEntry {
+public:
+    int start_offset; // inclusive
+    int end_offset; // exclusive
+    int line; // -1 if the instructions have no line number
+
+    PycLineTableEntry(int m_start_offset, int m_end_offset, int m_line) :
+        start_offset(m_start_offset), end_offset(m_end_offset), line(m_line) {};
+};
+
 class PycCode : public PycObject {
 public:
     typedef std::vector<PycRef<PycString>> globals_t;
@@ -75,6 +85,22 @@ public:
     PycRef<PycString> lnTable() const { return m_lnTable; }
     PycRef<PycString> exceptTable() const { return m_exceptTable; }
 
+    /* Used to construct code objects in memory, e.g. for PycMarshalWriter */
+    void setArgCount(int count) { m_argCount = count; }
+    void setPosOnlyArgCount(int count) { m_posOnlyArgCount = count; }
+    void setKwOnlyArgCount(int count) { m_kwOnlyArgCount = count; }
+    void setNumLocals(int count) { m_numLocals = count; }
+    void setStackSize(int size) { m_stackSize = size; }
+    void setFlags(int flags) { m_flags = flags; }
+    void setCode(PycRef<PycString> code) { m_code = std::move(code); }
+    void setConsts(PycRef<PycSequence> consts) { m_consts = std::move(consts); }
+    void setNames(PycRef<PycSequence> names) { m_names = std::move(names); }
+    void setLocalNames(PycRef<PycSequence> names) { m_localNames = std::move(names); }
+    void setFileName(PycRef<PycString> name) { m_fileName = std::move(name); }
+    void setName(PycRef<PycString> name) { m_name = std::move(name); }
+    void setQualName(PycRef<PycString> name) { m_qualName = std::move(name); }
+    void setFirstLine(int line) { m_firstLine = line; }
+
     PycRef<PycObject> getConst(int idx) const
     {
         return m_consts->get(idx);
@@ -101,6 +127,10 @@ public:
 
     std::vector<PycExceptionTableEntry> exceptionTableEntries() const;
 
+    /* Decodes co_lnotab, co_linetable (3.10) or the location table (3.11+)
+     * into the ranges of bytecode offsets for each line */
+    std::vector<PycLineTableEntry> lineTableEntries(PycModule* mod) const;
+
 private:
     int m_argCount, m_posOnlyArgCount, m_kwOnlyArgCount, m_numLocals;
     int m_stackSize, m_flags;
@@ -0,0 +1,19 @@
+#ifndef _PYC_FS_H
+#define _PYC_FS_H
+
+#include <string>
+#include <vector>
+
+/* Filesystem helpers shared by the output cache and pycdas --stats */
+
+bool is_directory(const std::string& path);
+
+/* True for a symbolic link (or on Windows, any reparse point such as a
+ * junction), without following it */
+bool is_link(const std::string& path);
+
+/* The names of the entries in a directory, except . and .., in no
+ * particular order.  Empty if the directory can't be read. */
+std::vector<std::string> list_directory(const std::string& path);
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef _PYC_IR_H
+#define _PYC_IR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* The binary disassembly written by pycdas --format=bin, and a reader for it.
+ *
+ * This header does not depend on the rest of pycdc, so analysis tools can
+ * copy it.  The file is meant to be mapped into memory and used in place:
+ *
+ *   - All integers are little endian, and the reader only accepts files on
+ *     little endian hosts.
+ *   - The file starts with a PycIRHeader, which gives the offset and count
+ *     of each section.  Sections are arrays of the fixed size records below
+ *     and start on an 8 byte boundary.
+ *   - Strings are referred to by their index in the string table.  Each
+ *     string table entry gives the offset and length of the string in the
+ *     string data section, where it is followed by a NUL.  Identical strings
+ *     are stored once.  PYCIR_NONE means no string (or no code object).
+ *   - Code objects are numbered breadth first from the module's code object
+ *     (0), the same way as pycdas --format=json numbers them.  Each one
+ *     refers to its own ranges of the name, constant, instruction, line and
+ *     exception sections, so any function can be read without reading the
+ *     others.
+ *
+ * The version is increased for any change to the layout.  Readers should
+ * reject versions they don't know.
+ */
+
+#define PYCIR_MAGIC     "PYCIR\r\n\032"
+#define PYCIR_VERSION   1
+#define PYCIR_NONE      0xFFFFFFFFu
+
+#define PYCIR_FLAG_UNICODE  0x1     // Python 2 module compiled with -U
+
+struct PycIRSection {
+    uint64_t offset;        // From the start of the file
+    uint64_t count;         // Records, or bytes for the string data
+};
+
+struct PycIRHeader {
+    char magic[8];          // PYCIR_MAGIC
+    uint32_t version;       // PYCIR_VERSION
+    uint32_t header_size;   // sizeof(PycIRHeader)
+    uint16_t py_major, py_minor;
+    uint32_t flags;         // PYCIR_FLAG_*
+
+    PycIRSection strings;       // PycIRString
+    PycIRSection string_data;   // char
+    PycIRSection names;         // uint32_t string indices
+    PycIRSection consts;        // PycIRConst
+    PycIRSection codes;         // PycIRCode
+    PycIRSection instructions;  // PycIRInstruction
+    PycIRSection lines;         // PycIRLine
+    PycIRSection exceptions;    // PycIRException
+};
+
+struct PycIRString {
+    uint32_t offset;        // In the string data
+    uint32_t length;        // Not counting the NUL
+};
+
+struct PycIRRange {
+    uint32_t first, count;
+};
+
+struct PycIRCode {
+    uint32_t name, qualname, filename;  // Strings (qualname is PYCIR_NONE before 3.11)
+    uint32_t parent;                    // Code object, or PYCIR_NONE for the module
+    int32_t first_line;
+    int32_t arg_count, pos_only_arg_count, kw_only_arg_count;
+    int32_t num_locals, stack_size;
+    uint32_t flags;                     // co_flags as stored in the code object
+    uint32_t code_size;                 // Bytes of bytecode
+    PycIRRange names;                   // In the names section
+    PycIRRange var_names;               // Locals (3.11+: locals, cells and frees)
+    PycIRRange free_vars;               // Before 3.11 only
+    PycIRRange cell_vars;               // Before 3.11 only
+    PycIRRange consts;
+    PycIRRange instructions;
+    PycIRRange lines;
+    PycIRRange exceptions;
+};
+
+struct PycIRConst {
+    uint16_t type;          // Marshal type code, e.g. 's' or ')'
+    uint16_t reserved;
+    uint32_t repr;          // String
+    uint32_t code;          // Code object, or PYCIR_NONE
+    uint32_t reserved2;
+};
+
+struct PycIRInstruction {
+    enum Kind {             // How the argument is shown, as in pycdas
+        NO_ARG, PLAIN, CONST, NAME, JUMP, DESC, INVALID
+    };
+
+    uint32_t offset;        // Of the instruction, in bytes
+    uint32_t opname;        // String
+    int32_t arg;            // 0 if kind is NO_ARG
+    uint32_t argrepr;       // String, or PYCIR_NONE
+    int32_t target;         // Jump target offset, or -1
+    uint8_t kind;
+    uint8_t reserved[3];
+};
+
+struct PycIRLine {
+    uint32_t start, end;    // Bytecode offsets, end exclusive
+    int32_t line;           // -1 for instructions without a line
+};
+
+struct PycIRException {
+    uint32_t start, end;    // Bytecode offsets, end exclusive
+    uint32_t target;
+    uint32_t depth;
+    uint32_t push_lasti;
+};
+
+/* Reads a binary disassembly held in memory (e.g. mapped from a file), which
+ * must stay valid and be 8 byte aligned.  Nothing is copied.  The accessors
+ * don't check their arguments; open() checks that every section and every
+ * code object's ranges are within the file, that every string is followed
+ * by its NUL, and that the string and code object indices in the records
+ * are in range. */
+class PycIRReader {
+public:
+    PycIRReader() : m_data(), m_size(), m_header(), m_error() { }
+
+    bool open(const void* data, size_t size)
+    {
+        m_data = static_cast<const char*>(data);
+        m_size = size;
+        m_header = nullptr;
+
+        const uint16_t one = 1;
+        if (*reinterpret_cast<const char*>(&one) != 1)
+            return fail("Only little endian hosts are supported");
+        if ((reinterpret_cast<uintptr_t>(data) & 7) != 0)
+            return fail("Data is not 8 byte aligned");
+        if (size < sizeof(PycIRHeader) || memcmp(data, PYCIR_MAGIC, 8) != 0)
+            return fail("Not a pycdas binary disassembly");
+
+        const PycIRHeader* header = reinterpret_cast<const PycIRHeader*>(data);
+        if (header->version != PYCIR_VERSION)
+            return fail("Unsupported version");
+        if (header->header_size != sizeof(PycIRHeader))
+            return fail("Bad header size");
+        if (!checkSection(header->strings, sizeof(PycIRString))
+                || !checkSection(header->string_data, 1)
+                || !checkSection(header->names, sizeof(uint32_t))
+                || !checkSection(header->consts, sizeof(PycIRConst))
+                || !checkSection(header->codes, sizeof(PycIRCode))
+                || !checkSection(header->instructions, sizeof(PycIRInstruction))
+                || !checkSection(header->lines, sizeof(PycIRLine))
+                || !checkSection(header->exceptions, sizeof(PycIRException)))
+            return fail("Section out of bounds");
+
+        const PycIRString* strings = section<PycIRString>(header->strings);
+        const char* string_data = section<char>(header->string_data);
+        for (uint64_t i = 0; i < header->strings.count; ++i) {
+            uint64_t end = (uint64_t)strings[i].offset + strings[i].length;
+            if (end >= header->string_data.count)
+                return fail("String out of bounds");
+            if (string_data[end] != '\0')
+                return fail("String not NUL terminated");
+        }
+
+        const uint64_t string_count = header->strings.count;
+        const uint64_t code_count = header->codes.count;
+        const uint32_t* names = section<uint32_t>(header->names);
+        for (uint64_t i = 0; i < header->names.count; ++i) {
+            if (!checkIndex(names[i], string_count))
+                return fail("Name out of bounds");
+        }
+        const PycIRCode* codes = section<PycIRCode>(header->codes);
+        for (uint64_t i = 0; i < code_count; ++i) {
+            const PycIRCode& code = codes[i];
+            if (!checkRange(code.names, header->names)
+                    || !checkRange(code.var_names, header->names)
+                    || !checkRange(code.free_vars, header->names)
+                    || !checkRange(code.cell_vars, header->names)
+                    || !checkRange(code.consts, header->consts)
+                    || !checkRange(code.instructions, header->instructions)
+                    || !checkRange(code.lines, header->lines)
+                    || !checkRange(code.exceptions, header->exceptions))
+                return fail("Code object range out of bounds");
+            if (!checkIndex(code.name, string_count)
+                    || !checkIndex(code.qualname, string_count)
+                    || !checkIndex(code.filename, string_count)
+                    || !checkIndex(code.parent, code_count))
+                return fail("Code object field out of bounds");
+        }
+        const PycIRConst* consts = section<PycIRConst>(header->consts);
+        for (uint64_t i = 0; i < header->consts.count; ++i) {
+            if (!checkIndex(consts[i].repr, string_count)
+                    || !checkIndex(consts[i].code, code_count))
+                return fail("Constant field out of bounds");
+        }
+        const PycIRInstruction* instructions =
+                section<PycIRInstruction>(header->instructions);
+        for (uint64_t i = 0; i < header->instructions.count; ++i) {
+            if (!checkIndex(instructions[i].opname, string_count)
+                    || !checkIndex(instructions[i].argrepr, string_count))
+                return fail("Instruction field out of bounds");
+        }
+
+        m_header = header;
+        m_error = nullptr;
+        return true;
+    }
+
+    /* Why open() failed */
+    const char* error() const { return m_error; }
+
+    const PycIRHeader& header() const { return *m_header; }
+
+    uint32_t codeCount() const { return (uint32_t)m_header->codes.count; }
+    const PycIRCode& code(uint32_t index) const
+    {
+        return section<PycIRCode>(m_header->codes)[index];
+    }
+
+    uint32_t stringCount() const { return (uint32_t)m_header->strings.count; }
+
+    /* NUL terminated, or nullptr for PYCIR_NONE */
+    const char* string(uint32_t index) const
+    {
+        if (index == PYCIR_NONE)
+            return nullptr;
+        return section<char>(m_header->string_data)
+                + section<PycIRString>(m_header->strings)[index].offset;
+    }
+
+    uint32_t stringLength(uint32_t index) const
+    {
+        if (index == PYCIR_NONE)
+            return 0;
+        return section<PycIRString>(m_header->strings)[index].length;
+    }
+
+    /* String indices for a code object's names, var_names, free_vars or
+     * cell_vars range */
+    const uint32_t* names(const PycIRRange& range) const
+    {
+        return section<uint32_t>(m_header->names) + range.first;
+    }
+
+    const PycIRConst* consts(const PycIRCode& code) const
+    {
+        return section<PycIRConst>(m_header->consts) + code.consts.first;
+    }
+
+    const PycIRInstruction* instructions(const PycIRCode& code) const
+    {
+        return section<PycIRInstruction>(m_header->instructions) + code.instructions.first;
+    }
+
+    const PycIRLine* lines(const PycIRCode& code) const
+    {
+        return section<PycIRLine>(m_header->lines) + code.lines.first;
+    }
+
+    const PycIRException* exceptions(const PycIRCode& code) const
+    {
+        return section<PycIRException>(m_header->exceptions) + code.exceptions.first;
+    }
+
+private:
+    const char* m_data;
+    size_t m_size;
+    const PycIRHeader* m_header;
+    const char* m_error;
+
+    bool fail(const char* error)
+    {
+        m_error = error;
+        return false;
+    }
+
+    bool checkSection(const PycIRSection& section, size_t record_size) const
+    {
+        if (section.offset > m_size || (section.offset & 7) != 0)
+            return false;
+        return section.count <= (m_size - section.offset) / record_size;
+    }
+
+    static bool checkRange(const PycIRRange& range, const PycIRSection& section)
+    {
+        return (uint64_t)range.first + range.count <= section.count;
+    }
+
+    /* A string or code object index, which may be PYCIR_NONE */
+    static bool checkIndex(uint32_t index, uint64_t count)
+    {
+        return index == PYCIR_NONE || index < count;
+    }
+
+    template <class T>
+    const T* section(const PycIRSection& section) const
+    {
+        return reinterpret_cast<const T*>(m_data + section.offset);
+    }
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include "pyc_marshal.h"
+#include "pyc_module.h"
+#include "pyc_numeric.h"
+#include <cstdio>
+#include <stdexcept>
+
+unsigned int PycMarshalWriter::magicFor(int major, int minor)
+{
+    // Python 3.0 and 3.1 always set the unicode bit (magic+1)
+    static const struct {
+        int major, minor;
+        unsigned int magic;
+    } s_magics[] = {
+        { 1, 0, MAGIC_1_0 }, { 1, 1, MAGIC_1_1 }, { 1, 2, MAGIC_1_1 },
+        { 1, 3, MAGIC_1_3 }, { 1, 4, MAGIC_1_4 }, { 1, 5, MAGIC_1_5 },
+        { 1, 6, MAGIC_1_6 }, { 2, 0, MAGIC_2_0 }, { 2, 1, MAGIC_2_1 },
+        { 2, 2, MAGIC_2_2 }, { 2, 3, MAGIC_2_3 }, { 2, 4, MAGIC_2_4 },
+        { 2, 5, MAGIC_2_5 }, { 2, 6, MAGIC_2_6 }, { 2, 7, MAGIC_2_7 },
+        { 3, 0, MAGIC_3_0+1 }, { 3, 1, MAGIC_3_1+1 }, { 3, 2, MAGIC_3_2 },
+        { 3, 3, MAGIC_3_3 }, { 3, 4, MAGIC_3_4 }, { 3, 5, MAGIC_3_5_3 },
+        { 3, 6, MAGIC_3_6 }, { 3, 7, MAGIC_3_7 }, { 3, 8, MAGIC_3_8 },
+        { 3, 9, MAGIC_3_9 }, { 3, 10, MAGIC_3_10 }, { 3, 11, MAGIC_3_11 },
+        { 3, 12, MAGIC_3_12 }, { 3, 13, MAGIC_3_13 },
+    };
+
+    for (const auto& entry : s_magics) {
+        if (entry.major == major && entry.minor == minor) {
+            if (!PycModule::isSupportedVersion(major, minor))
+                break;
+            return entry.magic;
+        }
+    }
+    return INVALID;
+}
+
+void PycMarshalWriter::writeHeader()
+{
+    unsigned int magic = magicFor(m_maj, m_min);
+    if (magic == INVALID)
+        throw std::runtime_error("Unsupported Python version for marshal output");
+    write32((int)magic);
+
+    if (verCompare(3, 7) >= 0)
+        write32(0);     // Flags: timestamp-based pyc
+    write32(0);         // Timestamp
+    if (verCompare(3, 3) >= 0)
+        write32(0);     // Source size
+}
+
+void PycMarshalWriter::write16(int value)
+{
+    writeByte(value);
+    writeByte(value >> 8);
+}
+
+void PycMarshalWriter::write32(int value)
+{
+    writeByte(value);
+    writeByte(value >> 8);
+    writeByte(value >> 16);
+    writeByte(value >> 24);
+}
+
+void PycMarshalWriter::write64(Pyc_INT64 value)
+{
+    write32((int)(value & 0xFFFFFFFF));
+    write32((int)((value >> 32) & 0xFFFFFFFF));
+}
+
+void PycMarshalWriter::writeObject(PycRef<PycObject> obj)
+{
+    if (obj == NULL) {
+        writeByte(PycObject::TYPE_NULL);
+        return;
+    }
+
+    int type = obj->type();
+    switch (type) {
+    case PycObject::TYPE_NONE:
+    case PycObject::TYPE_FALSE:
+    case PycObject::TYPE_TRUE:
+    case PycObject::TYPE_STOPITER:
+    case PycObject::TYPE_ELLIPSIS:
+        writeByte(type);
+        break;
+    case PycObject::TYPE_INT:
+        writeByte(type);
+        write32(obj.cast<PycInt>()->value());
+        break;
+    case PycObject::TYPE_INT64:
+        {
+            // Stored as 15-bit sign/magnitude digits after loading
+            PycRef<PycLong> value = obj.cast<PycLong>();
+            unsigned long long bits = 0;
+            const auto& digits = value->value();
+            for (size_t i = digits.size(); i-- > 0; )
+                bits = (bits << 15) | digits[i];
+            if (value->size() < 0)
+                bits = 0ULL - bits;
+            writeByte(type);
+            write64((Pyc_INT64)bits);
+        }
+        break;
+    case PycObject::TYPE_LONG:
+        {
+            PycRef<PycLong> value = obj.cast<PycLong>();
+            writeByte(type);
+            write32(value->size());
+            for (auto digit : value->value())
+                write16(digit);
+        }
+        break;
+    case PycObject::TYPE_FLOAT:
+        {
+            const char* value = obj.cast<PycFloat>()->value();
+            size_t length = strlen(value);
+            writeByte(type);
+            writeByte((int)length);
+            writeBuffer(value, length);
+        }
+        break;
+    case PycObject::TYPE_COMPLEX:
+        {
+            PycRef<PycComplex> value = obj.cast<PycComplex>();
+            size_t length = strlen(value->value());
+            size_t imagLength = strlen(value->imag());
+            writeByte(type);
+            writeByte((int)length);
+            writeBuffer(value->value(), length);
+            writeByte((int)imagLength);
+            writeBuffer(value->imag(), imagLength);
+        }
+        break;
+    case PycObject::TYPE_BINARY_FLOAT:
+        {
+            double value = obj.cast<PycCFloat>()->value();
+            Pyc_INT64 bits;
+            memcpy(&bits, &value, sizeof(bits));
+            writeByte(type);
+            write64(bits);
+        }
+        break;
+    case PycObject::TYPE_BINARY_COMPLEX:
+        {
+            PycRef<PycCComplex> value = obj.cast<PycCComplex>();
+            double parts[2] = { value->value(), value->imag() };
+            Pyc_INT64 bits;
+            writeByte(type);
+            for (double part : parts) {
+                memcpy(&bits, &part, sizeof(bits));
+                write64(bits);
+            }
+        }
+        break;
+    case PycObject::TYPE_STRING:
+    case PycObject::TYPE_INTERNED:
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_ASCII_INTERNED:
+    case PycObject::TYPE_SHORT_ASCII:
+    case PycObject::TYPE_SHORT_ASCII_INTERNED:
+        {
+            PycRef<PycString> str = obj.cast<PycString>();
+            if ((type == PycObject::TYPE_SHORT_ASCII
+                    || type == PycObject::TYPE_SHORT_ASCII_INTERNED) && str->length() > 0xFF) {
+                // Too long for the short form
+                type = (type == PycObject::TYPE_SHORT_ASCII) ? PycObject::TYPE_ASCII
+                                                             : PycObject::TYPE_ASCII_INTERNED;
+            }
+            writeByte(type);
+            if (type == PycObject::TYPE_SHORT_ASCII || type == PycObject::TYPE_SHORT_ASCII_INTERNED)
+                writeByte(str->length());
+            else
+                write32(str->length());
+            writeBuffer(str->value(), str->length());
+        }
+        break;
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+    case PycObject::TYPE_LIST:
+    case PycObject::TYPE_SET:
+    case PycObject::TYPE_FROZENSET:
+        {
+            PycRef<PycSimpleSequence> seq = obj.cast<PycSimpleSequence>();
+            if (type == PycObject::TYPE_SMALL_TUPLE && seq->size() > 0xFF)
+                type = PycObject::TYPE_TUPLE;
+            writeByte(type);
+            if (type == PycObject::TYPE_SMALL_TUPLE)
+                writeByte(seq->size());
+            else
+                write32(seq->size());
+            for (const auto& value : seq->values())
+                writeObject(value);
+        }
+        break;
+    case PycObject::TYPE_DICT:
+        writeByte(type);
+        for (const auto& item : obj.cast<PycDict>()->values()) {
+            writeObject(std::get<0>(item));
+            writeObject(std::get<1>(item));
+        }
+        writeByte(PycObject::TYPE_NULL);
+        break;
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        writeByte(type);
+        writeCode(obj.cast<PycCode>());
+        break;
+    default:
+        throw std::runtime_error("Cannot marshal object of unsupported type");
+    }
+}
+
+/* Sequences missing from a constructed code object are written empty */
+void PycMarshalWriter::writeSequence(PycRef<PycSequence> seq)
+{
+    if (seq == NULL)
+        seq = new PycTuple(verCompare(3, 4) >= 0 ? PycObject::TYPE_SMALL_TUPLE
+                                                 : PycObject::TYPE_TUPLE);
+    writeObject(seq.cast<PycObject>());
+}
+
+/* See the marshal structure table in pyc_code.cpp */
+void PycMarshalWriter::writeCode(PycRef<PycCode> code)
+{
+    auto writeShortOrLong = [this](int value) {
+        if (verCompare(2, 3) < 0)
+            write16(value);
+        else
+            write32(value);
+    };
+    auto writeString = [this](PycRef<PycString> str) {
+        if (str == NULL)
+            str = new PycString(PycObject::TYPE_STRING);
+        writeObject(str.cast<PycObject>());
+    };
+
+    if (verCompare(1, 3) >= 0)
+        writeShortOrLong(code->argCount());
+    if (verCompare(3, 8) >= 0)
+        write32(code->posOnlyArgCount());
+    if (majorVer() >= 3)
+        write32(code->kwOnlyArgCount());
+    if (verCompare(1, 3) >= 0 && verCompare(3, 11) < 0)
+        writeShortOrLong(code->numLocals());
+    if (verCompare(1, 5) >= 0)
+        writeShortOrLong(code->stackSize());
+    if (verCompare(1, 3) >= 0) {
+        int flags = code->flags();
+        if (verCompare(3, 8) < 0) {
+            // Undo the remapping of the FUTURE flags done in PycCode::load()
+            flags = (flags & 0xFFFF) | ((flags >> 4) & 0xFFF0000);
+        }
+        writeShortOrLong(flags);
+    }
+
+    writeString(code->code());
+    writeSequence(code->consts());
+    writeSequence(code->names());
+    if (verCompare(1, 3) >= 0)
+        writeSequence(code->localNames());
+    if (verCompare(3, 11) >= 0)
+        writeString(code->localKinds());
+    if (verCompare(2, 1) >= 0 && verCompare(3, 11) < 0) {
+        writeSequence(code->freeVars());
+        writeSequence(code->cellVars());
+    }
+    writeString(m_structural ? nullptr : code->fileName());
+    writeString(code->name());
+    if (verCompare(3, 11) >= 0)
+        writeString(code->qualName());
+    if (verCompare(1, 5) >= 0)
+        writeShortOrLong(m_structural ? 0 : code->firstLine());
+    if (verCompare(1, 5) >= 0)
+        writeString(m_structural ? nullptr : code->lnTable());
+    if (verCompare(3, 11) >= 0)
+        writeString(code->exceptTable());
+}
+
+bool PycMarshalWriter::saveToFile(const char* filename) const
+{
+    FILE* out = fopen(filename, "wb");
+    if (!out)
+        return false;
+    bool ok = fwrite(m_data.data(), 1, m_data.size(), out) == m_data.size();
+    return (fclose(out) == 0) && ok;
+}
@@ -0,0 +1,59 @@
+#ifndef _PYC_MARSHAL_H
+#define _PYC_MARSHAL_H
+
+#include "pyc_code.h"
+#include <string>
+
+/* Serializes PycObjects into the marshal format of a given Python version,
+ * mirroring the load() method of each object type.  Objects are always
+ * written in full; no FLAG_REF or reference entries are emitted. */
+class PycMarshalWriter {
+public:
+    PycMarshalWriter(int major, int minor)
+        : m_maj(major), m_min(minor), m_structural() { }
+
+    /* Magic number for a version, or INVALID if it is not supported */
+    static unsigned int magicFor(int major, int minor);
+
+    /* Leave out the file name, first line number and line number table of
+     * code objects, so that identical code compiled in different places is
+     * written identically */
+    void setStructural(bool structural) { m_structural = structural; }
+
+    int majorVer() const { return m_maj; }
+    int minorVer() const { return m_min; }
+
+    int verCompare(int maj, int min) const
+    {
+        if (m_maj == maj)
+            return m_min - min;
+        return m_maj - maj;
+    }
+
+    /* Write the .pyc header (magic, flags, timestamp and size fields) */
+    void writeHeader();
+    void writeObject(PycRef<PycObject> obj);
+
+    void writeByte(int value) { m_data.push_back(char(value & 0xFF)); }
+    void write16(int value);
+    void write32(int value);
+    void write64(Pyc_INT64 value);
+    void writeBuffer(const void* buffer, size_t size)
+    {
+        m_data.append(static_cast<const char*>(buffer), size);
+    }
+
+    const std::string& data() const { return m_data; }
+    bool saveToFile(const char* filename) const;
+
+private:
+    void writeCode(PycRef<PycCode> code);
+    void writeSequence(PycRef<PycSequence> seq);
+
+private:
+    int m_maj, m_min;
+    bool m_structural;
+    std::string m_data;
+};
+
+#endif
@@ -0,0 +1,238 @@
+#include "pyc_memstats.h"
+#include "pyc_module.h"
+#include "pyc_numeric.h"
+#include <mutex>
+#include <unordered_set>
+
+std::atomic<bool> PycMemStats::s_enabled(false);
+
+struct Counters {
+    std::atomic<long> live, peak;
+    std::atomic<unsigned long long> created;
+};
+
+static Counters s_counters[PycMemStats::NUM_KINDS][PycMemStats::NUM_TYPES];
+
+static std::mutex s_codeMutex;
+static std::vector<PycMemStats::CodeStats> s_codeStats;
+
+// AST nodes live on one thread, so they are also counted per thread
+static thread_local long t_liveNodes = 0;
+static thread_local long t_peakNodes = 0;
+
+void PycMemStats::count(Kind kind, int type, int delta)
+{
+    Counters& counters = s_counters[kind][type & (NUM_TYPES - 1)];
+    long live = counters.live.fetch_add(delta, std::memory_order_relaxed) + delta;
+    if (delta > 0) {
+        counters.created.fetch_add(1, std::memory_order_relaxed);
+        long peak = counters.peak.load(std::memory_order_relaxed);
+        while (live > peak && !counters.peak.compare_exchange_weak(peak, live,
+                std::memory_order_relaxed)) { }
+    }
+
+    if (kind == AST_NODE) {
+        t_liveNodes += delta;
+        if (t_liveNodes > t_peakNodes)
+            t_peakNodes = t_liveNodes;
+    }
+}
+
+void PycMemStats::move(Kind kind, int from, int to)
+{
+    s_counters[kind][from & (NUM_TYPES - 1)].live.fetch_sub(1, std::memory_order_relaxed);
+    Counters& counters = s_counters[kind][to & (NUM_TYPES - 1)];
+    long live = counters.live.fetch_add(1, std::memory_order_relaxed) + 1;
+    long peak = counters.peak.load(std::memory_order_relaxed);
+    while (live > peak && !counters.peak.compare_exchange_weak(peak, live,
+            std::memory_order_relaxed)) { }
+}
+
+unsigned long PycMemStats::liveNodes()
+{
+    // Nodes created before accounting was enabled may take this below 0
+    return t_liveNodes > 0 ? (unsigned long)t_liveNodes : 0;
+}
+
+unsigned long PycMemStats::peakNodes()
+{
+    return t_peakNodes > 0 ? (unsigned long)t_peakNodes : 0;
+}
+
+void PycMemStats::resetPeakNodes()
+{
+    t_peakNodes = t_liveNodes;
+}
+
+PycMemStats::Counts PycMemStats::counts(Kind kind, int type)
+{
+    const Counters& counters = s_counters[kind][type & (NUM_TYPES - 1)];
+    Counts result;
+    result.live = counters.live.load(std::memory_order_relaxed);
+    result.peak = counters.peak.load(std::memory_order_relaxed);
+    result.created = counters.created.load(std::memory_order_relaxed);
+    return result;
+}
+
+const char* PycMemStats::objectTypeName(int type)
+{
+    switch (type) {
+    case PycObject::TYPE_INT:
+        return "PycInt";
+    case PycObject::TYPE_INT64:
+    case PycObject::TYPE_LONG:
+        return "PycLong";
+    case PycObject::TYPE_FLOAT:
+        return "PycFloat";
+    case PycObject::TYPE_BINARY_FLOAT:
+        return "PycCFloat";
+    case PycObject::TYPE_COMPLEX:
+        return "PycComplex";
+    case PycObject::TYPE_BINARY_COMPLEX:
+        return "PycCComplex";
+    case PycObject::TYPE_STRING:
+    case PycObject::TYPE_INTERNED:
+    case PycObject::TYPE_STRINGREF:
+    case PycObject::TYPE_UNICODE:
+    case PycObject::TYPE_ASCII:
+    case PycObject::TYPE_ASCII_INTERNED:
+    case PycObject::TYPE_SHORT_ASCII:
+    case PycObject::TYPE_SHORT_ASCII_INTERNED:
+        return "PycString";
+    case PycObject::TYPE_TUPLE:
+    case PycObject::TYPE_SMALL_TUPLE:
+        return "PycTuple";
+    case PycObject::TYPE_LIST:
+        return "PycList";
+    case PycObject::TYPE_DICT:
+        return "PycDict";
+    case PycObject::TYPE_CODE:
+    case PycObject::TYPE_CODE2:
+        return "PycCode";
+    case PycObject::TYPE_SET:
+    case PycObject::TYPE_FROZENSET:
+        return "PycSet";
+    default:
+        return "PycObject";
+    }
+}
+
+void PycMemStats::addCode(CodeStats stats)
+{
+    std::lock_guard<std::mutex> lock(s_codeMutex);
+    s_codeStats.push_back(std::move(stats));
+}
+
+std::vector<PycMemStats::CodeStats> PycMemStats::takeCodeStats()
+{
+    std::lock_guard<std::mutex> lock(s_codeMutex);
+    std::vector<CodeStats> stats;
+    stats.swap(s_codeStats);
+    return stats;
+}
+
+/* Adds up the memory held by obj and everything it references that hasn't
+ * been seen yet */
+static void measure_object(PycRef<PycObject> obj, std::unordered_set<PycObject*>& seen,
+                           PycMemStats::ModuleBytes& bytes)
+{
+    std::vector<PycRef<PycObject>> pending(1, obj);
+    while (!pending.empty()) {
+        obj = pending.back();
+        pending.pop_back();
+        if (obj == NULL || !seen.insert((PycObject*)obj).second)
+            continue;
+
+        switch (obj->type()) {
+        case PycObject::TYPE_STRING:
+        case PycObject::TYPE_INTERNED:
+        case PycObject::TYPE_STRINGREF:
+        case PycObject::TYPE_UNICODE:
+        case PycObject::TYPE_ASCII:
+        case PycObject::TYPE_ASCII_INTERNED:
+        case PycObject::TYPE_SHORT_ASCII:
+        case PycObject::TYPE_SHORT_ASCII_INTERNED:
+            ++bytes.strings;
+            bytes.string_bytes += obj.cast<PycString>()->strValue().capacity();
+            bytes.other_bytes += sizeof(PycString);
+            break;
+        case PycObject::TYPE_TUPLE:
+        case PycObject::TYPE_SMALL_TUPLE:
+        case PycObject::TYPE_LIST:
+        case PycObject::TYPE_SET:
+        case PycObject::TYPE_FROZENSET:
+            {
+                const auto& values = obj.cast<PycSimpleSequence>()->values();
+                ++bytes.sequences;
+                bytes.sequence_bytes += values.capacity() * sizeof(values[0]);
+                bytes.other_bytes += sizeof(PycSimpleSequence);
+                pending.insert(pending.end(), values.begin(), values.end());
+            }
+            break;
+        case PycObject::TYPE_DICT:
+            {
+                const auto& values = obj.cast<PycDict>()->values();
+                ++bytes.sequences;
+                bytes.sequence_bytes += values.capacity() * sizeof(values[0]);
+                bytes.other_bytes += sizeof(PycDict);
+                for (const auto& item : values) {
+                    pending.push_back(std::get<0>(item));
+                    pending.push_back(std::get<1>(item));
+                }
+            }
+            break;
+        case PycObject::TYPE_CODE:
+        case PycObject::TYPE_CODE2:
+            {
+                PycRef<PycCode> code = obj.cast<PycCode>();
+                ++bytes.code_objects;
+                bytes.other_bytes += sizeof(PycCode);
+                pending.push_back(code->code().cast<PycObject>());
+                pending.push_back(code->consts().cast<PycObject>());
+                pending.push_back(code->names().cast<PycObject>());
+                pending.push_back(code->localNames().cast<PycObject>());
+                pending.push_back(code->localKinds().cast<PycObject>());
+                pending.push_back(code->freeVars().cast<PycObject>());
+                pending.push_back(code->cellVars().cast<PycObject>());
+                pending.push_back(code->fileName().cast<PycObject>());
+                pending.push_back(code->name().cast<PycObject>());
+                pending.push_back(code->qualName().cast<PycObject>());
+                pending.push_back(code->lnTable().cast<PycObject>());
+                pending.push_back(code->exceptTable().cast<PycObject>());
+            }
+            break;
+        case PycObject::TYPE_LONG:
+        case PycObject::TYPE_INT64:
+            bytes.other_bytes += sizeof(PycLong)
+                    + obj.cast<PycLong>()->value().capacity() * sizeof(uint16_t);
+            break;
+        case PycObject::TYPE_INT:
+            bytes.other_bytes += sizeof(PycInt);
+            break;
+        case PycObject::TYPE_FLOAT:
+            bytes.other_bytes += sizeof(PycFloat);
+            break;
+        case PycObject::TYPE_COMPLEX:
+            bytes.other_bytes += sizeof(PycComplex);
+            break;
+        case PycObject::TYPE_BINARY_FLOAT:
+            bytes.other_bytes += sizeof(PycCFloat);
+            break;
+        case PycObject::TYPE_BINARY_COMPLEX:
+            bytes.other_bytes += sizeof(PycCComplex);
+            break;
+        default:
+            // The shared singletons (None, True, ...)
+            break;
+        }
+    }
+}
+
+PycMemStats::ModuleBytes PycMemStats::measure(const PycModule* mod)
+{
+    ModuleBytes bytes = { };
+    std::unordered_set<PycObject*> seen;
+    measure_object(mod->code().cast<PycObject>(), seen, bytes);
+    bytes.other_bytes += mod->tableBytes();
+    return bytes;
+}
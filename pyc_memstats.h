@@ -0,0 +1,94 @@
+#ifndef _PYC_MEMSTATS_H
+#define _PYC_MEMSTATS_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+/* Memory accounting for pycdc --mem-stats.
+ *
+ * While enabled, the PycObject and ASTNode constructors and destructors
+ * count live, peak and created instances by type code (which determines
+ * the concrete class), for all threads.  BuildFromCode also records what
+ * it allocated for each code object.  When disabled, each construction and
+ * destruction costs one relaxed atomic load. */
+
+class PycModule;
+
+class PycMemStats {
+public:
+    enum Kind { PYC_OBJECT, AST_NODE, NUM_KINDS };
+    enum { NUM_TYPES = 128 };
+
+    struct Counts {
+        long live, peak;
+        unsigned long long created;
+    };
+
+    /* Memory held by a module's objects */
+    struct ModuleBytes {
+        unsigned long strings, sequences, code_objects;
+        unsigned long long string_bytes;    // String contents
+        unsigned long long sequence_bytes;  // Tuple, list, set and dict storage
+        unsigned long long other_bytes;     // Objects themselves, and the module's tables
+    };
+
+    /* Stats for one BuildFromCode call */
+    struct CodeStats {
+        std::string name;
+        int code_size;
+        unsigned long nodes_created;
+        unsigned long peak_nodes;       // Most AST nodes alive at once
+        unsigned long snapshots;        // Stacks saved in stack_hist
+        unsigned long max_depth;        // Most stacks in stack_hist at once
+        unsigned long long peak_bytes;  // Most bytes held in stack_hist
+    };
+
+    static void enable() { s_enabled.store(true, std::memory_order_relaxed); }
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static void created(Kind kind, int type)
+    {
+        if (enabled())
+            count(kind, type, 1);
+    }
+
+    static void destroyed(Kind kind, int type)
+    {
+        if (enabled())
+            count(kind, type, -1);
+    }
+
+    /* For an object whose type code changed after it was created */
+    static void retyped(Kind kind, int from, int to)
+    {
+        if (enabled())
+            move(kind, from, to);
+    }
+
+    /* AST nodes alive on this thread, and the most there have been since
+     * resetPeakNodes() */
+    static unsigned long liveNodes();
+    static unsigned long peakNodes();
+    static void resetPeakNodes();
+
+    static Counts counts(Kind kind, int type);
+
+    /* Name of the class used for PycObjects of the given type */
+    static const char* objectTypeName(int type);
+
+    static void addCode(CodeStats stats);
+
+    /* The stats recorded by addCode() since the last call */
+    static std::vector<CodeStats> takeCodeStats();
+
+    static ModuleBytes measure(const PycModule* mod);
+
+private:
+    static void count(Kind kind, int type, int delta);
+    static void move(Kind kind, int from, int to);
+
+    static std::atomic<bool> s_enabled;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "pyc_module.h"
 #include "data.h"
+#include "pyc_trace.h"
 #include <stdexcept>
 
 void PycModule::setVersion(unsigned int magic)
@@ -207,12 +208,25 @@ void PycModule::loadFromFile(const char* filename)
 {
     PycFile in(filename);
     if (!in.isOpen()) {
-        fprintf(stderr, "Error opening file %s\n", filename);
+        fprintf(pyc_error_stream(), "Error opening file %s\n", filename);
         return;
     }
+    loadFromStream(&in);
+}
+
+void PycModule::loadFromBuffer(const void* buffer, int size)
+{
+    PycBuffer in(buffer, size);
+    loadFromStream(&in);
+}
+
+void PycModule::loadFromStream(PycData* stream)
+{
+    PycTraceSpan span("PycModule::load");
+    PycData& in = *stream;
     setVersion(in.get32());
     if (!isValid()) {
-        fputs("Bad MAGIC!\n", stderr);
+        fputs("Bad MAGIC!\n", pyc_error_stream());
         return;
     }
 
@@ -231,24 +245,36 @@ void PycModule::loadFromFile(const char* filename)
             in.get32(); // Size parameter added in Python 3.3
     }
 
-    m_code = LoadObject(&in, this).cast<PycCode>();
+    m_code = LoadObject(stream, this).cast<PycCode>();
 }
 
 void PycModule::loadFromMarshalledFile(const char* filename, int major, int minor)
 {
     PycFile in (filename);
     if (!in.isOpen()) {
-        fprintf(stderr, "Error opening file %s\n", filename);
+        fprintf(pyc_error_stream(), "Error opening file %s\n", filename);
         return;
     }
+    loadMarshalledStream(&in, major, minor);
+}
+
+void PycModule::loadFromMarshalledBuffer(const void* buffer, int size, int major, int minor)
+{
+    PycBuffer in(buffer, size);
+    loadMarshalledStream(&in, major, minor);
+}
+
+void PycModule::loadMarshalledStream(PycData* stream, int major, int minor)
+{
+    PycTraceSpan span("PycModule::load");
     if (!isSupportedVersion(major, minor)) {
-        fprintf(stderr, "Unsupported version %d.%d\n", major, minor);
+        fprintf(pyc_error_stream(), "Unsupported version %d.%d\n", major, minor);
         return;
     }
     m_maj = major;
     m_min = minor;
     m_unicode = (major >= 3);
-    m_code = LoadObject(&in, this).cast<PycCode>();
+    m_code = LoadObject(stream, this).cast<PycCode>();
 }
 
 PycRef<PycString> PycModule::getIntern(int ref) const
@@ -42,10 +42,13 @@ enum PycMagic {
 
 class PycModule {
 public:
-    PycModule() : m_maj(-1), m_min(-1), m_unicode(false) { }
+    PycModule() : m_maj(-1), m_min(-1), m_unicode(false), m_strictUnicode(false),
+                  m_decimalLongs(false) { }
 
     void loadFromFile(const char* filename);
     void loadFromMarshalledFile(const char *filename, int major, int minor);
+    void loadFromBuffer(const void* buffer, int size);
+    void loadFromMarshalledBuffer(const void* buffer, int size, int major, int minor);
     bool isValid() const { return (m_maj >= 0) && (m_min >= 0); }
 
     int majorVer() const { return m_maj; }
@@ -60,6 +63,15 @@ public:
 
     bool isUnicode() const { return m_unicode; }
 
+    /* Reject unicode strings that aren't valid UTF-8 instead of escaping
+     * the offending bytes in the output */
+    bool strictUnicode() const { return m_strictUnicode; }
+    void setStrictUnicode(bool strict) { m_strictUnicode = strict; }
+
+    /* Print long integer constants in decimal rather than hex */
+    bool decimalLongs() const { return m_decimalLongs; }
+    void setDecimalLongs(bool decimal) { m_decimalLongs = decimal; }
+
     bool strIsUnicode() const
     {
         return (m_maj >= 3) || (m_code->flags() & PycCode::CO_FUTURE_UNICODE_LITERALS) != 0;
@@ -78,14 +90,25 @@ public:
     void refObject(PycRef<PycObject> obj) { m_refs.emplace_back(std::move(obj)); }
     PycRef<PycObject> getRef(int ref) const;
 
+    /* Bytes allocated for the intern and reference tables */
+    size_t tableBytes() const
+    {
+        return m_interns.capacity() * sizeof(m_interns[0])
+                + m_refs.capacity() * sizeof(m_refs[0]);
+    }
+
     static bool isSupportedVersion(int major, int minor);
 
 private:
     void setVersion(unsigned int magic);
+    void loadFromStream(class PycData* stream);
+    void loadMarshalledStream(class PycData* stream, int major, int minor);
 
 private:
     int m_maj, m_min;
     bool m_unicode;
+    bool m_strictUnicode;
+    bool m_decimalLongs;
 
     PycRef<PycCode> m_code;
     std::vector<PycRef<PycString>> m_interns;
@@ -2,6 +2,8 @@
 #include "pyc_module.h"
 #include "data.h"
 #include <cstring>
+#include <cstdint>
+#include <cmath>
 
 #ifdef _MSC_VER
 #define snprintf sprintf_s
@@ -18,14 +20,20 @@ void PycInt::load(PycData* stream, PycModule*)
 void PycLong::load(PycData* stream, PycModule*)
 {
     if (type() == TYPE_INT64) {
-        m_value.reserve(4);
-        int lo = stream->get32();
-        int hi = stream->get32();
-        m_value.push_back((lo      ) & 0xFFFF);
-        m_value.push_back((lo >> 16) & 0xFFFF);
-        m_value.push_back((hi      ) & 0xFFFF);
-        m_value.push_back((hi >> 16) & 0xFFFF);
-        m_size = (hi & 0x80000000) != 0 ? -4 : 4;
+        // Convert the two's complement value into the same sign/magnitude
+        // 15-bit digit form used by TYPE_LONG
+        unsigned int lo = stream->get32();
+        unsigned int hi = stream->get32();
+        unsigned long long bits = ((unsigned long long)hi << 32) | lo;
+        bool negative = (hi & 0x80000000) != 0;
+        if (negative)
+            bits = 0ULL - bits;
+        m_value.reserve(5);
+        while (bits) {
+            m_value.push_back(bits & 0x7FFF);
+            bits >>= 15;
+        }
+        m_size = negative ? -(int)m_value.size() : (int)m_value.size();
     } else {
         m_size = stream->get32();
         int actualSize = m_size >= 0 ? m_size : -m_size;
@@ -55,16 +63,22 @@ bool PycLong::isEqual(PycRef<PycObject> obj) const
 
 std::string PycLong::repr(PycModule* mod) const
 {
-    // Longs are printed as hex, since it's easier (and faster) to convert
-    // arbitrary-length integers to a power of two than an arbitrary base
+    std::string accum = mod->decimalLongs() ? decimalString() : hexString();
+    if (mod->verCompare(3, 0) < 0)
+        accum.push_back('L');
+    return accum;
+}
 
-    if (m_size == 0)
-        return (mod->verCompare(3, 0) >= 0) ? "0x0" : "0x0L";
+std::string PycLong::hexString() const
+{
+    if (m_value.empty())
+        return "0x0";
 
     // Realign to 32 bits, since Python uses only 15
     std::vector<unsigned> bits;
     bits.reserve((m_value.size() + 1) / 2);
-    int shift = 0, temp = 0;
+    int shift = 0;
+    unsigned temp = 0;
     for (auto bit : m_value) {
         temp |= unsigned(bit & 0xFFFF) << shift;
         shift += 15;
@@ -76,9 +90,11 @@ std::string PycLong::repr(PycModule* mod) const
     }
     if (temp)
         bits.push_back(temp);
+    while (bits.size() > 1 && bits.back() == 0)
+        bits.pop_back();
 
     std::string accum;
-    accum.resize(3 + (bits.size() * 8) + 2);
+    accum.resize(3 + (bits.size() * 8));
     char* aptr = &accum[0];
 
     if (m_size < 0)
@@ -88,11 +104,198 @@ std::string PycLong::repr(PycModule* mod) const
 
     auto iter = bits.crbegin();
     aptr += snprintf(aptr, 9, "%X", *iter++);
-    while (iter != bits.rend())
+    while (iter != bits.crend())
         aptr += snprintf(aptr, 9, "%08X", *iter++);
-    if (mod->verCompare(3, 0) < 0)
-        *aptr++ = 'L';
-    *aptr = 0;
+    accum.resize(aptr - &accum[0]);
+    return accum;
+}
+
+/* Arbitrary-precision helpers for decimal conversion.  Numbers are vectors
+ * of base 10**9 limbs, least significant first, without leading zeros. */
+namespace {
+
+typedef std::vector<uint32_t> DecLimbs;
+
+const uint32_t DEC_BASE = 1000000000;
+const size_t KARATSUBA_CUTOFF = 48;
+const size_t DIRECT_CONVERT_CUTOFF = 128;
+
+void trim(DecLimbs& num)
+{
+    while (!num.empty() && num.back() == 0)
+        num.pop_back();
+}
+
+/* dest += src * DEC_BASE**shift */
+void add_shifted(DecLimbs& dest, const uint32_t* src, size_t srclen, size_t shift)
+{
+    if (dest.size() < shift + srclen)
+        dest.resize(shift + srclen, 0);
+    uint32_t carry = 0;
+    size_t i = 0;
+    for (; i < srclen; ++i) {
+        uint32_t sum = dest[shift + i] + src[i] + carry;
+        carry = (sum >= DEC_BASE);
+        dest[shift + i] = carry ? sum - DEC_BASE : sum;
+    }
+    for (size_t pos = shift + i; carry; ++pos) {
+        if (pos == dest.size())
+            dest.push_back(0);
+        uint32_t sum = dest[pos] + carry;
+        carry = (sum >= DEC_BASE);
+        dest[pos] = carry ? sum - DEC_BASE : sum;
+    }
+}
+
+/* dest -= src, where dest >= src */
+void subtract(DecLimbs& dest, const DecLimbs& src)
+{
+    uint32_t borrow = 0;
+    for (size_t i = 0; i < dest.size() && (i < src.size() || borrow); ++i) {
+        uint32_t sub = (i < src.size() ? src[i] : 0) + borrow;
+        borrow = (dest[i] < sub);
+        dest[i] = borrow ? dest[i] + DEC_BASE - sub : dest[i] - sub;
+    }
+    trim(dest);
+}
+
+DecLimbs multiply(const uint32_t* a, size_t alen, const uint32_t* b, size_t blen);
+
+DecLimbs multiply_schoolbook(const uint32_t* a, size_t alen, const uint32_t* b, size_t blen)
+{
+    DecLimbs result(alen + blen, 0);
+    for (size_t i = 0; i < alen; ++i) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < blen; ++j) {
+            uint64_t cur = result[i + j] + (uint64_t)a[i] * b[j] + carry;
+            carry = cur / DEC_BASE;
+            result[i + j] = (uint32_t)(cur - carry * DEC_BASE);
+        }
+        result[i + blen] = (uint32_t)carry;
+    }
+    trim(result);
+    return result;
+}
+
+DecLimbs multiply_karatsuba(const uint32_t* a, size_t alen, const uint32_t* b, size_t blen)
+{
+    size_t half = (alen > blen ? alen : blen) / 2;
+    size_t a0len = alen < half ? alen : half, b0len = blen < half ? blen : half;
+    size_t a1len = alen - a0len, b1len = blen - b0len;
+
+    DecLimbs a0(a, a + a0len), b0(b, b + b0len);
+    trim(a0);
+    trim(b0);
+    DecLimbs z0 = multiply(a0.data(), a0.size(), b0.data(), b0.size());
+    DecLimbs z2 = multiply(a + a0len, a1len, b + b0len, b1len);
+
+    DecLimbs asum = a0, bsum = b0;
+    add_shifted(asum, a + a0len, a1len, 0);
+    add_shifted(bsum, b + b0len, b1len, 0);
+    trim(asum);
+    trim(bsum);
+    DecLimbs z1 = multiply(asum.data(), asum.size(), bsum.data(), bsum.size());
+    subtract(z1, z0);
+    subtract(z1, z2);
+
+    DecLimbs result = z0;
+    add_shifted(result, z1.data(), z1.size(), half);
+    add_shifted(result, z2.data(), z2.size(), half * 2);
+    trim(result);
+    return result;
+}
+
+DecLimbs multiply(const uint32_t* a, size_t alen, const uint32_t* b, size_t blen)
+{
+    if (alen == 0 || blen == 0)
+        return DecLimbs();
+    size_t shorter = alen < blen ? alen : blen;
+    size_t longer = alen < blen ? blen : alen;
+    // Karatsuba only pays off when both operands are large and of similar size
+    if (shorter < KARATSUBA_CUTOFF || shorter * 2 < longer)
+        return multiply_schoolbook(a, alen, b, blen);
+    return multiply_karatsuba(a, alen, b, blen);
+}
+
+/* Quadratic conversion of count 15-bit digits, used for the leaves of the
+ * divide-and-conquer conversion */
+DecLimbs convert_direct(const uint16_t* digits, size_t count)
+{
+    DecLimbs result;
+    result.reserve(count / 2 + 1);
+    for (size_t i = count; i-- > 0; ) {
+        uint32_t carry = digits[i] & 0x7FFF;
+        for (auto& limb : result) {
+            uint64_t cur = ((uint64_t)limb << 15) | carry;
+            carry = (uint32_t)(cur / DEC_BASE);
+            limb = (uint32_t)(cur - (uint64_t)carry * DEC_BASE);
+        }
+        while (carry) {
+            result.push_back(carry % DEC_BASE);
+            carry /= DEC_BASE;
+        }
+    }
+    return result;
+}
+
+/* pow2[k] holds 2**(15 * DIRECT_CONVERT_CUTOFF * 2**k) in decimal limbs */
+DecLimbs convert_recursive(const uint16_t* digits, size_t count, std::vector<DecLimbs>& pow2)
+{
+    if (count <= DIRECT_CONVERT_CUTOFF)
+        return convert_direct(digits, count);
+
+    // Split at the largest power-of-two multiple of the cutoff below count
+    size_t level = 0, split = DIRECT_CONVERT_CUTOFF;
+    while (split * 2 < count) {
+        split *= 2;
+        ++level;
+    }
+    while (pow2.size() <= level) {
+        if (pow2.empty()) {
+            std::vector<uint16_t> one(DIRECT_CONVERT_CUTOFF + 1, 0);
+            one.back() = 1;
+            pow2.push_back(convert_direct(one.data(), one.size()));
+        } else {
+            const DecLimbs& prev = pow2.back();
+            pow2.push_back(multiply(prev.data(), prev.size(), prev.data(), prev.size()));
+        }
+    }
+
+    DecLimbs high = convert_recursive(digits + split, count - split, pow2);
+    DecLimbs result = multiply(high.data(), high.size(), pow2[level].data(), pow2[level].size());
+    DecLimbs low = convert_recursive(digits, split, pow2);
+    add_shifted(result, low.data(), low.size(), 0);
+    trim(result);
+    return result;
+}
+
+}
+
+std::string PycLong::decimalString() const
+{
+    std::vector<DecLimbs> pow2;
+    DecLimbs limbs = convert_recursive(m_value.data(), m_value.size(), pow2);
+    trim(limbs);
+    if (limbs.empty())
+        return "0";
+
+    std::string accum;
+    accum.reserve(1 + limbs.size() * 9);
+    if (m_size < 0)
+        accum.push_back('-');
+
+    char text[16];
+    int len = snprintf(text, sizeof(text), "%u", (unsigned)limbs.back());
+    accum.append(text, len);
+    for (size_t i = limbs.size() - 1; i-- > 0; ) {
+        uint32_t limb = limbs[i];
+        char* tp = text + 9;
+        for (int d = 0; d < 9; ++d) {
+            *--tp = char('0' + limb % 10);
+            limb /= 10;
+        }
+        accum.append(tp, 9);
+    }
     return accum;
 }
 
@@ -158,3 +361,312 @@ void PycCComplex::load(PycData* stream, PycModule* mod)
     Pyc_INT64 bits = stream->get64();
     memcpy(&m_imag, &bits, sizeof(bits));
 }
+
+
+/* Shortest round-trip double formatting, following the Ryu algorithm
+ * (Ulf Adams, "Ryu: Fast Float-to-String Conversion", PLDI 2018) */
+namespace {
+
+#include "pyc_float_tables.inl"
+
+const int DOUBLE_MANTISSA_BITS = 52;
+const int DOUBLE_EXPONENT_BITS = 11;
+const int DOUBLE_BIAS = 1023;
+const int DOUBLE_POW5_INV_BITCOUNT = 125;
+const int DOUBLE_POW5_BITCOUNT = 125;
+
+inline int pow5bits(int e)
+{
+    return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+inline int log10Pow2(int e)
+{
+    return (int)(((uint32_t)e * 78913) >> 18);
+}
+
+inline int log10Pow5(int e)
+{
+    return (int)(((uint32_t)e * 732923) >> 20);
+}
+
+inline int pow5Factor(uint64_t value)
+{
+    int count = 0;
+    while (value % 5 == 0) {
+        value /= 5;
+        ++count;
+    }
+    return count;
+}
+
+inline bool multipleOfPowerOf5(uint64_t value, int p)
+{
+    return pow5Factor(value) >= p;
+}
+
+inline bool multipleOfPowerOf2(uint64_t value, int p)
+{
+    return (value & ((1ULL << p) - 1)) == 0;
+}
+
+/* (m * mul) >> j, where mul is a 128-bit value and j >= 64 */
+inline uint64_t mulShift64(uint64_t m, const uint64_t* mul, int j)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+    unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+#else
+    // Portable 64x64->128 multiply built from 32-bit halves
+    auto umul128 = [](uint64_t a, uint64_t b, uint64_t* hi) -> uint64_t {
+        uint64_t aLo = (uint32_t)a, aHi = a >> 32;
+        uint64_t bLo = (uint32_t)b, bHi = b >> 32;
+        uint64_t b00 = aLo * bLo, b01 = aLo * bHi;
+        uint64_t b10 = aHi * bLo, b11 = aHi * bHi;
+        uint64_t mid1 = b10 + (b00 >> 32);
+        uint64_t mid2 = b01 + (uint32_t)mid1;
+        *hi = b11 + (mid1 >> 32) + (mid2 >> 32);
+        return (mid2 << 32) | (uint32_t)b00;
+    };
+    uint64_t high1, high0;
+    uint64_t low1 = umul128(m, mul[1], &high1);
+    umul128(m, mul[0], &high0);
+    uint64_t sum = high0 + low1;
+    if (sum < high0)
+        ++high1;
+    int dist = j - 64;
+    if (dist == 0)
+        return sum;
+    if (dist >= 64)
+        return high1 >> (dist - 64);
+    return (high1 << (64 - dist)) | (sum >> dist);
+#endif
+}
+
+/* Find the shortest decimal output * 10**exponent that rounds back to
+ * the finite, non-zero double given by its IEEE mantissa and exponent */
+void shortest_decimal(uint64_t ieeeMantissa, uint32_t ieeeExponent,
+                      uint64_t& output, int& exponent)
+{
+    int e2;
+    uint64_t m2;
+    if (ieeeExponent == 0) {
+        e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int)ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (1ULL << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+    }
+    const bool even = (m2 & 1) == 0;
+    const bool acceptBounds = even;
+
+    // Step 2: Determine the interval of valid decimal representations
+    const uint64_t mv = 4 * m2;
+    const uint32_t mmShift = (ieeeMantissa != 0 || ieeeExponent <= 1) ? 1 : 0;
+
+    // Step 3: Convert to a decimal power base using 128-bit arithmetic
+    uint64_t vr, vp, vm;
+    int e10;
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+    if (e2 >= 0) {
+        const int q = log10Pow2(e2) - (e2 > 3);
+        e10 = q;
+        const int k = DOUBLE_POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        const int i = -e2 + q + k;
+        vr = mulShift64(4 * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_INV_SPLIT[q], i);
+        vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_INV_SPLIT[q], i);
+        if (q <= 21) {
+            // Only one of mp, mv, and mm can be a multiple of 5, if any
+            if (mv % 5 == 0)
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            else if (acceptBounds)
+                vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+            else
+                vp -= multipleOfPowerOf5(mv + 2, q);
+        }
+    } else {
+        const int q = log10Pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        const int i = -e2 - q;
+        const int k = pow5bits(i) - DOUBLE_POW5_BITCOUNT;
+        const int j = q - k;
+        vr = mulShift64(4 * m2, DOUBLE_POW5_SPLIT[i], j);
+        vp = mulShift64(4 * m2 + 2, DOUBLE_POW5_SPLIT[i], j);
+        vm = mulShift64(4 * m2 - 1 - mmShift, DOUBLE_POW5_SPLIT[i], j);
+        if (q <= 1) {
+            // mv has at least q trailing 0 bits, since it is a multiple of 4
+            vrIsTrailingZeros = true;
+            if (acceptBounds)
+                vmIsTrailingZeros = (mmShift == 1);
+            else
+                --vp;
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+        }
+    }
+
+    // Step 4: Find the shortest decimal representation in the interval
+    int removed = 0;
+    uint8_t lastRemovedDigit = 0;
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        // General case, which happens rarely (~0.7%)
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= (vm % 10 == 0);
+            vrIsTrailingZeros &= (lastRemovedDigit == 0);
+            lastRemovedDigit = (uint8_t)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= (lastRemovedDigit == 0);
+                lastRemovedDigit = (uint8_t)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                ++removed;
+            }
+        }
+        // Round even if the exact number is .....50..0
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0)
+            lastRemovedDigit = 4;
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros))
+                       || lastRemovedDigit >= 5);
+    } else {
+        // Specialized for the common case (~99.3%)
+        bool roundUp = false;
+        while (vp / 10 > vm / 10) {
+            roundUp = (vr % 10 >= 5);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+    exponent = e10 + removed;
+}
+
+}
+
+int float_repr(char* buffer, double value, bool addDotZero)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const bool sign = (bits >> 63) != 0;
+    const uint64_t ieeeMantissa = bits & ((1ULL << DOUBLE_MANTISSA_BITS) - 1);
+    const uint32_t ieeeExponent = (uint32_t)((bits >> DOUBLE_MANTISSA_BITS)
+                                             & ((1u << DOUBLE_EXPONENT_BITS) - 1));
+
+    char* out = buffer;
+    if (sign)
+        *out++ = '-';
+
+    if (ieeeExponent == (1u << DOUBLE_EXPONENT_BITS) - 1) {
+        memcpy(out, ieeeMantissa ? "nan" : "inf", 4);
+        return (int)(out - buffer) + 3;
+    }
+
+    // Collect the significant digits and the position of the decimal
+    // point relative to the first digit
+    char digits[20];
+    int ndigits = 0;
+    int decpt = 1;
+    if (ieeeExponent == 0 && ieeeMantissa == 0) {
+        digits[ndigits++] = '0';
+    } else {
+        uint64_t output;
+        int exponent;
+        shortest_decimal(ieeeMantissa, ieeeExponent, output, exponent);
+        char* dp = digits + sizeof(digits);
+        do {
+            *--dp = char('0' + output % 10);
+            output /= 10;
+        } while (output != 0);
+        ndigits = (int)((digits + sizeof(digits)) - dp);
+        memmove(digits, dp, ndigits);
+        decpt = ndigits + exponent;
+    }
+
+    // Same layout rules as Python's float_repr_style 'short'
+    if (decpt <= -4 || decpt > 16) {
+        int exp10 = decpt - 1;
+        *out++ = digits[0];
+        if (ndigits > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, ndigits - 1);
+            out += ndigits - 1;
+        }
+        *out++ = 'e';
+        if (exp10 < 0) {
+            *out++ = '-';
+            exp10 = -exp10;
+        } else {
+            *out++ = '+';
+        }
+        if (exp10 >= 100)
+            *out++ = char('0' + exp10 / 100);
+        *out++ = char('0' + (exp10 / 10) % 10);
+        *out++ = char('0' + exp10 % 10);
+    } else if (decpt <= 0) {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', -decpt);
+        out += -decpt;
+        memcpy(out, digits, ndigits);
+        out += ndigits;
+    } else if (decpt >= ndigits) {
+        memcpy(out, digits, ndigits);
+        out += ndigits;
+        memset(out, '0', decpt - ndigits);
+        out += decpt - ndigits;
+        if (addDotZero) {
+            *out++ = '.';
+            *out++ = '0';
+        }
+    } else {
+        memcpy(out, digits, decpt);
+        out += decpt;
+        *out++ = '.';
+        memcpy(out, digits + decpt, ndigits - decpt);
+        out += ndigits - decpt;
+    }
+    *out = '\0';
+    return (int)(out - buffer);
+}
+
+/* A part of a complex repr.  Python's complex repr never signs a NaN, so
+ * the sign float_repr() keeps for float('-nan') is left off here. */
+static int complex_part_repr(char* buffer, double value)
+{
+    if (std::isnan(value)) {
+        memcpy(buffer, "nan", 4);
+        return 3;
+    }
+    return float_repr(buffer, value, false);
+}
+
+int complex_repr(char* buffer, double real, double imag)
+{
+    char* out = buffer;
+    if (real == 0.0 && !std::signbit(real)) {
+        // Pure imaginary values are printed without the real part or parens
+        out += complex_part_repr(out, imag);
+        *out++ = 'j';
+    } else {
+        *out++ = '(';
+        out += complex_part_repr(out, real);
+        if (!std::signbit(imag) || std::isnan(imag))
+            *out++ = '+';
+        out += complex_part_repr(out, imag);
+        *out++ = 'j';
+        *out++ = ')';
+    }
+    *out = '\0';
+    return (int)(out - buffer);
+}
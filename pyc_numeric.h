@@ -3,6 +3,7 @@
 
 #include "pyc_object.h"
 #include "data.h"
+#include <cstdint>
 #include <vector>
 #include <string>
 
@@ -35,13 +36,15 @@ public:
     void load(class PycData* stream, class PycModule* mod) override;
 
     int size() const { return m_size; }
-    const std::vector<int>& value() const { return m_value; }
+    const std::vector<uint16_t>& value() const { return m_value; }
 
     std::string repr(PycModule* mod) const;
+    std::string hexString() const;
+    std::string decimalString() const;
 
 private:
     int m_size;
-    std::vector<int> m_value;
+    std::vector<uint16_t> m_value;  // 15-bit digits, least significant first
 };
 
 class PycFloat : public PycObject {
@@ -112,4 +115,15 @@ private:
     double m_imag;
 };
 
+/* Shortest round-trip formatting of doubles, matching Python's repr().
+ * The buffer must hold at least FLOAT_REPR_SIZE characters; the length
+ * of the NUL-terminated result is returned.  Non-finite values produce
+ * "inf" or "nan" with their sign, so callers can wrap them as needed
+ * (float('-nan') keeps the sign bit).  complex_repr() leaves the sign off
+ * NaN parts, as Python's repr() does. */
+enum { FLOAT_REPR_SIZE = 32, COMPLEX_REPR_SIZE = 2 * FLOAT_REPR_SIZE + 4 };
+
+int float_repr(char* buffer, double value, bool addDotZero = true);
+int complex_repr(char* buffer, double real, double imag);
+
 #endif
@@ -5,11 +5,11 @@
 #include "data.h"
 #include <cstdio>
 
-PycRef<PycObject> Pyc_None = new PycObject(PycObject::TYPE_NONE);
-PycRef<PycObject> Pyc_Ellipsis = new PycObject(PycObject::TYPE_ELLIPSIS);
-PycRef<PycObject> Pyc_StopIteration = new PycObject(PycObject::TYPE_STOPITER);
-PycRef<PycObject> Pyc_False = new PycObject(PycObject::TYPE_FALSE);
-PycRef<PycObject> Pyc_True = new PycObject(PycObject::TYPE_TRUE);
+PycRef<PycObject> Pyc_None = (new PycObject(PycObject::TYPE_NONE))->makeImmortal();
+PycRef<PycObject> Pyc_Ellipsis = (new PycObject(PycObject::TYPE_ELLIPSIS))->makeImmortal();
+PycRef<PycObject> Pyc_StopIteration = (new PycObject(PycObject::TYPE_STOPITER))->makeImmortal();
+PycRef<PycObject> Pyc_False = (new PycObject(PycObject::TYPE_FALSE))->makeImmortal();
+PycRef<PycObject> Pyc_True = (new PycObject(PycObject::TYPE_TRUE))->makeImmortal();
 
 PycRef<PycObject> CreateObject(int type)
 {
@@ -63,11 +63,47 @@ PycRef<PycObject> CreateObject(int type)
     case PycObject::TYPE_FROZENSET:
         return new PycSet(type);
     default:
-        fprintf(stderr, "CreateObject: Got unsupported type 0x%X\n", type);
+        fprintf(pyc_error_stream(), "CreateObject: Got unsupported type 0x%X\n", type);
         return NULL;
     }
 }
 
+const char* MarshalTypeName(int type)
+{
+    switch (type) {
+    case PycObject::TYPE_NULL: return "NULL";
+    case PycObject::TYPE_NONE: return "NONE";
+    case PycObject::TYPE_FALSE: return "FALSE";
+    case PycObject::TYPE_TRUE: return "TRUE";
+    case PycObject::TYPE_STOPITER: return "STOPITER";
+    case PycObject::TYPE_ELLIPSIS: return "ELLIPSIS";
+    case PycObject::TYPE_INT: return "INT";
+    case PycObject::TYPE_INT64: return "INT64";
+    case PycObject::TYPE_FLOAT: return "FLOAT";
+    case PycObject::TYPE_BINARY_FLOAT: return "BINARY_FLOAT";
+    case PycObject::TYPE_COMPLEX: return "COMPLEX";
+    case PycObject::TYPE_BINARY_COMPLEX: return "BINARY_COMPLEX";
+    case PycObject::TYPE_LONG: return "LONG";
+    case PycObject::TYPE_STRING: return "STRING";
+    case PycObject::TYPE_INTERNED: return "INTERNED";
+    case PycObject::TYPE_STRINGREF: return "STRINGREF";
+    case PycObject::TYPE_TUPLE: return "TUPLE";
+    case PycObject::TYPE_LIST: return "LIST";
+    case PycObject::TYPE_DICT: return "DICT";
+    case PycObject::TYPE_CODE: return "CODE";
+    case PycObject::TYPE_CODE2: return "CODE2";
+    case PycObject::TYPE_UNICODE: return "UNICODE";
+    case PycObject::TYPE_SET: return "SET";
+    case PycObject::TYPE_FROZENSET: return "FROZENSET";
+    case PycObject::TYPE_ASCII: return "ASCII";
+    case PycObject::TYPE_ASCII_INTERNED: return "ASCII_INTERNED";
+    case PycObject::TYPE_SMALL_TUPLE: return "SMALL_TUPLE";
+    case PycObject::TYPE_SHORT_ASCII: return "SHORT_ASCII";
+    case PycObject::TYPE_SHORT_ASCII_INTERNED: return "SHORT_ASCII_INTERNED";
+    default: return "UNKNOWN";
+    }
+}
+
 PycRef<PycObject> LoadObject(PycData* stream, PycModule* mod)
 {
     int type = stream->getByte();
@@ -2,6 +2,7 @@
 #define _PYC_OBJECT_H
 
 #include <typeinfo>
+#include "pyc_memstats.h"
 
 template <class _Obj>
 class PycRef {
@@ -129,8 +130,12 @@ public:
         TYPE_SHORT_ASCII_INTERNED = 'Z',    // Python 3.4 ->
     };
 
-    PycObject(int type = TYPE_UNKNOWN) : m_refs(0), m_type(type) { }
-    virtual ~PycObject() { }
+    PycObject(int type = TYPE_UNKNOWN) : m_refs(0), m_type(type), m_visiting()
+    {
+        PycMemStats::created(PycMemStats::PYC_OBJECT, type);
+    }
+
+    virtual ~PycObject() { PycMemStats::destroyed(PycMemStats::PYC_OBJECT, m_type); }
 
     int type() const { return m_type; }
 
@@ -141,15 +146,32 @@ public:
 
     virtual void load(PycData*, PycModule*) { }
 
+    /* Immortal objects are never counted or freed.  This is used for the
+     * shared singletons, so threads can reference them without racing on
+     * the reference count. */
+    PycObject* makeImmortal() { m_refs = IMMORTAL_REFS; return this; }
+
+    /* Set while a code object is being decompiled, or while the contents
+     * of a code object or container are being printed or counted, to
+     * detect circular references.  Only those can be part of a cycle, so other objects
+     * (including the immortal ones shared between threads) are never
+     * marked. */
+    bool visiting() const { return m_visiting; }
+    void setVisiting(bool visiting) { m_visiting = visiting; }
+
 private:
+    enum { IMMORTAL_REFS = -1 };
     int m_refs;
 
 protected:
-    int m_type;
+    short m_type;
+
+private:
+    bool m_visiting;
 
 public:
-    void addRef() { ++m_refs; }
-    void delRef() { if (--m_refs == 0) delete this; }
+    void addRef() { if (m_refs != IMMORTAL_REFS) ++m_refs; }
+    void delRef() { if (m_refs != IMMORTAL_REFS && --m_refs == 0) delete this; }
 };
 
 template <class _Obj>
@@ -158,7 +180,25 @@ int PycRef<_Obj>::type() const
     return m_obj ? m_obj->type() : PycObject::TYPE_NULL;
 }
 
+/* Marks an object as being visited until the scope ends (including by an
+ * exception) */
+class PycVisitMark {
+public:
+    explicit PycVisitMark(PycObject* obj) : m_obj(obj) { obj->setVisiting(true); }
+    ~PycVisitMark() { m_obj->setVisiting(false); }
+
+    PycVisitMark(const PycVisitMark&) = delete;
+    PycVisitMark& operator=(const PycVisitMark&) = delete;
+
+private:
+    PycObject* m_obj;
+};
+
 PycRef<PycObject> CreateObject(int type);
+
+/* The name of a marshal type code, e.g. "SMALL_TUPLE" */
+const char* MarshalTypeName(int type);
+
 PycRef<PycObject> LoadObject(PycData* stream, PycModule* mod);
 
 /* Static Singleton objects */
@@ -29,6 +29,12 @@ public:
     const value_t& values() const { return m_values; }
     PycRef<PycObject> get(int idx) const override { return m_values.at(idx); }
 
+    void append(PycRef<PycObject> value)
+    {
+        m_values.emplace_back(std::move(value));
+        m_size = (int)m_values.size();
+    }
+
 protected:
     value_t m_values;
 };
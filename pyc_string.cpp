@@ -2,14 +2,110 @@
 #include "pyc_module.h"
 #include "data.h"
 #include <stdexcept>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define PYC_STRING_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define PYC_STRING_SSE2
+#endif
+
+#ifdef _MSC_VER
+#  include <intrin.h>
+static inline unsigned count_trailing_zeros(unsigned mask)
+{
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+}
+#else
+static inline unsigned count_trailing_zeros(unsigned mask)
+{
+    return __builtin_ctz(mask);
+}
+#endif
+
+/* Returns the offset of the first byte at or after pos with the high bit
+ * set, or length if the rest of the data is plain ASCII. */
+static size_t find_non_ascii(const unsigned char* data, size_t pos, size_t length)
+{
+#ifdef PYC_STRING_AVX2
+    for (; pos + 32 <= length; pos += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(block);
+        if (mask)
+            return pos + count_trailing_zeros(mask);
+    }
+#endif
+#ifdef PYC_STRING_SSE2
+    for (; pos + 16 <= length; pos += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        unsigned mask = (unsigned)_mm_movemask_epi8(block);
+        if (mask)
+            return pos + count_trailing_zeros(mask);
+    }
+#endif
+    for (; pos < length; ++pos) {
+        if (data[pos] & 0x80)
+            break;
+    }
+    return pos;
+}
 
 static bool check_ascii(const std::string& data)
 {
-    auto cp = reinterpret_cast<const unsigned char*>(data.c_str());
-    while (*cp) {
-        if (*cp & 0x80)
+    auto cp = reinterpret_cast<const unsigned char*>(data.data());
+    return find_non_ascii(cp, 0, data.size()) == data.size();
+}
+
+size_t utf8_sequence_length(const unsigned char* data, size_t avail)
+{
+    unsigned char lead = data[0];
+    if (lead < 0x80)
+        return 1;
+
+    size_t length;
+    unsigned char lo = 0x80, hi = 0xBF;     // Valid range for the second byte
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        if (lead == 0xE0)
+            lo = 0xA0;
+        else if (lead == 0xED)
+            hi = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        if (lead == 0xF0)
+            lo = 0x90;
+        else if (lead == 0xF4)
+            hi = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (avail < length || data[1] < lo || data[1] > hi)
+        return 0;
+    for (size_t i = 2; i < length; ++i) {
+        if ((data[i] & 0xC0) != 0x80)
+            return 0;
+    }
+    return length;
+}
+
+static bool check_utf8(const std::string& data)
+{
+    auto cp = reinterpret_cast<const unsigned char*>(data.data());
+    size_t length = data.size();
+    size_t pos = find_non_ascii(cp, 0, length);
+    while (pos < length) {
+        size_t seqlen = utf8_sequence_length(cp + pos, length - pos);
+        if (seqlen == 0)
             return false;
-        ++cp;
+        pos = find_non_ascii(cp, pos + seqlen, length);
     }
     return true;
 }
@@ -19,8 +115,10 @@ void PycString::load(PycData* stream, PycModule* mod)
 {
     if (type() == TYPE_STRINGREF) {
         PycRef<PycString> str = mod->getIntern(stream->get32());
+        PycMemStats::retyped(PycMemStats::PYC_OBJECT, m_type, str->m_type);
         m_type = str->m_type;
         m_value = str->m_value;
+        m_badUtf8 = str->m_badUtf8;
     } else {
         int length;
         if (type() == TYPE_SHORT_ASCII || type() == TYPE_SHORT_ASCII_INTERNED)
@@ -38,6 +136,10 @@ void PycString::load(PycData* stream, PycModule* mod)
                     type() == TYPE_SHORT_ASCII || type() == TYPE_SHORT_ASCII_INTERNED) {
                 if (!check_ascii(m_value))
                     throw std::runtime_error("Invalid bytes in ASCII string");
+            } else if (type() == TYPE_UNICODE) {
+                m_badUtf8 = !check_utf8(m_value);
+                if (m_badUtf8 && mod->strictUnicode())
+                    throw std::runtime_error("Invalid UTF-8 in unicode string");
             }
         }
 
@@ -56,7 +158,156 @@ bool PycString::isEqual(PycRef<PycObject> obj) const
     return isEqual(strObj->m_value);
 }
 
-void PycString::print(std::ostream &pyc_output, PycModule* mod, bool triple,
+/* Describes which bytes can't be copied verbatim into a string literal.
+ * Control characters, DEL and backslashes always need escaping. */
+struct EscapeSet {
+    bool high;      // Escape bytes >= 0x80
+    bool braces;    // Double up '{' and '}' inside f-strings
+    char quote;     // Quote to escape, or 0 for none
+};
+
+static inline bool needs_escape(unsigned char ch, const EscapeSet& esc)
+{
+    return ch < 0x20 || ch == 0x7F || ch == '\\' || ch == (unsigned char)esc.quote
+            || (esc.high && ch >= 0x80)
+            || (esc.braces && (ch == '{' || ch == '}'));
+}
+
+#ifdef PYC_STRING_SSE2
+static inline unsigned escape_mask_sse2(__m128i block, const EscapeSet& esc)
+{
+    // Signed compare catches both control characters and bytes >= 0x80
+    __m128i special = _mm_cmplt_epi8(block, _mm_set1_epi8(0x20));
+    if (!esc.high)
+        special = _mm_andnot_si128(_mm_cmplt_epi8(block, _mm_setzero_si128()), special);
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7F)));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+    special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8(esc.quote)));
+    if (esc.braces) {
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('{')));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('}')));
+    }
+    return (unsigned)_mm_movemask_epi8(special);
+}
+#endif
+
+#ifdef PYC_STRING_AVX2
+static inline unsigned escape_mask_avx2(__m256i block, const EscapeSet& esc)
+{
+    __m256i special = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), block);
+    if (!esc.high)
+        special = _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_setzero_si256(), block), special);
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7F)));
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\')));
+    special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(esc.quote)));
+    if (esc.braces) {
+        special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('{')));
+        special = _mm256_or_si256(special, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('}')));
+    }
+    return (unsigned)_mm256_movemask_epi8(special);
+}
+#endif
+
+/* Returns the offset of the first byte at or after pos that needs escaping,
+ * or length if the rest of the string can be copied as is. */
+static size_t find_escape(const unsigned char* data, size_t pos, size_t length,
+                          const EscapeSet& esc)
+{
+#ifdef PYC_STRING_AVX2
+    for (; pos + 32 <= length; pos += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        unsigned mask = escape_mask_avx2(block, esc);
+        if (mask)
+            return pos + count_trailing_zeros(mask);
+    }
+#endif
+#ifdef PYC_STRING_SSE2
+    for (; pos + 16 <= length; pos += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        unsigned mask = escape_mask_sse2(block, esc);
+        if (mask)
+            return pos + count_trailing_zeros(mask);
+    }
+#endif
+    for (; pos < length; ++pos) {
+        if (needs_escape(data[pos], esc))
+            break;
+    }
+    return pos;
+}
+
+/* Locates the first single quote, double quote and other byte needing an
+ * escape in one pass, so the quote style can be chosen without rescanning.
+ * Stops as soon as all three have been seen. */
+static void scan_string(const unsigned char* data, size_t length, const EscapeSet& esc,
+                        size_t& first_single, size_t& first_double, size_t& first_other)
+{
+    first_single = first_double = first_other = length;
+    auto record = [&](unsigned smask, unsigned dmask, unsigned omask, size_t base) {
+        if (smask && first_single == length)
+            first_single = base + count_trailing_zeros(smask);
+        if (dmask && first_double == length)
+            first_double = base + count_trailing_zeros(dmask);
+        if (omask && first_other == length)
+            first_other = base + count_trailing_zeros(omask);
+        return first_single != length && first_double != length && first_other != length;
+    };
+
+    size_t pos = 0;
+#ifdef PYC_STRING_AVX2
+    for (; pos + 32 <= length; pos += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        unsigned smask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\'')));
+        unsigned dmask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')));
+        if (record(smask, dmask, escape_mask_avx2(block, esc), pos))
+            return;
+    }
+#endif
+#ifdef PYC_STRING_SSE2
+    for (; pos + 16 <= length; pos += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        unsigned smask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+        unsigned dmask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+        if (record(smask, dmask, escape_mask_sse2(block, esc), pos))
+            return;
+    }
+#endif
+    for (; pos < length; ++pos) {
+        unsigned char ch = data[pos];
+        if (record(ch == '\'', ch == '"', needs_escape(ch, esc), pos))
+            return;
+    }
+}
+
+static void print_hex_escape(PycOutput& pyc_output, unsigned char ch)
+{
+    static const char hexdigits[] = "0123456789abcdef";
+    const char escape[4] = { '\\', 'x', hexdigits[ch >> 4], hexdigits[ch & 0xF] };
+    pyc_output.write(escape, sizeof(escape));
+}
+
+/* Prints one sequence from malformed UTF-8 data and returns the number of
+ * bytes consumed.  Surrogates (as written by Python's surrogatepass error
+ * handler) become \u escapes; other undecodable bytes become \x escapes. */
+static size_t print_utf8_sequence(PycOutput& pyc_output, const unsigned char* data,
+                                  size_t avail)
+{
+    size_t seqlen = utf8_sequence_length(data, avail);
+    if (seqlen != 0) {
+        pyc_output.write(reinterpret_cast<const char*>(data), seqlen);
+        return seqlen;
+    }
+    if (avail >= 3 && data[0] == 0xED && data[1] >= 0xA0 && data[1] <= 0xBF
+            && (data[2] & 0xC0) == 0x80) {
+        unsigned codepoint = 0xD000 | ((data[1] & 0x3F) << 6) | (data[2] & 0x3F);
+        pyc_output.printf("\\u%04x", codepoint);
+        return 3;
+    }
+    print_hex_escape(pyc_output, data[0]);
+    return 1;
+}
+
+void PycString::print(PycOutput &pyc_output, PycModule* mod, bool triple,
                       const char* parent_f_string_quote)
 {
     char prefix = 0;
@@ -89,20 +340,23 @@ void PycString::print(std::ostream &pyc_output, PycModule* mod, bool triple,
         return;
     }
 
-    // Determine preferred quote style (Emulate Python's method)
-    bool useQuotes = false;
-    if (!parent_f_string_quote) {
-        for (char ch : m_value) {
-            if (ch == '\'') {
-                useQuotes = true;
-            } else if (ch == '"') {
-                useQuotes = false;
-                break;
-            }
-        }
-    } else {
+    auto data = reinterpret_cast<const unsigned char*>(m_value.data());
+    size_t length = m_value.size();
+    EscapeSet esc;
+    esc.high = (type() != TYPE_UNICODE) || m_badUtf8;
+    esc.braces = (parent_f_string_quote != nullptr);
+    esc.quote = 0;
+
+    // Determine preferred quote style (Emulate Python's method: single
+    // quotes unless the string contains a ' and no ")
+    size_t first_single, first_double, first_other;
+    scan_string(data, length, esc, first_single, first_double, first_other);
+    bool useQuotes;
+    if (!parent_f_string_quote)
+        useQuotes = (first_single != length && first_double == length);
+    else
         useQuotes = parent_f_string_quote[0] == '"';
-    }
+    esc.quote = useQuotes ? '"' : '\'';
 
     // Output the string
     if (!parent_f_string_quote) {
@@ -111,41 +365,55 @@ void PycString::print(std::ostream &pyc_output, PycModule* mod, bool triple,
         else
             pyc_output << (useQuotes ? '"' : '\'');
     }
-    for (char ch : m_value) {
-        if (static_cast<unsigned char>(ch) < 0x20 || ch == 0x7F) {
-            if (ch == '\r') {
-                pyc_output << "\\r";
-            } else if (ch == '\n') {
-                if (triple)
-                    pyc_output << '\n';
-                else
-                    pyc_output << "\\n";
-            } else if (ch == '\t') {
-                pyc_output << "\\t";
-            } else {
-                formatted_print(pyc_output, "\\x%02x", (ch & 0xFF));
-            }
-        } else if (static_cast<unsigned char>(ch) >= 0x80) {
-            if (type() == TYPE_UNICODE) {
-                // Unicode stored as UTF-8...  Let the stream interpret it
-                pyc_output << ch;
+
+    // Copy runs that need no escaping in bulk, and escape the rest one at a time.
+    // Unicode stored as UTF-8 is passed through...  Let the stream interpret it
+    size_t pos = std::min(first_other, useQuotes ? first_double : first_single);
+    pyc_output.write(m_value.data(), pos);
+    while (pos < length) {
+        unsigned char ch = data[pos++];
+        switch (ch) {
+        case '\r':
+            pyc_output << "\\r";
+            break;
+        case '\n':
+            if (triple)
+                pyc_output << '\n';
+            else
+                pyc_output << "\\n";
+            break;
+        case '\t':
+            pyc_output << "\\t";
+            break;
+        case '\'':
+            pyc_output << R"(\')";
+            break;
+        case '"':
+            pyc_output << R"(\")";
+            break;
+        case '\\':
+            pyc_output << R"(\\)";
+            break;
+        case '{':
+            pyc_output << "{{";
+            break;
+        case '}':
+            pyc_output << "}}";
+            break;
+        default:
+            if (ch >= 0x80 && type() == TYPE_UNICODE) {
+                // Only reached for malformed UTF-8.  Keep the valid sequences
+                // and escape whatever can't be decoded.
+                pos += print_utf8_sequence(pyc_output, data + pos - 1, length - pos + 1) - 1;
             } else {
-                formatted_print(pyc_output, "\\x%02x", (ch & 0xFF));
+                print_hex_escape(pyc_output, ch);
             }
-        } else {
-            if (!useQuotes && ch == '\'')
-                pyc_output << R"(\')";
-            else if (useQuotes && ch == '"')
-                pyc_output << R"(\")";
-            else if (ch == '\\')
-                pyc_output << R"(\\)";
-            else if (parent_f_string_quote && ch == '{')
-                pyc_output << "{{";
-            else if (parent_f_string_quote && ch == '}')
-                pyc_output << "}}";
-            else
-                pyc_output << ch;
+            break;
         }
+
+        size_t next = find_escape(data, pos, length, esc);
+        pyc_output.write(m_value.data() + pos, next - pos);
+        pos = next;
     }
     if (!parent_f_string_quote) {
         if (triple)
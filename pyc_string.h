@@ -9,7 +9,7 @@
 class PycString : public PycObject {
 public:
     PycString(int type = TYPE_STRING)
-        : PycObject(type) { }
+        : PycObject(type), m_badUtf8() { }
 
     bool isEqual(PycRef<PycObject> obj) const override;
     bool isEqual(const std::string& str) const { return m_value == str; }
@@ -25,13 +25,21 @@ public:
     const char* value() const { return m_value.c_str(); }
     const std::string &strValue() const { return m_value; }
 
+    /* True if a TYPE_UNICODE value is not well-formed UTF-8 */
+    bool hasBadUtf8() const { return m_badUtf8; }
+
     void setValue(std::string str) { m_value = std::move(str); }
 
-    void print(std::ostream& stream, class PycModule* mod, bool triple = false,
+    void print(PycOutput& stream, class PycModule* mod, bool triple = false,
                const char* parent_f_string_quote = nullptr);
 
 private:
     std::string m_value;
+    bool m_badUtf8;
 };
 
+/* Returns the length of the well-formed UTF-8 sequence starting at data,
+ * or 0 if it is truncated, overlong, a surrogate or out of range. */
+size_t utf8_sequence_length(const unsigned char* data, size_t avail);
+
 #endif
@@ -0,0 +1,144 @@
+#include "pyc_trace.h"
+#include "pyc_code.h"
+#include "pyc_string.h"
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> PycTrace::s_enabled(false);
+
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    double start_us, duration_us;
+    unsigned thread;
+    std::string code_name, qualname;
+    int code_size;
+};
+
+struct TraceLog {
+    std::mutex mutex;
+    std::string filename;
+    PycTrace::Clock::time_point origin;
+    std::vector<TraceEvent> events;
+};
+
+}
+
+static TraceLog& trace_log()
+{
+    static TraceLog log;
+    return log;
+}
+
+/* Small thread numbers, in the order threads first record a span */
+static unsigned thread_number()
+{
+    static std::atomic<unsigned> s_next(1);
+    static thread_local unsigned s_number = s_next++;
+    return s_number;
+}
+
+/* Bytes that aren't part of well-formed UTF-8 (names in Python 2 modules
+ * can be in any encoding) are written as \u00XX, so the file stays valid
+ * JSON */
+static void write_json_string(FILE* out, const std::string& text)
+{
+    auto data = reinterpret_cast<const unsigned char*>(text.data());
+    size_t length = text.size();
+    fputc('"', out);
+    for (size_t pos = 0; pos < length; ) {
+        unsigned char ch = data[pos];
+        if (ch == '"' || ch == '\\') {
+            fprintf(out, "\\%c", ch);
+            ++pos;
+        } else if (ch < 0x20) {
+            fprintf(out, "\\u%04x", ch);
+            ++pos;
+        } else {
+            size_t seqlen = utf8_sequence_length(data + pos, length - pos);
+            if (seqlen == 0) {
+                fprintf(out, "\\u%04x", ch);
+                ++pos;
+            } else {
+                fwrite(data + pos, 1, seqlen, out);
+                pos += seqlen;
+            }
+        }
+    }
+    fputc('"', out);
+}
+
+bool PycTrace::start(const char* filename)
+{
+    TraceLog& log = trace_log();
+    std::lock_guard<std::mutex> lock(log.mutex);
+    log.filename = filename;
+    log.origin = Clock::now();
+    log.events.clear();
+    s_enabled.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+bool PycTrace::stop()
+{
+    TraceLog& log = trace_log();
+    std::lock_guard<std::mutex> lock(log.mutex);
+    if (!s_enabled.load(std::memory_order_relaxed))
+        return true;
+    s_enabled.store(false, std::memory_order_relaxed);
+
+    FILE* out = fopen(log.filename.c_str(), "w");
+    if (!out)
+        return false;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", out);
+    bool first = true;
+    for (const TraceEvent& event : log.events) {
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"pycdc\",\"ph\":\"X\",\"pid\":1,"
+                "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", first ? "" : ",", event.name,
+                event.thread, event.start_us, event.duration_us);
+        if (event.code_size >= 0) {
+            fputs(",\"args\":{\"name\":", out);
+            write_json_string(out, event.code_name);
+            if (!event.qualname.empty()) {
+                fputs(",\"qualname\":", out);
+                write_json_string(out, event.qualname);
+            }
+            fprintf(out, ",\"bytecode_size\":%d}", event.code_size);
+        }
+        fputc('}', out);
+        first = false;
+    }
+    fputs("\n]}\n", out);
+    log.events.clear();
+    log.events.shrink_to_fit();
+    return fclose(out) == 0;
+}
+
+void PycTrace::record(const char* name, Clock::time_point start,
+                      const std::string& code_name, const std::string& qualname,
+                      int code_size)
+{
+    Clock::time_point end = Clock::now();
+    unsigned thread = thread_number();
+
+    TraceLog& log = trace_log();
+    std::lock_guard<std::mutex> lock(log.mutex);
+    if (!s_enabled.load(std::memory_order_relaxed))
+        return;
+    typedef std::chrono::duration<double, std::micro> Micros;
+    log.events.push_back({ name, Micros(start - log.origin).count(),
+                           Micros(end - start).count(), thread, code_name, qualname,
+                           code_size });
+}
+
+void PycTraceSpan::describe(const PycCode* code)
+{
+    // co_qualname is only stored from Python 3.11, and is left empty before
+    if (code->name() != NULL)
+        m_codeName = code->name()->strValue();
+    if (code->qualName() != NULL)
+        m_qualName = code->qualName()->strValue();
+    m_codeSize = (code->code() != NULL) ? code->code()->length() : 0;
+}
@@ -0,0 +1,72 @@
+#ifndef _PYC_TRACE_H
+#define _PYC_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+/* Opt-in tracing of the phases of loading and decompiling a module, written
+ * as Chrome trace-event JSON (view it in chrome://tracing or Perfetto).
+ *
+ * Spans are recorded with PycTraceSpan, which measures its own lifetime.
+ * When tracing is off, a span only costs one relaxed atomic load. */
+
+class PycCode;
+
+class PycTrace {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    /* Starts collecting spans, to be written to filename by stop() */
+    static bool start(const char* filename);
+
+    /* Writes the collected spans and stops collecting.  Returns false if
+     * the file could not be written. */
+    static bool stop();
+
+    static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    static void record(const char* name, Clock::time_point start,
+                       const std::string& code_name, const std::string& qualname,
+                       int code_size);
+
+private:
+    static std::atomic<bool> s_enabled;
+};
+
+class PycTraceSpan {
+public:
+    explicit PycTraceSpan(const char* name)
+        : m_name(PycTrace::enabled() ? name : nullptr), m_codeSize(-1)
+    {
+        if (m_name)
+            m_start = PycTrace::Clock::now();
+    }
+
+    ~PycTraceSpan()
+    {
+        if (m_name)
+            PycTrace::record(m_name, m_start, m_codeName, m_qualName, m_codeSize);
+    }
+
+    PycTraceSpan(const PycTraceSpan&) = delete;
+    PycTraceSpan& operator=(const PycTraceSpan&) = delete;
+
+    /* Tags the span with the code object's name, qualified name (Python 3.11+)
+     * and bytecode size */
+    void setCode(const PycCode* code)
+    {
+        if (m_name)
+            describe(code);
+    }
+
+private:
+    void describe(const PycCode* code);
+
+    const char* m_name;
+    PycTrace::Clock::time_point m_start;
+    std::string m_codeName, m_qualName;
+    int m_codeSize;
+};
+
+#endif
@@ -1,13 +1,15 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cstdarg>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <fstream>
-#include <unordered_set>
-#include "pyc_module.h"
-#include "pyc_numeric.h"
+#include "disasm.h"
 #include "bytecode.h"
+#include "pyc_cache.h"
+#include "corpus_stats.h"
 
 #ifdef WIN32
 #  define PATHSEP '\\'
@@ -15,270 +17,90 @@
 #  define PATHSEP '/'
 #endif
 
-static const char* flag_names[] = {
-    "CO_OPTIMIZED", "CO_NEWLOCALS", "CO_VARARGS", "CO_VARKEYWORDS",
-    "CO_NESTED", "CO_GENERATOR", "CO_NOFREE", "CO_COROUTINE",
-    "CO_ITERABLE_COROUTINE", "CO_ASYNC_GENERATOR", "<0x400>", "<0x800>",
-    "CO_GENERATOR_ALLOWED", "<0x2000>", "<0x4000>", "<0x8000>",
-    "<0x10000>", "CO_FUTURE_DIVISION", "CO_FUTURE_ABSOLUTE_IMPORT", "CO_FUTURE_WITH_STATEMENT",
-    "CO_FUTURE_PRINT_FUNCTION", "CO_FUTURE_UNICODE_LITERALS", "CO_FUTURE_BARRY_AS_BDFL",
-            "CO_FUTURE_GENERATOR_STOP",
-    "CO_FUTURE_ANNOTATIONS", "CO_NO_MONITORING_EVENTS", "<0x4000000>", "<0x8000000>",
-    "<0x10000000>", "<0x20000000>", "<0x40000000>", "<0x80000000>"
-};
-
-static void print_coflags(unsigned long flags, std::ostream& pyc_output)
-{
-    if (flags == 0) {
-        pyc_output << "\n";
-        return;
-    }
-
-    pyc_output << " (";
-    unsigned long f = 1;
-    int k = 0;
-    while (k < 32) {
-        if ((flags & f) != 0) {
-            flags &= ~f;
-            if (flags == 0)
-                pyc_output << flag_names[k];
-            else
-                pyc_output << flag_names[k] << " | ";
-        }
-        ++k;
-        f <<= 1;
-    }
-    pyc_output << ")\n";
-}
-
-static void iputs(std::ostream& pyc_output, int indent, const char* text)
-{
-    for (int i=0; i<indent; i++)
-        pyc_output << "    ";
-    pyc_output << text;
-}
-
-static void ivprintf(std::ostream& pyc_output, int indent, const char* fmt,
-                     va_list varargs)
+static void print_cache_stats(const PycCache& cache, bool hit)
 {
-    for (int i=0; i<indent; i++)
-        pyc_output << "    ";
-    formatted_printv(pyc_output, fmt, varargs);
+    PycCacheStats stats = cache.stats();
+    fprintf(stderr, "Cache %s (%llu hits, %llu misses, %llu entries, %llu bytes)\n",
+            hit ? "hit" : "miss", stats.hits, stats.misses, stats.entries, stats.bytes);
 }
 
-static void iprintf(std::ostream& pyc_output, int indent, const char* fmt, ...)
-{
-    va_list varargs;
-    va_start(varargs, fmt);
-    ivprintf(pyc_output, indent, fmt, varargs);
-    va_end(varargs);
-}
+enum OutputFormat { FORMAT_TEXT, FORMAT_JSON, FORMAT_NDJSON, FORMAT_BIN };
 
-static std::unordered_set<PycObject *> out_seen;
-
-void output_object(PycRef<PycObject> obj, PycModule* mod, int indent,
-                   unsigned flags, std::ostream& pyc_output)
+/* Disassembles infile, or its already loaded contents if given */
+static int disassemble_file(const char* infile, const char* dispname,
+                            const std::string* contents, bool marshalled, int major,
+                            int minor, bool strict_unicode, bool decimal_longs,
+                            unsigned disasm_flags, OutputFormat format,
+                            std::ostream& out_stream)
 {
-    if (obj == NULL) {
-        iputs(pyc_output, indent, "<NULL>");
-        return;
-    }
-
-    if (out_seen.find((PycObject *)obj) != out_seen.end()) {
-        fputs("WARNING: Circular reference detected\n", stderr);
-        return;
+    PycModule mod;
+    mod.setStrictUnicode(strict_unicode);
+    mod.setDecimalLongs(decimal_longs);
+    try {
+        if (contents && marshalled)
+            mod.loadFromMarshalledBuffer(contents->data(), (int)contents->size(), major, minor);
+        else if (contents)
+            mod.loadFromBuffer(contents->data(), (int)contents->size());
+        else if (marshalled)
+            mod.loadFromMarshalledFile(infile, major, minor);
+        else
+            mod.loadFromFile(infile);
+    } catch (std::exception &ex) {
+        fprintf(pyc_error_stream(), "Error disassembling %s: %s\n", infile, ex.what());
+        return 1;
     }
-    out_seen.insert((PycObject *)obj);
 
-    switch (obj->type()) {
-    case PycObject::TYPE_CODE:
-    case PycObject::TYPE_CODE2:
-        {
-            PycRef<PycCode> codeObj = obj.cast<PycCode>();
-            iputs(pyc_output, indent, "[Code]\n");
-            iprintf(pyc_output, indent + 1, "File Name: %s\n", codeObj->fileName()->value());
-            iprintf(pyc_output, indent + 1, "Object Name: %s\n", codeObj->name()->value());
-            if (mod->verCompare(3, 11) >= 0)
-                iprintf(pyc_output, indent + 1, "Qualified Name: %s\n", codeObj->qualName()->value());
-            iprintf(pyc_output, indent + 1, "Arg Count: %d\n", codeObj->argCount());
-            if (mod->verCompare(3, 8) >= 0)
-                iprintf(pyc_output, indent + 1, "Pos Only Arg Count: %d\n", codeObj->posOnlyArgCount());
-            if (mod->majorVer() >= 3)
-                iprintf(pyc_output, indent + 1, "KW Only Arg Count: %d\n", codeObj->kwOnlyArgCount());
-            if (mod->verCompare(3, 11) < 0)
-                iprintf(pyc_output, indent + 1, "Locals: %d\n", codeObj->numLocals());
-            if (mod->verCompare(1, 5) >= 0)
-                iprintf(pyc_output, indent + 1, "Stack Size: %d\n", codeObj->stackSize());
-            if (mod->verCompare(1, 3) >= 0) {
-                unsigned int orig_flags = codeObj->flags();
-                if (mod->verCompare(3, 8) < 0) {
-                    // Remap flags back to the value stored in the PyCode object
-                    orig_flags = (orig_flags & 0xFFFF) | ((orig_flags & 0xFFF00000) >> 4);
-                }
-                iprintf(pyc_output, indent + 1, "Flags: 0x%08X", orig_flags);
-                print_coflags(codeObj->flags(), pyc_output);
-            }
-
-            iputs(pyc_output, indent + 1, "[Names]\n");
-            for (int i=0; i<codeObj->names()->size(); i++)
-                output_object(codeObj->names()->get(i), mod, indent + 2, flags, pyc_output);
-
-            if (mod->verCompare(1, 3) >= 0) {
-                if (mod->verCompare(3, 11) >= 0)
-                    iputs(pyc_output, indent + 1, "[Locals+Names]\n");
-                else
-                    iputs(pyc_output, indent + 1, "[Var Names]\n");
-                for (int i=0; i<codeObj->localNames()->size(); i++)
-                    output_object(codeObj->localNames()->get(i), mod, indent + 2, flags, pyc_output);
-            }
-
-            if (mod->verCompare(3, 11) >= 0 && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
-                iputs(pyc_output, indent + 1, "[Locals+Kinds]\n");
-                output_object(codeObj->localKinds().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
-            }
-
-            if (mod->verCompare(2, 1) >= 0 && mod->verCompare(3, 11) < 0) {
-                iputs(pyc_output, indent + 1, "[Free Vars]\n");
-                for (int i=0; i<codeObj->freeVars()->size(); i++)
-                    output_object(codeObj->freeVars()->get(i), mod, indent + 2, flags, pyc_output);
-
-                iputs(pyc_output, indent + 1, "[Cell Vars]\n");
-                for (int i=0; i<codeObj->cellVars()->size(); i++)
-                    output_object(codeObj->cellVars()->get(i), mod, indent + 2, flags, pyc_output);
-            }
-
-            iputs(pyc_output, indent + 1, "[Constants]\n");
-            for (int i=0; i<codeObj->consts()->size(); i++)
-                output_object(codeObj->consts()->get(i), mod, indent + 2, flags, pyc_output);
-
-            iputs(pyc_output, indent + 1, "[Disassembly]\n");
-            bc_disasm(pyc_output, codeObj, mod, indent + 2, flags);
-
-            if (mod->verCompare(3, 11) >= 0) {
-                iputs(pyc_output, indent + 1, "[Exception Table]\n");
-                bc_exceptiontable(pyc_output, codeObj, indent+2);
-            }
-
-            if (mod->verCompare(1, 5) >= 0 && (flags & Pyc::DISASM_PYCODE_VERBOSE) != 0) {
-                iprintf(pyc_output, indent + 1, "First Line: %d\n", codeObj->firstLine());
-                iputs(pyc_output, indent + 1, "[Line Number Table]\n");
-                output_object(codeObj->lnTable().cast<PycObject>(), mod, indent + 2, flags, pyc_output);
-            }
-        }
-        break;
-    case PycObject::TYPE_STRING:
-    case PycObject::TYPE_UNICODE:
-    case PycObject::TYPE_INTERNED:
-    case PycObject::TYPE_ASCII:
-    case PycObject::TYPE_ASCII_INTERNED:
-    case PycObject::TYPE_SHORT_ASCII:
-    case PycObject::TYPE_SHORT_ASCII_INTERNED:
-        iputs(pyc_output, indent, "");
-        obj.cast<PycString>()->print(pyc_output, mod);
-        pyc_output << "\n";
-        break;
-    case PycObject::TYPE_TUPLE:
-    case PycObject::TYPE_SMALL_TUPLE:
-        {
-            iputs(pyc_output, indent, "(\n");
-            for (const auto& val : obj.cast<PycTuple>()->values())
-                output_object(val, mod, indent + 1, flags, pyc_output);
-            iputs(pyc_output, indent, ")\n");
-        }
-        break;
-    case PycObject::TYPE_LIST:
-        {
-            iputs(pyc_output, indent, "[\n");
-            for (const auto& val : obj.cast<PycList>()->values())
-                output_object(val, mod, indent + 1, flags, pyc_output);
-            iputs(pyc_output, indent, "]\n");
-        }
-        break;
-    case PycObject::TYPE_DICT:
-        {
-            iputs(pyc_output, indent, "{\n");
-            for (const auto& val : obj.cast<PycDict>()->values()) {
-                output_object(std::get<0>(val), mod, indent + 1, flags, pyc_output);
-                output_object(std::get<1>(val), mod, indent + 2, flags, pyc_output);
-            }
-            iputs(pyc_output, indent, "}\n");
-        }
-        break;
-    case PycObject::TYPE_SET:
-        {
-            iputs(pyc_output, indent, "{\n");
-            for (const auto& val : obj.cast<PycSet>()->values())
-                output_object(val, mod, indent + 1, flags, pyc_output);
-            iputs(pyc_output, indent, "}\n");
-        }
-        break;
-    case PycObject::TYPE_FROZENSET:
-        {
-            iputs(pyc_output, indent, "frozenset({\n");
-            for (const auto& val : obj.cast<PycSet>()->values())
-                output_object(val, mod, indent + 1, flags, pyc_output);
-            iputs(pyc_output, indent, "})\n");
+    PycOutput pyc_output(out_stream);
+    try {
+        if (format == FORMAT_TEXT) {
+            formatted_print(pyc_output, "%s (Python %d.%d%s)\n", dispname,
+                            mod.majorVer(), mod.minorVer(),
+                            (mod.majorVer() < 3 && mod.isUnicode()) ? " -U" : "");
+            output_object(mod.code().try_cast<PycObject>(), &mod, 0, disasm_flags,
+                          pyc_output);
+        } else if (format == FORMAT_BIN) {
+            output_ir(&mod, disasm_flags, pyc_output);
+        } else {
+            output_json(&mod, dispname, format == FORMAT_NDJSON, disasm_flags,
+                        pyc_output);
         }
-        break;
-    case PycObject::TYPE_NONE:
-        iputs(pyc_output, indent, "None\n");
-        break;
-    case PycObject::TYPE_FALSE:
-        iputs(pyc_output, indent, "False\n");
-        break;
-    case PycObject::TYPE_TRUE:
-        iputs(pyc_output, indent, "True\n");
-        break;
-    case PycObject::TYPE_ELLIPSIS:
-        iputs(pyc_output, indent, "...\n");
-        break;
-    case PycObject::TYPE_INT:
-        iprintf(pyc_output, indent, "%d\n", obj.cast<PycInt>()->value());
-        break;
-    case PycObject::TYPE_LONG:
-        iprintf(pyc_output, indent, "%s\n", obj.cast<PycLong>()->repr(mod).c_str());
-        break;
-    case PycObject::TYPE_FLOAT:
-        iprintf(pyc_output, indent, "%s\n", obj.cast<PycFloat>()->value());
-        break;
-    case PycObject::TYPE_COMPLEX:
-        iprintf(pyc_output, indent, "(%s+%sj)\n", obj.cast<PycComplex>()->value(),
-                                      obj.cast<PycComplex>()->imag());
-        break;
-    case PycObject::TYPE_BINARY_FLOAT:
-        iprintf(pyc_output, indent, "%g\n", obj.cast<PycCFloat>()->value());
-        break;
-    case PycObject::TYPE_BINARY_COMPLEX:
-        iprintf(pyc_output, indent, "(%g+%gj)\n", obj.cast<PycCComplex>()->value(),
-                                      obj.cast<PycCComplex>()->imag());
-        break;
-    default:
-        iprintf(pyc_output, indent, "<TYPE: %d>\n", obj->type());
+    } catch (std::exception& ex) {
+        fprintf(pyc_error_stream(), "Error disassembling %s: %s\n", infile, ex.what());
+        return 1;
     }
 
-    out_seen.erase((PycObject *)obj);
+    return 0;
 }
 
 int main(int argc, char* argv[])
 {
     const char* infile = nullptr;
     bool marshalled = false;
+    bool strict_unicode = false;
+    bool decimal_longs = false;
     const char* version = nullptr;
     unsigned disasm_flags = 0;
-    std::ostream* pyc_output = &std::cout;
+    OutputFormat format = FORMAT_TEXT;
+    std::ostream* out_stream = &std::cout;
     std::ofstream out_file;
+    const char* cache_dir = nullptr;
+    unsigned long long cache_size = 1024;
+    bool cache_stats = false;
+    bool corpus_stats = false;
+    CorpusStatsOptions stats_options;
+    std::vector<std::string> inputs;
 
     for (int arg = 1; arg < argc; ++arg) {
         if (strcmp(argv[arg], "-o") == 0) {
             if (arg + 1 < argc) {
                 const char* filename = argv[++arg];
-                out_file.open(filename, std::ios_base::out);
+                out_file.open(filename, std::ios_base::out | std::ios_base::binary);
                 if (out_file.fail()) {
                     fprintf(stderr, "Error opening file '%s' for writing\n",
                             filename);
                     return 1;
                 }
-                pyc_output = &out_file;
+                out_stream = &out_file;
             } else {
                 fputs("Option '-o' requires a filename\n", stderr);
                 return 1;
@@ -296,14 +118,83 @@ int main(int argc, char* argv[])
             disasm_flags |= Pyc::DISASM_PYCODE_VERBOSE;
         } else if (strcmp(argv[arg], "--show-caches") == 0) {
             disasm_flags |= Pyc::DISASM_SHOW_CACHES;
+        } else if (strcmp(argv[arg], "--strict-unicode") == 0) {
+            strict_unicode = true;
+        } else if (strcmp(argv[arg], "--decimal-longs") == 0) {
+            decimal_longs = true;
+        } else if (strcmp(argv[arg], "--cache") == 0) {
+            if (arg + 1 < argc) {
+                cache_dir = argv[++arg];
+            } else {
+                fputs("Option '--cache' requires a directory\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--cache-size") == 0) {
+            char* end = nullptr;
+            cache_size = (arg + 1 < argc) ? strtoull(argv[++arg], &end, 10) : 0;
+            if (!end || *end || end == argv[arg]) {
+                fputs("Option '--cache-size' requires a size in MB\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--cache-stats") == 0) {
+            cache_stats = true;
+        } else if (strcmp(argv[arg], "--format") == 0
+                   || strncmp(argv[arg], "--format=", 9) == 0) {
+            const char* name = (argv[arg][8] == '=') ? argv[arg] + 9
+                             : (arg + 1 < argc) ? argv[++arg] : "";
+            if (strcmp(name, "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp(name, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(name, "ndjson") == 0) {
+                format = FORMAT_NDJSON;
+            } else if (strcmp(name, "bin") == 0) {
+                format = FORMAT_BIN;
+            } else {
+                fputs("Option '--format' requires 'text', 'json', 'ndjson' or 'bin'\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            corpus_stats = true;
+        } else if (strcmp(argv[arg], "--stats-format") == 0) {
+            const char* stats_format = (arg + 1 < argc) ? argv[++arg] : "";
+            if (strcmp(stats_format, "json") == 0) {
+                stats_options.csv = false;
+            } else if (strcmp(stats_format, "csv") == 0) {
+                stats_options.csv = true;
+            } else {
+                fputs("Option '--stats-format' requires 'json' or 'csv'\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "-j") == 0 || strcmp(argv[arg], "--jobs") == 0) {
+            const char* option = argv[arg];
+            char* end = nullptr;
+            unsigned long value = (arg + 1 < argc) ? strtoul(argv[++arg], &end, 10) : 0;
+            if (!end || *end || end == argv[arg]) {
+                fprintf(stderr, "Option '%s' requires a number\n", option);
+                return 1;
+            }
+            stats_options.jobs = (unsigned)value;
         } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
-            fprintf(stderr, "Usage:  %s [options] input.pyc\n\n", argv[0]);
+            fprintf(stderr, "Usage:  %s [options] input.pyc\n", argv[0]);
+            fprintf(stderr, "        %s --stats [options] input.pyc|directory...\n\n", argv[0]);
             fputs("Options:\n", stderr);
             fputs("  -o <filename>  Write output to <filename> (default: stdout)\n", stderr);
             fputs("  -c             Specify loading a compiled code object. Requires the version to be set\n", stderr);
             fputs("  -v <x.y>       Specify a Python version for loading a compiled code object\n", stderr);
             fputs("  --pycode-extra Show extra fields in PyCode object dumps\n", stderr);
             fputs("  --show-caches  Don't suprress CACHE instructions in Python 3.11+ disassembly\n", stderr);
+            fputs("  --strict-unicode Fail on unicode strings that are not valid UTF-8\n", stderr);
+            fputs("  --decimal-longs  Print long integer constants in decimal instead of hex\n", stderr);
+            fputs("  --format <text|json|ndjson|bin>  Output format (default: text);\n"
+                  "                 bin is the binary format described in pyc_ir.h\n", stderr);
+            fputs("  --cache <dir>  Cache output in <dir> (default: $PYCDC_CACHE_DIR if set)\n", stderr);
+            fputs("  --cache-size <MB>  Maximum size of the cache (default: 1024)\n", stderr);
+            fputs("  --cache-stats  Print cache hit and miss counts to stderr\n", stderr);
+            fputs("  --stats        Count opcodes, bytecode sizes, constant types and code object\n"
+                  "                 depths for each Python version, instead of disassembling\n", stderr);
+            fputs("  --stats-format <json|csv>  Output format for --stats (default: json)\n", stderr);
+            fputs("  -j, --jobs <n> Files loaded in parallel by --stats (default: one per CPU)\n", stderr);
             fputs("  --help         Show this help text and then exit\n", stderr);
             return 0;
         } else if (argv[arg][0] == '-') {
@@ -311,7 +202,21 @@ int main(int argc, char* argv[])
             return 1;
         } else {
             infile = argv[arg];
+            inputs.push_back(infile);
+        }
+    }
+
+    if (corpus_stats) {
+        if (marshalled) {
+            fputs("Option '--stats' cannot be used with '-c'\n", stderr);
+            return 1;
         }
+        if (inputs.empty()) {
+            fputs("No input files specified\n", stderr);
+            return 1;
+        }
+        stats_options.strict_unicode = strict_unicode;
+        return corpus_stats_main(inputs, stats_options, *out_stream);
     }
 
     if (!infile) {
@@ -319,15 +224,8 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    PycModule mod;
-    if (!marshalled) {
-        try {
-            mod.loadFromFile(infile);
-        } catch (std::exception &ex) {
-            fprintf(stderr, "Error disassembling %s: %s\n", infile, ex.what());
-            return 1;
-        }
-    } else {
+    int major = 0, minor = 0;
+    if (marshalled) {
         if (!version) {
             fputs("Opening raw code objects requires a version to be specified\n", stderr);
             return 1;
@@ -338,22 +236,38 @@ int main(int argc, char* argv[])
             fputs("Unable to parse version string (use the format x.y)\n", stderr);
             return 1;
         }
-        int major = std::stoi(s.substr(0, dot));
-        int minor = std::stoi(s.substr(dot+1, s.size()));
-        mod.loadFromMarshalledFile(infile, major, minor);
+        major = std::stoi(s.substr(0, dot));
+        minor = std::stoi(s.substr(dot+1, s.size()));
     }
+
     const char* dispname = strrchr(infile, PATHSEP);
     dispname = (dispname == NULL) ? infile : dispname + 1;
-    formatted_print(*pyc_output, "%s (Python %d.%d%s)\n", dispname,
-                    mod.majorVer(), mod.minorVer(),
-                    (mod.majorVer() < 3 && mod.isUnicode()) ? " -U" : "");
-    try {
-        output_object(mod.code().try_cast<PycObject>(), &mod, 0, disasm_flags,
-                      *pyc_output);
-    } catch (std::exception& ex) {
-        fprintf(stderr, "Error disassembling %s: %s\n", infile, ex.what());
-        return 1;
+
+    if (!cache_dir)
+        cache_dir = getenv("PYCDC_CACHE_DIR");
+    if (cache_dir) {
+        PycCache cache;
+        if (cache.open(cache_dir, cache_size << 20, argv[0])) {
+            char options[64];
+            snprintf(options, sizeof(options), "pycdas %d %d.%d %d %d %u %d", marshalled,
+                     major, minor, strict_unicode, decimal_longs, disasm_flags, (int)format);
+            bool hit = false;
+            int status = cache.run(infile, std::string(options) + " " + dispname, *out_stream,
+                    [&](const std::string& contents, std::ostream& out, bool&) {
+                        return disassemble_file(infile, dispname, &contents, marshalled,
+                                                major, minor, strict_unicode,
+                                                decimal_longs, disasm_flags, format, out);
+                    }, hit);
+            if (cache_stats)
+                print_cache_stats(cache, hit);
+            if (status >= 0)
+                return status;
+        } else {
+            fprintf(stderr, "Unable to use cache directory %s\n", cache_dir);
+        }
     }
 
-    return 0;
+    return disassemble_file(infile, dispname, nullptr, marshalled, major, minor,
+                            strict_unicode, decimal_longs, disasm_flags, format,
+                            *out_stream);
 }
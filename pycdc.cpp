@@ -1,7 +1,13 @@
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include "ASTJson.h"
 #include "ASTree.h"
+#include "pyc_cache.h"
+#include "pyc_memstats.h"
+#include "pyc_trace.h"
+#include "serve.h"
 
 #ifdef WIN32
 #  define PATHSEP '\\'
@@ -9,13 +15,128 @@
 #  define PATHSEP '/'
 #endif
 
+static void print_cache_stats(const PycCache& cache, bool hit)
+{
+    PycCacheStats stats = cache.stats();
+    fprintf(stderr, "Cache %s (%llu hits, %llu misses, %llu entries, %llu bytes)\n",
+            hit ? "hit" : "miss", stats.hits, stats.misses, stats.entries, stats.bytes);
+}
+
+static void print_type_counts(PycMemStats::Kind kind, const char* (*type_name)(int))
+{
+    for (int type = 0; type < PycMemStats::NUM_TYPES; ++type) {
+        PycMemStats::Counts counts = PycMemStats::counts(kind, type);
+        if (counts.created == 0)
+            continue;
+        char name[64];
+        if (kind == PycMemStats::PYC_OBJECT)
+            snprintf(name, sizeof(name), "%s '%c'", type_name(type), type);
+        else
+            snprintf(name, sizeof(name), "%s", type_name(type));
+        fprintf(stderr, "  %-24s %10ld %10ld %12llu\n", name, counts.live, counts.peak,
+                counts.created);
+    }
+}
+
+static void print_mem_stats(const char* dispname, const PycModule& mod)
+{
+    fprintf(stderr, "Memory stats for %s:\n", dispname);
+    fprintf(stderr, "  %-24s %10s %10s %12s\n", "Type", "Live", "Peak", "Created");
+    print_type_counts(PycMemStats::PYC_OBJECT, &PycMemStats::objectTypeName);
+    print_type_counts(PycMemStats::AST_NODE, &ASTNode::typeName);
+
+    PycMemStats::ModuleBytes bytes = PycMemStats::measure(&mod);
+    fprintf(stderr, "  Strings: %lu, %llu bytes of contents\n", bytes.strings,
+            bytes.string_bytes);
+    fprintf(stderr, "  Tuples, lists, sets and dicts: %lu, %llu bytes of storage\n",
+            bytes.sequences, bytes.sequence_bytes);
+    fprintf(stderr, "  Code objects: %lu; other objects and tables: %llu bytes\n",
+            bytes.code_objects, bytes.other_bytes);
+
+    fprintf(stderr, "  %-32s %8s %10s %10s %10s %10s %12s\n", "Code object", "Bytecode",
+            "AST nodes", "Peak nodes", "Snapshots", "Max depth", "Peak hist B");
+    for (const auto& code : PycMemStats::takeCodeStats()) {
+        fprintf(stderr, "  %-32s %8d %10lu %10lu %10lu %10lu %12llu\n", code.name.c_str(),
+                code.code_size, code.nodes_created, code.peak_nodes, code.snapshots,
+                code.max_depth, code.peak_bytes);
+    }
+}
+
+/* Decompiles infile, or its already loaded contents if given */
+static int decompile_file(const char* infile, const char* dispname,
+                          const std::string* contents, bool marshalled, int major,
+                          int minor, bool strict_unicode, bool decimal_longs,
+                          bool emit_ast, std::ostream& out_stream)
+{
+    PycModule mod;
+    mod.setStrictUnicode(strict_unicode);
+    mod.setDecimalLongs(decimal_longs);
+    try {
+        if (contents && marshalled)
+            mod.loadFromMarshalledBuffer(contents->data(), (int)contents->size(), major, minor);
+        else if (contents)
+            mod.loadFromBuffer(contents->data(), (int)contents->size());
+        else if (marshalled)
+            mod.loadFromMarshalledFile(infile, major, minor);
+        else
+            mod.loadFromFile(infile);
+    } catch (std::exception& ex) {
+        fprintf(pyc_error_stream(), "Error loading file %s: %s\n", infile, ex.what());
+        return 1;
+    }
+
+    if (!mod.isValid()) {
+        fprintf(pyc_error_stream(), "Could not load file %s\n", infile);
+        return 1;
+    }
+    PycOutput pyc_output(out_stream);
+    if (emit_ast) {
+        try {
+            dump_ast_json(&mod, dispname, pyc_output);
+        } catch (std::exception& ex) {
+            fprintf(pyc_error_stream(), "Error decompyling %s: %s\n", infile, ex.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    pyc_output << "# Source Generated with Decompyle++\n";
+    formatted_print(pyc_output, "# File: %s (Python %d.%d%s)\n\n", dispname,
+                    mod.majorVer(), mod.minorVer(),
+                    (mod.majorVer() < 3 && mod.isUnicode()) ? " Unicode" : "");
+    int status = 0;
+    try {
+        decompyle(mod.code(), &mod, pyc_output);
+    } catch (std::exception& ex) {
+        fprintf(pyc_error_stream(), "Error decompyling %s: %s\n", infile, ex.what());
+        status = 1;
+    }
+
+    if (PycMemStats::enabled())
+        print_mem_stats(dispname, mod);
+    return status;
+}
+
 int main(int argc, char* argv[])
 {
     const char* infile = nullptr;
     bool marshalled = false;
+    bool strict_unicode = false;
+    bool decimal_longs = false;
     const char* version = nullptr;
-    std::ostream* pyc_output = &std::cout;
+    std::ostream* out_stream = &std::cout;
     std::ofstream out_file;
+    bool serve = false;
+    bool serve_worker = false;
+    ServeOptions serve_options;
+    const char* cache_dir = nullptr;
+    unsigned long long cache_size = 1024;
+    bool cache_stats = false;
+    const char* memo_file = nullptr;
+    const char* trace_file = nullptr;
+    DecompileBudget budget;
+    bool emit_ast = false;
+    bool streaming = false;
 
     for (int arg = 1; arg < argc; ++arg) {
         if (strcmp(argv[arg], "-o") == 0) {
@@ -27,7 +148,7 @@ int main(int argc, char* argv[])
                             filename);
                     return 1;
                 }
-                pyc_output = &out_file;
+                out_stream = &out_file;
             } else {
                 fputs("Option '-o' requires a filename\n", stderr);
                 return 1;
@@ -41,12 +162,119 @@ int main(int argc, char* argv[])
                 fputs("Option '-v' requires a version\n", stderr);
                 return 1;
             }
+        } else if (strcmp(argv[arg], "--strict-unicode") == 0) {
+            strict_unicode = true;
+        } else if (strcmp(argv[arg], "--decimal-longs") == 0) {
+            decimal_longs = true;
+        } else if (strcmp(argv[arg], "--cache") == 0) {
+            if (arg + 1 < argc) {
+                cache_dir = argv[++arg];
+            } else {
+                fputs("Option '--cache' requires a directory\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--cache-size") == 0) {
+            char* end = nullptr;
+            cache_size = (arg + 1 < argc) ? strtoull(argv[++arg], &end, 10) : 0;
+            if (!end || *end || end == argv[arg]) {
+                fputs("Option '--cache-size' requires a size in MB\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--cache-stats") == 0) {
+            cache_stats = true;
+        } else if (strcmp(argv[arg], "--memo") == 0) {
+            if (arg + 1 < argc) {
+                memo_file = argv[++arg];
+            } else {
+                fputs("Option '--memo' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--mem-stats") == 0) {
+            PycMemStats::enable();
+        } else if (strcmp(argv[arg], "--trace") == 0) {
+            if (arg + 1 < argc) {
+                trace_file = argv[++arg];
+            } else {
+                fputs("Option '--trace' requires a filename\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--emit-ast") == 0
+                   || strncmp(argv[arg], "--emit-ast=", 11) == 0) {
+            const char* format = (argv[arg][10] == '=') ? argv[arg] + 11
+                               : (arg + 1 < argc) ? argv[++arg] : "";
+            if (strcmp(format, "json") != 0) {
+                fputs("Option '--emit-ast' requires 'json'\n", stderr);
+                return 1;
+            }
+            emit_ast = true;
+        } else if (strcmp(argv[arg], "--stream") == 0) {
+            streaming = true;
+        } else if (strcmp(argv[arg], "--serve") == 0) {
+            serve = true;
+        } else if (strcmp(argv[arg], "--serve-worker") == 0) {
+            serve_worker = true;
+        } else if (strcmp(argv[arg], "--socket") == 0) {
+            if (arg + 1 < argc) {
+                serve_options.socket_path = argv[++arg];
+            } else {
+                fputs("Option '--socket' requires a path\n", stderr);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--workers") == 0
+                || strcmp(argv[arg], "--timeout") == 0
+                || strcmp(argv[arg], "--max-memory") == 0
+                || strcmp(argv[arg], "--budget-steps") == 0
+                || strcmp(argv[arg], "--budget-nodes") == 0
+                || strcmp(argv[arg], "--budget-time") == 0) {
+            const char* option = argv[arg];
+            char* end = nullptr;
+            unsigned long value = (arg + 1 < argc) ? strtoul(argv[++arg], &end, 10) : 0;
+            if (!end || *end || end == argv[arg]) {
+                fprintf(stderr, "Option '%s' requires a number\n", option);
+                return 1;
+            }
+            if (strcmp(option, "--workers") == 0)
+                serve_options.workers = (unsigned)value;
+            else if (strcmp(option, "--timeout") == 0)
+                serve_options.timeout_ms = (unsigned)value;
+            else if (strcmp(option, "--max-memory") == 0)
+                serve_options.max_memory_mb = (unsigned)value;
+            else if (strcmp(option, "--budget-steps") == 0)
+                budget.max_steps = value;
+            else if (strcmp(option, "--budget-nodes") == 0)
+                budget.max_nodes = value;
+            else
+                budget.max_time_ms = value;
         } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
             fprintf(stderr, "Usage:  %s [options] input.pyc\n\n", argv[0]);
             fputs("Options:\n", stderr);
             fputs("  -o <filename>  Write output to <filename> (default: stdout)\n", stderr);
             fputs("  -c             Specify loading a compiled code object. Requires the version to be set\n", stderr);
             fputs("  -v <x.y>       Specify a Python version for loading a compiled code object\n", stderr);
+            fputs("  --strict-unicode Fail on unicode strings that are not valid UTF-8\n", stderr);
+            fputs("  --decimal-longs  Print long integer constants in decimal instead of hex\n", stderr);
+            fputs("  --cache <dir>  Cache output in <dir> (default: $PYCDC_CACHE_DIR if set);\n"
+                  "                 not used with --budget-time, --mem-stats or --trace\n", stderr);
+            fputs("  --cache-size <MB>  Maximum size of the cache (default: 1024)\n", stderr);
+            fputs("  --cache-stats  Print cache (and memo) hit and miss counts to stderr\n", stderr);
+            fputs("  --memo <file>  Reuse the output for functions decompiled before,\n"
+                  "                 remembered in <file>\n", stderr);
+            fputs("  --mem-stats    Print object counts and memory use for the module and\n"
+                  "                 each code object to stderr\n", stderr);
+            fputs("  --trace <file> Write a Chrome trace of the time spent loading, building\n"
+                  "                 and printing each code object to <file>\n", stderr);
+            fputs("  --emit-ast json  Write the decompiled syntax tree as JSON instead of source\n", stderr);
+            fputs("  --stream       Print each statement as soon as it is decompiled, using\n"
+                  "                 less memory for very large modules\n", stderr);
+            fputs("  --budget-steps <n>  Abandon functions that take more than <n>\n"
+                  "                 instructions to decompile (default: 0, no limit)\n", stderr);
+            fputs("  --budget-nodes <n>  Abandon functions that create more than <n> AST nodes\n", stderr);
+            fputs("  --budget-time <ms>  Abandon functions that take longer than <ms> to decompile\n", stderr);
+            fputs("  --serve        Run as a decompile server (see serve.h for the protocol)\n", stderr);
+            fputs("  --socket <path>  Listen on a Unix socket instead of stdin/stdout\n", stderr);
+            fputs("  --workers <n>  Number of worker processes (default: one per CPU)\n", stderr);
+            fputs("  --timeout <ms> Default request timeout, 0 for none (default: 30000)\n", stderr);
+            fputs("  --max-memory <MB>  Default request memory budget, 0 for none (default: 0)\n", stderr);
             fputs("  --help         Show this help text and then exit\n", stderr);
             return 0;
         } else {
@@ -54,20 +282,21 @@ int main(int argc, char* argv[])
         }
     }
 
+    set_decompile_budget(budget);
+    set_decompile_streaming(streaming);
+    serve_options.budget = budget;
+    if (serve_worker)
+        return serve_worker_main(serve_options);
+    if (serve)
+        return serve_main(argv[0], serve_options);
+
     if (!infile) {
         fputs("No input file specified\n", stderr);
         return 1;
     }
 
-    PycModule mod;
-    if (!marshalled) {
-        try {
-            mod.loadFromFile(infile);
-        } catch (std::exception& ex) {
-            fprintf(stderr, "Error loading file %s: %s\n", infile, ex.what());
-            return 1;
-        }
-    } else {
+    int major = 0, minor = 0;
+    if (marshalled) {
         if (!version) {
             fputs("Opening raw code objects requires a version to be specified\n", stderr);
             return 1;
@@ -78,27 +307,81 @@ int main(int argc, char* argv[])
             fputs("Unable to parse version string (use the format x.y)\n", stderr);
             return 1;
         }
-        int major = std::stoi(s.substr(0, dot));
-        int minor = std::stoi(s.substr(dot+1, s.size()));
-        mod.loadFromMarshalledFile(infile, major, minor);
+        major = std::stoi(s.substr(0, dot));
+        minor = std::stoi(s.substr(dot+1, s.size()));
     }
 
-    if (!mod.isValid()) {
-        fprintf(stderr, "Could not load file %s\n", infile);
-        return 1;
-    }
     const char* dispname = strrchr(infile, PATHSEP);
     dispname = (dispname == NULL) ? infile : dispname + 1;
-    *pyc_output << "# Source Generated with Decompyle++\n";
-    formatted_print(*pyc_output, "# File: %s (Python %d.%d%s)\n\n", dispname,
-                    mod.majorVer(), mod.minorVer(),
-                    (mod.majorVer() < 3 && mod.isUnicode()) ? " Unicode" : "");
-    try {
-        decompyle(mod.code(), &mod, *pyc_output);
-    } catch (std::exception& ex) {
-        fprintf(stderr, "Error decompyling %s: %s\n", infile, ex.what());
-        return 1;
+
+    DecompileMemo memo;
+    uint64_t build_id = 0;
+    if (memo_file) {
+        if (PycCache::buildId(argv[0], build_id)) {
+            // A missing memo file, or one from another build, starts empty
+            memo.load(memo_file, build_id);
+            set_decompile_memo(&memo);
+        } else {
+            fputs("Unable to determine the build ID; not using --memo\n", stderr);
+            memo_file = nullptr;
+        }
     }
 
-    return 0;
+    if (trace_file)
+        PycTrace::start(trace_file);
+
+    int status = -1;
+    if (!cache_dir)
+        cache_dir = getenv("PYCDC_CACHE_DIR");
+    if (cache_dir && (budget.max_time_ms || PycMemStats::enabled() || trace_file)) {
+        // The output may differ between runs, or the stats or trace would
+        // be missing when the output comes from the cache
+        if (cache_stats)
+            fputs("Cache not used with --budget-time, --mem-stats or --trace\n", stderr);
+        cache_dir = nullptr;
+    }
+    if (cache_dir) {
+        PycCache cache;
+        if (cache.open(cache_dir, cache_size << 20, argv[0])) {
+            char options[128];
+            snprintf(options, sizeof(options), "pycdc %d %d.%d %d %d %lu %lu %lu %d %d",
+                     marshalled, major, minor, strict_unicode, decimal_longs,
+                     budget.max_steps, budget.max_nodes, budget.max_time_ms, emit_ast,
+                     streaming);
+            bool hit = false;
+            status = cache.run(infile, std::string(options) + " " + dispname, *out_stream,
+                    [&](const std::string& contents, std::ostream& out, bool& cacheable) {
+                        // Don't keep stubs for functions abandoned over
+                        // budget; they are decompiled again next time
+                        unsigned long exceeded = decompile_budget_exceeded();
+                        int result = decompile_file(infile, dispname, &contents, marshalled,
+                                                    major, minor, strict_unicode,
+                                                    decimal_longs, emit_ast, out);
+                        cacheable = decompile_budget_exceeded() == exceeded;
+                        return result;
+                    }, hit);
+            if (cache_stats)
+                print_cache_stats(cache, hit);
+        } else {
+            fprintf(stderr, "Unable to use cache directory %s\n", cache_dir);
+        }
+    }
+    if (status < 0) {
+        status = decompile_file(infile, dispname, nullptr, marshalled, major, minor,
+                                strict_unicode, decimal_longs, emit_ast, *out_stream);
+    }
+
+    if (trace_file && !PycTrace::stop())
+        fprintf(stderr, "Error writing trace file %s\n", trace_file);
+
+    if (memo_file) {
+        set_decompile_memo(nullptr);
+        if (cache_stats) {
+            fprintf(stderr, "Memo: %lu hits, %lu misses, %zu entries\n",
+                    memo.hits(), memo.misses(), memo.entries());
+        }
+        if (!memo.save(memo_file, build_id))
+            fprintf(stderr, "Error writing memo file %s\n", memo_file);
+    }
+    return status;
 }
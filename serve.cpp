@@ -0,0 +1,878 @@
+#include "serve.h"
+#include <cstdio>
+
+#ifdef _WIN32
+
+int serve_main(const char*, const ServeOptions&)
+{
+    fputs("--serve is not supported on this platform\n", stderr);
+    return 1;
+}
+
+int serve_worker_main(const ServeOptions&)
+{
+    return serve_main(nullptr, ServeOptions());
+}
+
+#else
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ASTree.h"
+#include "bytecode.h"
+#include "disasm.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// Frames larger than this are treated as a protocol error
+static const uint32_t MAX_FRAME_SIZE = 512 * 1024 * 1024;
+
+// Requests a connection may have in flight before we stop reading from it
+static const size_t MAX_PIPELINED = 64;
+
+static bool read_full(int fd, void* buffer, size_t size)
+{
+    char* p = static_cast<char*>(buffer);
+    while (size > 0) {
+        ssize_t count = read(fd, p, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        p += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* buffer, size_t size)
+{
+    const char* p = static_cast<const char*>(buffer);
+    while (size > 0) {
+        ssize_t count = write(fd, p, size);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return false;
+        p += count;
+        size -= (size_t)count;
+    }
+    return true;
+}
+
+static uint32_t decode_size(const unsigned char* header)
+{
+    return header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+}
+
+static bool read_frame(int fd, std::string& frame)
+{
+    unsigned char header[4];
+    if (!read_full(fd, header, sizeof(header)))
+        return false;
+    uint32_t size = decode_size(header);
+    if (size > MAX_FRAME_SIZE)
+        return false;
+    frame.resize(size);
+    return size == 0 || read_full(fd, &frame[0], size);
+}
+
+static bool write_frame(int fd, const std::string& frame)
+{
+    uint32_t size = (uint32_t)frame.size();
+    unsigned char header[4] = {
+        (unsigned char)size, (unsigned char)(size >> 8),
+        (unsigned char)(size >> 16), (unsigned char)(size >> 24),
+    };
+    return write_full(fd, header, sizeof(header))
+            && write_full(fd, frame.data(), frame.size());
+}
+
+static std::string make_response(const char* error, const std::string& output,
+                                 const std::string& diagnostics)
+{
+    char header[64];
+    snprintf(header, sizeof(header), error ? "ERROR %zu %zu " : "OK %zu %zu",
+             output.size(), diagnostics.size());
+    std::string response = header;
+    if (error) {
+        // The message has to stay on the header line
+        for (const char* p = error; *p; ++p)
+            response += (*p == '\n') ? ' ' : *p;
+    }
+    response += '\n';
+    response += output;
+    response += diagnostics;
+    return response;
+}
+
+struct Request {
+    Request()
+        : major(-1), minor(-1), strict_unicode(), decimal_longs(),
+          disasm_flags(), timeout_ms(-1), max_memory_mb(-1), budget_steps(-1),
+          budget_nodes(-1), budget_time_ms(-1), payload_offset() { }
+
+    std::string command;
+    std::string only;
+    std::string name;
+    int major, minor;
+    bool strict_unicode;
+    bool decimal_longs;
+    unsigned disasm_flags;
+    long timeout_ms;
+    long max_memory_mb;
+    long budget_steps, budget_nodes, budget_time_ms;
+    size_t payload_offset;
+};
+
+static bool parse_number(const std::string& text, long& value)
+{
+    if (text.empty() || text.size() > 9
+            || text.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    value = strtol(text.c_str(), nullptr, 10);
+    return true;
+}
+
+/* Returns an empty string on success, or a description of the problem */
+static std::string parse_request(const std::string& frame, Request& req)
+{
+    size_t eol = frame.find('\n');
+    if (eol == std::string::npos)
+        return "Missing request header";
+    req.payload_offset = eol + 1;
+
+    std::istringstream words(frame.substr(0, eol));
+    if (!(words >> req.command))
+        return "Empty request header";
+    if (req.command != "decompile" && req.command != "disassemble"
+            && req.command != "stats")
+        return "Unknown command '" + req.command + "'";
+
+    req.name = "<input>";
+    std::string word;
+    while (words >> word) {
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        std::string value = (eq == std::string::npos) ? std::string() : word.substr(eq + 1);
+        if (word == "strict-unicode") {
+            req.strict_unicode = true;
+        } else if (word == "decimal-longs") {
+            req.decimal_longs = true;
+        } else if (word == "pycode-verbose") {
+            req.disasm_flags |= Pyc::DISASM_PYCODE_VERBOSE;
+        } else if (word == "show-caches") {
+            req.disasm_flags |= Pyc::DISASM_SHOW_CACHES;
+        } else if (eq == std::string::npos || value.empty()) {
+            return "Unknown option '" + word + "'";
+        } else if (key == "only") {
+            req.only = value;
+        } else if (key == "name") {
+            req.name = value;
+        } else if (key == "version") {
+            size_t dot = value.find('.');
+            long major, minor;
+            if (dot == std::string::npos || !parse_number(value.substr(0, dot), major)
+                    || !parse_number(value.substr(dot + 1), minor))
+                return "Unable to parse version string (use the format x.y)";
+            req.major = (int)major;
+            req.minor = (int)minor;
+        } else if (key == "timeout") {
+            if (!parse_number(value, req.timeout_ms))
+                return "Invalid timeout '" + value + "'";
+        } else if (key == "max-memory") {
+            if (!parse_number(value, req.max_memory_mb))
+                return "Invalid memory budget '" + value + "'";
+        } else if (key == "budget-steps") {
+            if (!parse_number(value, req.budget_steps))
+                return "Invalid step budget '" + value + "'";
+        } else if (key == "budget-nodes") {
+            if (!parse_number(value, req.budget_nodes))
+                return "Invalid node budget '" + value + "'";
+        } else if (key == "budget-time") {
+            if (!parse_number(value, req.budget_time_ms))
+                return "Invalid time budget '" + value + "'";
+        } else {
+            return "Unknown option '" + word + "'";
+        }
+    }
+    return std::string();
+}
+
+/* Size of the process's address space, which RLIMIT_AS applies to.  This
+ * is only available on Linux; elsewhere memory budgets are not enforced. */
+static bool address_space_size(rlim_t& size)
+{
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return false;
+    unsigned long pages;
+    bool ok = (fscanf(statm, "%lu", &pages) == 1);
+    fclose(statm);
+    size = (rlim_t)pages * (rlim_t)sysconf(_SC_PAGESIZE);
+    return ok;
+}
+
+/* Limits the address space of the worker process to its size at startup
+ * plus a budget for as long as it is alive, so that a request which needs
+ * more fails with std::bad_alloc.  Memory freed by earlier requests stays
+ * mapped and is reused, so it is measured from startup rather than from
+ * the start of each request. */
+class MemoryBudget {
+public:
+    MemoryBudget(rlim_t baseline, long megabytes) : m_active()
+    {
+        if (baseline == 0 || megabytes <= 0 || getrlimit(RLIMIT_AS, &m_saved) != 0)
+            return;
+
+        struct rlimit limit = m_saved;
+        limit.rlim_cur = baseline + ((rlim_t)megabytes << 20);
+        if (m_saved.rlim_max != RLIM_INFINITY && limit.rlim_cur > m_saved.rlim_max)
+            limit.rlim_cur = m_saved.rlim_max;
+        m_active = (setrlimit(RLIMIT_AS, &limit) == 0);
+    }
+
+    ~MemoryBudget()
+    {
+        if (m_active)
+            setrlimit(RLIMIT_AS, &m_saved);
+    }
+
+private:
+    struct rlimit m_saved;
+    bool m_active;
+};
+
+/* Find a code object by its dotted name within the module, e.g. "Class.method" */
+static PycRef<PycCode> find_code(PycRef<PycCode> code, const std::string& path)
+{
+    size_t dot = path.find('.');
+    std::string name = path.substr(0, dot);
+    PycRef<PycSequence> consts = code->consts();
+    for (int i = 0; consts != NULL && i < consts->size(); ++i) {
+        PycRef<PycCode> child = consts->get(i).try_cast<PycCode>();
+        if (child == NULL || child->name() == NULL || child->name()->strValue() != name)
+            continue;
+        if (dot == std::string::npos)
+            return child;
+        PycRef<PycCode> found = find_code(child, path.substr(dot + 1));
+        if (found != NULL)
+            return found;
+    }
+    return NULL;
+}
+
+/* Returns an empty string on success, or a description of the problem */
+static std::string process_request(const Request& req, const std::string& frame,
+                                   std::ostream& out_stream)
+{
+    const char* payload = frame.data() + req.payload_offset;
+    int size = (int)(frame.size() - req.payload_offset);
+
+    PycModule mod;
+    mod.setStrictUnicode(req.strict_unicode);
+    mod.setDecimalLongs(req.decimal_longs);
+    if (req.major >= 0)
+        mod.loadFromMarshalledBuffer(payload, size, req.major, req.minor);
+    else
+        mod.loadFromBuffer(payload, size);
+    if (!mod.isValid())
+        return "Could not load " + req.name;
+
+    PycRef<PycCode> code = mod.code();
+    if (!req.only.empty()) {
+        code = find_code(code, req.only);
+        if (code == NULL)
+            return "No code object named '" + req.only + "'";
+    }
+
+    PycOutput pyc_output(out_stream);
+    if (req.command == "decompile") {
+        pyc_output << "# Source Generated with Decompyle++\n";
+        formatted_print(pyc_output, "# File: %s (Python %d.%d%s)\n\n", req.name.c_str(),
+                        mod.majorVer(), mod.minorVer(),
+                        (mod.majorVer() < 3 && mod.isUnicode()) ? " Unicode" : "");
+        DecompileScope scope;
+        decompyle(code, &mod, pyc_output);
+    } else {
+        formatted_print(pyc_output, "%s (Python %d.%d%s)\n", req.name.c_str(),
+                        mod.majorVer(), mod.minorVer(),
+                        (mod.majorVer() < 3 && mod.isUnicode()) ? " -U" : "");
+        output_object(code.cast<PycObject>(), &mod, 0, req.disasm_flags, pyc_output);
+    }
+    return std::string();
+}
+
+static std::string run_request(const std::string& frame, rlim_t baseline,
+                               const ServeOptions& defaults, FILE* diagnostics)
+{
+    Request req;
+    std::string error = parse_request(frame, req);
+    if (!error.empty())
+        return make_response(error.c_str(), std::string(), std::string());
+
+    rewind(diagnostics);
+    if (ftruncate(fileno(diagnostics), 0) != 0)
+        return make_response(strerror(errno), std::string(), std::string());
+
+    DecompileBudget func_budget = defaults.budget;
+    if (req.budget_steps >= 0)
+        func_budget.max_steps = (unsigned long)req.budget_steps;
+    if (req.budget_nodes >= 0)
+        func_budget.max_nodes = (unsigned long)req.budget_nodes;
+    if (req.budget_time_ms >= 0)
+        func_budget.max_time_ms = (unsigned long)req.budget_time_ms;
+    set_decompile_budget(func_budget);
+
+    std::ostringstream output;
+    {
+        MemoryBudget budget(baseline, req.max_memory_mb >= 0 ? req.max_memory_mb
+                                                              : (long)defaults.max_memory_mb);
+        try {
+            error = process_request(req, frame, output);
+        } catch (std::bad_alloc&) {
+            error = "Memory budget exceeded";
+        } catch (std::exception& ex) {
+            error = ex.what();
+        }
+    }
+
+    fflush(diagnostics);
+    std::string diag_text((size_t)ftell(diagnostics), '\0');
+    rewind(diagnostics);
+    if (!diag_text.empty() && fread(&diag_text[0], 1, diag_text.size(), diagnostics) != diag_text.size())
+        diag_text.clear();
+    return make_response(error.empty() ? nullptr : error.c_str(), output.str(), diag_text);
+}
+
+int serve_worker_main(const ServeOptions& options)
+{
+    signal(SIGPIPE, SIG_IGN);
+    FILE* diagnostics = tmpfile();
+    if (!diagnostics) {
+        perror("tmpfile");
+        return 1;
+    }
+    set_pyc_error_stream(diagnostics);
+
+    // Functions seen in earlier requests are printed from memory.  This is
+    // kept small, since it counts against the memory budget of requests.
+    DecompileMemo memo(32 * 1024 * 1024);
+    set_decompile_memo(&memo);
+
+    rlim_t baseline;
+    if (!address_space_size(baseline))
+        baseline = 0;
+
+    std::string frame;
+    while (read_frame(STDIN_FILENO, frame)) {
+        if (!write_frame(STDOUT_FILENO, run_request(frame, baseline, options, diagnostics)))
+            break;
+    }
+    set_decompile_memo(nullptr);
+    fclose(diagnostics);
+    return 0;
+}
+
+class ServerStats {
+public:
+    enum Outcome { OK, ERROR, TIMEOUT, CRASH };
+
+    ServerStats()
+        : m_started(Clock::now()), m_counts(), m_bytesIn(), m_bytesOut(),
+          m_nextLatency() { }
+
+    void record(Outcome outcome, Clock::duration latency, size_t bytes_in,
+                size_t bytes_out)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_counts[outcome];
+        m_bytesIn += bytes_in;
+        m_bytesOut += bytes_out;
+
+        double ms = std::chrono::duration<double, std::milli>(latency).count();
+        if (m_latencies.size() < LATENCY_WINDOW) {
+            m_latencies.push_back(ms);
+        } else {
+            m_latencies[m_nextLatency] = ms;
+            m_nextLatency = (m_nextLatency + 1) % LATENCY_WINDOW;
+        }
+    }
+
+    std::string report(unsigned workers)
+    {
+        std::vector<double> latencies;
+        unsigned long counts[4];
+        unsigned long long bytes_in, bytes_out;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            latencies = m_latencies;
+            std::copy(m_counts, m_counts + 4, counts);
+            bytes_in = m_bytesIn;
+            bytes_out = m_bytesOut;
+        }
+        std::sort(latencies.begin(), latencies.end());
+
+        double uptime = std::chrono::duration<double>(Clock::now() - m_started).count();
+        unsigned long requests = counts[OK] + counts[ERROR] + counts[TIMEOUT] + counts[CRASH];
+        char text[1024];
+        snprintf(text, sizeof(text),
+                 "uptime_s %.3f\n"
+                 "workers %u\n"
+                 "requests %lu\n"
+                 "ok %lu\n"
+                 "errors %lu\n"
+                 "timeouts %lu\n"
+                 "crashes %lu\n"
+                 "bytes_in %llu\n"
+                 "bytes_out %llu\n"
+                 "throughput_rps %.3f\n"
+                 "latency_window %zu\n"
+                 "latency_ms_p50 %.3f\n"
+                 "latency_ms_p90 %.3f\n"
+                 "latency_ms_p99 %.3f\n"
+                 "latency_ms_max %.3f\n",
+                 uptime, workers, requests, counts[OK], counts[ERROR],
+                 counts[TIMEOUT], counts[CRASH], bytes_in, bytes_out,
+                 uptime > 0 ? requests / uptime : 0.0, latencies.size(),
+                 percentile(latencies, 50), percentile(latencies, 90),
+                 percentile(latencies, 99), percentile(latencies, 100));
+        return text;
+    }
+
+private:
+    // Latency percentiles are taken over this many of the latest requests
+    static const size_t LATENCY_WINDOW = 10000;
+
+    static double percentile(const std::vector<double>& sorted, unsigned pct)
+    {
+        if (sorted.empty())
+            return 0.0;
+        size_t rank = (sorted.size() * pct + 99) / 100;
+        return sorted[rank ? rank - 1 : 0];
+    }
+
+    std::mutex m_mutex;
+    Clock::time_point m_started;
+    unsigned long m_counts[4];
+    unsigned long long m_bytesIn, m_bytesOut;
+    std::vector<double> m_latencies;
+    size_t m_nextLatency;
+};
+
+struct Job {
+    std::string request;
+    unsigned timeout_ms;
+    Clock::time_point received;
+    std::promise<std::string> response;
+};
+
+class JobQueue {
+public:
+    JobQueue() : m_closed() { }
+
+    void push(std::shared_ptr<Job> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(std::move(job));
+        }
+        m_ready.notify_one();
+    }
+
+    /* Returns NULL once the queue is closed and empty */
+    std::shared_ptr<Job> pop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_ready.wait(lock, [this] { return !m_jobs.empty() || m_closed; });
+        if (m_jobs.empty())
+            return nullptr;
+        std::shared_ptr<Job> job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        return job;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closed = true;
+        }
+        m_ready.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<std::shared_ptr<Job>> m_jobs;
+    bool m_closed;
+};
+
+/* A worker process, running "pycdc --serve-worker" with requests on its
+ * stdin and responses on its stdout.  It is restarted after a timeout or
+ * crash. */
+class WorkerProcess {
+public:
+    WorkerProcess(const char* exe, const char* argv0, const ServeOptions& options)
+        : m_exe(exe), m_pid(-1), m_toWorker(-1), m_fromWorker(-1)
+    {
+        m_args.push_back(argv0);
+        m_args.push_back("--serve-worker");
+        m_args.push_back("--max-memory");
+        m_args.push_back(std::to_string(options.max_memory_mb));
+        m_args.push_back("--budget-steps");
+        m_args.push_back(std::to_string(options.budget.max_steps));
+        m_args.push_back("--budget-nodes");
+        m_args.push_back(std::to_string(options.budget.max_nodes));
+        m_args.push_back("--budget-time");
+        m_args.push_back(std::to_string(options.budget.max_time_ms));
+
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        m_maxFd = (max_fd < 0 || max_fd > 65536) ? 65536 : (int)max_fd;
+    }
+
+    ~WorkerProcess() { stop(false); }
+
+    WorkerProcess(const WorkerProcess&) = delete;
+    WorkerProcess& operator=(const WorkerProcess&) = delete;
+
+    bool start()
+    {
+        if (m_pid >= 0)
+            return true;
+
+        // Build everything before forking, since the child may only make
+        // async-signal-safe calls before exec
+        std::vector<char*> argv;
+        for (auto& arg : m_args)
+            argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+
+        int to_worker[2], from_worker[2];
+        if (pipe(to_worker) != 0)
+            return false;
+        if (pipe(from_worker) != 0) {
+            close(to_worker[0]);
+            close(to_worker[1]);
+            return false;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(to_worker[0], STDIN_FILENO);
+            dup2(from_worker[1], STDOUT_FILENO);
+            // Don't hold other workers' pipes or client connections open
+            for (int fd = STDERR_FILENO + 1; fd < m_maxFd; ++fd)
+                close(fd);
+            execv(m_exe, argv.data());
+            _exit(127);
+        }
+
+        close(to_worker[0]);
+        close(from_worker[1]);
+        if (pid < 0) {
+            close(to_worker[1]);
+            close(from_worker[0]);
+            return false;
+        }
+        m_pid = pid;
+        m_toWorker = to_worker[1];
+        m_fromWorker = from_worker[0];
+        return true;
+    }
+
+    /* Returns the worker's wait status */
+    int stop(bool force)
+    {
+        if (m_pid < 0)
+            return 0;
+        close(m_toWorker);
+        close(m_fromWorker);
+        if (force)
+            kill(m_pid, SIGKILL);
+        int status = 0;
+        while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) { }
+        m_pid = -1;
+        return status;
+    }
+
+    std::string run(const std::string& request, unsigned timeout_ms,
+                    ServerStats::Outcome& outcome)
+    {
+        outcome = ServerStats::CRASH;
+        if (!start())
+            return make_response("Unable to start a worker process", std::string(), std::string());
+
+        Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        unsigned char header[4];
+        std::string response;
+        ReadResult result = ReadClosed;
+        if (write_frame(m_toWorker, request)) {
+            result = readWithDeadline(header, sizeof(header), timeout_ms, deadline);
+            uint32_t size = decode_size(header);
+            if (result == ReadOk && size > MAX_FRAME_SIZE)
+                result = ReadClosed;
+            if (result == ReadOk && size > 0) {
+                response.resize(size);
+                result = readWithDeadline(&response[0], size, timeout_ms, deadline);
+            }
+        }
+
+        char message[64];
+        switch (result) {
+        case ReadOk:
+            outcome = (response.compare(0, 3, "OK ") == 0) ? ServerStats::OK
+                                                             : ServerStats::ERROR;
+            return response;
+        case ReadTimeout:
+            stop(true);
+            outcome = ServerStats::TIMEOUT;
+            snprintf(message, sizeof(message), "Timed out after %u ms", timeout_ms);
+            return make_response(message, std::string(), std::string());
+        case ReadClosed:
+        default:
+            {
+                int status = stop(true);
+                if (WIFSIGNALED(status))
+                    snprintf(message, sizeof(message), "Worker crashed (signal %d)", WTERMSIG(status));
+                else
+                    snprintf(message, sizeof(message), "Worker exited (status %d)", WEXITSTATUS(status));
+                return make_response(message, std::string(), std::string());
+            }
+        }
+    }
+
+private:
+    enum ReadResult { ReadOk, ReadClosed, ReadTimeout };
+
+    ReadResult readWithDeadline(void* buffer, size_t size, unsigned timeout_ms,
+                                Clock::time_point deadline)
+    {
+        char* p = static_cast<char*>(buffer);
+        while (size > 0) {
+            int wait_ms = -1;
+            if (timeout_ms) {
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        deadline - Clock::now()).count();
+                if (remaining <= 0)
+                    return ReadTimeout;
+                wait_ms = (int)std::min<decltype(remaining)>(remaining, 1000 * 1000);
+            }
+            struct pollfd pfd = { m_fromWorker, POLLIN, 0 };
+            int ready = poll(&pfd, 1, wait_ms);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready < 0)
+                return ReadClosed;
+            if (ready == 0)
+                continue;
+            ssize_t count = read(m_fromWorker, p, size);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return ReadClosed;
+            p += count;
+            size -= (size_t)count;
+        }
+        return ReadOk;
+    }
+
+    const char* m_exe;
+    std::vector<std::string> m_args;
+    int m_maxFd;
+    pid_t m_pid;
+    int m_toWorker, m_fromWorker;
+};
+
+static void dispatch_jobs(JobQueue& queue, WorkerProcess& worker, ServerStats& stats)
+{
+    worker.start();
+    while (std::shared_ptr<Job> job = queue.pop()) {
+        ServerStats::Outcome outcome;
+        std::string response = worker.run(job->request, job->timeout_ms, outcome);
+        stats.record(outcome, Clock::now() - job->received, job->request.size(),
+                     response.size());
+        job->response.set_value(std::move(response));
+    }
+    worker.stop(false);
+}
+
+struct Server {
+    const ServeOptions* options;
+    unsigned workers;
+    JobQueue queue;
+    ServerStats stats;
+};
+
+static void serve_connection(int in_fd, int out_fd, Server& server)
+{
+    // Responses are written from a separate thread in request order, so that
+    // clients can pipeline requests to keep several workers busy
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::future<std::string>> pending;
+    bool done = false;
+
+    std::thread writer([&] {
+        bool connected = true;
+        for ( ;; ) {
+            std::future<std::string> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return !pending.empty() || done; });
+                if (pending.empty())
+                    return;
+                next = std::move(pending.front());
+                pending.pop_front();
+            }
+            changed.notify_all();
+            std::string response = next.get();
+            if (connected)
+                connected = write_frame(out_fd, response);
+        }
+    });
+
+    std::string frame;
+    while (read_frame(in_fd, frame)) {
+        Request req;
+        std::string error = parse_request(frame, req);
+        std::future<std::string> response;
+        if (!error.empty()) {
+            std::promise<std::string> immediate;
+            immediate.set_value(make_response(error.c_str(), std::string(), std::string()));
+            response = immediate.get_future();
+        } else if (req.command == "stats") {
+            // Deferred, so the report is made by the writer once the replies
+            // queued before it are done, and includes those requests
+            response = std::async(std::launch::deferred, [&server] {
+                return make_response(nullptr, server.stats.report(server.workers),
+                                     std::string());
+            });
+        } else {
+            std::shared_ptr<Job> job = std::make_shared<Job>();
+            job->request.swap(frame);
+            job->timeout_ms = (req.timeout_ms >= 0) ? (unsigned)req.timeout_ms
+                                                    : server.options->timeout_ms;
+            job->received = Clock::now();
+            response = job->response.get_future();
+            server.queue.push(std::move(job));
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return pending.size() < MAX_PIPELINED; });
+        pending.push_back(std::move(response));
+        changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    changed.notify_all();
+    writer.join();
+}
+
+static int listen_unix(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace a socket left behind by a previous server
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Unable to listen on '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve_main(const char* argv0, const ServeOptions& options)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = -1;
+    if (options.socket_path) {
+        listener = listen_unix(options.socket_path);
+        if (listener < 0)
+            return 1;
+    }
+
+    Server server;
+    server.options = &options;
+    server.workers = options.workers ? options.workers : std::thread::hardware_concurrency();
+    if (server.workers == 0)
+        server.workers = 1;
+
+    // Workers run this same executable
+    const char* exe = (access("/proc/self/exe", X_OK) == 0) ? "/proc/self/exe" : argv0;
+    std::vector<std::unique_ptr<WorkerProcess>> processes;
+    std::vector<std::thread> dispatchers;
+    for (unsigned i = 0; i < server.workers; ++i) {
+        processes.emplace_back(new WorkerProcess(exe, argv0, options));
+        dispatchers.emplace_back(dispatch_jobs, std::ref(server.queue),
+                                 std::ref(*processes.back()), std::ref(server.stats));
+    }
+
+    if (listener < 0) {
+        serve_connection(STDIN_FILENO, STDOUT_FILENO, server);
+    } else {
+        fprintf(stderr, "Listening on %s\n", options.socket_path);
+        for ( ;; ) {
+            int conn = accept(listener, nullptr, nullptr);
+            if (conn < 0) {
+                if (errno != EINTR) {
+                    perror("accept");
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                continue;
+            }
+            std::thread([conn, &server] {
+                serve_connection(conn, conn, server);
+                close(conn);
+            }).detach();
+        }
+    }
+
+    server.queue.close();
+    for (auto& thread : dispatchers)
+        thread.join();
+    return 0;
+}
+
+#endif
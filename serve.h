@@ -0,0 +1,49 @@
+#ifndef _PYC_SERVE_H
+#define _PYC_SERVE_H
+
+#include "ASTree.h"
+
+/* pycdc --serve: a long-running decompile server.
+ *
+ * Requests and responses are frames: a 4-byte little-endian length followed
+ * by that many bytes.  A request starts with a header line of space
+ * separated words, followed by the .pyc (or marshalled code) payload:
+ *
+ *     decompile|disassemble [only=NAME] [version=X.Y] [name=FILE]
+ *         [strict-unicode] [decimal-longs] [pycode-verbose] [show-caches]
+ *         [timeout=MS] [max-memory=MB] [budget-steps=N] [budget-nodes=N]
+ *         [budget-time=MS]\n<payload>
+ *     stats\n
+ *
+ * The response header line is "OK <output size> <diagnostics size>\n" or
+ * "ERROR <output size> <diagnostics size> <message>\n", followed by the
+ * output and then any diagnostics that pycdc would print to stderr.
+ * Responses on a connection are sent in request order, so requests may be
+ * pipelined.  A stats response counts every request sent before it on the
+ * same connection.
+ *
+ * Requests are run by a fixed pool of worker processes, so a request that
+ * times out, exceeds its memory budget or crashes only costs a worker
+ * restart.  The budget-* options limit the work done on each function of
+ * a request (see DecompileBudget); functions over budget are abandoned and
+ * printed as stubs without failing the request.
+ */
+
+struct ServeOptions {
+    ServeOptions()
+        : socket_path(), workers(), timeout_ms(30000), max_memory_mb() { }
+
+    const char* socket_path;    // Unix socket to listen on; NULL for stdin/stdout
+    unsigned workers;           // 0 for one per CPU
+    unsigned timeout_ms;        // Default per-request timeout; 0 for none
+    unsigned max_memory_mb;     // Default per-request memory budget; 0 for none
+    DecompileBudget budget;     // Default per-function budget
+};
+
+int serve_main(const char* argv0, const ServeOptions& options);
+
+/* The worker process side, run as "pycdc --serve-worker" with the options
+ * that apply to requests */
+int serve_worker_main(const ServeOptions& options);
+
+#endif
@@ -0,0 +1,172 @@
+# Checks the output cache (--cache) in a new cache under WORK_DIR:
+#  * a miss and then a hit print the same output and diagnostics as a run
+#    without the cache
+#  * changing an option that affects the output uses another entry
+#  * the counters file counts hits, misses and the bytes stored
+#  * storing past --cache-size trims the cache back below the limit
+#
+#   cmake -DPYCDC=... -DPYCDAS=... -DTEST_DIR=<source>/tests -DWORK_DIR=...
+#         -P cache_test.cmake
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+unset(ENV{PYCDC_CACHE_DIR})
+
+# Runs a command in run_dir, setting <prefix>_out, <prefix>_err and
+# <prefix>_status
+function(run prefix)
+    execute_process(COMMAND ${ARGN}
+        WORKING_DIRECTORY "${run_dir}"
+        OUTPUT_VARIABLE out
+        ERROR_VARIABLE err
+        RESULT_VARIABLE status)
+    set(${prefix}_out "${out}" PARENT_SCOPE)
+    set(${prefix}_err "${err}" PARENT_SCOPE)
+    set(${prefix}_status "${status}" PARENT_SCOPE)
+endfunction()
+
+function(check_same what expected actual)
+    if(NOT "${expected}" STREQUAL "${actual}")
+        message(FATAL_ERROR "${what} differs:\n--- expected\n${expected}\n--- actual\n${actual}")
+    endif()
+endfunction()
+
+function(hex_byte pair out_var)
+    string(TOLOWER "${pair}" pair)
+    string(SUBSTRING "${pair}" 0 1 high)
+    string(SUBSTRING "${pair}" 1 1 low)
+    string(FIND "0123456789abcdef" "${high}" high)
+    string(FIND "0123456789abcdef" "${low}" low)
+    math(EXPR value "${high} * 16 + ${low}")
+    set(${out_var} ${value} PARENT_SCOPE)
+endfunction()
+
+# Sets hits, misses and bytes from <cache>/counters, three little-endian
+# 64-bit values
+function(read_counters cache)
+    file(READ "${cache}/counters" hex HEX)
+    string(LENGTH "${hex}" length)
+    if(NOT length EQUAL 48)
+        message(FATAL_ERROR "${cache}/counters is ${length} hex digits, not 48")
+    endif()
+    set(offset 0)
+    foreach(name hits misses bytes)
+        set(value 0)
+        set(scale 1)
+        foreach(byte RANGE 7)
+            string(SUBSTRING "${hex}" ${offset} 2 pair)
+            hex_byte(${pair} byte_value)
+            math(EXPR value "${value} + ${byte_value} * ${scale}")
+            math(EXPR scale "${scale} * 256")
+            math(EXPR offset "${offset} + 2")
+        endforeach()
+        set(${name} ${value} PARENT_SCOPE)
+    endforeach()
+endfunction()
+
+function(check_counters cache expected_hits expected_misses)
+    read_counters("${cache}")
+    if(NOT hits EQUAL expected_hits OR NOT misses EQUAL expected_misses)
+        message(FATAL_ERROR "Expected ${expected_hits} hits and ${expected_misses} misses, "
+                            "but the counters have ${hits} and ${misses}")
+    endif()
+endfunction()
+
+# Sets entries and total_size from the entry files in <cache>/XX/
+function(scan_entries cache)
+    file(GLOB files "${cache}/??/*")
+    set(count 0)
+    set(total 0)
+    foreach(file ${files})
+        file(READ "${file}" hex HEX)
+        string(LENGTH "${hex}" length)
+        math(EXPR total "${total} + ${length} / 2")
+        math(EXPR count "${count} + 1")
+    endforeach()
+    set(entries ${count} PARENT_SCOPE)
+    set(total_size ${total} PARENT_SCOPE)
+endfunction()
+
+function(check_entries cache expected)
+    scan_entries("${cache}")
+    if(NOT entries EQUAL expected)
+        message(FATAL_ERROR "Expected ${expected} cache entries, found ${entries}")
+    endif()
+endfunction()
+
+# Miss, then hit, with the diagnostics printed to stderr each time
+set(run_dir "${TEST_DIR}/cache")
+set(cache "${WORK_DIR}/cache")
+set(input unsupported.3.11.pyc)
+run(plain "${PYCDC}" ${input})
+if(NOT plain_status EQUAL 0 OR NOT plain_err MATCHES "Unsupported opcode")
+    message(FATAL_ERROR "Expected ${input} to decompile with diagnostics:\n${plain_err}")
+endif()
+
+run(miss "${PYCDC}" --cache "${cache}" ${input})
+check_same("Output on a miss" "${plain_out}" "${miss_out}")
+check_same("Diagnostics on a miss" "${plain_err}" "${miss_err}")
+check_same("Status on a miss" "${plain_status}" "${miss_status}")
+check_counters("${cache}" 0 1)
+check_entries("${cache}" 1)
+
+run(hit "${PYCDC}" --cache "${cache}" ${input})
+check_same("Output on a hit" "${plain_out}" "${hit_out}")
+check_same("Diagnostics on a hit" "${plain_err}" "${hit_err}")
+check_same("Status on a hit" "${plain_status}" "${hit_status}")
+check_counters("${cache}" 1 1)
+check_entries("${cache}" 1)
+
+# Other options and the other tool are kept apart
+run(option "${PYCDC}" --cache "${cache}" --decimal-longs ${input})
+check_same("Output with --decimal-longs" "${plain_out}" "${option_out}")
+check_counters("${cache}" 1 2)
+check_entries("${cache}" 2)
+
+run(plain_disasm "${PYCDAS}" ${input})
+run(disasm "${PYCDAS}" --cache "${cache}" ${input})
+check_same("Disassembly on a miss" "${plain_disasm_out}" "${disasm_out}")
+check_counters("${cache}" 1 3)
+check_entries("${cache}" 3)
+
+run(hit "${PYCDC}" --cache "${cache}" --decimal-longs ${input})
+check_counters("${cache}" 2 3)
+
+scan_entries("${cache}")
+read_counters("${cache}")
+if(NOT bytes EQUAL total_size)
+    message(FATAL_ERROR "The counters have ${bytes} bytes stored, but the entries hold "
+                        "${total_size}")
+endif()
+
+# Copies of one module, under different names so each has its own entry,
+# stored until they pass a 1 MB limit
+set(run_dir "${WORK_DIR}/copies")
+set(cache "${WORK_DIR}/trim")
+set(limit 1048576)
+file(MAKE_DIRECTORY "${run_dir}")
+set(stored 0)
+set(copies 0)
+while(stored LESS_EQUAL limit)
+    set(copy "copy_${copies}.pyc")
+    configure_file("${TEST_DIR}/compiled/async_for.3.7.pyc" "${run_dir}/${copy}" COPYONLY)
+    run(store "${PYCDAS}" --cache "${cache}" --cache-size 1 ${copy})
+    if(NOT store_status EQUAL 0 OR NOT store_err STREQUAL "")
+        message(FATAL_ERROR "pycdas failed on ${copy} (${store_status}):\n${store_err}")
+    endif()
+    string(LENGTH "${store_out}" length)
+    math(EXPR stored "${stored} + ${length}")
+    math(EXPR copies "${copies} + 1")
+endwhile()
+
+scan_entries("${cache}")
+read_counters("${cache}")
+if(total_size GREATER limit OR NOT entries LESS copies)
+    message(FATAL_ERROR "After storing ${copies} entries (${stored} bytes of output) with "
+                        "a limit of ${limit} bytes, the cache holds ${entries} entries in "
+                        "${total_size} bytes")
+endif()
+if(NOT bytes EQUAL total_size)
+    message(FATAL_ERROR "The counters have ${bytes} bytes stored after trimming, but the "
+                        "entries hold ${total_size}")
+endif()
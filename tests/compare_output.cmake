@@ -0,0 +1,19 @@
+# Runs PROGRAM with ARGS (a ;-list ending with the input file) in
+# WORKING_DIRECTORY and compares everything it prints, stdout and stderr
+# together, with the EXPECTED file.  The output is kept in OUTPUT.
+#
+#   cmake -DPROGRAM=... -DARGS=... -DWORKING_DIRECTORY=... -DEXPECTED=...
+#         -DOUTPUT=... -P compare_output.cmake
+
+get_filename_component(output_dir "${OUTPUT}" DIRECTORY)
+file(MAKE_DIRECTORY "${output_dir}")
+execute_process(COMMAND "${PROGRAM}" ${ARGS}
+    WORKING_DIRECTORY "${WORKING_DIRECTORY}"
+    OUTPUT_FILE "${OUTPUT}"
+    ERROR_FILE "${OUTPUT}")
+
+execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${EXPECTED}" "${OUTPUT}"
+    RESULT_VARIABLE different)
+if(different)
+    message(FATAL_ERROR "${OUTPUT} does not match ${EXPECTED}")
+endif()
@@ -0,0 +1 @@
+Error loading file unicode_surrogate.3.11.pyc: Invalid UTF-8 in unicode string
@@ -0,0 +1,3 @@
+a = 1e300 * 1e300 * 0j
+b = -1e300 * 1e300 * 0j
+c = 1e300 * 1e300 * 1j
@@ -0,0 +1,2 @@
+s = '\udcff'
+t = 'ok \ud800 end'
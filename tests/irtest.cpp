@@ -0,0 +1,382 @@
+/* Tests for the binary disassembly (pycdas --format=bin) and PycIRReader.
+ *
+ * Every module in the test corpus is written in the binary format, read
+ * back with PycIRReader and turned into JSON, which must match what
+ * pycdas --format=json writes for the module apart from the fields the
+ * binary format leaves out ("flag_names", which follows from "flags", and
+ * "localkinds").  Damaged copies of a file must then be rejected by
+ * PycIRReader::open(). */
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "disasm.h"
+#include "pyc_fs.h"
+#include "pyc_ir.h"
+
+#ifndef PYCTEST_DIR
+#  define PYCTEST_DIR "tests"
+#endif
+
+/* As written by pycdas */
+static void json_string(std::string& out, const char* text, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out += '"';
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char ch = (unsigned char)text[i];
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += (char)ch;
+        } else if (ch < 0x20) {
+            char escape[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF] };
+            out.append(escape, sizeof(escape));
+        } else {
+            out += (char)ch;
+        }
+    }
+    out += '"';
+}
+
+static void json_string(std::string& out, const PycIRReader& reader, uint32_t index)
+{
+    if (index == PYCIR_NONE)
+        out += "null";
+    else
+        json_string(out, reader.string(index), reader.stringLength(index));
+}
+
+static void json_format(std::string& out, const char* fmt, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    out += buffer;
+}
+
+static void json_names(std::string& out, const PycIRReader& reader, const PycIRRange& range)
+{
+    const uint32_t* names = reader.names(range);
+    out += '[';
+    for (uint32_t i = 0; i < range.count; ++i) {
+        if (i != 0)
+            out += ',';
+        json_string(out, reader, names[i]);
+    }
+    out += ']';
+}
+
+/* The JSON pycdas would write for the module, less the fields the binary
+ * format doesn't have */
+static std::string ir_to_json(const PycIRReader& reader, const char* dispname)
+{
+    const PycIRHeader& header = reader.header();
+    std::string out = "{\"file\":";
+    json_string(out, dispname, strlen(dispname));
+    json_format(out, ",\"version\":\"%d.%d\",\"unicode\":%s,\"code\":[\n", header.py_major,
+                header.py_minor, (header.flags & PYCIR_FLAG_UNICODE) ? "true" : "false");
+
+    for (uint32_t id = 0; id < reader.codeCount(); ++id) {
+        const PycIRCode& code = reader.code(id);
+        if (id != 0)
+            out += ",\n";
+        json_format(out, "{\"type\":\"code\",\"id\":%u,\"parent\":", id);
+        if (code.parent == PYCIR_NONE)
+            out += "null";
+        else
+            json_format(out, "%u", code.parent);
+        out += ",\"name\":";
+        json_string(out, reader, code.name);
+        if (code.qualname != PYCIR_NONE) {
+            out += ",\"qualname\":";
+            json_string(out, reader, code.qualname);
+        }
+        out += ",\"filename\":";
+        json_string(out, reader, code.filename);
+        json_format(out, ",\"firstlineno\":%d,\"argcount\":%d,\"posonlyargcount\":%d"
+                    ",\"kwonlyargcount\":%d,\"nlocals\":%d,\"stacksize\":%d,\"flags\":%u",
+                    code.first_line, code.arg_count, code.pos_only_arg_count,
+                    code.kw_only_arg_count, code.num_locals, code.stack_size, code.flags);
+
+        out += ",\"names\":";
+        json_names(out, reader, code.names);
+        out += ",\"varnames\":";
+        json_names(out, reader, code.var_names);
+        out += ",\"freevars\":";
+        json_names(out, reader, code.free_vars);
+        out += ",\"cellvars\":";
+        json_names(out, reader, code.cell_vars);
+
+        out += ",\"consts\":[";
+        const PycIRConst* consts = reader.consts(code);
+        for (uint32_t i = 0; i < code.consts.count; ++i) {
+            if (i != 0)
+                out += ',';
+            if (consts[i].type == PycObject::TYPE_NULL) {
+                out += "{\"type\":\"NULL\"}";
+                continue;
+            }
+            out += "{\"type\":";
+            const char* type_name = MarshalTypeName(consts[i].type);
+            json_string(out, type_name, strlen(type_name));
+            if (consts[i].code != PYCIR_NONE)
+                json_format(out, ",\"code\":%u", consts[i].code);
+            out += ",\"repr\":";
+            json_string(out, reader, consts[i].repr);
+            out += '}';
+        }
+        out += ']';
+
+        out += ",\"instructions\":[";
+        const PycIRInstruction* instructions = reader.instructions(code);
+        for (uint32_t i = 0; i < code.instructions.count; ++i) {
+            const PycIRInstruction& insn = instructions[i];
+            json_format(out, "%s{\"offset\":%u,\"opname\":", (i != 0) ? "," : "", insn.offset);
+            json_string(out, reader, insn.opname);
+            if (insn.kind != PycIRInstruction::NO_ARG) {
+                json_format(out, ",\"arg\":%d", insn.arg);
+                if (insn.kind == PycIRInstruction::INVALID) {
+                    out += ",\"argrepr\":\"<INVALID>\"";
+                } else if (insn.argrepr != PYCIR_NONE) {
+                    out += ",\"argrepr\":";
+                    json_string(out, reader, insn.argrepr);
+                }
+                if (insn.target >= 0)
+                    json_format(out, ",\"target\":%d", insn.target);
+            }
+            out += '}';
+        }
+        out += ']';
+
+        out += ",\"lines\":[";
+        const PycIRLine* lines = reader.lines(code);
+        for (uint32_t i = 0; i < code.lines.count; ++i) {
+            json_format(out, "%s[%u,%u,", (i != 0) ? "," : "", lines[i].start, lines[i].end);
+            if (lines[i].line < 0)
+                out += "null]";
+            else
+                json_format(out, "%d]", lines[i].line);
+        }
+        out += ']';
+
+        out += ",\"exceptions\":[";
+        const PycIRException* exceptions = reader.exceptions(code);
+        for (uint32_t i = 0; i < code.exceptions.count; ++i) {
+            json_format(out, "%s{\"start\":%u,\"end\":%u,\"target\":%u,\"depth\":%u,"
+                        "\"lasti\":%s}", (i != 0) ? "," : "", exceptions[i].start,
+                        exceptions[i].end, exceptions[i].target, exceptions[i].depth,
+                        exceptions[i].push_lasti ? "true" : "false");
+        }
+        out += "]}";
+    }
+    out += "\n]}\n";
+    return out;
+}
+
+/* Removes "field":[...] from JSON, where the list holds no brackets */
+static void remove_list_field(std::string& json, const char* field)
+{
+    std::string key = std::string(",\"") + field + "\":[";
+    size_t pos;
+    while ((pos = json.find(key)) != std::string::npos)
+        json.erase(pos, json.find(']', pos) + 1 - pos);
+}
+
+/* An 8 byte aligned, writable copy of a binary disassembly */
+class IRBuffer {
+public:
+    explicit IRBuffer(const std::string& data)
+        : m_words((data.size() + 7) / 8), m_size(data.size())
+    {
+        memcpy(m_words.data(), data.data(), data.size());
+    }
+
+    char* data() { return reinterpret_cast<char*>(m_words.data()); }
+    size_t size() const { return m_size; }
+
+    bool open(PycIRReader& reader) { return reader.open(data(), m_size); }
+
+    PycIRHeader& header() { return *reinterpret_cast<PycIRHeader*>(data()); }
+
+    template <class T>
+    T* section(const PycIRSection& section)
+    {
+        return reinterpret_cast<T*>(data() + section.offset);
+    }
+
+private:
+    std::vector<uint64_t> m_words;
+    size_t m_size;
+};
+
+static int s_failures = 0;
+
+static void fail(const std::string& name, const char* what)
+{
+    fprintf(stderr, "%s: %s\n", name.c_str(), what);
+    ++s_failures;
+}
+
+/* Damages a copy of the file in one way with damage(), which returns false
+ * if the file has nothing to damage, and checks that open() rejects it */
+template <typename Fn>
+static void check_rejected(const std::string& name, const std::string& ir, const char* what,
+                           Fn damage)
+{
+    IRBuffer buffer(ir);
+    PycIRReader reader;
+    if (damage(buffer) && buffer.open(reader)) {
+        std::string message = std::string("Accepted with ") + what;
+        fail(name, message.c_str());
+    }
+}
+
+static void check_damaged(const std::string& name, const std::string& ir)
+{
+    check_rejected(name, ir, "a string missing its NUL", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.string_data.count == 0)
+            return false;
+        buffer.section<char>(header.string_data)[header.string_data.count - 1] = 'x';
+        return true;
+    });
+    check_rejected(name, ir, "a string overlapping the next", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.strings.count == 0)
+            return false;
+        ++buffer.section<PycIRString>(header.strings)[0].length;
+        return true;
+    });
+    check_rejected(name, ir, "a bad name index", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.names.count == 0)
+            return false;
+        buffer.section<uint32_t>(header.names)[0] = (uint32_t)header.strings.count;
+        return true;
+    });
+    check_rejected(name, ir, "a bad code object name", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.codes.count == 0)
+            return false;
+        buffer.section<PycIRCode>(header.codes)[0].name = (uint32_t)header.strings.count;
+        return true;
+    });
+    check_rejected(name, ir, "a bad parent", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.codes.count == 0)
+            return false;
+        buffer.section<PycIRCode>(header.codes)[0].parent = (uint32_t)header.codes.count;
+        return true;
+    });
+    check_rejected(name, ir, "a bad constant repr", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.consts.count == 0)
+            return false;
+        buffer.section<PycIRConst>(header.consts)[0].repr = 0x7FFFFFFF;
+        return true;
+    });
+    check_rejected(name, ir, "a bad constant code object", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.consts.count == 0)
+            return false;
+        buffer.section<PycIRConst>(header.consts)[0].code = (uint32_t)header.codes.count;
+        return true;
+    });
+    check_rejected(name, ir, "a bad opname", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.instructions.count == 0)
+            return false;
+        buffer.section<PycIRInstruction>(header.instructions)[0].opname =
+                (uint32_t)header.strings.count;
+        return true;
+    });
+    check_rejected(name, ir, "a bad argrepr", [](IRBuffer& buffer) {
+        PycIRHeader& header = buffer.header();
+        if (header.instructions.count == 0)
+            return false;
+        buffer.section<PycIRInstruction>(header.instructions)[0].argrepr = 0x7FFFFFFF;
+        return true;
+    });
+    check_rejected(name, ir, "a truncated file", [](IRBuffer& buffer) {
+        buffer.header().exceptions.offset += 8 * buffer.size();
+        return true;
+    });
+}
+
+static void check_file(const std::string& dir, const std::string& name)
+{
+    PycModule mod;
+    try {
+        mod.loadFromFile((dir + "/" + name).c_str());
+    } catch (std::exception& ex) {
+        fail(name, ex.what());
+        return;
+    }
+    if (!mod.isValid()) {
+        fail(name, "Could not load file");
+        return;
+    }
+
+    std::ostringstream json_stream, ir_stream;
+    {
+        PycOutput json_output(json_stream);
+        output_json(&mod, name.c_str(), false, 0, json_output);
+        PycOutput ir_output(ir_stream);
+        output_ir(&mod, 0, ir_output);
+    }
+    std::string json = json_stream.str();
+    remove_list_field(json, "flag_names");
+    remove_list_field(json, "localkinds");
+
+    IRBuffer buffer(ir_stream.str());
+    PycIRReader reader;
+    if (!buffer.open(reader)) {
+        fail(name, reader.error());
+        return;
+    }
+    std::string round_trip = ir_to_json(reader, name.c_str());
+    if (round_trip != json) {
+        size_t pos = std::mismatch(json.begin(), json.begin() + std::min(json.size(),
+                                                                       round_trip.size()),
+                                   round_trip.begin()).first - json.begin();
+        size_t start = (pos > 40) ? pos - 40 : 0;
+        fprintf(stderr, "%s: differs from the JSON at %zu\n  json: %s\n  bin:  %s\n",
+                name.c_str(), pos, json.substr(start, 80).c_str(),
+                round_trip.substr(start, 80).c_str());
+        ++s_failures;
+    }
+
+    check_damaged(name, ir_stream.str());
+}
+
+int main(int argc, char* argv[])
+{
+    std::string dir = (argc > 1) ? argv[1] : PYCTEST_DIR "/compiled";
+    std::vector<std::string> names = list_directory(dir);
+    std::sort(names.begin(), names.end());
+    int files = 0;
+    for (const std::string& name : names) {
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".pyc") == 0) {
+            check_file(dir, name);
+            ++files;
+        }
+    }
+    if (files == 0) {
+        fprintf(stderr, "No .pyc files found in %s\n", dir.c_str());
+        return 1;
+    }
+
+    if (s_failures) {
+        fprintf(stderr, "%d check(s) failed in %d files\n", s_failures, files);
+        return 1;
+    }
+    printf("%d files passed\n", files);
+    return 0;
+}
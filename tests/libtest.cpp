@@ -0,0 +1,318 @@
+/* Tests for the libpycdc C interface.
+ *
+ * Only libpycdc.h is used, so this also checks that everything it needs
+ * is exported from the shared library. */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "libpycdc.h"
+
+#ifndef PYCTEST_DIR
+#  define PYCTEST_DIR "tests"
+#endif
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++s_failures; \
+        } \
+    } while (0)
+
+#define CHECK_STATUS(call, expected) \
+    do { \
+        pycdc_status status_ = (call); \
+        if (status_ != (expected)) { \
+            fprintf(stderr, "%s:%d: %s returned %s, expected %s\n", __FILE__, __LINE__, \
+                    #call, pycdc_status_string(status_), pycdc_status_string(expected)); \
+            ++s_failures; \
+        } \
+    } while (0)
+
+static const char* const s_modules[] = {
+    "private_name.2.7.pyc",
+    "test_class.2.5.pyc",
+    "test_class_method_py3.3.7.pyc",
+    "f-string.3.7.pyc",
+    "test_loops3.3.12.pyc",
+};
+
+static std::string read_module(const char* name)
+{
+    std::ifstream in(std::string(PYCTEST_DIR "/compiled/") + name,
+                     std::ios_base::in | std::ios_base::binary);
+    if (!in) {
+        fprintf(stderr, "Error reading %s\n", name);
+        ++s_failures;
+        return std::string();
+    }
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    return buffer.str();
+}
+
+static int append_output(void* user_data, const char* data, size_t size)
+{
+    static_cast<std::string*>(user_data)->append(data, size);
+    return 0;
+}
+
+/* Counts the calls, and asks to stop at the first one */
+static int abort_output(void* user_data, const char*, size_t)
+{
+    ++*static_cast<int*>(user_data);
+    return 1;
+}
+
+typedef pycdc_status (*output_fn)(pycdc_context* ctx, pycdc_write_fn write, void* user_data);
+typedef pycdc_status (*buffer_fn)(pycdc_context* ctx, char* buffer, size_t size,
+                                  size_t* length);
+
+static std::string output_of(pycdc_context* ctx, output_fn output)
+{
+    std::string result;
+    CHECK_STATUS(output(ctx, append_output, &result), PYCDC_OK);
+    return result;
+}
+
+static void test_load_and_output()
+{
+    pycdc_context* ctx = pycdc_context_create();
+    CHECK(ctx != nullptr);
+    CHECK(pycdc_api_version() == PYCDC_API_VERSION);
+
+    std::string data = read_module("test_class_method_py3.3.7.pyc");
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+    CHECK(pycdc_last_error(ctx)->status == PYCDC_OK);
+    CHECK(strcmp(pycdc_last_error(ctx)->message, "") == 0);
+
+    int major = 0, minor = 0;
+    CHECK_STATUS(pycdc_python_version(ctx, &major, &minor), PYCDC_OK);
+    CHECK(major == 3 && minor == 7);
+
+    std::string source = output_of(ctx, pycdc_decompile);
+    CHECK(source.find("class ") != std::string::npos);
+
+    std::string disassembly = output_of(ctx, pycdc_disassemble);
+    CHECK(disassembly.find("LOAD_CONST") != std::string::npos);
+
+    // Output is repeatable, and the same with or without streaming
+    CHECK(output_of(ctx, pycdc_decompile) == source);
+    CHECK_STATUS(pycdc_set_option(ctx, PYCDC_OPT_STREAM, 1), PYCDC_OK);
+    CHECK(output_of(ctx, pycdc_decompile) == source);
+
+    // Decompiling leaves the loaded module as it was, private names included
+    data = read_module("private_name.2.7.pyc");
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+    disassembly = output_of(ctx, pycdc_disassemble);
+    CHECK(disassembly.find("_Klass__private_name") != std::string::npos);
+    source = output_of(ctx, pycdc_decompile);
+    CHECK(source.find("_Klass__") == std::string::npos);
+    CHECK(output_of(ctx, pycdc_disassemble) == disassembly);
+    CHECK(output_of(ctx, pycdc_decompile) == source);
+
+    pycdc_context_destroy(ctx);
+}
+
+static void check_buffer_output(pycdc_context* ctx, output_fn output, buffer_fn to_buffer)
+{
+    std::string expected = output_of(ctx, output);
+    CHECK(expected.size() > 16);
+
+    // A NULL buffer just reports the length
+    size_t length = 0;
+    CHECK_STATUS(to_buffer(ctx, nullptr, 0, &length), PYCDC_ERR_BUFFER_TOO_SMALL);
+    CHECK(length == expected.size());
+
+    // A short buffer gets as much as fits, and the full length
+    std::vector<char> buffer(16, '\xff');
+    length = 0;
+    CHECK_STATUS(to_buffer(ctx, buffer.data(), buffer.size(), &length),
+                 PYCDC_ERR_BUFFER_TOO_SMALL);
+    CHECK(pycdc_last_error(ctx)->status == PYCDC_ERR_BUFFER_TOO_SMALL);
+    CHECK(length == expected.size());
+    CHECK(memcmp(buffer.data(), expected.data(), buffer.size()) == 0);
+
+    // Exactly the length still leaves no room for the NUL
+    buffer.assign(length, '\xff');
+    CHECK_STATUS(to_buffer(ctx, buffer.data(), buffer.size(), nullptr),
+                 PYCDC_ERR_BUFFER_TOO_SMALL);
+
+    // Retrying with the size asked for succeeds
+    buffer.assign(length + 1, '\xff');
+    size_t retry_length = 0;
+    CHECK_STATUS(to_buffer(ctx, buffer.data(), buffer.size(), &retry_length), PYCDC_OK);
+    CHECK(retry_length == expected.size());
+    CHECK(buffer[length] == '\0');
+    CHECK(std::string(buffer.data()) == expected);
+}
+
+static void test_buffer_too_small()
+{
+    pycdc_context* ctx = pycdc_context_create();
+    std::string data = read_module("test_class.2.5.pyc");
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+    check_buffer_output(ctx, pycdc_decompile, pycdc_decompile_to_buffer);
+    check_buffer_output(ctx, pycdc_disassemble, pycdc_disassemble_to_buffer);
+    pycdc_context_destroy(ctx);
+}
+
+static void test_aborted()
+{
+    pycdc_context* ctx = pycdc_context_create();
+    std::string data = read_module("test_class.2.5.pyc");
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+
+    int calls = 0;
+    CHECK_STATUS(pycdc_decompile(ctx, abort_output, &calls), PYCDC_ERR_ABORTED);
+    CHECK(calls == 1);
+    CHECK(pycdc_last_error(ctx)->status == PYCDC_ERR_ABORTED);
+
+    calls = 0;
+    CHECK_STATUS(pycdc_disassemble(ctx, abort_output, &calls), PYCDC_ERR_ABORTED);
+    CHECK(calls == 1);
+
+    // The module is still loaded afterwards
+    std::string source = output_of(ctx, pycdc_decompile);
+    CHECK(!source.empty());
+    CHECK(pycdc_last_error(ctx)->status == PYCDC_OK);
+
+    pycdc_context_destroy(ctx);
+}
+
+static void test_budget()
+{
+    pycdc_context* ctx = pycdc_context_create();
+    std::string data = read_module("if_elif_else.3.7.pyc");
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+    std::string full = output_of(ctx, pycdc_decompile);
+    CHECK(full.find("elif flags == 2:") != std::string::npos);
+
+    // Enough steps for the module body, but not for the function
+    CHECK_STATUS(pycdc_set_option(ctx, PYCDC_OPT_BUDGET_STEPS, 10), PYCDC_OK);
+    std::string source = output_of(ctx, pycdc_decompile);
+    CHECK(pycdc_last_error(ctx)->status == PYCDC_OK);
+    size_t stub = source.find("def test(msgtype, flags):\n    pass\n");
+    CHECK(stub != std::string::npos);
+    CHECK(source.find("# WARNING: Decompyle incomplete", stub) != std::string::npos);
+    CHECK(source.find("elif") == std::string::npos);
+    CHECK(strstr(pycdc_last_error(ctx)->diagnostics,
+                 "Abandoned test: exceeded the step budget") != nullptr);
+
+    // Without a budget, the function is decompiled again
+    CHECK_STATUS(pycdc_set_option(ctx, PYCDC_OPT_BUDGET_STEPS, 0), PYCDC_OK);
+    CHECK(output_of(ctx, pycdc_decompile) == full);
+    CHECK(strcmp(pycdc_last_error(ctx)->diagnostics, "") == 0);
+
+    pycdc_context_destroy(ctx);
+}
+
+static void test_no_module()
+{
+    pycdc_context* ctx = pycdc_context_create();
+    std::string result;
+    CHECK_STATUS(pycdc_decompile(ctx, append_output, &result), PYCDC_ERR_NO_MODULE);
+    CHECK_STATUS(pycdc_disassemble(ctx, append_output, &result), PYCDC_ERR_NO_MODULE);
+    CHECK(result.empty());
+
+    // A failed load drops the module loaded before it
+    std::string data = read_module("private_name.2.7.pyc");
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+    const char garbage[] = "not a pyc file";
+    CHECK_STATUS(pycdc_load(ctx, garbage, sizeof(garbage)), PYCDC_ERR_BAD_MAGIC);
+    CHECK(strlen(pycdc_last_error(ctx)->message) != 0);
+    CHECK_STATUS(pycdc_decompile(ctx, append_output, &result), PYCDC_ERR_NO_MODULE);
+
+    // So does a truncated one
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size()), PYCDC_OK);
+    CHECK_STATUS(pycdc_load(ctx, data.data(), data.size() / 2), PYCDC_ERR_LOAD);
+    CHECK_STATUS(pycdc_disassemble(ctx, append_output, &result), PYCDC_ERR_NO_MODULE);
+    CHECK(result.empty());
+
+    size_t length = 1;
+    char buffer[16];
+    CHECK_STATUS(pycdc_decompile_to_buffer(ctx, buffer, sizeof(buffer), &length),
+                 PYCDC_ERR_NO_MODULE);
+    CHECK(length == 0);
+
+    CHECK_STATUS(pycdc_load(ctx, nullptr, 0), PYCDC_ERR_INVALID_ARGUMENT);
+    CHECK_STATUS(pycdc_decompile(nullptr, append_output, &result),
+                 PYCDC_ERR_INVALID_ARGUMENT);
+    pycdc_context_destroy(ctx);
+}
+
+static void test_concurrent_contexts()
+{
+    const size_t module_count = sizeof(s_modules) / sizeof(s_modules[0]);
+    std::vector<std::string> data(module_count);
+    std::vector<std::string> expected(module_count);
+    pycdc_context* ctx = pycdc_context_create();
+    for (size_t i = 0; i < module_count; ++i) {
+        data[i] = read_module(s_modules[i]);
+        CHECK_STATUS(pycdc_load(ctx, data[i].data(), data[i].size()), PYCDC_OK);
+        expected[i] = output_of(ctx, pycdc_decompile);
+        expected[i] += output_of(ctx, pycdc_disassemble);
+    }
+    pycdc_context_destroy(ctx);
+
+    // Each thread works through every module in a different order with
+    // its own context; results are compared on the main thread
+    const size_t thread_count = 8;
+    const int rounds = 4;
+    std::vector<std::vector<std::string> > results(thread_count,
+                                                   std::vector<std::string>(module_count));
+    std::vector<int> thread_failures(thread_count, 0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&, t]() {
+            pycdc_context* thread_ctx = pycdc_context_create();
+            for (int round = 0; round < rounds; ++round) {
+                for (size_t n = 0; n < module_count; ++n) {
+                    size_t i = (n + t) % module_count;
+                    std::string output;
+                    if (pycdc_load(thread_ctx, data[i].data(), data[i].size()) != PYCDC_OK
+                            || pycdc_decompile(thread_ctx, append_output, &output) != PYCDC_OK
+                            || pycdc_disassemble(thread_ctx, append_output, &output) != PYCDC_OK)
+                        ++thread_failures[t];
+                    else if (round == 0)
+                        results[t][i] = output;
+                    else if (output != results[t][i])
+                        ++thread_failures[t];
+                }
+            }
+            pycdc_context_destroy(thread_ctx);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (size_t t = 0; t < thread_count; ++t) {
+        CHECK(thread_failures[t] == 0);
+        for (size_t i = 0; i < module_count; ++i)
+            CHECK(results[t][i] == expected[i]);
+    }
+}
+
+int main()
+{
+    test_load_and_output();
+    test_buffer_too_small();
+    test_aborted();
+    test_budget();
+    test_no_module();
+    test_concurrent_contexts();
+
+    if (s_failures) {
+        fprintf(stderr, "%d check(s) failed\n", s_failures);
+        return 1;
+    }
+    printf("All libpycdc tests passed\n");
+    return 0;
+}
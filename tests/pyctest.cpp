@@ -0,0 +1,1069 @@
+/* In-process test runner.
+ *
+ * Equivalent to tests/run_tests.py, but decompiles every module on a pool
+ * of threads inside a single process and tokenizes the output with a
+ * native port of scripts/token_dump, instead of starting a pycdc and a
+ * Python process per test file. */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ASTree.h"
+#include "pyc_numeric.h"
+
+#ifdef WIN32
+#  include <windows.h>
+#  include <direct.h>
+#  define PATHSEP '\\'
+#else
+#  include <dirent.h>
+#  include <sys/stat.h>
+#  define PATHSEP '/'
+#endif
+
+#ifndef PYCTEST_DIR
+#  define PYCTEST_DIR "tests"
+#endif
+
+/* Filesystem helpers */
+
+static std::string join_path(const std::string& dir, const std::string& name)
+{
+    if (dir.empty() || dir.back() == '/' || dir.back() == PATHSEP)
+        return dir + name;
+    return dir + PATHSEP + name;
+}
+
+/* fnmatch-style matching of '*' and '?' wildcards */
+static bool glob_match(const char* pattern, const char* name)
+{
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            ++pattern;
+            ++name;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        ++pattern;
+    return *pattern == 0;
+}
+
+/* Sorted names of the entries in dir matching pattern, skipping hidden
+ * files like Python's glob does */
+static std::vector<std::string> list_dir(const std::string& dir, const std::string& pattern)
+{
+    std::vector<std::string> names;
+#ifdef WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA(join_path(dir, "*").c_str(), &data);
+    if (find != INVALID_HANDLE_VALUE) {
+        do {
+            if (data.cFileName[0] != '.' && glob_match(pattern.c_str(), data.cFileName))
+                names.emplace_back(data.cFileName);
+        } while (FindNextFileA(find, &data));
+        FindClose(find);
+    }
+#else
+    DIR* dirp = opendir(dir.c_str());
+    if (dirp) {
+        while (struct dirent* entry = readdir(dirp)) {
+            if (entry->d_name[0] != '.' && glob_match(pattern.c_str(), entry->d_name))
+                names.emplace_back(entry->d_name);
+        }
+        closedir(dirp);
+    }
+#endif
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+static void make_dir(const std::string& dir)
+{
+#ifdef WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0777);
+#endif
+}
+
+static bool read_file(const std::string& filename, std::string& content)
+{
+    std::ifstream in(filename, std::ios_base::in | std::ios_base::binary);
+    if (!in)
+        return false;
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+static void write_file(const std::string& filename, const std::string& content)
+{
+    std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
+    out.write(content.data(), content.size());
+}
+
+/* Remove a stale output file left by an earlier failing run */
+static void remove_file(const std::string& filename)
+{
+    std::remove(filename.c_str());
+}
+
+
+/* Native port of scripts/token_dump.  Produces identical output, including
+ * the handling of its quirks (e.g. 0x10 is an int 0 followed by a word). */
+class TokenDump {
+public:
+    explicit TokenDump(const std::string& source);
+
+    /* Append the token dump to output.  On a tokenizer error, the partial
+     * output is kept and false is returned with the Python exception that
+     * token_dump would have raised in error. */
+    bool dump(std::string& output, std::string& error);
+
+private:
+    std::string m_source;
+    size_t m_pos;
+    std::string m_line;
+    int m_nline;
+    std::string* m_output;
+
+    bool readLine();
+    void emit(const std::string& token) { *m_output += token; *m_output += ' '; }
+    void emitLine(const char* token) { *m_output += token; *m_output += '\n'; }
+
+    bool symbolicToken(size_t& pos, std::string& token);
+    bool floatToken(size_t& pos);
+    bool intToken(size_t& pos);
+    bool stringToken(size_t& pos);
+    bool wordToken(size_t& pos);
+};
+
+static bool is_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+static bool is_digit(char ch) { return ch >= '0' && ch <= '9'; }
+
+static bool is_word_start(char ch)
+{
+    return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || ch == '_';
+}
+
+static size_t scan_digits(const std::string& str, size_t pos)
+{
+    // [0-9][0-9_]*, assuming str[pos] is a digit
+    ++pos;
+    while (pos < str.size() && (is_digit(str[pos]) || str[pos] == '_'))
+        ++pos;
+    return pos;
+}
+
+static std::string strip_underscores(const std::string& value)
+{
+    std::string result;
+    result.reserve(value.size());
+    for (char ch : value) {
+        if (ch != '_')
+            result.push_back(ch);
+    }
+    return result;
+}
+
+static void replace_all(std::string& str, const char* from, const char* to)
+{
+    size_t fromLen = strlen(from), toLen = strlen(to);
+    for (size_t pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + toLen))
+        str.replace(pos, fromLen, to);
+}
+
+TokenDump::TokenDump(const std::string& source)
+    : m_pos(0), m_nline(0), m_output(nullptr)
+{
+    // Python reads the source with universal newlines
+    m_source.reserve(source.size());
+    for (size_t i = 0; i < source.size(); ++i) {
+        if (source[i] == '\r') {
+            m_source.push_back('\n');
+            if (i + 1 < source.size() && source[i + 1] == '\n')
+                ++i;
+        } else {
+            m_source.push_back(source[i]);
+        }
+    }
+}
+
+bool TokenDump::readLine()
+{
+    if (m_pos >= m_source.size()) {
+        m_line.clear();
+        return false;
+    }
+    size_t end = m_source.find('\n', m_pos);
+    end = (end == std::string::npos) ? m_source.size() : end + 1;
+    m_line.assign(m_source, m_pos, end - m_pos);
+    m_pos = end;
+    return true;
+}
+
+bool TokenDump::dump(std::string& output, std::string& error)
+{
+    m_output = &output;
+    std::vector<size_t> indentStack(1, 0);
+    std::vector<char> contextStack;
+
+    try {
+        for ( ;; ) {
+            bool haveLine = readLine();
+            ++m_nline;
+            if (!haveLine)
+                break;
+
+            size_t pos = 0;
+            while (pos < m_line.size() && is_space(m_line[pos]))
+                ++pos;
+            if (pos == m_line.size() || m_line[pos] == '#')
+                continue;
+
+            // Look for indentation changes
+            if (contextStack.empty()) {
+                size_t indent = pos;
+                if (indent > indentStack.back()) {
+                    indentStack.push_back(indent);
+                    emitLine("<INDENT>");
+                }
+                while (indent < indentStack.back()) {
+                    indentStack.pop_back();
+                    emitLine("<OUTDENT>");
+                }
+                if (indent != indentStack.back())
+                    throw std::runtime_error("RuntimeError: Incorrect indentation on line " + std::to_string(m_nline));
+            }
+
+            for ( ;; ) {
+                while (pos < m_line.size() && is_space(m_line[pos]))
+                    ++pos;
+                if (pos == m_line.size())
+                    break;
+                if (m_line[pos] == '#') {
+                    // The rest of this line is a comment
+                    break;
+                }
+
+                std::string token;
+                if (symbolicToken(pos, token)) {
+                    char tok = token.size() == 1 ? token[0] : 0;
+                    if (tok == '(' || tok == '{' || tok == '[') {
+                        contextStack.push_back(tok);
+                    } else if (tok == ')' || tok == '}' || tok == ']') {
+                        char open = (tok == ')') ? '(' : (tok == '}') ? '{' : '[';
+                        if (contextStack.empty() || contextStack.back() != open) {
+                            throw std::runtime_error("RuntimeError: Mismatched token at " + m_line.substr(pos - 1)
+                                                     + " on line " + std::to_string(m_nline));
+                        }
+                        contextStack.pop_back();
+                    }
+                    emit(token);
+                    continue;
+                }
+                if (floatToken(pos) || intToken(pos) || stringToken(pos) || wordToken(pos))
+                    continue;
+
+                throw std::runtime_error("RuntimeError: Error: Unrecognized tokens: \"" + m_line.substr(pos)
+                                         + "\" at line " + std::to_string(m_nline));
+            }
+
+            if (contextStack.empty())
+                emitLine("<EOL>");
+        }
+    } catch (std::exception& ex) {
+        error = std::string(ex.what()) + "\n";
+        return false;
+    }
+    return true;
+}
+
+bool TokenDump::symbolicToken(size_t& pos, std::string& token)
+{
+    // Tokens sharing a common prefix are ordered from longest to shortest,
+    // matching SYMBOLIC_TOKENS in token_dump
+    static const char* s_symbolic_tokens[] = {
+        "<<=", ">>=", "**=", "//=", "...", ".",
+        "+=", "-=", "*=", "@=", "/=", "%=", "&=", "|=", "^=",
+        "<>", "<<", "<=", "<", ">>", ">=", ">", "!=", "==", "=",
+        ",", ";", ":=", ":", "->", "~", "`",
+        "+", "-", "**", "*", "@", "//", "/", "%", "&", "|", "^",
+        "(", ")", "{", "}", "[", "]",
+    };
+
+    for (const char* tok : s_symbolic_tokens) {
+        size_t len = strlen(tok);
+        if (m_line.compare(pos, len, tok) == 0) {
+            token = tok;
+            pos += len;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TokenDump::floatToken(size_t& pos)
+{
+    // (([0-9][0-9_]*)?\.[0-9][0-9_]*|[0-9][0-9_]*\.)([eE][+-]?[0-9][0-9_]*)?
+    size_t end = pos;
+    bool leading = false;
+    if (is_digit(m_line[end])) {
+        end = scan_digits(m_line, end);
+        leading = true;
+    }
+    if (end >= m_line.size() || m_line[end] != '.')
+        return false;
+    ++end;
+    if (end < m_line.size() && is_digit(m_line[end]))
+        end = scan_digits(m_line, end);
+    else if (!leading)
+        return false;
+
+    if (end < m_line.size() && (m_line[end] == 'e' || m_line[end] == 'E')) {
+        size_t exp = end + 1;
+        if (exp < m_line.size() && (m_line[exp] == '+' || m_line[exp] == '-'))
+            ++exp;
+        if (exp < m_line.size() && is_digit(m_line[exp]))
+            end = scan_digits(m_line, exp);
+    }
+
+    std::string value = strip_underscores(m_line.substr(pos, end - pos));
+    char buffer[FLOAT_REPR_SIZE];
+    float_repr(buffer, strtod(value.c_str(), nullptr));
+    emit(buffer);
+    pos = end;
+    return true;
+}
+
+bool TokenDump::intToken(size_t& pos)
+{
+    // [0-9][0-9_]* -- the hex, binary and octal alternatives in token_dump
+    // can never match, since this one is tried first
+    if (!is_digit(m_line[pos]))
+        return false;
+    size_t end = scan_digits(m_line, pos);
+    std::string value = strip_underscores(m_line.substr(pos, end - pos));
+    pos = end;
+
+    size_t first = value.find_first_not_of('0');
+    if (first == std::string::npos) {
+        emit("0");
+    } else if (first == 0) {
+        emit(value);
+    } else {
+        // Python 2.x octal literal; convert to decimal in base 10**9 limbs
+        std::vector<uint32_t> limbs;
+        for (char ch : value) {
+            if (ch > '7') {
+                throw std::runtime_error("ValueError: invalid literal for int() with base 8: '"
+                                         + value + "'");
+            }
+            uint64_t carry = ch - '0';
+            for (uint32_t& limb : limbs) {
+                uint64_t cur = (uint64_t)limb * 8 + carry;
+                limb = (uint32_t)(cur % 1000000000);
+                carry = cur / 1000000000;
+            }
+            if (carry)
+                limbs.push_back((uint32_t)carry);
+        }
+        std::string decimal = std::to_string(limbs.back());
+        for (size_t i = limbs.size() - 1; i-- > 0; ) {
+            char buffer[16];
+            snprintf(buffer, sizeof(buffer), "%09u", (unsigned)limbs[i]);
+            decimal += buffer;
+        }
+        emit(decimal);
+    }
+    return true;
+}
+
+bool TokenDump::stringToken(size_t& pos)
+{
+    // ([rR][fFbB]?|[uU]|[fF][rR]?|[bB][rR]?)?('''|'|"""|")
+    auto is_quote = [this](size_t at) {
+        return at < m_line.size() && (m_line[at] == '\'' || m_line[at] == '"');
+    };
+    auto in_set = [](char ch, const char* set) { return ch != 0 && strchr(set, ch) != nullptr; };
+
+    size_t prefixLen = 0;
+    char first = m_line[pos];
+    const char* second = in_set(first, "rR") ? "fFbB"
+                       : in_set(first, "fF") ? "rR"
+                       : in_set(first, "bB") ? "rR"
+                       : in_set(first, "uU") ? "" : nullptr;
+    if (second) {
+        if (*second && pos + 1 < m_line.size() && in_set(m_line[pos + 1], second) && is_quote(pos + 2))
+            prefixLen = 2;
+        else if (is_quote(pos + 1))
+            prefixLen = 1;
+        else
+            return false;
+    } else if (!is_quote(pos)) {
+        return false;
+    }
+
+    std::string prefix = m_line.substr(pos, prefixLen);
+    size_t qpos = pos + prefixLen;
+    std::string quotes(1, m_line[qpos]);
+    if (m_line.compare(qpos, 3, std::string(3, m_line[qpos])) == 0)
+        quotes.assign(3, m_line[qpos]);
+
+    // Look for the end of the string
+    size_t start = qpos + quotes.size();
+    size_t end;
+    std::string content;
+    for ( ;; ) {
+        end = m_line.find(quotes, start);
+        if (end != std::string::npos && end > 0 && m_line[end - 1] == '\\') {
+            content.append(m_line, start, end + 1 - start);
+            start = end + 1;
+            continue;
+        } else if (end != std::string::npos) {
+            content.append(m_line, start, end - start);
+            break;
+        }
+
+        // Read in a new line
+        content.append(m_line, start, std::string::npos);
+        bool haveLine = readLine();
+        ++m_nline;
+        start = 0;
+        if (!haveLine) {
+            std::string repr = (quotes[0] == '\'') ? "\"" + quotes + "\"" : "'" + quotes + "'";
+            throw std::runtime_error("RuntimeError: Reached EOF while looking for " + repr);
+        }
+    }
+
+    // Normalize the prefix and special characters for comparison
+    for (char& ch : prefix)
+        ch = (char)tolower((unsigned char)ch);
+    std::sort(prefix.begin(), prefix.end());
+    replace_all(content, "\\'", "'");
+    replace_all(content, "'", "\\'");
+    replace_all(content, "\\\"", "\"");
+    replace_all(content, "\t", "\\t");
+    replace_all(content, "\n", "\\n");
+    replace_all(content, "\r", "\\r");
+    emit(prefix + "'" + content + "'");
+
+    pos = end + quotes.size();
+    return true;
+}
+
+bool TokenDump::wordToken(size_t& pos)
+{
+    if (!is_word_start(m_line[pos]))
+        return false;
+    size_t end = pos + 1;
+    while (end < m_line.size() && (is_word_start(m_line[end]) || is_digit(m_line[end])))
+        ++end;
+    emit(m_line.substr(pos, end - pos));
+    pos = end;
+    return true;
+}
+
+
+/* Unified diff of two texts by lines, in the format of difflib.unified_diff */
+static std::vector<std::string> split_lines(const std::string& text)
+{
+    std::vector<std::string> lines;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        end = (end == std::string::npos) ? text.size() : end + 1;
+        lines.emplace_back(text, pos, end - pos);
+        pos = end;
+    }
+    return lines;
+}
+
+static std::string format_range(size_t start, size_t stop)
+{
+    size_t beginning = start + 1;
+    size_t length = stop - start;
+    if (length == 1)
+        return std::to_string(beginning);
+    if (length == 0)
+        --beginning;
+    return std::to_string(beginning) + "," + std::to_string(length);
+}
+
+static std::vector<std::string> unified_diff(const std::string& from, const std::string& to,
+                                             const std::string& fromfile, const std::string& tofile)
+{
+    static const size_t CONTEXT = 3;
+    std::vector<std::string> a = split_lines(from), b = split_lines(to);
+    const int n = (int)a.size(), m = (int)b.size();
+
+    // Myers' O(ND) shortest edit script, keeping each round's V for backtracking
+    const int offset = n + m + 1;
+    std::vector<int> v(2 * offset + 1, 0);
+    std::vector<std::vector<int>> trace;
+    for (int d = 0; d <= n + m; ++d) {
+        trace.push_back(v);
+        bool done = false;
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1]))
+                  ? v[offset + k + 1] : v[offset + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                ++x;
+                ++y;
+            }
+            v[offset + k] = x;
+            if (x >= n && y >= m) {
+                done = true;
+                break;
+            }
+        }
+        if (done)
+            break;
+    }
+
+    // Walk back to get matching line pairs
+    std::vector<std::pair<int, int>> matches;
+    int x = n, y = m;
+    for (int d = (int)trace.size() - 1; d >= 0 && (x > 0 || y > 0); --d) {
+        const std::vector<int>& pv = trace[d];
+        int k = x - y;
+        int prevK = (k == -d || (k != d && pv[offset + k - 1] < pv[offset + k + 1])) ? k + 1 : k - 1;
+        int prevX = (d == 0) ? 0 : pv[offset + prevK];
+        int prevY = prevX - prevK;
+        while (x > prevX && y > prevY)
+            matches.emplace_back(--x, --y);
+        if (d > 0) {
+            x = prevX;
+            y = prevY;
+        }
+    }
+    std::reverse(matches.begin(), matches.end());
+    matches.emplace_back(n, m);     // Sentinel
+
+    // Turn the matches into change regions: (a1, a2, b1, b2)
+    struct Change { size_t a1, a2, b1, b2; };
+    std::vector<Change> changes;
+    size_t ai = 0, bi = 0;
+    for (const auto& match : matches) {
+        if ((size_t)match.first > ai || (size_t)match.second > bi)
+            changes.push_back({ ai, (size_t)match.first, bi, (size_t)match.second });
+        ai = match.first + 1;
+        bi = match.second + 1;
+    }
+
+    std::vector<std::string> diff;
+    if (changes.empty())
+        return diff;
+    diff.push_back("--- " + fromfile + "\n");
+    diff.push_back("+++ " + tofile + "\n");
+
+    // Group changes whose context overlaps into hunks
+    size_t first = 0;
+    while (first < changes.size()) {
+        size_t last = first;
+        while (last + 1 < changes.size()
+                && changes[last + 1].a1 - changes[last].a2 <= 2 * CONTEXT)
+            ++last;
+
+        size_t a1 = changes[first].a1 >= CONTEXT ? changes[first].a1 - CONTEXT : 0;
+        size_t b1 = changes[first].b1 - (changes[first].a1 - a1);
+        size_t a2 = std::min(changes[last].a2 + CONTEXT, a.size());
+        size_t b2 = changes[last].b2 + (a2 - changes[last].a2);
+        diff.push_back("@@ -" + format_range(a1, a2) + " +" + format_range(b1, b2) + " @@\n");
+
+        size_t pa = a1;
+        for (size_t i = first; i <= last; ++i) {
+            for ( ; pa < changes[i].a1; ++pa)
+                diff.push_back(" " + a[pa]);
+            for (size_t j = changes[i].a1; j < changes[i].a2; ++j)
+                diff.push_back("-" + a[j]);
+            for (size_t j = changes[i].b1; j < changes[i].b2; ++j)
+                diff.push_back("+" + b[j]);
+            pa = changes[i].a2;
+        }
+        for ( ; pa < a2; ++pa)
+            diff.push_back(" " + a[pa]);
+        first = last + 1;
+    }
+    return diff;
+}
+
+
+/* Test execution */
+
+struct TestFile {
+    size_t test;        // Index into the tests
+    std::string path;
+    bool xfail;
+
+    bool ok;
+    std::vector<std::string> errs;
+    std::string output;     // Source and messages, kept when checking the memo
+};
+
+struct Test {
+    std::string name;
+    std::string expected;
+    std::vector<size_t> files;
+    std::atomic<size_t> remaining;
+
+    Test() : remaining(0) { }
+};
+
+/* Read back whatever was written to the error stream since start */
+static std::string read_errors(FILE* errors, long start)
+{
+    fflush(errors);
+    long end = ftell(errors);
+    std::string text;
+    if (end > start) {
+        text.resize(end - start);
+        fseek(errors, start, SEEK_SET);
+        text.resize(fread(&text[0], 1, text.size(), errors));
+        fseek(errors, end, SEEK_SET);
+    }
+    return text;
+}
+
+/* Decompile in the same way as `pycdc <file> -o <outfile>`, returning
+ * everything pycdc would have printed to the console in messages */
+static bool decompyle_file(const std::string& path, std::string& source,
+                           std::string& messages, FILE* errors)
+{
+    long start = ftell(errors);
+    bool ok = true;
+
+    PycModule mod;
+    try {
+        mod.loadFromFile(path.c_str());
+    } catch (std::exception& ex) {
+        fprintf(errors, "Error loading file %s: %s\n", path.c_str(), ex.what());
+        ok = false;
+    }
+    if (ok && !mod.isValid()) {
+        fprintf(errors, "Could not load file %s\n", path.c_str());
+        ok = false;
+    }
+
+    if (ok) {
+        const char* dispname = strrchr(path.c_str(), PATHSEP);
+        dispname = (dispname == NULL) ? path.c_str() : dispname + 1;
+        std::ostringstream out_stream;
+        {
+            PycOutput pyc_output(out_stream);
+            pyc_output << "# Source Generated with Decompyle++\n";
+            formatted_print(pyc_output, "# File: %s (Python %d.%d%s)\n\n", dispname,
+                            mod.majorVer(), mod.minorVer(),
+                            (mod.majorVer() < 3 && mod.isUnicode()) ? " Unicode" : "");
+            try {
+                decompyle(mod.code(), &mod, pyc_output);
+            } catch (std::exception& ex) {
+                fprintf(errors, "Error decompyling %s: %s\n", path.c_str(), ex.what());
+                ok = false;
+            }
+        }
+        source = out_stream.str();
+    }
+
+    messages = read_errors(errors, start);
+    return ok && messages.empty();
+}
+
+/* Checks that decompiling again in another way gave the same source and
+ * messages, reporting a diff against tests-out/<file>.src.py otherwise */
+static bool check_same(const std::string& basename, const std::string& out_base,
+                       const char* kind, const char* what, const std::string& expected,
+                       const std::string& actual, std::vector<std::string>& errs)
+{
+    std::string diff_file = out_base + "." + kind + ".diff";
+    if (actual == expected) {
+        remove_file(diff_file);
+        return true;
+    }
+    std::vector<std::string> diff = unified_diff(expected, actual,
+                                                 "tests-out/" + basename + ".src.py",
+                                                 "tests-out/" + basename + "." + kind + ".py");
+    std::string diff_text;
+    for (const auto& line : diff)
+        diff_text += line;
+    write_file(diff_file, diff_text);
+    errs.push_back(std::string(what) + " does not match:\n");
+    errs.insert(errs.end(), diff.begin(), diff.end());
+    return false;
+}
+
+/* Decompile again with streaming (pycdc --stream), which must give the
+ * same source and messages.  A batch of 1 flushes wherever a statement is
+ * complete, so every module goes through the streaming sink. */
+static bool check_streamed(const std::string& path, const std::string& basename,
+                           const std::string& out_base, const std::string& expected,
+                           FILE* errors, std::vector<std::string>& errs)
+{
+    std::string source, messages;
+    set_decompile_streaming(true, 1);
+    decompyle_file(path, source, messages, errors);
+    set_decompile_streaming(false);
+    return check_same(basename, out_base, "stream", "Streamed output", expected,
+                      source + messages, errs);
+}
+
+/* Decompile twice more with the memo shared by the whole run (pycdc
+ * --memo): the first may find code remembered from other modules, and the
+ * second finds everything the first remembered.  Both must give the same
+ * source and messages. */
+static bool check_memo(const std::string& path, const std::string& basename,
+                       const std::string& out_base, const std::string& expected,
+                       DecompileMemo& memo, FILE* errors, std::vector<std::string>& errs)
+{
+    std::string source, messages, warm_source, warm_messages;
+    set_decompile_memo(&memo);
+    decompyle_file(path, source, messages, errors);
+    decompyle_file(path, warm_source, warm_messages, errors);
+    set_decompile_memo(nullptr);
+    return check_same(basename, out_base, "memo", "Output with a memo", expected,
+                      source + messages, errs)
+        && check_same(basename, out_base, "memo", "Output with a warm memo", expected,
+                      warm_source + warm_messages, errs);
+}
+
+struct RunOptions {
+    bool stream;
+    DecompileMemo* memo;    // NULL unless checking the memo
+};
+
+static void run_file(TestFile& file, const Test& test, const std::string& outdir,
+                     const RunOptions& options, FILE* errors)
+{
+    std::string basename = file.path.substr(file.path.find_last_of(PATHSEP) + 1);
+    std::string out_base = join_path(outdir, basename);
+    file.ok = false;
+
+    std::string source, messages;
+    bool ok = decompyle_file(file.path, source, messages, errors);
+    write_file(out_base + ".src.py", source);
+    if (options.stream && !check_streamed(file.path, basename, out_base, source + messages,
+                                          errors, file.errs))
+        return;
+    if (options.memo) {
+        file.output = source + messages;
+        if (!check_memo(file.path, basename, out_base, file.output, *options.memo, errors,
+                        file.errs))
+            return;
+    }
+    if (!ok) {
+        write_file(out_base + ".err", messages);
+        file.errs.push_back(messages);
+        return;
+    }
+    remove_file(out_base + ".err");
+
+    std::string tokenized, token_dump_err;
+    bool tok_ok = TokenDump(source).dump(tokenized, token_dump_err);
+    write_file(out_base + ".tok.txt", tokenized);
+    if (!tok_ok) {
+        write_file(out_base + ".tok.err", token_dump_err);
+        file.errs.push_back(token_dump_err);
+        return;
+    }
+    remove_file(out_base + ".tok.err");
+
+    if (tokenized != test.expected) {
+        std::vector<std::string> diff = unified_diff(test.expected, tokenized,
+                                                     "tokenized/" + test.name + ".txt",
+                                                     "tests-out/" + basename + ".tok.txt");
+        std::string diff_text;
+        for (const auto& line : diff)
+            diff_text += line;
+        write_file(out_base + ".tok.diff", diff_text);
+        file.errs.push_back("Tokenized output does not match expected output:\n");
+        file.errs.insert(file.errs.end(), diff.begin(), diff.end());
+        return;
+    }
+
+    file.ok = true;
+}
+
+/* Summarize a finished test, returning the number of failures */
+static int report_test(const Test& test, const std::vector<TestFile>& files, std::string& output)
+{
+    if (test.files.empty()) {
+        output = "No compiled/xfail modules found for " + test.name + "\n";
+        return 1;
+    }
+    output = "\033[1m*** " + test.name + ":\033[0m ";
+
+    std::string errlines;
+    int compiled = 0, fails = 0, xfails = 0, upass = 0;
+    for (size_t index : test.files) {
+        const TestFile& file = files[index];
+        if (!file.xfail) {
+            ++compiled;
+            if (!file.ok) {
+                ++fails;
+                errlines += "\t\033[31m" + file.path.substr(file.path.find_last_of(PATHSEP) + 1)
+                          + "\033[0m\n";
+                for (const auto& err : file.errs)
+                    errlines += err;
+            }
+        } else if (!file.ok) {
+            ++xfails;
+        } else {
+            ++upass;
+        }
+    }
+
+    char buffer[128];
+    if (fails == 0) {
+        // As in run_tests.py, a test with only xfail files that all passed
+        // is reported as PASS (0)
+        if (xfails != 0 && compiled == 0)
+            snprintf(buffer, sizeof(buffer), "\033[33mXFAIL (%d)\033[0m", xfails);
+        else if (xfails != 0)
+            snprintf(buffer, sizeof(buffer), "\033[32mPASS (%d)\033[33m + XFAIL (%d)\033[0m",
+                     compiled, xfails);
+        else
+            snprintf(buffer, sizeof(buffer), "\033[32mPASS (%d)\033[0m", compiled);
+    } else {
+        if (xfails != 0)
+            snprintf(buffer, sizeof(buffer), "\033[31mFAIL (%d of %d)\033[33m + XFAIL (%d)\033[0m",
+                     fails, compiled, xfails);
+        else
+            snprintf(buffer, sizeof(buffer), "\033[31mFAIL (%d of %d)\033[0m", fails, compiled);
+    }
+    output += buffer;
+    if (upass != 0) {
+        snprintf(buffer, sizeof(buffer), "\033[35m + UPASS (%d)\033[0m", upass);
+        output += buffer;
+    }
+    output += "\n" + errlines;
+    return fails;
+}
+
+/* Saves the memo filled by the run and loads it back, which must give the
+ * same output for the modules that passed, and checks that a memo saved
+ * by another build is not loaded.  Returns the number of failures. */
+static int check_memo_file(const DecompileMemo& memo, const std::vector<TestFile>& files,
+                           const std::string& outdir)
+{
+    // Any id will do, as long as loading checks it
+    const uint64_t build_id = 0x5059435445535431ULL;
+    std::string memo_file = join_path(outdir, "memo.bin");
+    int fails = 0;
+
+    printf("\033[1m*** memo:\033[0m %zu entries, %lu hits\n", memo.entries(), memo.hits());
+    if (memo.hits() == 0) {
+        printf("\t\033[31mThe memo was never used\033[0m\n");
+        ++fails;
+    }
+
+    DecompileMemo loaded;
+    if (!memo.save(memo_file.c_str(), build_id)
+            || !loaded.load(memo_file.c_str(), build_id)
+            || loaded.entries() != memo.entries()) {
+        printf("\t\033[31mSaving and loading %s lost entries\033[0m\n", memo_file.c_str());
+        ++fails;
+    }
+    DecompileMemo other_build;
+    if (other_build.load(memo_file.c_str(), build_id + 1) || other_build.entries() != 0) {
+        printf("\t\033[31mA memo from another build was loaded\033[0m\n");
+        ++fails;
+    }
+
+    FILE* errors = tmpfile();
+    if (!errors) {
+        perror("tmpfile");
+        return fails + 1;
+    }
+    set_pyc_error_stream(errors);
+    set_decompile_memo(&loaded);
+    for (const TestFile& file : files) {
+        if (!file.ok)
+            continue;
+        std::string basename = file.path.substr(file.path.find_last_of(PATHSEP) + 1);
+        std::string out_base = join_path(outdir, basename);
+        std::string source, messages;
+        decompyle_file(file.path, source, messages, errors);
+        std::vector<std::string> errs;
+        if (!check_same(basename, out_base, "memo", "Output with a loaded memo", file.output,
+                        source + messages, errs)) {
+            printf("\t\033[31m%s\033[0m\n", basename.c_str());
+            for (const auto& err : errs)
+                fputs(err.c_str(), stdout);
+            ++fails;
+        }
+    }
+    set_decompile_memo(nullptr);
+    set_pyc_error_stream(nullptr);
+    fclose(errors);
+
+    if (loaded.hits() == 0) {
+        printf("\t\033[31mThe loaded memo was never used\033[0m\n");
+        ++fails;
+    }
+    return fails;
+}
+
+int main(int argc, char* argv[])
+{
+    // For simpler invocation from CMake's check target, we also support
+    // setting these parameters via environment variables.
+    const char* env_jobs = getenv("JOBS");
+    const char* env_filter = getenv("FILTER");
+    int jobs = env_jobs ? atoi(env_jobs) : (int)std::thread::hardware_concurrency();
+    std::string filter = env_filter ? env_filter : "";
+    std::string test_dir = PYCTEST_DIR;
+    RunOptions options = { false, nullptr };
+    bool memo_check = false;
+
+    for (int arg = 1; arg < argc; ++arg) {
+        if ((strcmp(argv[arg], "--jobs") == 0 || strcmp(argv[arg], "-j") == 0) && arg + 1 < argc) {
+            jobs = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--filter") == 0 && arg + 1 < argc) {
+            filter = argv[++arg];
+        } else if (strcmp(argv[arg], "--test-dir") == 0 && arg + 1 < argc) {
+            test_dir = argv[++arg];
+        } else if (strcmp(argv[arg], "--stream") == 0) {
+            options.stream = true;
+        } else if (strcmp(argv[arg], "--memo") == 0) {
+            memo_check = true;
+        } else if (strcmp(argv[arg], "--help") == 0 || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "Usage:  %s [options]\n\n", argv[0]);
+            fputs("Options:\n", stderr);
+            fputs("  -j, --jobs <n>      Number of modules to decompile in parallel\n", stderr);
+            fputs("  --filter <text>     Run only test(s) matching the supplied filter\n", stderr);
+            fputs("  --test-dir <dir>    Directory containing the compiled, xfail and tokenized\n", stderr);
+            fputs("                      subdirectories (default: " PYCTEST_DIR ")\n", stderr);
+            fputs("  --stream            Also decompile each module with streaming (as with\n"
+                  "                      pycdc --stream, but printing each statement as soon\n"
+                  "                      as it can be) and check that the output is the same\n", stderr);
+            fputs("  --memo              Also decompile each module twice with a memo shared by\n"
+                  "                      all modules (as with pycdc --memo), then save and load\n"
+                  "                      it, and check that the output is the same\n", stderr);
+            fputs("  --help              Show this help text and then exit\n", stderr);
+            return 0;
+        } else {
+            fprintf(stderr, "Error: Unrecognized argument %s\n", argv[arg]);
+            return 1;
+        }
+    }
+    if (jobs < 1)
+        jobs = 1;
+    DecompileMemo memo;
+    if (memo_check)
+        options.memo = &memo;
+
+    std::string outdir = "tests-out";
+    make_dir(outdir);
+
+    std::string tokenized_dir = join_path(test_dir, "tokenized");
+    std::string compiled_dir = join_path(test_dir, "compiled");
+    std::string xfail_dir = join_path(test_dir, "xfail");
+    std::vector<std::string> test_names = list_dir(tokenized_dir, "*" + filter + "*.txt");
+
+    std::vector<Test> tests(test_names.size());
+    std::vector<TestFile> files;
+    for (size_t i = 0; i < tests.size(); ++i) {
+        Test& test = tests[i];
+        test.name = test_names[i].substr(0, test_names[i].size() - 4);
+        if (!read_file(join_path(tokenized_dir, test_names[i]), test.expected)) {
+            fprintf(stderr, "Error reading %s\n", test_names[i].c_str());
+            return 1;
+        }
+        for (const auto& name : list_dir(compiled_dir, test.name + ".?.*.pyc")) {
+            test.files.push_back(files.size());
+            files.push_back({ i, join_path(compiled_dir, name), false, false, { }, std::string() });
+        }
+        for (const auto& name : list_dir(xfail_dir, test.name + ".?.*.pyc")) {
+            test.files.push_back(files.size());
+            files.push_back({ i, join_path(xfail_dir, name), true, false, { }, std::string() });
+        }
+        test.remaining = test.files.size();
+    }
+
+    // Workers take files in order and mark a test complete when its last
+    // file is done; the main thread reports tests in order as they finish
+    std::atomic<size_t> next_file(0);
+    std::mutex lock;
+    std::condition_variable finished;
+    std::vector<bool> test_done(tests.size(), false);
+    for (size_t i = 0; i < tests.size(); ++i)
+        test_done[i] = tests[i].files.empty();
+
+    auto worker = [&]() {
+        FILE* errors = tmpfile();
+        if (!errors) {
+            perror("tmpfile");
+            std::exit(1);
+        }
+        set_pyc_error_stream(errors);
+        for ( ;; ) {
+            size_t index = next_file++;
+            if (index >= files.size())
+                break;
+            TestFile& file = files[index];
+            Test& test = tests[file.test];
+            run_file(file, test, outdir, options, errors);
+            if (--test.remaining == 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                test_done[file.test] = true;
+                finished.notify_one();
+            }
+        }
+        set_pyc_error_stream(nullptr);
+        fclose(errors);
+    };
+
+    std::vector<std::thread> threads;
+    int thread_count = std::min<int>(jobs, (int)std::max<size_t>(files.size(), 1));
+    for (int i = 0; i < thread_count; ++i)
+        threads.emplace_back(worker);
+
+    int total_fails = 0;
+    for (size_t i = 0; i < tests.size(); ++i) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            finished.wait(guard, [&]() { return test_done[i]; });
+        }
+        std::string output;
+        total_fails += report_test(tests[i], files, output);
+        fputs(output.c_str(), stdout);
+        fflush(stdout);
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+    if (memo_check)
+        total_fails += check_memo_file(memo, files, outdir);
+
+    if (total_fails) {
+        printf("%d test(s) failed\n", total_fails);
+        return 1;
+    }
+    return 0;
+}
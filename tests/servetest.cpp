@@ -0,0 +1,391 @@
+/* Tests for pycdc --serve, driven over its stdin and stdout.
+ *
+ *   servetest <pycdc> <pycdas>
+ *
+ * All requests are pipelined on one connection to a server with a single
+ * worker, and the responses checked in order.  Decompiled and disassembled
+ * output is compared with what the command line tools print. */
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <csignal>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef PYCTEST_DIR
+#  define PYCTEST_DIR "tests"
+#endif
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++s_failures; \
+        } \
+    } while (0)
+
+static bool contains(const std::string& text, const char* part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+static std::string read_module(const char* name)
+{
+    std::ifstream in(name, std::ios_base::in | std::ios_base::binary);
+    if (!in) {
+        fprintf(stderr, "Error reading %s\n", name);
+        ++s_failures;
+        return std::string();
+    }
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    return buffer.str();
+}
+
+/* What a command line tool prints to stdout for a module */
+static std::string run_tool(const char* tool, const char* module)
+{
+    std::string command = std::string("'") + tool + "' " + module + " 2>/dev/null";
+    FILE* pipe = popen(command.c_str(), "r");
+    if (!pipe) {
+        fprintf(stderr, "Unable to run %s\n", tool);
+        ++s_failures;
+        return std::string();
+    }
+    std::string output;
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+        output.append(buffer, count);
+    pclose(pipe);
+    return output;
+}
+
+static void put32(std::string& out, uint32_t value)
+{
+    for (int byte = 0; byte < 4; ++byte)
+        out += (char)(value >> (byte * 8));
+}
+
+static void put_string(std::string& out, const char* text)
+{
+    out += 's';
+    put32(out, (uint32_t)strlen(text));
+    out += text;
+}
+
+/* A marshalled Python 2.7 module whose constants are count ints, which
+ * takes far longer than a millisecond to disassemble */
+static std::string large_module(uint32_t count)
+{
+    std::string code = "c";
+    put32(code, 0);     // argcount
+    put32(code, 0);     // nlocals
+    put32(code, 1);     // stacksize
+    put32(code, 0x40);  // flags (CO_NOFREE)
+    code += 's';
+    put32(code, 4);
+    code.append("d\0\0S", 4);   // LOAD_CONST 0; RETURN_VALUE
+    code += '(';
+    put32(code, count);
+    for (uint32_t i = 0; i < count; ++i) {
+        code += 'i';
+        put32(code, i);
+    }
+    for (int names = 0; names < 4; ++names) {
+        code += '(';
+        put32(code, 0);
+    }
+    put_string(code, "large.py");
+    put_string(code, "<module>");
+    put32(code, 1);     // firstlineno
+    put_string(code, "");
+    return code;
+}
+
+static std::string frame(const std::string& body)
+{
+    std::string out;
+    put32(out, (uint32_t)body.size());
+    return out + body;
+}
+
+struct Response {
+    bool ok;
+    std::string message;
+    std::string output;
+    std::string diagnostics;
+};
+
+/* pycdc --serve, with pipes to its stdin and stdout */
+class ServerProcess {
+public:
+    explicit ServerProcess(const char* pycdc) : m_pid(-1), m_toServer(-1), m_fromServer(-1)
+    {
+        int to_server[2], from_server[2];
+        if (pipe(to_server) != 0 || pipe(from_server) != 0)
+            return;
+        m_pid = fork();
+        if (m_pid == 0) {
+            dup2(to_server[0], STDIN_FILENO);
+            dup2(from_server[1], STDOUT_FILENO);
+            close(to_server[0]);
+            close(to_server[1]);
+            close(from_server[0]);
+            close(from_server[1]);
+            execl(pycdc, pycdc, "--serve", "--workers", "1", (char*)nullptr);
+            _exit(127);
+        }
+        close(to_server[0]);
+        close(from_server[1]);
+        m_toServer = to_server[1];
+        m_fromServer = from_server[0];
+    }
+
+    ~ServerProcess() { finish(); }
+
+    bool started() const { return m_pid > 0; }
+
+    bool send(const std::string& data)
+    {
+        const char* p = data.data();
+        size_t size = data.size();
+        while (size > 0) {
+            ssize_t count = write(m_toServer, p, size);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            p += count;
+            size -= (size_t)count;
+        }
+        return true;
+    }
+
+    /* Ends the connection, so the server exits once it has replied */
+    void closeInput()
+    {
+        if (m_toServer >= 0)
+            close(m_toServer);
+        m_toServer = -1;
+    }
+
+    bool receive(Response& response)
+    {
+        unsigned char header[4];
+        if (!readFull(header, sizeof(header)))
+            return false;
+        uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16)
+                | ((uint32_t)header[3] << 24);
+        std::string body(size, '\0');
+        if (size > 0 && !readFull(&body[0], size))
+            return false;
+
+        size_t eol = body.find('\n');
+        if (eol == std::string::npos)
+            return false;
+        std::string line = body.substr(0, eol);
+        unsigned long output_size, diag_size;
+        int message_offset = 0;
+        if (sscanf(line.c_str(), "OK %lu %lu", &output_size, &diag_size) == 2) {
+            response.ok = true;
+        } else if (sscanf(line.c_str(), "ERROR %lu %lu %n", &output_size, &diag_size,
+                          &message_offset) == 2 && message_offset > 0) {
+            response.ok = false;
+            response.message = line.substr((size_t)message_offset);
+        } else {
+            return false;
+        }
+        if (body.size() != eol + 1 + output_size + diag_size)
+            return false;
+        response.output = body.substr(eol + 1, output_size);
+        response.diagnostics = body.substr(eol + 1 + output_size);
+        return true;
+    }
+
+    int finish()
+    {
+        closeInput();
+        if (m_fromServer >= 0)
+            close(m_fromServer);
+        m_fromServer = -1;
+        int status = -1;
+        if (m_pid > 0) {
+            while (waitpid(m_pid, &status, 0) < 0 && errno == EINTR) { }
+            m_pid = -1;
+        }
+        return status;
+    }
+
+private:
+    bool readFull(void* buffer, size_t size)
+    {
+        char* p = static_cast<char*>(buffer);
+        while (size > 0) {
+            ssize_t count = read(m_fromServer, p, size);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return false;
+            p += count;
+            size -= (size_t)count;
+        }
+        return true;
+    }
+
+    pid_t m_pid;
+    int m_toServer, m_fromServer;
+};
+
+enum {
+    REQ_DECOMPILE, REQ_DISASSEMBLE, REQ_ONLY, REQ_VERSION, REQ_UNKNOWN_COMMAND,
+    REQ_UNKNOWN_OPTION, REQ_BAD_PAYLOAD, REQ_TIMEOUT, REQ_AFTER_TIMEOUT, REQ_STATS,
+    REQ_COUNT
+};
+
+// Requests handled by the workers, which stats counts; the rest are
+// rejected by the server before they get that far
+static const unsigned WORKER_REQUESTS = 7;
+
+int main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        fputs("Usage: servetest <pycdc> <pycdas>\n", stderr);
+        return 2;
+    }
+    // The tools are run from the corpus directory
+    char pycdc[PATH_MAX], pycdas[PATH_MAX];
+    if (!realpath(argv[1], pycdc) || !realpath(argv[2], pycdas)) {
+        fputs("Unable to find pycdc or pycdas\n", stderr);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (chdir(PYCTEST_DIR "/compiled") != 0) {
+        fprintf(stderr, "Unable to change to %s: %s\n", PYCTEST_DIR "/compiled",
+                strerror(errno));
+        return 1;
+    }
+
+    const char* module = "if_elif_else.3.7.pyc";
+    std::string pyc = read_module(module);
+    std::string expected_source = run_tool(pycdc, module);
+    std::string expected_disasm = run_tool(pycdas, module);
+    CHECK(contains(expected_source, "elif"));
+
+    std::vector<std::string> requests(REQ_COUNT);
+    requests[REQ_DECOMPILE] = std::string("decompile name=") + module + "\n" + pyc;
+    requests[REQ_DISASSEMBLE] = std::string("disassemble name=") + module + "\n" + pyc;
+    requests[REQ_ONLY] = "decompile only=A.A1.foo name=test_class.2.5.pyc\n"
+            + read_module("test_class.2.5.pyc");
+    // The same module without the 16 byte .pyc header
+    requests[REQ_VERSION] = std::string("decompile version=3.7 name=") + module + "\n"
+            + pyc.substr(pyc.size() < 16 ? pyc.size() : 16);
+    requests[REQ_UNKNOWN_COMMAND] = "frobnicate\n";
+    requests[REQ_UNKNOWN_OPTION] = "decompile colour=red\nxyz";
+    requests[REQ_BAD_PAYLOAD] = "decompile name=junk.pyc\nnot a pyc";
+    requests[REQ_TIMEOUT] = "disassemble version=2.7 timeout=1 name=large.pyc\n"
+            + large_module(1000000);
+    requests[REQ_AFTER_TIMEOUT] = requests[REQ_DECOMPILE];
+    requests[REQ_STATS] = "stats\n";
+
+    ServerProcess server(pycdc);
+    if (!server.started()) {
+        fprintf(stderr, "Unable to start %s --serve\n", pycdc);
+        return 1;
+    }
+
+    // Written from another thread, so neither side blocks on a full pipe
+    std::thread writer([&] {
+        for (const auto& request : requests) {
+            if (!server.send(frame(request)))
+                break;
+        }
+        server.closeInput();
+    });
+
+    std::vector<Response> responses(REQ_COUNT);
+    bool received = true;
+    for (int i = 0; i < REQ_COUNT && received; ++i) {
+        received = server.receive(responses[i]);
+        if (!received)
+            fprintf(stderr, "No response to request %d\n", i);
+    }
+    writer.join();
+    int status = server.finish();
+    CHECK(received);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    if (received) {
+        const Response& decompiled = responses[REQ_DECOMPILE];
+        CHECK(decompiled.ok);
+        CHECK(decompiled.output == expected_source);
+        CHECK(decompiled.diagnostics.empty());
+
+        const Response& disassembled = responses[REQ_DISASSEMBLE];
+        CHECK(disassembled.ok);
+        CHECK(disassembled.output == expected_disasm);
+
+        const Response& only = responses[REQ_ONLY];
+        CHECK(only.ok);
+        CHECK(contains(only.output, "'A1.foo'"));
+        CHECK(!contains(only.output, "'A1.__init__'"));
+        CHECK(!contains(only.output, "'A.foo'"));
+        CHECK(!contains(only.output, "class "));
+
+        const Response& version = responses[REQ_VERSION];
+        CHECK(version.ok);
+        CHECK(version.output == expected_source);
+
+        const Response& unknown_command = responses[REQ_UNKNOWN_COMMAND];
+        CHECK(!unknown_command.ok);
+        CHECK(unknown_command.message == "Unknown command 'frobnicate'");
+
+        const Response& unknown_option = responses[REQ_UNKNOWN_OPTION];
+        CHECK(!unknown_option.ok);
+        CHECK(unknown_option.message == "Unknown option 'colour=red'");
+
+        const Response& bad_payload = responses[REQ_BAD_PAYLOAD];
+        CHECK(!bad_payload.ok);
+        CHECK(bad_payload.message == "Could not load junk.pyc");
+        CHECK(bad_payload.output.empty());
+        CHECK(contains(bad_payload.diagnostics, "Bad MAGIC"));
+
+        const Response& timeout = responses[REQ_TIMEOUT];
+        CHECK(!timeout.ok);
+        CHECK(timeout.message == "Timed out after 1 ms");
+
+        const Response& restarted = responses[REQ_AFTER_TIMEOUT];
+        CHECK(restarted.ok);
+        CHECK(restarted.output == expected_source);
+
+        const Response& stats = responses[REQ_STATS];
+        char expected_requests[64];
+        snprintf(expected_requests, sizeof(expected_requests), "\nrequests %u\n",
+                 WORKER_REQUESTS);
+        CHECK(stats.ok);
+        CHECK(contains(stats.output, "\nworkers 1\n"));
+        CHECK(contains(stats.output, expected_requests));
+        CHECK(contains(stats.output, "\nok 5\n"));
+        CHECK(contains(stats.output, "\nerrors 1\n"));
+        CHECK(contains(stats.output, "\ntimeouts 1\n"));
+        CHECK(contains(stats.output, "\ncrashes 0\n"));
+    }
+
+    if (s_failures) {
+        fprintf(stderr, "%d check(s) failed\n", s_failures);
+        return 1;
+    }
+    printf("All server tests passed\n");
+    return 0;
+}
@@ -0,0 +1,245 @@
+/* Tests for SmallVector.
+ *
+ * Elements count their constructions and destructions, and mark
+ * themselves when destroyed, so leaks and double destruction show up as
+ * well as wrong values. */
+
+#include <cstdio>
+#include <utility>
+#include "SmallVector.h"
+
+static int s_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++s_failures; \
+        } \
+    } while (0)
+
+class Counted {
+public:
+    static int s_live;
+    static int s_badDestroys;
+
+    explicit Counted(int value) : m_value(value), m_magic(ALIVE) { ++s_live; }
+    Counted(const Counted& copy) : m_value(copy.m_value), m_magic(ALIVE) { ++s_live; }
+    Counted(Counted&& move) : m_value(move.m_value), m_magic(ALIVE)
+    {
+        move.m_value = -1;
+        ++s_live;
+    }
+
+    ~Counted()
+    {
+        if (m_magic != ALIVE)
+            ++s_badDestroys;
+        m_magic = DEAD;
+        --s_live;
+    }
+
+    Counted& operator=(const Counted&) = delete;
+    Counted& operator=(Counted&&) = delete;
+
+    int value() const { return m_value; }
+
+private:
+    enum { ALIVE = 0x600DF00D, DEAD = 0xDEADBEEF };
+
+    int m_value;
+    unsigned m_magic;
+};
+
+int Counted::s_live = 0;
+int Counted::s_badDestroys = 0;
+
+typedef SmallVector<Counted, 4> Vec;
+
+/* True if v holds first, first + 1, ..., first + count - 1 */
+static bool holds(const Vec& v, int first, size_t count)
+{
+    if (v.size() != count)
+        return false;
+    for (size_t i = 0; i < count; ++i) {
+        if (v[i].value() != first + (int)i)
+            return false;
+    }
+    return true;
+}
+
+static bool is_inline(const Vec& v)
+{
+    const char* object = reinterpret_cast<const char*>(&v);
+    const char* data = reinterpret_cast<const char*>(v.begin());
+    return data >= object && data < object + sizeof(v);
+}
+
+static void test_reclaim_and_grow()
+{
+    {
+        Vec v;
+        for (int i = 0; i < 4; ++i)
+            v.emplace_back(i);
+        CHECK(is_inline(v));
+
+        // Three free slots in front of one element: the next one reclaims
+        // them instead of growing
+        v.pop_front();
+        v.pop_front();
+        v.pop_front();
+        v.emplace_back(4);
+        CHECK(is_inline(v));
+        CHECK(holds(v, 3, 2));
+        v.emplace_back(5);
+        v.emplace_back(6);
+        CHECK(is_inline(v));
+        CHECK(holds(v, 3, 4));
+
+        // Full with nothing to reclaim: grows to the heap
+        v.emplace_back(7);
+        CHECK(!is_inline(v));
+        CHECK(holds(v, 3, 5));
+
+        // Fewer free slots in front than live elements: grows again
+        v.pop_front();
+        for (int i = 8; i < 12; ++i)
+            v.emplace_back(i);
+        CHECK(holds(v, 4, 8));
+        CHECK(Counted::s_live == 8);
+    }
+    CHECK(Counted::s_live == 0);
+}
+
+static void test_aliasing()
+{
+    {
+        // At capacity on the grow path
+        Vec v;
+        for (int i = 0; i < 4; ++i)
+            v.emplace_back(i);
+        v.push_back(v.front());
+        CHECK(v.size() == 5 && v[4].value() == 0);
+        for (int i = 5; i < 8; ++i)
+            v.emplace_back(i);
+        v.push_back(v.back());
+        CHECK(v.size() == 9 && v[8].value() == 7);
+        CHECK(v[0].value() == 0 && v[7].value() == 7);
+    }
+    {
+        // At capacity on the reclaim path
+        Vec v;
+        for (int i = 0; i < 4; ++i)
+            v.emplace_back(i);
+        v.pop_front();
+        v.pop_front();
+        v.pop_front();
+        v.push_back(v.back());
+        CHECK(v.size() == 2 && v[0].value() == 3 && v[1].value() == 3);
+
+        Vec w;
+        for (int i = 0; i < 4; ++i)
+            w.emplace_back(i);
+        w.pop_front();
+        w.pop_front();
+        w.pop_front();
+        w.push_back(w.front());
+        CHECK(w.size() == 2 && w[0].value() == 3 && w[1].value() == 3);
+    }
+    CHECK(Counted::s_live == 0);
+}
+
+static Vec make(int first, int count, int popped)
+{
+    Vec v;
+    for (int i = 0; i < count; ++i)
+        v.emplace_back(first + i);
+    for (int i = 0; i < popped; ++i)
+        v.pop_front();
+    return v;
+}
+
+static void test_copy_and_move()
+{
+    {
+        // From inline storage, with an offset head
+        Vec small = make(10, 3, 1);
+        CHECK(is_inline(small));
+        Vec copy(small);
+        CHECK(holds(copy, 11, 2) && holds(small, 11, 2));
+        Vec moved(std::move(small));
+        CHECK(is_inline(moved) && holds(moved, 11, 2));
+        CHECK(small.empty());
+        small.emplace_back(1);
+        CHECK(holds(small, 1, 1));
+
+        // From heap storage, with an offset head
+        Vec large = make(20, 9, 2);
+        CHECK(!is_inline(large));
+        Vec large_copy(large);
+        CHECK(holds(large_copy, 22, 7) && holds(large, 22, 7));
+        Vec large_moved(std::move(large));
+        CHECK(!is_inline(large_moved) && holds(large_moved, 22, 7));
+        CHECK(large.empty() && is_inline(large));
+        large.emplace_back(2);
+        CHECK(holds(large, 2, 1));
+
+        // Assignment between the two states
+        copy = large_copy;
+        CHECK(holds(copy, 22, 7));
+        large_copy = make(30, 2, 0);
+        CHECK(holds(large_copy, 30, 2));
+        moved = std::move(large_moved);
+        CHECK(holds(moved, 22, 7) && large_moved.empty());
+        large_moved = std::move(small);
+        CHECK(holds(large_moved, 1, 1) && small.empty());
+        const Vec& self = copy;
+        copy = self;
+        CHECK(holds(copy, 22, 7));
+    }
+    CHECK(Counted::s_live == 0);
+}
+
+static void test_empty_and_reuse()
+{
+    {
+        Vec v = make(0, 6, 0);
+        v.clear();
+        CHECK(v.empty() && Counted::s_live == 0);
+        for (int i = 0; i < 6; ++i)
+            v.emplace_back(i);
+        CHECK(holds(v, 0, 6));
+
+        v.pop_front();
+        while (!v.empty())
+            v.pop_back();
+        CHECK(Counted::s_live == 0);
+        for (int i = 0; i < 10; ++i)
+            v.emplace_back(i);
+        CHECK(holds(v, 0, 10));
+
+        Vec w = make(0, 3, 2);
+        w.pop_back();
+        CHECK(w.empty());
+        for (int i = 0; i < 4; ++i)
+            w.emplace_back(i);
+        CHECK(is_inline(w) && holds(w, 0, 4));
+    }
+    CHECK(Counted::s_live == 0);
+}
+
+int main()
+{
+    test_reclaim_and_grow();
+    test_aliasing();
+    test_copy_and_move();
+    test_empty_and_reuse();
+    CHECK(Counted::s_badDestroys == 0);
+
+    if (s_failures) {
+        fprintf(stderr, "%d check(s) failed\n", s_failures);
+        return 1;
+    }
+    printf("All SmallVector tests passed\n");
+    return 0;
+}